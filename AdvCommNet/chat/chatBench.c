@@ -0,0 +1,320 @@
+/******************************************************************************/
+// chatBench.c
+// Microbenchmarks for the chat library.  Each benchmark drives one part of
+// the library in a tight loop on the calling thread, with no sockets, and
+// prints what it measured as "name value" lines, so that a run can be
+// compared against one from an earlier build.
+//	table	joins and leaves of synthetic clients in the client table
+//	wire	laying out and parsing one message in each wire protocol
+//	parse	parsing text protocol lines of each kind, in messages per second
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+//include system, network, and io libraries
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+//include chat library
+#include "chatUtil.h"
+#include "chatPool.h"
+#include "chatReliable.h"
+#include "chatQueue.h"
+#include "chatTable.h"
+
+/*
+ * Benchmark configuration values
+ */
+enum {
+	TABLE_CLIENTS = 100000,
+	TABLE_ROUNDS = 3,
+	WIRE_ITERATIONS = 2000000,
+	PARSE_ITERATIONS = 10000000
+};
+
+/*
+ * Function signature declarations see function definitions for further
+ * documentation
+ */
+void usage();
+long benchNanos();
+void benchTable(int clients);
+int flatten(const struct iovec *iov, int count, char *buffer);
+void benchWire(int iterations);
+void benchParse(int iterations);
+
+/*
+ * main
+ * Run the benchmark named on the command line
+ */
+int main( int argc, char *argv[] ) {
+	if ( argc < 2 ) {
+		usage();
+	}
+	if ( strcmp(argv[1], "table") == 0 ) {
+		benchTable(argc > 2 ? atoi(argv[2]) : TABLE_CLIENTS);
+	} else if ( strcmp(argv[1], "wire") == 0 ) {
+		benchWire(argc > 2 ? atoi(argv[2]) : WIRE_ITERATIONS);
+	} else if ( strcmp(argv[1], "parse") == 0 ) {
+		benchParse(argc > 2 ? atoi(argv[2]) : PARSE_ITERATIONS);
+	} else {
+		usage();
+	}
+	return 0;
+}
+
+/*
+ * usage
+ * Print usage information and exit
+ */
+void usage() {
+	printf("Usage: chatBench <benchmark> [count]\n");
+	printf("  table [clients]  join and leave clients in the client table "
+		"(default %i)\n", TABLE_CLIENTS);
+	printf("  wire [iterations]  lay out and parse a text message in each "
+		"protocol\n                     (default %i)\n", WIRE_ITERATIONS);
+	printf("  parse [iterations]  parse text protocol lines of each kind "
+		"(default %i)\n", PARSE_ITERATIONS);
+	exit(1);
+}
+
+/*
+ * benchNanos
+ * @return A monotonic clock in nanoseconds
+ */
+long benchNanos() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * benchTable
+ * Join synthetic clients to the client table as addClient does, looking
+ * each address up first, then look every one up by id and address, then
+ * remove them all.  The first round grows the table; later rounds reuse
+ * its free list.
+ * @param clients Number of clients, 1 to MAX_CLIENTS - 1
+ */
+void benchTable(int clients) {
+	struct clientTable table;
+	struct sockaddr_in *addresses;
+	static const char hostname[] = "bench.local";
+	long joinNs = 0, findNs = 0, lookupNs = 0, leaveNs = 0;
+	long start;
+	long found = 0;
+	int round;
+	int i;
+
+	if ( clients < 1 || clients >= MAX_CLIENTS ) {
+		usage();
+	}
+	addresses = calloc(clients, sizeof(*addresses));
+	if ( addresses == NULL ) {
+		perror("Could not allocate addresses");
+		exit(1);
+	}
+
+	//Spread the clients over addresses and ports as a NAT would
+	for ( i = 0; i < clients; i++ ) {
+		addresses[i].sin_family = AF_INET;
+		addresses[i].sin_addr.s_addr = htonl(0x0a000000 + i / 50000);
+		addresses[i].sin_port = htons(10000 + i % 50000);
+	}
+
+	clientTableInit(&table, INITIAL_CLIENTS, 1);
+	for ( round = 0; round < TABLE_ROUNDS; round++ ) {
+		start = benchNanos();
+		for ( i = 0; i < clients; i++ ) {
+			if ( clientTableFind(&table, &addresses[i]) == JOIN_CID_CODE ) {
+				clientTableAdd(&table, &addresses[i], hostname,
+					sizeof(hostname) - 1, PROTOCOL_VERSION, NULL, NULL);
+			}
+		}
+		joinNs += benchNanos() - start;
+
+		start = benchNanos();
+		for ( i = 0; i < clients; i++ ) {
+			found += clientTableFind(&table, &addresses[i]) > 0;
+		}
+		findNs += benchNanos() - start;
+
+		start = benchNanos();
+		for ( i = 1; i <= clients; i++ ) {
+			found += clientTableLookup(&table, i) != NULL;
+		}
+		lookupNs += benchNanos() - start;
+
+		start = benchNanos();
+		for ( i = 1; i <= clients; i++ ) {
+			clientTableRemove(&table, i);
+		}
+		leaveNs += benchNanos() - start;
+	}
+	if ( found != 2L * clients * TABLE_ROUNDS || table.memberCount != 0 ) {
+		fprintf(stderr, "Client table lost clients\n");
+		exit(1);
+	}
+
+	printf("clients %i\nrounds %i\ncapacity %i\n", clients, TABLE_ROUNDS,
+		table.capacity);
+	printf("join_ns %.1f\nfind_ns %.1f\nlookup_ns %.1f\nleave_ns %.1f\n",
+		(double)joinNs / clients / TABLE_ROUNDS,
+		(double)findNs / clients / TABLE_ROUNDS,
+		(double)lookupNs / clients / TABLE_ROUNDS,
+		(double)leaveNs / clients / TABLE_ROUNDS);
+	free(addresses);
+}
+
+/*
+ * flatten
+ * Copy gathered vectors into one buffer, as the kernel does on send
+ * @param iov The vectors
+ * @param count The number of vectors
+ * @param buffer The buffer, large enough for every vector
+ * @return The number of bytes copied
+ */
+int flatten(const struct iovec *iov, int count, char *buffer) {
+	int length = 0;
+	int i;
+
+	for ( i = 0; i < count; i++ ) {
+		memcpy(buffer + length, iov[i].iov_base, iov[i].iov_len);
+		length += iov[i].iov_len;
+	}
+	return length;
+}
+
+/*
+ * benchWire
+ * Lay a typical text message out for sending, and parse it back, in the
+ * text protocol and in binary frames
+ * @param iterations Times to lay out and parse the message in each protocol
+ */
+void benchWire(int iterations) {
+	static const char hostname[] = "31337.client.example.net";
+	static const char text[] = "the quick brown fox jumps over the lazy "
+		"dog, twice";
+	static const char *names[] = { "text", "binary" };
+	struct messageView message;
+	struct messageView parsed;
+	struct iovec iov[GATHER_IOV];
+	char scratch[GATHER_SCRATCH];
+	char buffer[POOL_BUFFER_SIZE];
+	long serializeNs, parseNs;
+	long start;
+	unsigned long sink = 0;
+	int protocol;
+	int length = 0;
+	int i;
+
+	if ( iterations < 1 ) {
+		usage();
+	}
+	bzero((char *)&message, sizeof(message));
+	message.version = PROTOCOL_VERSION;
+	message.opcode = OP_TEXT;
+	message.cid = 4242;
+	message.hostname = hostname;
+	message.hostnameLen = sizeof(hostname) - 1;
+	message.payload = text;
+	message.payloadLen = sizeof(text) - 1;
+
+	printf("iterations %i\n", iterations);
+	for ( protocol = PROTOCOL_TEXT; protocol <= PROTOCOL_VERSION;
+		protocol++ ) {
+		start = benchNanos();
+		for ( i = 0; i < iterations; i++ ) {
+			message.cid = 4242 + (i & 7);
+			length = flatten(iov, gatherMessage(&message, protocol,
+				scratch, iov), buffer);
+			sink += length;
+		}
+		serializeNs = benchNanos() - start;
+
+		start = benchNanos();
+		for ( i = 0; i < iterations; i++ ) {
+			if ( protocol == PROTOCOL_TEXT ) {
+				sink += parseMessage(buffer, length, &parsed) == 0;
+			} else {
+				sink += decodeFrame(buffer, length, &parsed);
+			}
+			sink += parsed.cid;
+		}
+		parseNs = benchNanos() - start;
+		if ( parsed.payloadLen != message.payloadLen ||
+			memcmp(parsed.payload, text, parsed.payloadLen) != 0 ) {
+			fprintf(stderr, "The %s message did not parse back\n",
+				names[protocol]);
+			exit(1);
+		}
+
+		printf("%s_bytes %i\n%s_serialize_ns %.1f\n%s_parse_ns %.1f\n",
+			names[protocol], length, names[protocol],
+			(double)serializeNs / iterations, names[protocol],
+			(double)parseNs / iterations);
+	}
+	if ( sink == 0 ) {
+		printf("\n");
+	}
+}
+
+/*
+ * benchParse
+ * Parse a text protocol line of each kind the server receives, as it
+ * arrives from the socket, and report how many of each one thread parses
+ * in a second
+ * @param iterations Times to parse each line
+ */
+void benchParse(int iterations) {
+	static const char *names[] = { "text", "join", "enter" };
+	static const char *lines[] = {
+		"4242 31337.client.example.net the quick brown fox jumps over "
+			"the lazy dog, twice\n",
+		"0 JOIN 31337.client.example.net\n",
+		"4242 ENTER lobby 31337.client.example.net\n" };
+	struct messageView parsed;
+	long start, elapsed;
+	unsigned long sink = 0;
+	int length;
+	int kind;
+	int i;
+
+	if ( iterations < 1 ) {
+		usage();
+	}
+	printf("iterations %i\n", iterations);
+	for ( kind = 0; kind < sizeof(lines) / sizeof(lines[0]); kind++ ) {
+		length = strlen(lines[kind]);
+		start = benchNanos();
+		for ( i = 0; i < iterations; i++ ) {
+			if ( parseMessage(lines[kind], length, &parsed) < 0 ) {
+				fprintf(stderr, "The %s line did not parse\n", names[kind]);
+				exit(1);
+			}
+			sink += parsed.cid + parsed.payloadLen;
+		}
+		elapsed = benchNanos() - start;
+		printf("%s_bytes %i\n%s_parse_ns %.1f\n%s_msgs_per_sec %.0f\n",
+			names[kind], length, names[kind], (double)elapsed / iterations,
+			names[kind], iterations * 1e9 / elapsed);
+	}
+	if ( sink == 0 ) {
+		printf("\n");
+	}
+}
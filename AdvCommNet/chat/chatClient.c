@@ -8,19 +8,71 @@
 //include system, network, and io libraries
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <time.h>
 
 //include chat library
 #include "chatUtil.h"
+#include "chatPool.h"
+#include "chatReliable.h"
+#include "chatFragment.h"
+#include "chatLog.h"
+#include "chatEvent.h"
+#include "chatSession.h"
+#include "chatResolve.h"
+
+/*
+ * Client configuration values
+ */
+enum {
+	INPUT_BUFFER = 4*MAX_LINE
+};
+
+/*
+ * Standard input data structure
+ * @param data Input read but not yet sent; never a whole line
+ * @param size The size of data
+ * @param length Length of the input
+ * @param watched 1 if the event loop watches standard input, -1 if it
+ *	cannot, 0 until every session has joined
+ */
+struct lineInput {
+	char *data;
+	int size;
+	int length;
+	int watched;
+};
+
+//How the sessions join: offering the binary protocol, asking for
+// reliable delivery, and asking for history, either the last historyCount
+// messages of each room joined or entered, or the lobby's messages after
+// number historySince on joining
+struct chatOptions options = { 1, 0, 0, -1, 0, DEBUG_OFF };
+
+//The number of chat sessions to run, and the longest line sent as one
+// message, longer lines being cut
+int sessionCount = 1;
+int messageMax = MAX_LINE-1;
+
+//Server names already looked up, and lookups in progress
+struct resolver serverNames;
 
 /*
  * Function signature declarations see function definitions for further 
@@ -28,14 +80,18 @@
  */
 void usage();
 void startClient(char *serverName, int port, int debug); 
-struct sockaddr_in getServer(char *serverName, int port);
-int makeClientSocket ();
-void joinChat(int sd, struct clientInformation myinfo, int debug);
-void sendText(int sd, struct clientInformation myinfo, int debug, char *txt);
-void quitChat(int sd, struct clientInformation myinfo, int debug);
-void sendMessage(int sd, struct clientInformation myinfo, 
-	struct message theMessage, int debug);
-int receiveServerMessage(int sd, struct clientInformation myinfo, int debug);
+int readInput(struct lineInput *input, struct chatClient *client);
+void sendLine(struct chatClient *client, const char *line, int length);
+void sendRoomCommand(struct chatClient *client, const char *line, 
+	int length);
+int getServer(char *serverName, int port, struct sockaddr_in *server_addr);
+void printJoined(struct chatSession *session);
+void printText(struct chatSession *session, const struct messageView *view);
+void printQuit(struct chatSession *session, const struct messageView *view);
+void printNotice(struct chatSession *session, 
+	const struct messageView *view);
+void printHistory(struct chatSession *session, unsigned int seq,
+	const struct messageView *view);
 const char * getCDN();
 
 /*
@@ -47,23 +103,71 @@ int main( int argc, char *argv[] ) {
 	char* serverName;
 	int port = 0;
 	int debug = 0;
+	int opt;
+
+	//validate & set options
+	while ( (opt = getopt(argc, argv, "h:l:n:rs:T")) != -1 ) {
+		switch ( opt ) {
+		case 'n':
+			sessionCount = atoi(optarg);
+			if ( sessionCount < 1 || sessionCount > MAX_SESSIONS ) {
+				usage();
+			}
+			break;
+		case 'r':
+			options.offerReliable = 1;
+			break;
+		case 'h':
+			options.historyCount = atoi(optarg);
+			if ( options.historyCount < 1 ) {
+				usage();
+			}
+			break;
+		case 'l':
+			messageMax = atoi(optarg);
+			if ( messageMax < 1 || messageMax > MAX_MESSAGE ) {
+				usage();
+			}
+			break;
+		case 's':
+			options.historySince = atol(optarg);
+			if ( options.historySince < 0 ) {
+				usage();
+			}
+			break;
+		case 'T':
+			options.offerBinary = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	//Reliable delivery, history and fragments are carried in binary frames
+	if ( (options.offerReliable || options.historyCount > 0 ||
+		options.historySince >= 0 || messageMax > FRAGMENT_DATA) &&
+		!options.offerBinary ) {
+		usage();
+	}
 	
-	if ( argc != 4 ) {
+	if ( argc - optind != 3 ) {
 		usage();
 	}
 
-	serverName = argv[1];
+	serverName = argv[optind];
 
 	//validate & set debug
-	debug = atoi(argv[3]);
+	debug = atoi(argv[optind+2]);
+	options.debug = debug;
 	if ( debug == DEBUG_ON ) {
 		printf("Debug is on.\n");
+		logStart();
 	} else if ( debug == DEBUG_OFF) {
 	} else {
 		usage();
 	}
 
-	port = atoi(argv[2]);
+	port = atoi(argv[optind+1]);
 	if ( port < 0 || port > 65535 ) {
 		usage();
 	}
@@ -78,255 +182,360 @@ int main( int argc, char *argv[] ) {
  * Print usage information and exit
  */
 void usage() {
-	printf("Usage: chatServer <port> <debug>\n");
+	printf("Usage: chatClient [-h count] [-l length] [-n sessions] [-r] "
+		"[-s seq] [-T]\n       <server> <port> <debug>\n");
+	printf("  -h count  ask for the last count messages of each room joined "
+		"or entered\n");
+	printf("  -l length  longest line sent as one message (1-%i, default "
+		"%i); lines\n             longer than %i are sent in fragments\n",
+		MAX_MESSAGE, MAX_LINE-1, FRAGMENT_DATA);
+	printf("  -n sessions  chat sessions to run (1-%i, default 1); only the "
+		"first prints\n", MAX_SESSIONS);
+	printf("  -r  ask the server for reliable, ordered delivery\n");
+	printf("  -s seq  ask for the lobby's messages after number seq on "
+		"joining\n");
+	printf("  -T  speak only the text protocol\n");
+	printf("Lines read are sent as chat, except \"ENTER room\" and "
+		"\"LEAVE\", which\nmove between rooms, and \"QUIT\".\n");
 	exit(1);
 }
 
 /*
  * startClient
- * Start the client loop, beginning with connecting to the server and issuing
- * the JOIN command and completing with a QUIT command.
+ * Start the client loop.  Every session connects to the server and issues
+ * the JOIN command, then standard input is relayed by every session until
+ * it ends or a QUIT command is read, and every session issues a QUIT
+ * command.  Only the first session prints what it receives.
  * @param serverName The name of the server to which to connect
  * @param port The port to which to connect
  * @param debug Whether debug messages will be printed.
  */
 void startClient(char *serverName, int port, int debug) {
-	struct clientInformation myInformation;
-	int sd;
+	struct chatHandlers handlers = { printJoined, printText, printQuit,
+		printNotice, printHistory };
+	struct chatClient client;
 	struct sockaddr_in server_addr;
-	fd_set read_fd_set;
-	char buffer[MAX_LINE];
-
-	//Create a client socket
-	sd = makeClientSocket();
-
-	//Initialize the file descriptor set
-	FD_ZERO(&read_fd_set);
-
-	//Translate serverName and Port into a sockaddr_in
-	server_addr = getServer(serverName, port);
-
-	//Initilize the clientInformaiton datastructure for this client
-	myInformation.connected = JOIN_CID_CODE;
-	strcpy(myInformation.hostname, getCDN());
-	bcopy((char *)&server_addr, (char *)&myInformation.address, 
-		sizeof(server_addr));
-
-	//While we haven't been issued a client identified, send a join command
-	// and process a response.  Responses that are not join-acks will
-	// result in a new join command being sent.
-	while (myInformation.connected == JOIN_CID_CODE ) {
-		joinChat(sd, myInformation, debug);
-		myInformation.connected = 
-			receiveServerMessage(sd, myInformation, debug);
+	struct lineInput input;
+	struct poolStats stats;
+	void *ready[EVENT_BATCH];
+	int resolving;
+	int running = 1;
+	int timeout;
+	int n, i;
+
+	input.size = messageMax + 1 > INPUT_BUFFER ? messageMax + 1 : INPUT_BUFFER;
+	input.data = malloc(input.size);
+	input.length = 0;
+	input.watched = 0;
+	if ( input.data == NULL || chatClientInit(&client, sessionCount,
+		getCDN(), &handlers, &options) < 0 || resolverInit(&serverNames) < 0 ||
+		chatClientWatch(&client, serverNames.notify[0], &serverNames) < 0 ) {
+		perror("Could not start the client");
+		exit(1);
+	}
+	for ( i = 1; i < sessionCount; i++ ) {
+		client.sessions[i].deliver = 0;
 	}
 
-	//This is the main chat loop.  Adds standard input and the server
-	// socket address to the file descriptor monitor.  
-	while ( 1 ) {
-		FD_SET(0, &read_fd_set);
-		FD_SET(sd, &read_fd_set);
+	//Translate serverName and Port into a sockaddr_in.  A name that must
+	// be looked up is looked up in the background, and the sessions start
+	// joining when it is known.
+	resolving = getServer(serverName, port, &server_addr);
+	if ( resolving == RESOLVE_READY ) {
+		chatClientAim(&client, &server_addr);
+	}
 
-		select(sd+1, &read_fd_set, NULL, NULL, NULL);
-	
-		//If stdin has data, check to see if that data is "QUIT" and 
-		// break out of loop. Otherwise, send the data.
-		if ( FD_ISSET(0, &read_fd_set) ) {
-			bzero((char *) &buffer, sizeof(buffer));
-			read(STDIN_FILENO, buffer, MAX_LINE-1);
-			if ( strncmp(buffer, QUIT_STRING, 4) == 0 ) {
-				break;
-			}
-				
-			sendText(sd, myInformation, debug, buffer);
+	//This is the main chat loop.  The sessions join and keep joined in
+	// the background; once every session has joined, standard input is
+	// watched too, except while reliable sessions hold sends back for
+	// want of acknowledgements.
+	while ( running ) {
+		if ( input.watched > 0 && client.backlog > 0 ) {
+			chatClientUnwatch(&client, STDIN_FILENO);
+			input.watched = 0;
+		}
+		if ( client.joining == 0 && input.watched == 0 &&
+			client.backlog == 0 ) {
+			//Regular files cannot be watched, and are always ready to
+			// read
+			input.watched = chatClientWatch(&client, STDIN_FILENO,
+				&input) == 0 ? 1 : -1;
+		}
+		timeout = -1;
+		if ( input.watched < 0 && client.backlog == 0 ) {
+			running = readInput(&input, &client);
+			timeout = 0;
 		}
 
-		//If the server socket has data, process that data
-		if ( FD_ISSET(sd, &read_fd_set) ) {
-			receiveServerMessage(sd, myInformation, debug);
+		n = chatClientPoll(&client, ready, EVENT_BATCH, timeout);
+		for ( i = 0; i < n && running; i++ ) {
+			if ( ready[i] == &input ) {
+				running = readInput(&input, &client);
+			} else if ( ready[i] == &serverNames ) {
+				resolverDrain(&serverNames);
+				if ( resolving == RESOLVE_PENDING && (resolving = 
+					getServer(serverName, port, &server_addr)) ==
+					RESOLVE_READY ) {
+					chatClientAim(&client, &server_addr);
+				}
+			}
 		}
 	}
 
 	//Once the loop has broken, quit chat.
-	quitChat(sd, myInformation, debug);
+	for ( i = 0; i < sessionCount; i++ ) {
+		chatQuit(&client.sessions[i]);
+	}
+	if ( options.offerReliable ) {
+		if ( input.watched > 0 ) {
+			chatClientUnwatch(&client, STDIN_FILENO);
+		}
+		chatClientUnwatch(&client, serverNames.notify[0]);
+		chatLinger(&client, QUIT_LINGER_MS);
+	}
+	logStop();
+
+	if ( debug == DEBUG_ON ) {
+		poolStatistics(&stats);
+		printf("DEBUG: Buffer pool %lu hits, %lu misses, %lu slabs "
+			"(%lu on huge pages)\n", stats.hits, stats.misses,
+			stats.slabs, stats.hugeSlabs);
+		if ( options.offerReliable ) {
+			printf("DEBUG: Reliable delivery %lu retransmits, %lu "
+				"frames lost\n", client.retransmits, client.lost);
+		}
+	}
+	chatClientClose(&client);
+	free(input.data);
 }
 
 /*
- * makeClientSocket
- * Create a socket to use for sending data to the server
+ * readInput
+ * Read what standard input has ready and send each complete line from
+ * every session.  A line longer than a message is sent in pieces.
+ * @param input The partial line left from the last read
+ * @param client The client
+ * @return 0 if input has ended or a QUIT command was read, 1 otherwise
  */
-int makeClientSocket () {
-	int sd;
-	struct sockaddr_in client_addr;
-	
-	sd = socket(AF_INET, SOCK_DGRAM, 0);
-	if ( sd < 0 ) {
-		perror("Could not create client socket");
+int readInput(struct lineInput *input, struct chatClient *client) {
+	const char *line;
+	const char *newline;
+	int length;
+	int rest;
+
+	length = read(STDIN_FILENO, input->data + input->length, 
+		input->size - input->length);
+	if ( length <= 0 ) {
+		if ( input->length > 0 ) {
+			sendLine(client, input->data, input->length);
+		}
+		return 0;
 	}
+	input->length += length;
+
+	line = input->data;
+	rest = input->length;
+	while ( rest > 0 ) {
+		newline = memchr(line, '\n', rest);
+		if ( newline != NULL ) {
+			length = newline - line;
+		} else if ( rest >= messageMax ) {
+			length = messageMax;
+		} else {
+			break;
+		}
 
-	bzero((char *) &client_addr, sizeof(client_addr));
-	client_addr.sin_family = AF_INET;
-	client_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	client_addr.sin_port = htons(0);
+		//Check to see if the line is "QUIT"
+		if ( length >= 4 && memcmp(line, QUIT_STRING, 4) == 0 ) {
+			return 0;
+		}
 
-	if ( bind(sd, (struct sockaddr *) &client_addr, sizeof(client_addr))
-		< 0 ) {
-		perror("Could not bind client socket");
+		//"ENTER room" and "LEAVE" move every session between rooms
+		if ( length >= 5 && (memcmp(line, ENTER_STRING, 5) == 0 ||
+			memcmp(line, LEAVE_STRING, 5) == 0) ) {
+			sendRoomCommand(client, line, length);
+		} else {
+			while ( length > messageMax ) {
+				sendLine(client, line, messageMax);
+				line += messageMax;
+				rest -= messageMax;
+				length -= messageMax;
+			}
+			sendLine(client, line, length);
+		}
+		if ( newline != NULL ) {
+			length++;
+		}
+		line += length;
+		rest -= length;
 	}
-	return sd;
+
+	memmove(input->data, line, rest);
+	input->length = rest;
+	return 1;
 }
 
 /*
- * getServer
- * Returns a sockaddr_in structure based on the serverName and port provided
- * @param serverName the server's dns name or ip
- * @param port The port
- * @return A sockaddr_in representing the server/port combination.
+ * sendLine
+ * Send a line of text from every session
+ * @param client The client
+ * @param line The text
+ * @param length The length of the text
  */
-struct sockaddr_in getServer(char *serverName, int port) {
-	struct sockaddr_in server_addr;
-	struct hostent *server;
-	
-	server = gethostbyname(serverName);
+void sendLine(struct chatClient *client, const char *line, int length) {
+	int i;
 
-	bzero((char*) &server_addr, sizeof(server_addr));
+	//The line ends the message; it is not part of it
+	if ( length > 0 && line[length-1] == '\n' ) {
+		length--;
+	}
+	for ( i = 0; i < client->count; i++ ) {
+		chatSay(&client->sessions[i], line, length);
+	}
+}
 
-	server_addr.sin_family = AF_INET;
-	bcopy((char *)server->h_addr,
-		(char *)&server_addr.sin_addr.s_addr,
-		server->h_length);
-	server_addr.sin_port = htons(port);
+/*
+ * sendRoomCommand
+ * Send a room command from every session
+ * @param client The client
+ * @param line The command line: ENTER or LEAVE, then the room
+ * @param length The length of the line
+ */
+void sendRoomCommand(struct chatClient *client, const char *line, 
+	int length) {
+	int opcode = line[0] == 'E' ? OP_ENTER : OP_LEAVE;
+	const char *room = line + 5;
+	int roomLen;
+	int i;
+
+	while ( room < line + length && isspace((unsigned char)*room) ) {
+		room++;
+	}
+	roomLen = line + length - room;
+	while ( roomLen > 0 && isspace((unsigned char)room[roomLen-1]) ) {
+		roomLen--;
+	}
+	for ( i = 0; i < client->count; i++ ) {
+		chatMove(&client->sessions[i], opcode, room, roomLen);
+	}
+}
 
-	return server_addr;
-}	
+/*
+ * getServer
+ * Translate the server's dns name or ip and port into a sockaddr_in
+ * without blocking.  A name that must be looked up is looked up in the
+ * background; call again once serverNames has notified.
+ * @param serverName the server's dns name or ip
+ * @param port The port
+ * @param server_addr Set to the server's address when it is known
+ * @return RESOLVE_READY or RESOLVE_PENDING; exits if the name has no IPv4
+ *	address
+ */
+int getServer(char *serverName, int port, struct sockaddr_in *server_addr) {
+	struct sockaddr_storage address;
+	socklen_t length;
+	int result;
+
+	//The server only listens for IPv4
+	result = resolverLookup(&serverNames, serverName, AF_INET, port, 
+		&address, &length);
+	if ( result == RESOLVE_FAILED ) {
+		fprintf(stderr, "Could not resolve %s\n", serverName);
+		exit(1);
+	}
+	if ( result == RESOLVE_READY ) {
+		bcopy((char *)&address, (char *)server_addr, sizeof(*server_addr));
+	}
+	return result;
+}
 
 /*
- * receiveServerMessage
- * Receive a message from the server on the client socket
- * @param sd The client socket
- * @param myinfo A clientInformation structure containing the server address
- * @param debug Whether debugging output should be printed
- * @return The new CID if receiving a join-ack for this client, 0 otherwise
+ * printJoined
+ * Print the client id the printing session was assigned
+ * @param session The session
  */
-int receiveServerMessage(int sd, struct clientInformation myinfo, int debug) {
-	socklen_t serverLen = sizeof(myinfo.address);
-	int receivedLen = 0;
-	struct message rmsg;
-	char buffer[3*MAX_LINE];
-	bzero((char *) &buffer, sizeof(buffer));
-
-	//Receive a message as a raw string buffer and parse that message
-	// into a message data structure.
-	receivedLen = recvfrom(sd, buffer, 3*MAX_LINE, 0, 
-			(struct sockaddr *)&myinfo.address, &serverLen);
-	rmsg = parseMessage(buffer);
-	pDebug(debug, RECV_STRING, rmsg);
-
-	//Process messages containing the join command.  If the hostname
-	// matches this client's hostname, return the cid in the message.
-	if ( strcmp(rmsg.str1, JOIN_STRING) == 0 ) {
-		if ( strcmp(rmsg.str2, myinfo.hostname) == 0 ) {
-			printf("CID=%i assigned\n", rmsg.cid);
-			fflush(stdout);
-			return rmsg.cid;
-		} else {
-			printf("CID=%i %s joined\n", rmsg.cid, rmsg.str2);
-			fflush(stdout);
-			return 0;
-		}
-	//Process messages containing the quit command.
-	} else if ( strcmp(rmsg.str1, QUIT_STRING) == 0 ) {
-		printf("CID=%i %s quit\n", rmsg.cid, rmsg.str2);
-		fflush(stdout);
-		return 0;
-	//Print all other messages which we didn't originally send.
-	} else {
-		if ( rmsg.cid != myinfo.connected ) {
-			printf("CID=%i %s says \"%s\"\n", 
-				rmsg.cid, rmsg.str1, rmsg.str2);
-		}
+void printJoined(struct chatSession *session) {
+	if ( session->deliver ) {
+		printf("CID=%i assigned\n", session->info.connected);
 		fflush(stdout);
-		return 0;
 	}
 }
 
 /*
- * joinChat
- * Prepare and send a JOIN command.
- * @param sd The client socket
- * @param myinfo A clientInformation structure containing the server address
- * @param debug Whether debugging output should be printed
- */ 
-void joinChat(int sd, struct clientInformation myinfo, int debug) {
-	struct message joinMessage;
-	joinMessage.cid = JOIN_CID_CODE;
-	strcpy(joinMessage.str1, JOIN_STRING);
-	strcpy(joinMessage.str2, myinfo.hostname);
-
-	sendMessage(sd, myinfo, joinMessage, debug);
+ * printText
+ * Print text another client said
+ * @param session The session
+ * @param view The message
+ */
+void printText(struct chatSession *session, const struct messageView *view) {
+	printf("CID=%i %.*s says \"%.*s\"\n", view->cid, view->hostnameLen,
+		view->hostname, view->payloadLen, view->payload);
+	fflush(stdout);
 }
 
 /*
- * getCDN
- * Get the client domain name.  Prepend the process id to the hostname
- * for uniqueness
- * @return the client domain name.
+ * printQuit
+ * Print that a client quit
+ * @param session The session
+ * @param view The QUIT message
  */
-const char * getCDN() {
-	char hostname[70];
-	gethostname(hostname, 70);
-	char *buffer = malloc(sizeof(char) * MAX_LINE);
-	sprintf(buffer, "%i.%s", getpid(), hostname);
-	return buffer;
+void printQuit(struct chatSession *session, const struct messageView *view) {
+	printf("CID=%i %.*s quit\n", view->cid, view->hostnameLen,
+		view->hostname);
+	fflush(stdout);
 }
-	
+
 /*
- * sendText
- * Prepare and send a text message.
- * @param sd The client socket
- * @param myinfo A clientInformation structure containing the server address
- * @param debug Whether debugging output should be printed
- * @param txt The text to send
+ * printNotice
+ * Print that another client joined, or that a client entered or left a
+ * room
+ * @param session The session
+ * @param view The JOIN, ENTER or LEAVE message
  */
-void sendText(int sd, struct clientInformation myinfo, int debug, char *txt) {
-	struct message txtMessage;
-	txtMessage.cid = myinfo.connected;
-	strcpy(txtMessage.str1, myinfo.hostname);
-	strcpy(txtMessage.str2, txt);
-
-	sendMessage(sd, myinfo, txtMessage, debug);
+void printNotice(struct chatSession *session, 
+	const struct messageView *view) {
+	if ( view->opcode == OP_JOIN ) {
+		printf("CID=%i %.*s joined\n", view->cid, view->hostnameLen,
+			view->hostname);
+	} else {
+		printf("CID=%i %.*s %s %.*s\n", view->cid, view->hostnameLen,
+			view->hostname, view->opcode == OP_ENTER ? "entered" : "left",
+			view->payloadLen, view->payload);
+	}
+	fflush(stdout);
 }
 
 /*
- * quitChat 
- * Prepare and send a QUIT command.
- * @param sd The client socket
- * @param myinfo A clientInformation structure containing the server address
- * @param debug Whether debugging output should be printed
+ * printHistory
+ * Print a message from the history of the room, with its sequence number
+ * in the room
+ * @param session The session
+ * @param seq The message's sequence number
+ * @param view The message
  */
-void quitChat(int sd, struct clientInformation myinfo, int debug) {
-	struct message quitMessage;
-	quitMessage.cid = -1 * myinfo.connected;
-	strcpy(quitMessage.str1, QUIT_STRING);
-	strcpy(quitMessage.str2, myinfo.hostname);
-
-	sendMessage(sd, myinfo, quitMessage, debug);
+void printHistory(struct chatSession *session, unsigned int seq,
+	const struct messageView *view) {
+	printf("#%u CID=%i %.*s said \"%.*s\"\n", seq, view->cid,
+		view->hostnameLen, view->hostname, view->payloadLen, view->payload);
+	fflush(stdout);
 }
 
 /*
- * sendMessage
- * @param sd The client socket
- * @param myinfo A clientInformation structure containing the server address
- * @param theMessage The prepared message data structure to send
- * @param debug Whether debugging output should be printed
+ * getCDN
+ * Get the client domain name.  Prepend the process id to the hostname
+ * for uniqueness.  The name is worked out on the first call only.
+ * @return the client domain name.
  */
-void sendMessage(int sd, struct clientInformation myinfo, struct message theMessage, int debug) {
-	char buffer[3*MAX_LINE];
-	bzero((char *) &buffer, sizeof(buffer));
+const char * getCDN() {
+	static char buffer[MAX_LINE - SESSION_SUFFIX];
+	char hostname[70];
 
-	sprintf(buffer, "%i %s %s", theMessage.cid, theMessage.str1,
-		theMessage.str2);
-	sendto(sd, buffer, strlen(buffer), 0, (struct sockaddr *)&myinfo.address, sizeof(myinfo.address));
-	
-	pDebug(debug, SENT_STRING, theMessage);
+	if ( buffer[0] == '\0' ) {
+		if ( gethostname(hostname, sizeof(hostname)) < 0 ) {
+			strcpy(hostname, "localhost");
+		}
+		hostname[sizeof(hostname) - 1] = '\0';
+		snprintf(buffer, sizeof(buffer), "%i.%s", getpid(), hostname);
+	}
+	return buffer;
 }
@@ -0,0 +1,186 @@
+/******************************************************************************/
+// chatEvent.h
+// Readiness event loop.  Descriptors are registered once with an owner
+// pointer and stay registered until removed, so waiting does not rebuild
+// a descriptor set.  Uses epoll where the platform provides it and poll
+// elsewhere; define NO_EPOLL to force poll.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define HAVE_EPOLL 1
+#endif
+
+/*
+ * Event loop sizing values
+ */
+enum {
+	EVENT_BATCH = 64
+};
+
+/*
+ * Event loop data structure
+ * @param fd The epoll instance
+ * @param fds Registered descriptors, for poll
+ * @param owners Owner of each registered descriptor, for poll
+ * @param count Number of registered descriptors, for poll
+ * @param capacity Number of descriptors fds can hold, for poll
+ * @param next Next descriptor to check when poll reports more ready
+ *	descriptors than one wait returns
+ */
+struct eventLoop {
+#ifdef HAVE_EPOLL
+	int fd;
+#else
+	struct pollfd *fds;
+	void **owners;
+	int count;
+	int capacity;
+	int next;
+#endif
+};
+
+/*
+ * eventInit
+ * Create an event loop with no registered descriptors
+ * @param loop The event loop
+ * @return 0 on success, -1 on failure
+ */
+int eventInit(struct eventLoop *loop) {
+#ifdef HAVE_EPOLL
+	loop->fd = epoll_create1(0);
+	return loop->fd < 0 ? -1 : 0;
+#else
+	bzero((char *)loop, sizeof(*loop));
+	return 0;
+#endif
+}
+
+/*
+ * eventClose
+ * Close an event loop, whether or not eventInit succeeded
+ * @param loop The event loop
+ */
+void eventClose(struct eventLoop *loop) {
+#ifdef HAVE_EPOLL
+	if ( loop->fd >= 0 ) {
+		close(loop->fd);
+	}
+	loop->fd = -1;
+#else
+	free(loop->fds);
+	free(loop->owners);
+	bzero((char *)loop, sizeof(*loop));
+#endif
+}
+
+/*
+ * eventAdd
+ * Watch a descriptor for input
+ * @param loop The event loop
+ * @param fd The descriptor
+ * @param owner What eventWait reports when the descriptor is readable
+ * @return 0 on success, -1 on failure
+ */
+int eventAdd(struct eventLoop *loop, int fd, void *owner) {
+#ifdef HAVE_EPOLL
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.ptr = owner;
+	return epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &event);
+#else
+	struct pollfd *fds;
+	void **owners;
+	int capacity;
+
+	if ( loop->count == loop->capacity ) {
+		capacity = loop->capacity == 0 ? EVENT_BATCH : 2*loop->capacity;
+		fds = realloc(loop->fds, sizeof(*fds) * capacity);
+		if ( fds == NULL ) {
+			return -1;
+		}
+		loop->fds = fds;
+		owners = realloc(loop->owners, sizeof(*owners) * capacity);
+		if ( owners == NULL ) {
+			return -1;
+		}
+		loop->owners = owners;
+		loop->capacity = capacity;
+	}
+	loop->fds[loop->count].fd = fd;
+	loop->fds[loop->count].events = POLLIN;
+	loop->owners[loop->count++] = owner;
+	return 0;
+#endif
+}
+
+/*
+ * eventRemove
+ * Stop watching a descriptor
+ * @param loop The event loop
+ * @param fd The descriptor
+ */
+void eventRemove(struct eventLoop *loop, int fd) {
+#ifdef HAVE_EPOLL
+	struct epoll_event event;
+	epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, &event);
+#else
+	int i;
+	for ( i = 0; i < loop->count; i++ ) {
+		if ( loop->fds[i].fd == fd ) {
+			loop->count--;
+			loop->fds[i] = loop->fds[loop->count];
+			loop->owners[i] = loop->owners[loop->count];
+			return;
+		}
+	}
+#endif
+}
+
+/*
+ * eventWait
+ * Wait for registered descriptors to become readable
+ * @param loop The event loop
+ * @param owners The owners of the readable descriptors, filled
+ * @param max The most owners to return
+ * @param timeout Milliseconds to wait, or -1 to wait indefinitely
+ * @return The number of owners returned
+ */
+int eventWait(struct eventLoop *loop, void **owners, int max, int timeout) {
+	int ready;
+	int i;
+#ifdef HAVE_EPOLL
+	struct epoll_event events[EVENT_BATCH];
+
+	if ( max > EVENT_BATCH ) {
+		max = EVENT_BATCH;
+	}
+	ready = epoll_wait(loop->fd, events, max, timeout);
+	for ( i = 0; i < ready; i++ ) {
+		owners[i] = events[i].data.ptr;
+	}
+	return ready < 0 ? 0 : ready;
+#else
+	int n = 0;
+
+	ready = poll(loop->fds, loop->count, timeout);
+	if ( ready <= 0 ) {
+		return 0;
+	}
+
+	//Start where the last wait left off so that low descriptors cannot
+	// starve the others
+	for ( i = 0; i < loop->count && n < ready && n < max; i++ ) {
+		if ( loop->next >= loop->count ) {
+			loop->next = 0;
+		}
+		if ( loop->fds[loop->next].revents != 0 ) {
+			owners[n++] = loop->owners[loop->next];
+		}
+		loop->next++;
+	}
+	return n;
+#endif
+}
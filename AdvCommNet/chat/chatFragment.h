@@ -0,0 +1,216 @@
+/******************************************************************************/
+// chatFragment.h
+// Reassembly of messages sent as FLAG_FRAGMENT frames.  Fragments are
+// copied into one of a fixed set of message buffers, allocated together
+// when the reassembler is set up, so reassembly never holds more than its
+// number of slots of MAX_MESSAGE bytes however many senders are part way
+// through one.  Messages are told apart by the receiving session, the
+// sender, and the sender's number for them.  A message not completed within
+// REASSEMBLY_TIMEOUT_MS is abandoned, and a message started while every
+// buffer is in use takes over the buffer of the one started longest ago.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Reassembly sizing values
+ */
+enum {
+	REASSEMBLY_SLOTS = 8,
+	REASSEMBLY_TIMEOUT_MS = 5000,
+	REASSEMBLY_COMPLETE = 1,
+	REASSEMBLY_PENDING = 0,
+	REASSEMBLY_REJECTED = -1
+};
+
+/*
+ * Reassembly data structure; one message being put back together
+ * @param owner The receiving session
+ * @param cid The sender's client id
+ * @param messageId The sender's number for the message
+ * @param messageLen The length of the message, or 0 while the slot is free
+ * @param received Bytes of the message received so far
+ * @param have Which fragments have been received, one bit per fragment;
+ *	MAX_MESSAGE takes 52
+ * @param started When the first fragment arrived, in milliseconds
+ * @param hostnameLen The length of the sender's hostname
+ * @param hostname The sender's hostname
+ * @param data The message, MAX_MESSAGE bytes
+ */
+struct reassembly {
+	int owner;
+	int cid;
+	unsigned int messageId;
+	int messageLen;
+	int received;
+	unsigned long have;
+	long started;
+	int hostnameLen;
+	char hostname[MAX_LINE];
+	char *data;
+};
+
+/*
+ * Reassembler data structure
+ * @param slots The messages being put back together
+ * @param count Number of slots
+ * @param buffers The slots' message buffers, in one allocation
+ * @param completed Messages put back together
+ * @param expired Messages abandoned for taking too long
+ * @param evicted Messages abandoned to make room for another
+ */
+struct reassembler {
+	struct reassembly *slots;
+	int count;
+	char *buffers;
+	unsigned long completed;
+	unsigned long expired;
+	unsigned long evicted;
+};
+
+/*
+ * reassemblerInit
+ * Set up a reassembler and allocate its message buffers
+ * @param r The reassembler
+ * @param count Most messages to put back together at once
+ * @return 0 on success, -1 if the buffers could not be allocated
+ */
+int reassemblerInit(struct reassembler *r, int count) {
+	int i;
+
+	bzero((char *)r, sizeof(*r));
+	r->slots = calloc(count, sizeof(*r->slots));
+	r->buffers = malloc((size_t)count * MAX_MESSAGE);
+	if ( r->slots == NULL || r->buffers == NULL ) {
+		free(r->slots);
+		free(r->buffers);
+		return -1;
+	}
+	r->count = count;
+	for ( i = 0; i < count; i++ ) {
+		r->slots[i].data = r->buffers + (size_t)i * MAX_MESSAGE;
+	}
+	return 0;
+}
+
+/*
+ * reassemblerFree
+ * Free a reassembler's slots and message buffers
+ * @param r The reassembler
+ */
+void reassemblerFree(struct reassembler *r) {
+	free(r->slots);
+	free(r->buffers);
+	r->slots = NULL;
+	r->buffers = NULL;
+	r->count = 0;
+}
+
+/*
+ * reassemblySlot
+ * Find the slot of the message a fragment is part of, starting the message
+ * in a free or reclaimed slot if it is new, and abandoning messages that
+ * have taken too long
+ * @param r The reassembler
+ * @param owner The receiving session
+ * @param fragment The fragment
+ * @param now The time, in milliseconds
+ * @return The message's slot
+ */
+struct reassembly *reassemblySlot(struct reassembler *r, int owner,
+	const struct messageView *fragment, long now) {
+	struct reassembly *slot;
+	struct reassembly *found = NULL;
+	struct reassembly *spare = NULL;
+	int i;
+
+	for ( i = 0; i < r->count; i++ ) {
+		slot = &r->slots[i];
+		if ( slot->messageLen > 0 &&
+			now - slot->started > REASSEMBLY_TIMEOUT_MS ) {
+			slot->messageLen = 0;
+			r->expired++;
+		}
+		if ( slot->messageLen > 0 && slot->owner == owner &&
+			slot->cid == fragment->cid &&
+			slot->messageId == fragment->messageId &&
+			slot->messageLen == fragment->messageLen ) {
+			found = slot;
+		} else if ( spare == NULL || (spare->messageLen > 0 &&
+			(slot->messageLen == 0 || slot->started < spare->started)) ) {
+			spare = slot;
+		}
+	}
+	if ( found != NULL ) {
+		return found;
+	}
+
+	if ( spare->messageLen > 0 ) {
+		r->evicted++;
+	}
+	spare->owner = owner;
+	spare->cid = fragment->cid;
+	spare->messageId = fragment->messageId;
+	spare->messageLen = fragment->messageLen;
+	spare->received = 0;
+	spare->have = 0;
+	spare->started = now;
+	spare->hostnameLen = fragment->hostnameLen < MAX_LINE ?
+		fragment->hostnameLen : MAX_LINE;
+	memcpy(spare->hostname, fragment->hostname, spare->hostnameLen);
+	return spare;
+}
+
+/*
+ * reassemble
+ * Take a fragment into the message it is part of
+ * @param r The reassembler
+ * @param owner The receiving session
+ * @param fragment A FLAG_FRAGMENT message
+ * @param now The time, in milliseconds
+ * @param whole Set, once the last fragment is in, to the whole message,
+ *	unflagged; its strings stay valid until the next call
+ * @return REASSEMBLY_COMPLETE if the message is whole, REASSEMBLY_PENDING if
+ *	more fragments are to come, or REASSEMBLY_REJECTED if the fragment is
+ *	not cut as a sender cuts them
+ */
+int reassemble(struct reassembler *r, int owner,
+	const struct messageView *fragment, long now, struct messageView *whole) {
+	struct reassembly *slot;
+	int index = fragment->offset / FRAGMENT_DATA;
+	int expected = fragment->messageLen - fragment->offset;
+	unsigned long bit;
+
+	if ( expected > FRAGMENT_DATA ) {
+		expected = FRAGMENT_DATA;
+	}
+	if ( fragment->messageLen <= FRAGMENT_DATA ||
+		fragment->offset % FRAGMENT_DATA != 0 ||
+		fragment->payloadLen != expected ) {
+		return REASSEMBLY_REJECTED;
+	}
+
+	//A fragment received again, resent or duplicated, is left alone
+	slot = reassemblySlot(r, owner, fragment, now);
+	bit = 1UL << index;
+	if ( slot->have & bit ) {
+		return REASSEMBLY_PENDING;
+	}
+	memcpy(slot->data + fragment->offset, fragment->payload,
+		fragment->payloadLen);
+	slot->have |= bit;
+	slot->received += fragment->payloadLen;
+	if ( slot->received < slot->messageLen ) {
+		return REASSEMBLY_PENDING;
+	}
+
+	*whole = *fragment;
+	whole->flags &= ~FLAG_FRAGMENT;
+	whole->hostname = slot->hostname;
+	whole->hostnameLen = slot->hostnameLen;
+	whole->payload = slot->data;
+	whole->payloadLen = slot->messageLen;
+	slot->messageLen = 0;
+	r->completed++;
+	return REASSEMBLY_COMPLETE;
+}
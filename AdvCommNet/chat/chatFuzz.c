@@ -0,0 +1,496 @@
+/******************************************************************************/
+// chatFuzz.c
+// Differential fuzzing of the text protocol parser.  Random messages, and
+// messages built from pieces of real ones, are parsed both by parseMessage
+// and by the parser it replaced, kept here as referenceParse, and the two
+// results are compared.  Every message both accept must parse identically;
+// the only message parseMessage may reject that the reference accepts is
+// one whose client id does not fit in an int or whose hostname the client
+// table could not hold.
+//
+// Binary frames, laid out by gatherMessage with hostnames of every length
+// and sometimes with a byte changed or the end cut off, are decoded by
+// decodeFrame.  An intact frame must decode to what was laid out unless
+// its hostname is too long for the client table, and no frame decoded may
+// have such a hostname or reach past the bytes it was decoded from.
+//
+// The first message that breaks any rule is printed in hex and the run
+// fails; otherwise the counts are printed as "name value" lines.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+//include system, network, and io libraries
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//include chat library
+#include "chatUtil.h"
+
+/*
+ * Fuzzing configuration values
+ */
+enum {
+	FUZZ_ITERATIONS = 2000000,
+	FUZZ_LENGTH = 256,
+	FUZZ_PAYLOAD = 64
+};
+
+/*
+ * Pieces messages are built from: client ids, including ones that
+ * overflow, separators, commands and hostnames, and line endings
+ */
+static const char *idPieces[] = { "0", "7", "42", "-1", "+3", "017", "08",
+	"0x1f", "0X7fffffff", "0x", "0xg", "2147483647", "2147483648",
+	"-2147483648", "4294967296", "99999999999", "-", "" };
+static const char *spacePieces[] = { " ", "  ", "\t", "\v", "\f", "\r",
+	"\n", "" };
+static const char *wordPieces[] = { JOIN_STRING, QUIT_STRING, ENTER_STRING,
+	LEAVE_STRING, "JOINED", "ENTE", "host.example.net", "lobby", "r",
+	"31337.client", "" };
+static const char *endPieces[] = { "\n", "\0", "\n\n", "\0\n", "" };
+static const int endLengths[] = { 1, 1, 2, 2, 0 };
+
+/*
+ * Function signature declarations see function definitions for further
+ * documentation
+ */
+void usage();
+int referenceParse(const char *buffer, int length, struct messageView *view);
+int idOverflows(const char *buffer, int length);
+int randomMessage(char *buffer, unsigned int *seed);
+int builtMessage(char *buffer, unsigned int *seed);
+int frameMessage(char *buffer, unsigned int *seed, struct messageView *view);
+int checkFrame(const char *buffer, int length,
+	const struct messageView *view, int intact);
+void printMessage(const char *why, const char *buffer, int length);
+
+/*
+ * main
+ * Read command line parameters and compare the parsers over that many
+ * random and built messages
+ */
+int main( int argc, char *argv[] ) {
+	struct messageView got;
+	struct messageView want;
+	char buffer[FUZZ_LENGTH];
+	unsigned long acceptedBoth = 0, rejectedBoth = 0;
+	unsigned long overflowRejected = 0, hostnameRejected = 0;
+	unsigned long frameCounts[3] = { 0, 0, 0 };
+	struct messageView framed;
+	int intact;
+	unsigned int seed = 1;
+	int iterations = FUZZ_ITERATIONS;
+	int length;
+	int gotResult, wantResult;
+	int i;
+
+	if ( argc > 3 ) {
+		usage();
+	}
+	if ( argc > 1 ) {
+		iterations = atoi(argv[1]);
+	}
+	if ( argc > 2 ) {
+		seed = atoi(argv[2]);
+	}
+	if ( iterations < 1 ) {
+		usage();
+	}
+
+	for ( i = 0; i < iterations; i++ ) {
+		length = i % 2 == 0 ? randomMessage(buffer, &seed) :
+			builtMessage(buffer, &seed);
+		bzero((char *)&got, sizeof(got));
+		bzero((char *)&want, sizeof(want));
+		gotResult = parseMessage(buffer, length, &got);
+		wantResult = referenceParse(buffer, length, &want);
+
+		if ( gotResult == 0 && wantResult == 0 ) {
+			if ( got.cid != want.cid || got.opcode != want.opcode ||
+				got.hostname != want.hostname ||
+				got.hostnameLen != want.hostnameLen ||
+				got.payload != want.payload ||
+				got.payloadLen != want.payloadLen ) {
+				printMessage("The parsers disagree on", buffer, length);
+				exit(1);
+			}
+			acceptedBoth++;
+		} else if ( gotResult == 0 ) {
+			printMessage("Only parseMessage accepts", buffer, length);
+			exit(1);
+		} else if ( wantResult != 0 ) {
+			rejectedBoth++;
+		} else if ( idOverflows(buffer, length) ) {
+			overflowRejected++;
+		} else if ( want.hostnameLen >= MAX_LINE ) {
+			hostnameRejected++;
+		} else {
+			printMessage("Only the reference accepts", buffer, length);
+			exit(1);
+		}
+
+		//Lay a frame out, damage one in two, and decode it
+		length = frameMessage(buffer, &seed, &framed);
+		intact = rand_r(&seed) % 2;
+		if ( !intact && rand_r(&seed) % 2 == 0 ) {
+			buffer[rand_r(&seed) % length] = (char)rand_r(&seed);
+		} else if ( !intact ) {
+			length = rand_r(&seed) % length;
+		}
+		frameCounts[checkFrame(buffer, length, &framed, intact)]++;
+	}
+
+	printf("messages %i\naccepted_both %lu\nrejected_both %lu\n"
+		"rejected_overflow %lu\nrejected_hostname %lu\n", iterations,
+		acceptedBoth, rejectedBoth, overflowRejected, hostnameRejected);
+	printf("frames_accepted %lu\nframes_rejected %lu\n"
+		"frames_rejected_hostname %lu\nmismatches 0\n", frameCounts[0],
+		frameCounts[1], frameCounts[2]);
+	return 0;
+}
+
+/*
+ * usage
+ * Print usage information and exit
+ */
+void usage() {
+	printf("Usage: chatFuzz [iterations] [seed]\n");
+	printf("  iterations  messages to compare the parsers over "
+		"(default %i)\n", FUZZ_ITERATIONS);
+	printf("  seed        seed for generating them (default 1)\n");
+	exit(1);
+}
+
+/*
+ * referenceParse
+ * The text parser as it was before parseMessage found line ends with
+ * memchr and bounded client ids and hostnames, kept unchanged to check the
+ * current one against
+ * @param buffer The message buffer to parse
+ * @param length The length of the message buffer
+ * @param view The view to fill; its strings point into buffer
+ * @return 0 on success, -1 if the buffer is not a text message
+ */
+int referenceParse(const char *buffer, int length, struct messageView *view) {
+	const char *p = buffer;
+	const char *end = buffer + length;
+	const char *word;
+	unsigned int value = 0;
+	int negative = 0;
+	int base = 10;
+	int digit;
+	int digits = 0;
+
+	//Read the client id as %i would: optional sign, then decimal, 0x
+	// hexadecimal or 0 octal digits
+	while ( p < end && isspace((unsigned char)*p) ) {
+		p++;
+	}
+	if ( p < end && (*p == '-' || *p == '+') ) {
+		negative = *p++ == '-';
+	}
+	if ( p < end && *p == '0' ) {
+		base = 8;
+		digits++;
+		p++;
+		if ( p + 1 < end && (*p == 'x' || *p == 'X') &&
+			isxdigit((unsigned char)p[1]) ) {
+			base = 16;
+			p++;
+		}
+	}
+	for ( ; p < end; p++, digits++ ) {
+		if ( isdigit((unsigned char)*p) ) {
+			digit = *p - '0';
+		} else if ( base == 16 && isxdigit((unsigned char)*p) ) {
+			digit = (tolower((unsigned char)*p) - 'a') + 10;
+		} else {
+			break;
+		}
+		if ( digit >= base ) {
+			break;
+		}
+		value = value * base + digit;
+	}
+	if ( digits == 0 ) {
+		return -1;
+	}
+	view->cid = negative ? -(int)value : (int)value;
+
+	//The second word is a command or the sender's hostname
+	while ( p < end && isspace((unsigned char)*p) ) {
+		p++;
+	}
+	word = p;
+	while ( p < end && *p != '\0' && !isspace((unsigned char)*p) ) {
+		p++;
+	}
+	if ( p == word ) {
+		return -1;
+	}
+	view->hostname = word;
+	view->hostnameLen = p - word;
+
+	//The rest of the line is the message text, or the hostname of a
+	// JOIN or QUIT
+	while ( p < end && isspace((unsigned char)*p) ) {
+		p++;
+	}
+	view->payload = p;
+	while ( p < end && *p != '\n' && *p != '\0' ) {
+		p++;
+	}
+	view->payloadLen = p - view->payload;
+
+	view->version = PROTOCOL_TEXT;
+	view->flags = 0;
+	view->opcode = OP_TEXT;
+	if ( view->hostnameLen == 4 &&
+		(memcmp(word, JOIN_STRING, 4) == 0 ||
+		memcmp(word, QUIT_STRING, 4) == 0) ) {
+		view->opcode = word[0] == 'J' ? OP_JOIN : OP_QUIT;
+		view->hostname = view->payload;
+		view->hostnameLen = view->payloadLen;
+		view->payload = "";
+		view->payloadLen = 0;
+	} else if ( view->hostnameLen == 5 &&
+		(memcmp(word, ENTER_STRING, 5) == 0 ||
+		memcmp(word, LEAVE_STRING, 5) == 0) ) {
+		//Split the room from the hostname after it
+		view->opcode = word[0] == 'E' ? OP_ENTER : OP_LEAVE;
+		end = view->payload + view->payloadLen;
+		p = view->payload;
+		while ( p < end && !isspace((unsigned char)*p) ) {
+			p++;
+		}
+		view->payloadLen = p - view->payload;
+		while ( p < end && isspace((unsigned char)*p) ) {
+			p++;
+		}
+		view->hostname = p;
+		view->hostnameLen = end - p;
+	}
+	return 0;
+}
+
+/*
+ * idOverflows
+ * @param buffer A message the reference parser accepts
+ * @param length The length of the message
+ * @return Whether the magnitude of its client id is beyond what an int
+ *	holds
+ */
+int idOverflows(const char *buffer, int length) {
+	char copy[FUZZ_LENGTH + 1];
+	char *p = copy;
+
+	memcpy(copy, buffer, length);
+	copy[length] = '\0';
+	while ( isspace((unsigned char)*p) ) {
+		p++;
+	}
+	if ( *p == '-' || *p == '+' ) {
+		p++;
+	}
+	return strtoull(p, NULL, 0) > 0x7fffffffu;
+}
+
+/*
+ * randomMessage
+ * Fill a buffer with random bytes, mostly ones that mean something to the
+ * parser
+ * @param buffer The buffer, FUZZ_LENGTH long
+ * @param seed The generator's state
+ * @return The length of the message
+ */
+int randomMessage(char *buffer, unsigned int *seed) {
+	static const char alphabet[] = "0123456789abcdefxX+- \t\v\r\n.JOINQUT"
+		"ENTERLAV";
+	int length = rand_r(seed) % FUZZ_LENGTH;
+	int i;
+
+	for ( i = 0; i < length; i++ ) {
+		buffer[i] = rand_r(seed) % 8 == 0 ? (char)rand_r(seed) :
+			alphabet[rand_r(seed) % (sizeof(alphabet) - 1)];
+	}
+	return length;
+}
+
+/*
+ * builtMessage
+ * Build a message from pieces of real ones: a client id, a command or
+ * hostname, a room, a hostname or text, and a line ending, with random
+ * separators between them
+ * @param buffer The buffer, FUZZ_LENGTH long
+ * @param seed The generator's state
+ * @return The length of the message
+ */
+int builtMessage(char *buffer, unsigned int *seed) {
+	const char *piece;
+	int pieceLen;
+	int length = 0;
+	int part;
+	int repeat;
+	int end;
+
+	for ( part = 0; part < 9; part++ ) {
+		switch ( part ) {
+		case 0:
+		case 2:
+		case 4:
+		case 6:
+			piece = spacePieces[rand_r(seed) % (sizeof(spacePieces) /
+				sizeof(spacePieces[0]))];
+			break;
+		case 1:
+			piece = idPieces[rand_r(seed) % (sizeof(idPieces) /
+				sizeof(idPieces[0]))];
+			break;
+		case 8:
+			end = rand_r(seed) % (sizeof(endPieces) /
+				sizeof(endPieces[0]));
+			piece = endPieces[end];
+			break;
+		default:
+			piece = wordPieces[rand_r(seed) % (sizeof(wordPieces) /
+				sizeof(wordPieces[0]))];
+			break;
+		}
+
+		//A line ending may be a NUL, which strlen would not count
+		pieceLen = part == 8 ? endLengths[end] : strlen(piece);
+
+		//Long words make hostnames the client table could not hold
+		repeat = part >= 3 && rand_r(seed) % 16 == 0 ? 12 : 1;
+		while ( repeat-- > 0 && length + pieceLen <= FUZZ_LENGTH ) {
+			memcpy(buffer + length, piece, pieceLen);
+			length += pieceLen;
+		}
+	}
+	return length;
+}
+
+/*
+ * frameMessage
+ * Lay a binary frame out as gatherMessage does for sending, with a
+ * hostname of any length up to half the buffer, and sometimes as a fragment
+ * @param buffer The buffer, FUZZ_LENGTH long
+ * @param seed The generator's state
+ * @param view The message laid out, filled
+ * @return The length of the frame
+ */
+int frameMessage(char *buffer, unsigned int *seed, struct messageView *view) {
+	static char hostname[FUZZ_LENGTH / 2];
+	static char payload[FUZZ_PAYLOAD];
+	static const int opcodes[] = { OP_TEXT, OP_JOIN, OP_QUIT, OP_ENTER,
+		OP_LEAVE };
+	char scratch[GATHER_SCRATCH];
+	struct iovec iov[GATHER_IOV];
+	int length = 0;
+	int n, i;
+
+	if ( hostname[0] == '\0' ) {
+		memset(hostname, 'h', sizeof(hostname));
+		memset(payload, 'p', sizeof(payload));
+	}
+	bzero((char *)view, sizeof(*view));
+	view->version = PROTOCOL_VERSION;
+	view->opcode = opcodes[rand_r(seed) % (sizeof(opcodes) /
+		sizeof(opcodes[0]))];
+	view->cid = rand_r(seed) - RAND_MAX / 2;
+	view->hostname = hostname;
+	view->hostnameLen = rand_r(seed) % (sizeof(hostname) + 1);
+	view->payload = payload;
+	view->payloadLen = rand_r(seed) % (sizeof(payload) + 1);
+	if ( rand_r(seed) % 4 == 0 ) {
+		view->flags = FLAG_FRAGMENT;
+		view->messageId = rand_r(seed);
+		view->offset = rand_r(seed) % FUZZ_LENGTH;
+		view->messageLen = view->offset + view->payloadLen +
+			rand_r(seed) % FUZZ_PAYLOAD;
+	}
+
+	n = gatherMessage(view, PROTOCOL_VERSION, scratch, iov);
+	for ( i = 0; i < n; i++ ) {
+		memcpy(buffer + length, iov[i].iov_base, iov[i].iov_len);
+		length += iov[i].iov_len;
+	}
+	return length;
+}
+
+/*
+ * checkFrame
+ * Decode a frame and check it against what was laid out
+ * @param buffer The frame, as laid out and perhaps damaged
+ * @param length The length of the frame
+ * @param view The message laid out
+ * @param intact Whether the frame is exactly as laid out
+ * @return 0 if the frame was accepted, 1 if it was rejected, or 2 if it was
+ *	intact and rejected for its hostname; exits on a frame decoded wrongly
+ */
+int checkFrame(const char *buffer, int length,
+	const struct messageView *view, int intact) {
+	struct messageView got;
+	int total;
+
+	bzero((char *)&got, sizeof(got));
+	total = decodeFrame(buffer, length, &got);
+	if ( total < 0 ) {
+		if ( !intact ) {
+			return 1;
+		}
+		if ( view->hostnameLen >= MAX_LINE ) {
+			return 2;
+		}
+		printMessage("decodeFrame rejects", buffer, length);
+		exit(1);
+	}
+
+	if ( total > length || got.hostnameLen >= MAX_LINE ||
+		got.hostname < buffer || got.payload + got.payloadLen >
+		buffer + total || ((got.flags & FLAG_FRAGMENT) &&
+		got.offset + got.payloadLen > got.messageLen) ) {
+		printMessage("decodeFrame wrongly accepts", buffer, length);
+		exit(1);
+	}
+	if ( intact && (view->hostnameLen >= MAX_LINE || total != length ||
+		got.opcode != view->opcode || got.flags != view->flags ||
+		got.cid != view->cid || got.hostnameLen != view->hostnameLen ||
+		got.payloadLen != view->payloadLen ||
+		memcmp(got.hostname, view->hostname, got.hostnameLen) != 0 ||
+		((got.flags & FLAG_FRAGMENT) && (got.offset != view->offset ||
+		got.messageLen != view->messageLen ||
+		got.messageId != view->messageId))) ) {
+		printMessage("decodeFrame misreads", buffer, length);
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * printMessage
+ * Print a message the parsers disagree on, in hex
+ * @param why What the parsers disagree on
+ * @param buffer The message
+ * @param length The length of the message
+ */
+void printMessage(const char *why, const char *buffer, int length) {
+	int i;
+
+	fprintf(stderr, "%s the %i byte message:\n", why, length);
+	for ( i = 0; i < length; i++ ) {
+		fprintf(stderr, "%02x%s", (unsigned char)buffer[i],
+			i % 16 == 15 || i == length - 1 ? "\n" : " ");
+	}
+}
@@ -0,0 +1,425 @@
+/******************************************************************************/
+// chatHistory.h
+// Message history for the chat server.  Each room keeps its most recent
+// text, as binary frames, in a ring of fixed-size slots allocated when the
+// room is first opened, numbered by a sequence that only grows.  A client
+// that joins or enters a room can ask for the last messages, or for those
+// after a sequence number it already has.
+//
+// The history may also be appended to a file, mapped into memory, that
+// outlives the server.  Records of rooms in the same name hash bucket are
+// chained newest first from the file's header, so that opening the file
+// reads only the header and a room reads its own records back when it is
+// first used.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * History sizing values.  A record holds as much as one sequenced OP_HISTORY
+ * datagram carries, so that every record kept can be sent back; that is
+ * more than the binary form of any unfragmented message a client sends,
+ * FRAME_HEADER + MAX_LINE + FRAGMENT_DATA.  Fragments, and datagrams built
+ * by hand to be longer, are not kept.
+ */
+enum {
+	HISTORY_MAX = 4096,
+	HISTORY_RECORD = POOL_BUFFER_SIZE - FRAME_HEADER - FRAME_SEQUENCE,
+	HISTORY_MAGIC = 0x43484831,
+	HISTORY_GROW = 1 << 20
+};
+
+/*
+ * History record data structure
+ * @param seq The message's sequence number in its room
+ * @param length The length of the frame
+ * @param frame The message as a binary frame
+ */
+struct historyRecord {
+	unsigned int seq;
+	int length;
+	char frame[HISTORY_RECORD];
+};
+
+/*
+ * History ring data structure; one per room number
+ * @param lock Held while the ring is used
+ * @param name The name of the room the ring holds history for
+ * @param nameLen The length of the name, or -1 before the ring is opened
+ * @param loaded Whether the room's records have been read from the file
+ * @param next The sequence number the next message gets
+ * @param count Number of records held, the newest count before next
+ * @param records Record slots; sequence number seq is kept in slot
+ *	seq % depth
+ */
+struct historyRing {
+	pthread_mutex_t lock;
+	char name[MAX_ROOM_NAME+1];
+	int nameLen;
+	int loaded;
+	unsigned int next;
+	int count;
+	struct historyRecord *records;
+};
+
+/*
+ * History file header data structure, at the start of the file
+ * @param magic HISTORY_MAGIC
+ * @param reserved Unused
+ * @param used Bytes of the file written, header included
+ * @param heads Offset of the newest record of each name hash bucket, or 0
+ */
+struct historyFileHeader {
+	unsigned int magic;
+	unsigned int reserved;
+	unsigned long used;
+	unsigned long heads[ROOM_BUCKETS];
+};
+
+/*
+ * History file record data structure; records are padded to 8 bytes
+ * @param prev Offset of the next older record of the same bucket, or 0
+ * @param seq The message's sequence number in its room
+ * @param length The length of the frame
+ * @param nameLen The length of the room's name
+ * @param name The room's name
+ * @param frame The message as a binary frame
+ */
+struct historyFileRecord {
+	unsigned long prev;
+	unsigned int seq;
+	unsigned short length;
+	unsigned char nameLen;
+	char name[MAX_ROOM_NAME];
+	char frame[];
+};
+
+/*
+ * History store data structure
+ * @param depth Messages kept per room
+ * @param rings Ring of each room number, or NULL until the room is opened
+ * @param fd The history file, or -1 if history is kept only in memory
+ * @param map The file's mapping
+ * @param size The size of the file and its mapping
+ * @param fileLock Held while the file is used; taken inside a ring's lock
+ */
+struct historyStore {
+	int depth;
+	struct historyRing *_Atomic *rings;
+	int fd;
+	char *map;
+	unsigned long size;
+	pthread_mutex_t fileLock;
+};
+
+/*
+ * historyInit
+ * Initialize a history store, opening and mapping its file if it has one
+ * @param store The history store
+ * @param depth Messages kept per room
+ * @param path The history file, or NULL
+ */
+void historyInit(struct historyStore *store, int depth, const char *path) {
+	struct historyFileHeader *header;
+	struct stat st;
+
+	store->depth = depth;
+	store->rings = calloc(MAX_ROOMS, sizeof(*store->rings));
+	if ( store->rings == NULL ) {
+		perror("Could not allocate history");
+		exit(1);
+	}
+	store->fd = -1;
+	store->map = NULL;
+	store->size = 0;
+	pthread_mutex_init(&store->fileLock, NULL);
+	if ( path == NULL ) {
+		return;
+	}
+
+	store->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if ( store->fd < 0 || fstat(store->fd, &st) < 0 ) {
+		perror("Could not open history file");
+		exit(1);
+	}
+	store->size = st.st_size;
+	if ( st.st_size == 0 ) {
+		store->size = sizeof(*header) + HISTORY_GROW;
+		if ( ftruncate(store->fd, store->size) < 0 ) {
+			perror("Could not size history file");
+			exit(1);
+		}
+	}
+	store->map = mmap(NULL, store->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, store->fd, 0);
+	if ( store->size < sizeof(*header) || store->map == MAP_FAILED ) {
+		fprintf(stderr, "Could not map history file %s\n", path);
+		exit(1);
+	}
+
+	//A new file is all zeroes
+	header = (struct historyFileHeader *)store->map;
+	if ( st.st_size == 0 ) {
+		header->magic = HISTORY_MAGIC;
+		header->used = sizeof(*header);
+	}
+	if ( header->magic != HISTORY_MAGIC || header->used < sizeof(*header) ||
+		header->used > store->size ) {
+		fprintf(stderr, "%s is not a history file\n", path);
+		exit(1);
+	}
+}
+
+/*
+ * historyOpen
+ * Give a room number's ring to the room now open under that number,
+ * clearing it if it held another room's history.  Called with the client
+ * table lock held.
+ * @param store The history store
+ * @param room The room number
+ * @param name The room's name
+ * @param nameLen The length of the name
+ */
+void historyOpen(struct historyStore *store, int room, const char *name,
+	int nameLen) {
+	struct historyRing *ring = atomic_load(&store->rings[room]);
+
+	//A room whose ring cannot be allocated keeps no history
+	if ( ring == NULL ) {
+		ring = calloc(1, sizeof(*ring));
+		if ( ring == NULL || (ring->records = calloc(store->depth,
+			sizeof(*ring->records))) == NULL ) {
+			free(ring);
+			return;
+		}
+		pthread_mutex_init(&ring->lock, NULL);
+		ring->nameLen = -1;
+		atomic_store(&store->rings[room], ring);
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	if ( ring->nameLen != nameLen ||
+		memcmp(ring->name, name, nameLen) != 0 ) {
+		memcpy(ring->name, name, nameLen);
+		ring->name[nameLen] = '\0';
+		ring->nameLen = nameLen;
+		ring->loaded = 0;
+		ring->next = 1;
+		ring->count = 0;
+	}
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * historyLoad
+ * Fill a ring from the file the first time it is used, following its
+ * bucket's chain from the newest record until the ring is full or the
+ * room's sequence breaks.  Called with the ring's lock held.
+ * @param store The history store
+ * @param ring The ring
+ */
+void historyLoad(struct historyStore *store, struct historyRing *ring) {
+	struct historyFileHeader *header;
+	struct historyFileRecord *record;
+	struct historyRecord *slot;
+	unsigned long at;
+
+	if ( ring->loaded ) {
+		return;
+	}
+	ring->loaded = 1;
+	if ( store->map == NULL ) {
+		return;
+	}
+
+	pthread_mutex_lock(&store->fileLock);
+	header = (struct historyFileHeader *)store->map;
+	at = header->heads[roomHash(ring->name, ring->nameLen)];
+	while ( at >= sizeof(*header) && at + sizeof(*record) <= header->used &&
+		ring->count < store->depth ) {
+		record = (struct historyFileRecord *)(store->map + at);
+		if ( record->length > HISTORY_RECORD || record->prev >= at ||
+			at + sizeof(*record) + record->length > header->used ) {
+			break;
+		}
+		if ( record->nameLen == ring->nameLen &&
+			memcmp(record->name, ring->name, ring->nameLen) == 0 ) {
+			if ( ring->count == 0 ) {
+				ring->next = record->seq + 1;
+			} else if ( record->seq != ring->next - ring->count - 1 ) {
+				break;
+			}
+			slot = &ring->records[record->seq % store->depth];
+			slot->seq = record->seq;
+			slot->length = record->length;
+			memcpy(slot->frame, record->frame, record->length);
+			ring->count++;
+		}
+		at = record->prev;
+	}
+	pthread_mutex_unlock(&store->fileLock);
+}
+
+/*
+ * historyAppend
+ * Append a record to the history file, growing the file and its mapping
+ * HISTORY_GROW bytes at a time.  Called with the ring's lock held.
+ * @param store The history store
+ * @param ring The ring the record was added to
+ * @param slot The record
+ */
+void historyAppend(struct historyStore *store, const struct historyRing *ring,
+	const struct historyRecord *slot) {
+	struct historyFileHeader *header;
+	struct historyFileRecord *record;
+	unsigned long size = (sizeof(*record) + slot->length + 7) & ~7UL;
+	int bucket = roomHash(ring->name, ring->nameLen);
+	char *map;
+
+	pthread_mutex_lock(&store->fileLock);
+	header = (struct historyFileHeader *)store->map;
+	if ( header->used + size > store->size ) {
+		if ( ftruncate(store->fd, store->size + HISTORY_GROW) < 0 ||
+			(map = mremap(store->map, store->size, store->size +
+			HISTORY_GROW, MREMAP_MAYMOVE)) == MAP_FAILED ) {
+			pthread_mutex_unlock(&store->fileLock);
+			return;
+		}
+		store->map = map;
+		store->size += HISTORY_GROW;
+		header = (struct historyFileHeader *)store->map;
+	}
+
+	//The record is whole before the header points at it
+	record = (struct historyFileRecord *)(store->map + header->used);
+	record->prev = header->heads[bucket];
+	record->seq = slot->seq;
+	record->length = slot->length;
+	record->nameLen = ring->nameLen;
+	memcpy(record->name, ring->name, ring->nameLen);
+	memcpy(record->frame, slot->frame, slot->length);
+	header->heads[bucket] = header->used;
+	header->used += size;
+	pthread_mutex_unlock(&store->fileLock);
+}
+
+/*
+ * historyRecord
+ * Keep a message in its room's history
+ * @param store The history store
+ * @param room The room number
+ * @param iov The message laid out as a binary frame
+ * @param iovlen Number of vectors
+ * @return 0 if the message was kept or the room keeps no history, -1 if the
+ *	frame is longer than HISTORY_RECORD
+ */
+int historyRecord(struct historyStore *store, int room,
+	const struct iovec *iov, int iovlen) {
+	struct historyRing *ring = atomic_load(&store->rings[room]);
+	struct historyRecord *slot;
+	int length = 0;
+	int i;
+
+	for ( i = 0; i < iovlen; i++ ) {
+		length += iov[i].iov_len;
+	}
+	if ( length > HISTORY_RECORD ) {
+		return -1;
+	}
+	if ( ring == NULL ) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	historyLoad(store, ring);
+	slot = &ring->records[ring->next % store->depth];
+	slot->seq = ring->next++;
+	slot->length = 0;
+	for ( i = 0; i < iovlen; i++ ) {
+		memcpy(slot->frame + slot->length, iov[i].iov_base,
+			iov[i].iov_len);
+		slot->length += iov[i].iov_len;
+	}
+	if ( ring->count < store->depth ) {
+		ring->count++;
+	}
+	if ( store->map != NULL ) {
+		historyAppend(store, ring, slot);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return 0;
+}
+
+/*
+ * historyStart
+ * Find where a client's catch-up starts and ends
+ * @param store The history store
+ * @param room The room number
+ * @param count The number of most recent messages wanted, or 0 for every
+ *	message after the one numbered after
+ * @param after The sequence number of the last message the client has
+ * @param end Set to the sequence number the next message will get
+ * @return The sequence number of the first message to send
+ */
+unsigned int historyStart(struct historyStore *store, int room, int count,
+	unsigned int after, unsigned int *end) {
+	struct historyRing *ring = atomic_load(&store->rings[room]);
+	unsigned int from;
+
+	*end = 0;
+	if ( ring == NULL ) {
+		return 0;
+	}
+	pthread_mutex_lock(&ring->lock);
+	historyLoad(store, ring);
+	*end = ring->next;
+	from = ring->next - ring->count;
+	if ( count > 0 && count < ring->count ) {
+		from = ring->next - count;
+	} else if ( count == 0 && after >= from ) {
+		from = after < ring->next ? after + 1 : ring->next;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return from;
+}
+
+/*
+ * historyCopy
+ * Copy consecutive messages of a room's history, as frames back to back,
+ * skipping any the ring no longer holds
+ * @param store The history store
+ * @param room The room number
+ * @param from The sequence number of the first message to copy; advanced
+ *	past the messages copied
+ * @param end The sequence number to stop before
+ * @param buffer The buffer to copy into
+ * @param size The size of the buffer
+ * @param first Set to the sequence number of the first message copied
+ * @return The number of bytes copied
+ */
+int historyCopy(struct historyStore *store, int room, unsigned int *from,
+	unsigned int end, char *buffer, int size, unsigned int *first) {
+	struct historyRing *ring = atomic_load(&store->rings[room]);
+	struct historyRecord *slot;
+	int length = 0;
+
+	if ( ring == NULL ) {
+		return 0;
+	}
+	pthread_mutex_lock(&ring->lock);
+	if ( (int)(*from - (ring->next - ring->count)) < 0 ) {
+		*from = ring->next - ring->count;
+	}
+	*first = *from;
+	while ( (int)(*from - end) < 0 && (int)(*from - ring->next) < 0 ) {
+		slot = &ring->records[*from % store->depth];
+		if ( slot->seq != *from || length + slot->length > size ) {
+			break;
+		}
+		memcpy(buffer + length, slot->frame, slot->length);
+		length += slot->length;
+		(*from)++;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return length;
+}
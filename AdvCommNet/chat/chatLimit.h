@@ -0,0 +1,202 @@
+/******************************************************************************/
+// chatLimit.h
+// Admission control for the chat server.  Every source address has a token
+// bucket that each of its datagrams takes a token from; a source that has
+// run its bucket dry has its datagrams dropped before they are parsed, so a
+// noisy client costs a hash lookup per datagram instead of a fan-out.  A
+// separate bucket admits JOINs, so a burst of clients reconnecting at once
+// is spread out instead of crowding out clients already chatting.
+//
+// Each worker keeps its own limiter, touched only by that worker's thread.
+// The kernel spreads sources across the workers' sockets by address, so a
+// source's datagrams all meet the same bucket.  Buckets live in a fixed
+// open-addressed table; a source that finds no room takes over the bucket
+// least recently used among those it probes.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Limiter sizing values.  Tokens are counted in thousandths so that rates
+ * below one per millisecond still refill between datagrams.
+ */
+enum {
+	LIMIT_SOURCES = 4096,
+	LIMIT_PROBE = 8,
+	LIMIT_SCALE = 1000,
+	LIMIT_MAX_RATE = 1000000
+};
+
+/*
+ * Token bucket data structure
+ * @param tokens Thousandths of a token in the bucket
+ * @param refilled When the bucket was last refilled, in milliseconds
+ */
+struct tokenBucket {
+	long tokens;
+	long refilled;
+};
+
+/*
+ * Source bucket data structure
+ * @param addr The source's IPv4 address, in network order, or 0 while the
+ *	bucket is unused
+ * @param port The source's port, in network order
+ * @param bucket The source's tokens
+ */
+struct sourceBucket {
+	unsigned int addr;
+	unsigned short port;
+	struct tokenBucket bucket;
+};
+
+/*
+ * Rate limiter data structure
+ * @param sources Bucket of each source seen, or NULL if sources are not
+ *	limited
+ * @param sourceRate Datagrams per second a source may send
+ * @param sourceBurst Datagrams a quiet source may send at once
+ * @param joins Tokens for JOINs from any source
+ * @param joinRate JOINs per second admitted, or 0 if JOINs are not limited
+ * @param joinBurst JOINs admitted at once after a quiet spell
+ */
+struct rateLimiter {
+	struct sourceBucket *sources;
+	long sourceRate;
+	long sourceBurst;
+	struct tokenBucket joins;
+	long joinRate;
+	long joinBurst;
+};
+
+/*
+ * bucketTake
+ * Refill a bucket for the time since it was last refilled, then take a
+ * token from it
+ * @param bucket The bucket
+ * @param rate Tokens added per second
+ * @param burst Most tokens the bucket holds
+ * @param now The time, in milliseconds
+ * @return 1 if a token was taken, 0 if the bucket is empty
+ */
+int bucketTake(struct tokenBucket *bucket, long rate, long burst, long now) {
+	long elapsed = now - bucket->refilled;
+
+	if ( elapsed > 0 ) {
+		//A full bucket takes burst/rate seconds to refill; waiting longer
+		// adds nothing and could overflow the product
+		if ( elapsed > burst * LIMIT_SCALE / rate + 1 ) {
+			elapsed = burst * LIMIT_SCALE / rate + 1;
+		}
+		bucket->tokens += elapsed * rate;
+		if ( bucket->tokens > burst * LIMIT_SCALE ) {
+			bucket->tokens = burst * LIMIT_SCALE;
+		}
+		bucket->refilled = now;
+	}
+	if ( bucket->tokens < LIMIT_SCALE ) {
+		return 0;
+	}
+	bucket->tokens -= LIMIT_SCALE;
+	return 1;
+}
+
+/*
+ * limiterInit
+ * Set up a worker's limiter; a rate of 0 leaves that check off
+ * @param limiter The limiter
+ * @param sourceRate Datagrams per second each source may send
+ * @param joinRate JOINs per second admitted from all sources together
+ * @param now The time, in milliseconds
+ * @return 0 on success, -1 if the buckets could not be allocated
+ */
+int limiterInit(struct rateLimiter *limiter, long sourceRate, long joinRate,
+	long now) {
+	bzero((char *)limiter, sizeof(*limiter));
+	if ( sourceRate > 0 ) {
+		limiter->sources = calloc(LIMIT_SOURCES, sizeof(*limiter->sources));
+		if ( limiter->sources == NULL ) {
+			return -1;
+		}
+	}
+
+	//A quiet source, or a quiet server, may spend one second's worth at
+	// once
+	limiter->sourceRate = sourceRate;
+	limiter->sourceBurst = sourceRate;
+	limiter->joinRate = joinRate;
+	limiter->joinBurst = joinRate;
+	limiter->joins.tokens = joinRate * LIMIT_SCALE;
+	limiter->joins.refilled = now;
+	return 0;
+}
+
+/*
+ * limiterBucket
+ * Find a source's bucket, taking one over for a source not seen before
+ * @param limiter The limiter
+ * @param address The source
+ * @param now The time, in milliseconds
+ * @return The source's bucket
+ */
+struct tokenBucket *limiterBucket(struct rateLimiter *limiter,
+	const struct sockaddr_in *address, long now) {
+	unsigned int addr = address->sin_addr.s_addr;
+	unsigned short port = address->sin_port;
+	unsigned int hash = (addr ^ ((unsigned int)port << 16 | port)) *
+		2654435761u;
+	struct sourceBucket *source;
+	struct sourceBucket *oldest = NULL;
+	int i;
+
+	for ( i = 0; i < LIMIT_PROBE; i++ ) {
+		source = &limiter->sources[(hash + i) & (LIMIT_SOURCES - 1)];
+		if ( source->addr == addr && source->port == port ) {
+			return &source->bucket;
+		}
+		if ( oldest == NULL || source->addr == 0 ||
+			(oldest->addr != 0 &&
+			source->bucket.refilled < oldest->bucket.refilled) ) {
+			oldest = source;
+		}
+	}
+
+	//A new source starts with a full bucket, as a quiet one would have
+	oldest->addr = addr;
+	oldest->port = port;
+	oldest->bucket.tokens = limiter->sourceBurst * LIMIT_SCALE;
+	oldest->bucket.refilled = now;
+	return &oldest->bucket;
+}
+
+/*
+ * limitSource
+ * Take a token for a datagram from a source
+ * @param limiter The limiter
+ * @param address The source
+ * @param now The time, in milliseconds
+ * @return 1 if the datagram may be handled, 0 if it is to be dropped
+ */
+int limitSource(struct rateLimiter *limiter, const struct sockaddr_in *address,
+	long now) {
+	if ( limiter->sources == NULL ) {
+		return 1;
+	}
+	return bucketTake(limiterBucket(limiter, address, now),
+		limiter->sourceRate, limiter->sourceBurst, now);
+}
+
+/*
+ * limitJoin
+ * Take a token for a JOIN
+ * @param limiter The limiter
+ * @param now The time, in milliseconds
+ * @return 1 if the JOIN may be handled, 0 if it is to be dropped
+ */
+int limitJoin(struct rateLimiter *limiter, long now) {
+	if ( limiter->joinRate == 0 ) {
+		return 1;
+	}
+	return bucketTake(&limiter->joins, limiter->joinRate, limiter->joinBurst,
+		now);
+}
@@ -0,0 +1,994 @@
+/******************************************************************************/
+// chatLoad.c
+// A load generator for the chat server.  One process runs thousands of
+// simulated clients, each with its own socket, through the whole chat
+// lifecycle: every client joins, optionally enters a room, sends text at
+// the aggregate rate asked for, and quits.  Every text carries the time it
+// was sent, so each copy the server fans back out gives an end-to-end
+// latency.  When the run is over the generator prints throughput, loss and
+// latency percentiles as "name value" lines.
+//
+// Named scenarios fix every setting, including the seed that picks which
+// client sends each message, so a scenario run against the same server
+// build measures the same workload every time.
+//
+// Given the server's process id, the generator also counts the server's
+// CPU time, and its cycles where the machine has a cycle counter, from the
+// start of sending to the end of the drain, and reports them per message
+// sent.  Given the server's metrics port, it reports how far the server's
+// own counters moved over the same span.
+//
+// Against one of a federation of peered servers, texts from other
+// generators' clients, relayed by the server's peers, are counted apart
+// from those of the generator's own clients, so loss is still reckoned
+// against what the server was sent, and the server's relay counters give
+// the datagrams each message cost its peers.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+//include system, network, and io libraries
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+//include chat library
+#include "chatUtil.h"
+#include "chatEvent.h"
+#include "chatResolve.h"
+#include "chatMetrics.h"
+
+/*
+ * Load generator configuration values
+ */
+enum {
+	MAX_BOTS = 16384,
+	MAX_LOAD_ROOMS = 1024,
+	LOAD_BUFFER = 2048,
+	MIN_SIZE = 24,
+	RESEND_MS = 500,
+	READY_WAIT_MS = 5000,
+	DRAIN_MS = 1000,
+	QUIT_WAIT_MS = 2000,
+	MAX_WATCHED = 64,
+	METRICS_WAIT_MS = 1000
+};
+
+/*
+ * Simulated client states
+ */
+enum {
+	BOT_IDLE,
+	BOT_JOINING,
+	BOT_ENTERING,
+	BOT_READY,
+	BOT_QUITTING,
+	BOT_DONE
+};
+
+/*
+ * Run phases
+ */
+enum {
+	PHASE_JOIN,
+	PHASE_SEND,
+	PHASE_DRAIN,
+	PHASE_QUIT,
+	PHASE_DONE
+};
+
+/*
+ * Scenario data structure
+ * @param name The scenario's name
+ * @param clients Number of simulated clients
+ * @param rooms Number of rooms the clients are spread over, or 0 to keep
+ *	them all in the lobby
+ * @param rate Text messages sent per second, across all clients
+ * @param size Length of each text message
+ * @param seconds How long text is sent for
+ * @param joinRate Clients joining, and quitting, per second
+ * @param protocol PROTOCOL_TEXT or PROTOCOL_VERSION
+ * @param batched Whether clients say they unpack OP_BATCH frames
+ * @param seed Seed for choosing which client sends each message
+ */
+struct loadScenario {
+	const char *name;
+	int clients;
+	int rooms;
+	int rate;
+	int size;
+	int seconds;
+	int joinRate;
+	int protocol;
+	int batched;
+	unsigned int seed;
+};
+
+/*
+ * Simulated client data structure
+ * @param sd The client's socket, connected to the server
+ * @param state BOT_IDLE through BOT_DONE
+ * @param cid The connection id the server gave the client
+ * @param room The room the client enters, or -1 for the lobby
+ * @param hostname The client's hostname
+ * @param hostnameLen The length of the hostname
+ * @param started When the client first sent its JOIN
+ * @param due When to resend the request the client is waiting on
+ * @param lastSent When the client last sent anything
+ */
+struct bot {
+	int sd;
+	int state;
+	int cid;
+	int room;
+	char hostname[MAX_LINE];
+	int hostnameLen;
+	long started;
+	long due;
+	long lastSent;
+};
+
+/*
+ * Checked-in scenarios.  Every setting is fixed so that a scenario can be
+ * rerun and compared against an earlier build.
+ */
+static const struct loadScenario scenarios[] = {
+	{ "smoke", 10, 0, 100, 32, 2, 100, PROTOCOL_VERSION, 0, 1 },
+	{ "fanout", 1000, 0, 200, 64, 5, 500, PROTOCOL_VERSION, 0, 1 },
+	{ "rooms", 1000, 50, 5000, 64, 5, 250, PROTOCOL_VERSION, 0, 1 },
+	{ "chatty", 50, 0, 20000, 24, 5, 100, PROTOCOL_VERSION, 0, 1 },
+	{ "batched", 50, 0, 20000, 24, 5, 100, PROTOCOL_VERSION, 1, 1 },
+	{ "text", 200, 0, 500, 64, 5, 200, PROTOCOL_TEXT, 0, 1 },
+	{ "cost", 1, 0, 20000, 64, 3, 100, PROTOCOL_VERSION, 0, 1 },
+	{ "relay", 100, 0, 50, 64, 5, 100, PROTOCOL_VERSION, 0, 1 },
+	{ "lobby", 24, 0, 800, 24, 5, 100, PROTOCOL_VERSION, 1, 1 }
+};
+
+//The run's settings and what it has measured
+struct loadScenario how;
+int roomMembers[MAX_LOAD_ROOMS + 1];
+int joined = 0;
+int ready = 0;
+int quitAcked = 0;
+unsigned long sent = 0;
+unsigned long expected = 0;
+unsigned long received = 0;
+unsigned long relayed = 0;
+char ownPrefix[32];
+int ownPrefixLen;
+unsigned long datagramsIn = 0;
+unsigned long datagramsOut = 0;
+unsigned long sendFailures = 0;
+struct histogram latency;
+struct histogram relayLatency;
+struct histogram joinLatency;
+
+//The server's threads' task clock and cycle counters, -1 where a counter
+// could not be opened
+int taskClocks[MAX_WATCHED];
+int cycleCounters[MAX_WATCHED];
+int watched = 0;
+unsigned long serverTaskNs = 0;
+unsigned long serverCycles = 0;
+int haveCycles = 0;
+
+//The server metrics reported, syscalls first and relay_out last for the
+// per-message figures, and how far each moved
+static const char *serverMetrics[] = { "syscalls", "messages_in",
+	"messages_out", "send_failures", "drops_overflow", "relay_in",
+	"relay_drops", "relay_out" };
+enum { SERVER_METRICS = sizeof(serverMetrics) / sizeof(serverMetrics[0]) };
+unsigned long serverMoved[SERVER_METRICS];
+int metricsQueried = 0;
+
+/*
+ * Function signature declarations see function definitions for further
+ * documentation
+ */
+void usage();
+void useScenario(const char *name);
+long loadNanos();
+long loadMillis();
+void raiseFileLimit(int needed);
+void startBot(struct bot *bot, int index, const struct sockaddr_in *server,
+	struct eventLoop *loop);
+void sendView(struct bot *bot, const struct messageView *view, long now);
+void sendRequest(struct bot *bot, int opcode, long now);
+void sendLine(struct bot *bot, long now);
+void receiveBot(struct bot *bot, long now);
+void handleMessage(struct bot *bot, const struct messageView *view,
+	long now);
+void handleText(const struct messageView *view, long now);
+void serviceBots(struct bot *bots, int count, long now);
+int openCounter(int tid, unsigned int type, unsigned long config);
+void watchServer(int pid);
+void readServer(unsigned long *taskNs, unsigned long *cycles);
+void queryServer(int port, unsigned long *values);
+void printReport(long sendMillis);
+void printPercentiles(const char *name, struct histogram *hist,
+	unsigned long scale);
+
+/*
+ * main
+ * Read command line parameters, run the scenario against the server, and
+ * print what was measured
+ */
+int main( int argc, char *argv[] ) {
+	struct sockaddr_in server;
+	struct resolver names;
+	struct sockaddr_storage address;
+	socklen_t length;
+	struct eventLoop loop;
+	struct bot *bots;
+	void *readyBots[EVENT_BATCH];
+	int phase = PHASE_JOIN;
+	int started = 0;
+	int stopped = 0;
+	long phaseStart;
+	long sendStart = 0;
+	long sendMillis = 0;
+	long now;
+	unsigned long due;
+	unsigned long taskNs = 0, cycles = 0;
+	unsigned long values[SERVER_METRICS];
+	int serverPid = 0;
+	int metricsPort = 0;
+	int opt;
+	int n, i;
+
+	useScenario("smoke");
+	while ( (opt = getopt(argc, argv, "Bc:d:g:j:m:M:p:P:s:S:T")) != -1 ) {
+		switch ( opt ) {
+		case 'p':
+			useScenario(optarg);
+			break;
+		case 'c':
+			how.clients = atoi(optarg);
+			break;
+		case 'g':
+			how.rooms = atoi(optarg);
+			break;
+		case 'm':
+			how.rate = atoi(optarg);
+			break;
+		case 's':
+			how.size = atoi(optarg);
+			break;
+		case 'd':
+			how.seconds = atoi(optarg);
+			break;
+		case 'j':
+			how.joinRate = atoi(optarg);
+			break;
+		case 'S':
+			how.seed = atoi(optarg);
+			break;
+		case 'T':
+			how.protocol = PROTOCOL_TEXT;
+			break;
+		case 'B':
+			how.batched = 1;
+			break;
+		case 'P':
+			serverPid = atoi(optarg);
+			break;
+		case 'M':
+			metricsPort = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ( argc - optind != 2 || how.clients < 1 || how.clients > MAX_BOTS ||
+		how.rooms < 0 || how.rooms > MAX_LOAD_ROOMS || how.rate < 1 ||
+		how.size < MIN_SIZE || how.size > MAX_LINE || how.seconds < 1 ||
+		how.joinRate < 1 || (how.batched && how.protocol == PROTOCOL_TEXT) ||
+		serverPid < 0 || metricsPort < 0 || metricsPort > 65535 ) {
+		usage();
+	}
+	if ( serverPid > 0 ) {
+		watchServer(serverPid);
+	}
+
+	//The server only listens for IPv4
+	if ( resolverInit(&names) < 0 ) {
+		perror("Could not start the resolver");
+		exit(1);
+	}
+	if ( resolverWait(&names, argv[optind], AF_INET, atoi(argv[optind+1]),
+		&address, &length) != RESOLVE_READY ) {
+		fprintf(stderr, "Could not resolve %s\n", argv[optind]);
+		exit(1);
+	}
+	bcopy((char *)&address, (char *)&server, sizeof(server));
+
+	raiseFileLimit(how.clients + 16);
+	ownPrefixLen = snprintf(ownPrefix, sizeof(ownPrefix), "%i.load",
+		getpid());
+	bots = calloc(how.clients, sizeof(*bots));
+	if ( bots == NULL || eventInit(&loop) < 0 ) {
+		perror("Could not start the load generator");
+		exit(1);
+	}
+
+	//Clients join at the join rate and are given until READY_WAIT_MS
+	// after the last one started to be acknowledged; text is then sent at
+	// the message rate, the replies are given DRAIN_MS to arrive, and
+	// clients quit at the join rate
+	phaseStart = loadMillis();
+	while ( phase != PHASE_DONE ) {
+		now = loadMillis();
+		switch ( phase ) {
+		case PHASE_JOIN:
+			due = (unsigned long)(now - phaseStart) * how.joinRate / 1000 + 1;
+			while ( started < how.clients && started < due ) {
+				startBot(&bots[started], started, &server, &loop);
+				started++;
+			}
+			if ( started == how.clients && (ready == how.clients ||
+				now - bots[started - 1].started > READY_WAIT_MS) ) {
+				phase = PHASE_SEND;
+				phaseStart = sendStart = now;
+				readServer(&taskNs, &cycles);
+				if ( metricsPort > 0 ) {
+					queryServer(metricsPort, values);
+				}
+			}
+			break;
+		case PHASE_SEND:
+			due = (unsigned long)(now - phaseStart) * how.rate / 1000;
+			while ( sent < due && ready > 0 ) {
+				i = rand_r(&how.seed) % how.clients;
+				while ( bots[i].state != BOT_READY ) {
+					i = (i + 1) % how.clients;
+				}
+				sendLine(&bots[i], now);
+			}
+			if ( now - phaseStart >= how.seconds * 1000L ) {
+				phase = PHASE_DRAIN;
+				phaseStart = now;
+				sendMillis = now - sendStart;
+			}
+			break;
+		case PHASE_DRAIN:
+			if ( now - phaseStart >= DRAIN_MS ) {
+				readServer(&serverTaskNs, &serverCycles);
+				serverTaskNs -= taskNs;
+				serverCycles -= cycles;
+				if ( metricsPort > 0 ) {
+					queryServer(metricsPort, serverMoved);
+					for ( i = 0; i < SERVER_METRICS; i++ ) {
+						serverMoved[i] -= values[i];
+					}
+					metricsQueried = 1;
+				}
+				phase = PHASE_QUIT;
+				phaseStart = now;
+			}
+			break;
+		case PHASE_QUIT:
+			due = (unsigned long)(now - phaseStart) * how.joinRate / 1000 + 1;
+			while ( stopped < how.clients && stopped < due ) {
+				if ( bots[stopped].state >= BOT_JOINING ) {
+					sendRequest(&bots[stopped], OP_QUIT, now);
+				}
+				stopped++;
+			}
+			if ( stopped == how.clients && (quitAcked == joined ||
+				now - phaseStart > QUIT_WAIT_MS +
+				how.clients * 1000L / how.joinRate) ) {
+				phase = PHASE_DONE;
+			}
+			break;
+		}
+		serviceBots(bots, started, now);
+
+		n = eventWait(&loop, readyBots, EVENT_BATCH, 1);
+		now = loadMillis();
+		for ( i = 0; i < n; i++ ) {
+			receiveBot(readyBots[i], now);
+		}
+	}
+
+	printReport(sendMillis);
+	return 0;
+}
+
+/*
+ * usage
+ * Print usage information and exit
+ */
+void usage() {
+	int i;
+
+	printf("Usage: chatLoad [-p scenario] [-c clients] [-g rooms] "
+		"[-m rate] [-s size]\n       [-d seconds] [-j rate] [-S seed] "
+		"[-T] [-B] [-P pid] [-M port]\n       <server> <port>\n");
+	printf("  -p scenario  start from a named scenario (default smoke)\n");
+	printf("  -c clients   simulated clients (1-%i)\n", MAX_BOTS);
+	printf("  -g rooms     rooms to spread clients over (0-%i, 0 for the "
+		"lobby)\n", MAX_LOAD_ROOMS);
+	printf("  -m rate      text messages per second across all clients\n");
+	printf("  -s size      length of each text message (%i-%i)\n",
+		MIN_SIZE, MAX_LINE);
+	printf("  -d seconds   how long text is sent for\n");
+	printf("  -j rate      clients joining and quitting per second\n");
+	printf("  -S seed      seed for choosing senders\n");
+	printf("  -T           speak only the text protocol\n");
+	printf("  -B           ask the server for OP_BATCH frames\n");
+	printf("  -P pid       count the server's CPU time and cycles per "
+		"message\n");
+	printf("  -M port      report how far the server's metrics on this "
+		"localhost port moved\n");
+	printf("Options after -p override the scenario.  Scenarios:\n");
+	for ( i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++ ) {
+		printf("  %-8s %5i clients %4i rooms %6i msg/s %3i bytes "
+			"%2i s%s%s\n", scenarios[i].name, scenarios[i].clients,
+			scenarios[i].rooms, scenarios[i].rate, scenarios[i].size,
+			scenarios[i].seconds,
+			scenarios[i].protocol == PROTOCOL_TEXT ? " text" : "",
+			scenarios[i].batched ? " batched" : "");
+	}
+	exit(1);
+}
+
+/*
+ * useScenario
+ * Take every setting from a named scenario
+ * @param name The scenario's name
+ */
+void useScenario(const char *name) {
+	int i;
+
+	for ( i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++ ) {
+		if ( strcmp(scenarios[i].name, name) == 0 ) {
+			how = scenarios[i];
+			return;
+		}
+	}
+	usage();
+}
+
+/*
+ * loadNanos
+ * @return A monotonic clock in nanoseconds
+ */
+long loadNanos() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * loadMillis
+ * @return A monotonic clock in milliseconds
+ */
+long loadMillis() {
+	return loadNanos() / 1000000;
+}
+
+/*
+ * raiseFileLimit
+ * Raise the open file limit as far as allowed, since every simulated
+ * client has its own socket
+ * @param needed The number of descriptors needed
+ */
+void raiseFileLimit(int needed) {
+	struct rlimit limit;
+
+	if ( getrlimit(RLIMIT_NOFILE, &limit) < 0 ||
+		limit.rlim_cur >= (rlim_t)needed ) {
+		return;
+	}
+	limit.rlim_cur = limit.rlim_max < (rlim_t)needed ?
+		limit.rlim_max : (rlim_t)needed;
+	setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+/*
+ * startBot
+ * Give a simulated client its own socket toward the server and send its
+ * JOIN
+ * @param bot The client
+ * @param index The client's number, which names it and its room
+ * @param server The server's address
+ * @param loop The event loop to watch the socket with
+ */
+void startBot(struct bot *bot, int index, const struct sockaddr_in *server,
+	struct eventLoop *loop) {
+	long now = loadMillis();
+
+	bot->sd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ( bot->sd < 0 || connect(bot->sd, (struct sockaddr *)server,
+		sizeof(*server)) < 0 || eventAdd(loop, bot->sd, bot) < 0 ) {
+		perror("Could not open client socket");
+		exit(1);
+	}
+	bot->room = how.rooms > 0 ? index % how.rooms : -1;
+	bot->hostnameLen = snprintf(bot->hostname, sizeof(bot->hostname),
+		"%s%i", ownPrefix, index);
+	bot->started = now;
+	sendRequest(bot, OP_JOIN, now);
+}
+
+/*
+ * sendView
+ * Send a message from a simulated client in its protocol
+ * @param bot The client
+ * @param view The message
+ * @param now The current time in milliseconds
+ */
+void sendView(struct bot *bot, const struct messageView *view, long now) {
+	char scratch[2][GATHER_SCRATCH];
+	struct iovec iov[2*GATHER_IOV+1];
+	struct msghdr msg;
+	int n;
+
+	//A JOIN offers the binary protocol by following the text JOIN with a
+	// NUL and a binary JOIN frame
+	if ( view->opcode == OP_JOIN ) {
+		n = gatherMessage(view, PROTOCOL_TEXT, scratch[0], iov);
+		if ( how.protocol != PROTOCOL_TEXT ) {
+			iov[n].iov_base = "";
+			iov[n++].iov_len = 1;
+			n += gatherMessage(view, how.protocol, scratch[1], iov + n);
+		}
+	} else {
+		n = gatherMessage(view, how.protocol, scratch[0], iov);
+	}
+
+	bzero((char *)&msg, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	if ( sendmsg(bot->sd, &msg, MSG_DONTWAIT) < 0 ) {
+		sendFailures++;
+	}
+	datagramsOut++;
+	bot->lastSent = now;
+}
+
+/*
+ * sendRequest
+ * Send a JOIN, ENTER, QUIT or PING from a simulated client and move it
+ * into the state that waits for the answer
+ * @param bot The client
+ * @param opcode OP_JOIN, OP_ENTER, OP_QUIT or OP_PING
+ * @param now The current time in milliseconds
+ */
+void sendRequest(struct bot *bot, int opcode, long now) {
+	struct messageView request;
+	char room[MAX_LINE];
+
+	bzero((char *)&request, sizeof(request));
+	request.version = how.protocol;
+	request.opcode = opcode;
+	request.cid = bot->cid;
+	request.hostname = bot->hostname;
+	request.hostnameLen = bot->hostnameLen;
+	request.payload = "";
+	switch ( opcode ) {
+	case OP_JOIN:
+		request.flags = how.batched ? FLAG_OFFER_BATCH : 0;
+		bot->state = BOT_JOINING;
+		break;
+	case OP_ENTER:
+		request.payload = room;
+		request.payloadLen = snprintf(room, sizeof(room), "load%i",
+			bot->room);
+		bot->state = BOT_ENTERING;
+		break;
+	case OP_QUIT:
+		request.cid = -bot->cid;
+		if ( bot->state == BOT_READY ) {
+			ready--;
+			roomMembers[bot->room + 1]--;
+		}
+		bot->state = BOT_QUITTING;
+		break;
+	}
+	sendView(bot, &request, now);
+	if ( opcode != OP_PING ) {
+		bot->due = now + RESEND_MS;
+	}
+}
+
+/*
+ * sendLine
+ * Send a text message stamped with the time it was sent, and count on
+ * every client in the sender's room getting it back
+ * @param bot The sending client
+ * @param now The current time in milliseconds
+ */
+void sendLine(struct bot *bot, long now) {
+	struct messageView line;
+	char text[MAX_LINE + 1];
+	int length;
+
+	length = snprintf(text, sizeof(text), "%ld ", loadNanos());
+	memset(text + length, 'x', how.size - length);
+
+	bzero((char *)&line, sizeof(line));
+	line.version = how.protocol;
+	line.opcode = OP_TEXT;
+	line.cid = bot->cid;
+	line.hostname = bot->hostname;
+	line.hostnameLen = bot->hostnameLen;
+	line.payload = text;
+	line.payloadLen = how.size;
+	sendView(bot, &line, now);
+	sent++;
+	expected += roomMembers[bot->room + 1];
+}
+
+/*
+ * receiveBot
+ * Read everything waiting on a simulated client's socket
+ * @param bot The client
+ * @param now The current time in milliseconds
+ */
+void receiveBot(struct bot *bot, long now) {
+	static char buffer[LOAD_BUFFER];
+	struct messageView view;
+	struct messageView record;
+	const char *p;
+	int length;
+	int used;
+
+	while ( (length = recv(bot->sd, buffer, sizeof(buffer),
+		MSG_DONTWAIT)) > 0 ) {
+		datagramsIn++;
+		if ( decodeFrame(buffer, length, &view) < 0 ) {
+			if ( parseMessage(buffer, length, &view) == 0 ) {
+				handleMessage(bot, &view, now);
+			}
+			continue;
+		}
+		if ( view.opcode != OP_BATCH ) {
+			handleMessage(bot, &view, now);
+			continue;
+		}
+		p = view.payload;
+		length = view.payloadLen;
+		while ( length > 0 && (used = decodeFrame(p, length, &record)) > 0 ) {
+			handleMessage(bot, &record, now);
+			p += used;
+			length -= used;
+		}
+	}
+}
+
+/*
+ * handleMessage
+ * Act on a message the server sent a simulated client
+ * @param bot The client
+ * @param view The message
+ * @param now The current time in milliseconds
+ */
+void handleMessage(struct bot *bot, const struct messageView *view,
+	long now) {
+	int own = view->hostnameLen == bot->hostnameLen &&
+		memcmp(view->hostname, bot->hostname, bot->hostnameLen) == 0;
+
+	if ( view->opcode == OP_TEXT ) {
+		handleText(view, now);
+		return;
+	}
+	if ( !own ) {
+		return;
+	}
+
+	//A client's own JOIN, ENTER and QUIT notices answer its requests
+	if ( view->opcode == OP_JOIN && bot->state == BOT_JOINING &&
+		view->cid > JOIN_CID_CODE ) {
+		bot->cid = view->cid;
+		joined++;
+		histogramRecord(&joinLatency, now - bot->started);
+		if ( bot->room >= 0 ) {
+			sendRequest(bot, OP_ENTER, now);
+			return;
+		}
+	} else if ( !(view->opcode == OP_ENTER && bot->state == BOT_ENTERING) ) {
+		if ( view->opcode == OP_QUIT && bot->state == BOT_QUITTING ) {
+			bot->state = BOT_DONE;
+			quitAcked++;
+		}
+		return;
+	}
+	bot->state = BOT_READY;
+	ready++;
+	roomMembers[bot->room + 1]++;
+}
+
+/*
+ * handleText
+ * Count a text message that came back, or that another generator's client
+ * sent through a peer of the server, and time it from the stamp at its
+ * start
+ * @param view The message
+ * @param now The current time in milliseconds
+ */
+void handleText(const struct messageView *view, long now) {
+	unsigned long stamp = 0;
+	int i;
+
+	for ( i = 0; i < view->payloadLen && view->payload[i] >= '0' &&
+		view->payload[i] <= '9'; i++ ) {
+		stamp = stamp * 10 + (view->payload[i] - '0');
+	}
+	if ( i == 0 ) {
+		return;
+	}
+
+	//Every client of this generator is named for its process id
+	if ( view->hostnameLen < ownPrefixLen ||
+		memcmp(view->hostname, ownPrefix, ownPrefixLen) != 0 ) {
+		relayed++;
+		histogramRecord(&relayLatency, loadNanos() - stamp);
+		return;
+	}
+	received++;
+	histogramRecord(&latency, loadNanos() - stamp);
+}
+
+/*
+ * serviceBots
+ * Resend requests that have not been answered in RESEND_MS, and ping the
+ * server for clients that have been quiet for KEEPALIVE_SEC
+ * @param bots The clients
+ * @param count The number of clients started
+ * @param now The current time in milliseconds
+ */
+void serviceBots(struct bot *bots, int count, long now) {
+	struct bot *bot;
+	int i;
+
+	for ( i = 0; i < count; i++ ) {
+		bot = &bots[i];
+		switch ( bot->state ) {
+		case BOT_JOINING:
+		case BOT_QUITTING:
+			if ( now >= bot->due ) {
+				sendRequest(bot, bot->state == BOT_JOINING ? OP_JOIN :
+					OP_QUIT, now);
+			}
+			break;
+		case BOT_ENTERING:
+			if ( now >= bot->due ) {
+				sendRequest(bot, OP_ENTER, now);
+			}
+			break;
+		case BOT_READY:
+			if ( how.protocol != PROTOCOL_TEXT &&
+				now - bot->lastSent >= KEEPALIVE_SEC * 1000L ) {
+				sendRequest(bot, OP_PING, now);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * openCounter
+ * Start counting an event for one of the server's threads
+ * @param tid The thread
+ * @param type PERF_TYPE_SOFTWARE or PERF_TYPE_HARDWARE
+ * @param config The event
+ * @return The counter's descriptor, or -1 if it could not be opened
+ */
+int openCounter(int tid, unsigned int type, unsigned long config) {
+	struct perf_event_attr attr;
+
+	bzero((char *)&attr, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	return syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+/*
+ * watchServer
+ * Open task clock and cycle counters on each of the server's threads.  The
+ * server starts all of its threads before it serves, so none are missed.
+ * @param pid The server's process id
+ */
+void watchServer(int pid) {
+	char path[64];
+	struct dirent *entry;
+	DIR *tasks;
+
+	snprintf(path, sizeof(path), "/proc/%i/task", pid);
+	tasks = opendir(path);
+	if ( tasks == NULL ) {
+		perror("Could not list the server's threads");
+		exit(1);
+	}
+	while ( (entry = readdir(tasks)) != NULL && watched < MAX_WATCHED ) {
+		if ( !isdigit((unsigned char)entry->d_name[0]) ) {
+			continue;
+		}
+		taskClocks[watched] = openCounter(atoi(entry->d_name),
+			PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+		if ( taskClocks[watched] < 0 ) {
+			perror("Could not count the server's CPU time");
+			exit(1);
+		}
+
+		//Virtual machines often have no cycle counter to share
+		cycleCounters[watched] = openCounter(atoi(entry->d_name),
+			PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		haveCycles = watched == 0 ? cycleCounters[0] >= 0 :
+			haveCycles && cycleCounters[watched] >= 0;
+		watched++;
+	}
+	closedir(tasks);
+}
+
+/*
+ * readServer
+ * Read the server's counters, summed over its threads; both are left as
+ * they were if no server is watched
+ * @param taskNs Where to store the CPU time in nanoseconds
+ * @param cycles Where to store the cycles, if counted
+ */
+void readServer(unsigned long *taskNs, unsigned long *cycles) {
+	unsigned long value;
+	int i;
+
+	if ( watched == 0 ) {
+		return;
+	}
+	*taskNs = *cycles = 0;
+	for ( i = 0; i < watched; i++ ) {
+		if ( read(taskClocks[i], &value, sizeof(value)) == sizeof(value) ) {
+			*taskNs += value;
+		}
+		if ( haveCycles &&
+			read(cycleCounters[i], &value, sizeof(value)) == sizeof(value) ) {
+			*cycles += value;
+		}
+	}
+}
+
+/*
+ * queryServer
+ * Ask the server for its metrics on localhost
+ * @param port The server's metrics port
+ * @param values Where to store the value of each of serverMetrics
+ */
+void queryServer(int port, unsigned long *values) {
+	static char reply[METRICS_REPLY];
+	struct sockaddr_in local;
+	struct pollfd answer;
+	const char *line;
+	int length;
+	int i;
+
+	bzero((char *)&local, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local.sin_port = htons(port);
+	answer.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	answer.events = POLLIN;
+	if ( answer.fd < 0 || sendto(answer.fd, "metrics", 7, 0,
+		(struct sockaddr *)&local, sizeof(local)) < 0 ||
+		poll(&answer, 1, METRICS_WAIT_MS) != 1 ||
+		(length = recv(answer.fd, reply, sizeof(reply) - 1, 0)) < 0 ) {
+		perror("Could not query the server's metrics");
+		exit(1);
+	}
+	close(answer.fd);
+	reply[length] = '\0';
+
+	for ( i = 0; i < SERVER_METRICS; i++ ) {
+		values[i] = 0;
+		for ( line = reply; line != NULL; line = strchr(line, '\n') ) {
+			line += *line == '\n';
+			if ( strncmp(line, serverMetrics[i],
+				strlen(serverMetrics[i])) == 0 &&
+				line[strlen(serverMetrics[i])] == ' ' ) {
+				values[i] = strtoul(line + strlen(serverMetrics[i]), NULL, 10);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * printReport
+ * Print the scenario and what was measured, one "name value" pair a line
+ * @param sendMillis How long text was sent for, in milliseconds
+ */
+void printReport(long sendMillis) {
+	unsigned long lost = expected > received ? expected - received : 0;
+	double seconds = sendMillis > 0 ? sendMillis / 1000.0 : 1;
+	int i;
+
+	printf("scenario %s\nclients %i\nrooms %i\nrate %i\nsize %i\n"
+		"seconds %i\nprotocol %s\n", how.name, how.clients, how.rooms,
+		how.rate, how.size, how.seconds,
+		how.protocol == PROTOCOL_TEXT ? "text" :
+		how.batched ? "binary-batched" : "binary");
+	printf("joined %i\nquit_acked %i\n", joined, quitAcked);
+	printPercentiles("join_ms", &joinLatency, 1);
+	printf("sent %lu\nexpected %lu\nreceived %lu\nlost %lu\n"
+		"loss_pct %.3f\n", sent, expected, received, lost,
+		expected > 0 ? 100.0 * lost / expected : 0.0);
+	printf("sent_per_sec %.0f\ndelivered_per_sec %.0f\n"
+		"datagrams_in %lu\ndatagrams_out %lu\nsend_failures %lu\n",
+		sent / seconds, received / seconds, datagramsIn, datagramsOut,
+		sendFailures);
+	printPercentiles("latency_us", &latency, 1000);
+	if ( relayed > 0 ) {
+		printf("relayed %lu\nrelayed_per_sec %.0f\n", relayed,
+			relayed / seconds);
+		printPercentiles("relay_latency_us", &relayLatency, 1000);
+	}
+	if ( watched > 0 ) {
+		printf("server_threads %i\nserver_cpu_ms %lu\n"
+			"server_ns_per_msg %.0f\n", watched, serverTaskNs / 1000000,
+			sent > 0 ? (double)serverTaskNs / sent : 0.0);
+		if ( haveCycles ) {
+			printf("server_cycles_per_msg %.0f\n",
+				sent > 0 ? (double)serverCycles / sent : 0.0);
+		}
+	}
+	if ( metricsQueried ) {
+		for ( i = 0; i < SERVER_METRICS; i++ ) {
+			printf("server_%s %lu\n", serverMetrics[i], serverMoved[i]);
+		}
+		printf("server_syscalls_per_msg %.3f\n"
+			"server_relays_per_msg %.3f\n",
+			sent > 0 ? (double)serverMoved[0] / sent : 0.0,
+			sent > 0 ? (double)serverMoved[SERVER_METRICS - 1] / sent : 0.0);
+	}
+}
+
+/*
+ * printPercentiles
+ * Print the median, tail percentiles and maximum of a histogram
+ * @param name The name to print each value under
+ * @param hist The histogram
+ * @param scale The unit to print values in, in recorded units
+ */
+void printPercentiles(const char *name, struct histogram *hist,
+	unsigned long scale) {
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	static const char *names[] = { "p50", "p90", "p99", "p999" };
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long max = metricsGet(&hist->max);
+	unsigned long total = 0;
+	unsigned long value;
+	int i;
+
+	for ( i = 0; i < HIST_BUCKETS; i++ ) {
+		counts[i] = metricsGet(&hist->counts[i]);
+		total += counts[i];
+	}
+	//A bucket's largest value can be beyond anything actually recorded
+	for ( i = 0; i < 4; i++ ) {
+		value = total == 0 ? 0 :
+			histogramPercentile(counts, total, percentiles[i]);
+		printf("%s_%s %lu\n", name, names[i],
+			(value < max ? value : max) / scale);
+	}
+	printf("%s_max %lu\n", name, max / scale);
+}
@@ -0,0 +1,191 @@
+#!/bin/sh
+################################################################################
+# chatLoad.sh
+# Loopback comparisons run with chatLoad against freshly started servers on
+# this machine.  Each comparison runs the same chatLoad scenario against
+# every server configuration it compares and prints chatLoad's report for
+# each, its lines prefixed with the configuration's name, so that the
+# configurations can be compared line by line.  Build first with "make".
+#	uring	the chatty and fanout scenarios against a server reading and
+#		sending with epoll and recvmmsg/sendmmsg, then with io_uring
+#	relay	the relay scenario's clients three times over against one
+#		server, then against each of three servers peered in a full
+#		mesh, a generator for each, on ports PORT up and metrics ports
+#		METRICS down
+#	recv	the cost and chatty scenarios against a server reading one
+#		datagram per receive call, then the default batch
+#	batch	the lobby and batched scenarios, whose clients unpack OP_BATCH
+#		frames, against a server sending each message alone, then
+#		batching a room's text for 1000 microseconds
+#	metrics	the cost and chatty scenarios against a server without -m,
+#		then with it, ROUNDS times over, and the mean difference in
+#		server CPU time per message that answering metrics queries
+#		costs
+# @author J. Joel vanBrandwijk
+# @date 2015-11-11
+################################################################################
+
+PORT=${PORT:-40100}
+METRICS=${METRICS:-40199}
+ROUNDS=${ROUNDS:-3}
+
+#usage
+#Print usage information and exit
+usage() {
+	echo "Usage: chatLoad.sh <comparison>"
+	echo "  uring  epoll and mmsg against io_uring, chatty and fanout"
+	echo "  relay  one server against three peered servers, relay"
+	echo "  recv   -b 1 against the default receive batch, cost and chatty"
+	echo "  batch  no -w against -w 1000, lobby and batched"
+	echo "  metrics  without -m against with it, cost and chatty"
+	exit 1
+}
+
+#startServer <port> <metrics port> <server options...>
+#Start a server with the options given and leave its process id in server;
+#a metrics port of 0 starts it without -m
+startServer() {
+	port=$1
+	metrics=$2
+	shift 2
+	if [ $metrics != 0 ]; then
+		set -- -m $metrics "$@"
+	fi
+	#A server that used io_uring can hold its ports for a moment after it
+	# exits, so the next one is given a few tries to bind them
+	for try in 1 2 3 4 5; do
+		./chatServer "$@" $port 0 > /dev/null 2>&1 &
+		server=$!
+		sleep 1
+		if kill -0 $server 2> /dev/null; then
+			break
+		fi
+		if [ $try = 5 ]; then
+			echo "Could not start the server with $*" >&2
+			exit 1
+		fi
+	done
+}
+
+#runServer <name> <scenario> <server options...>
+#Start a server with the options given, run a scenario against it, print
+#the report as <name>_<line>, and stop the server.  The server's metrics
+#are reported too unless unmetered is set.
+runServer() {
+	name=$1
+	scenario=$2
+	shift 2
+	if [ -n "$unmetered" ]; then
+		startServer $PORT 0 "$@"
+		meter=
+	else
+		startServer $PORT $METRICS "$@"
+		meter="-M $METRICS"
+	fi
+	./chatLoad -p $scenario -P $server $meter 127.0.0.1 $PORT |
+		sed "s/^/${name}_/"
+	kill $server
+	wait $server 2> /dev/null
+}
+
+#runMesh <name> <servers> <scenario> <chatLoad options...>
+#Start servers peered in a full mesh, run a scenario against every one of
+#them at once, print the report from server n as <name><n>_<line>, and
+#stop the servers
+runMesh() {
+	name=$1
+	count=$2
+	scenario=$3
+	shift 3
+	servers=
+	for n in $(seq $count); do
+		peers=
+		for peer in $(seq $count); do
+			if [ $peer != $n ]; then
+				peers="$peers -P 127.0.0.1:$((PORT + peer - 1))"
+			fi
+		done
+		startServer $((PORT + n - 1)) $((METRICS - n + 1)) -O $n $peers
+		servers="$servers $server"
+	done
+
+	#Each generator's report is held until they have all finished
+	reports=$(mktemp -d) || exit 1
+	loads=
+	n=1
+	for server in $servers; do
+		./chatLoad -p $scenario "$@" -P $server -M $((METRICS - n + 1)) \
+			127.0.0.1 $((PORT + n - 1)) > $reports/$n &
+		loads="$loads $!"
+		n=$((n + 1))
+	done
+	wait $loads
+	for n in $(seq $count); do
+		sed "s/^/${name}${n}_/" $reports/$n
+	done
+	rm -r $reports
+	kill $servers
+	wait $servers 2> /dev/null
+}
+
+cd "$(dirname "$0")" || exit 1
+case "$1" in
+uring)
+	for scenario in chatty fanout; do
+		runServer ${scenario}_epoll $scenario
+		runServer ${scenario}_uring $scenario -u
+	done
+	;;
+relay)
+	runMesh single 1 relay -c 300 -m 150
+	runMesh mesh 3 relay
+	;;
+recv)
+	for scenario in cost chatty; do
+		runServer ${scenario}_b1 $scenario -b 1
+		runServer ${scenario}_batch $scenario
+	done
+	;;
+batch)
+	for scenario in lobby batched; do
+		runServer ${scenario}_unbatched $scenario
+		runServer ${scenario}_w1000 $scenario -w 1000
+	done
+	;;
+metrics)
+	#Runs alternate so that drift in the machine's speed falls on both
+	for scenario in cost chatty; do
+		for round in $(seq $ROUNDS); do
+			unmetered=1
+			runServer ${scenario}_off$round $scenario
+			unmetered=
+			runServer ${scenario}_on$round $scenario
+		done
+	done | awk '{ print }
+		/_server_ns_per_msg / {
+			split($1, part, "_")
+			sub(/[0-9]+$/, "", part[2])
+			ns[part[1], part[2]] += $2
+			runs[part[1], part[2]]++
+			if ( !(part[1] in seen) ) {
+				seen[part[1]] = 1
+				order[++scenarios] = part[1]
+			}
+		}
+		END {
+			for ( i = 1; i <= scenarios; i++ ) {
+				s = order[i]
+				off = ns[s, "off"] / runs[s, "off"]
+				on = ns[s, "on"] / runs[s, "on"]
+				printf("%s_off_ns_per_msg %.0f\n%s_on_ns_per_msg %.0f\n",
+					s, off, s, on)
+				printf("%s_metrics_ns_per_msg %.0f\n" \
+					"%s_metrics_cost_pct %.2f\n", s, on - off, s,
+					100 * (on - off) / off)
+			}
+		}'
+	;;
+*)
+	usage
+	;;
+esac
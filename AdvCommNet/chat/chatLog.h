@@ -0,0 +1,360 @@
+/******************************************************************************/
+// chatLog.h
+// Asynchronous debug log.  Each thread writes fixed-size binary records into
+// its own single-producer ring; a background thread drains every ring and
+// does the formatting and printing, so a debug record costs the calling
+// thread a copy rather than a write to the terminal.  Records can be
+// sampled and rate limited, and records lost to a full ring are counted
+// and reported.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Log sizing values.  The rate limit is refilled, and lost records are
+ * reported, once every LOG_PERIOD_NS.
+ */
+enum {
+	LOG_RING = 1024,
+	LOG_DATA = 4*MAX_LINE,
+	LOG_ARGS = 4,
+	LOG_IDLE_NS = 1000000,
+	LOG_PERIOD_NS = 1000000000
+};
+
+/*
+ * Log record data structure.  A message record copies the message's
+ * strings into data; an event record keeps a pointer to a constant format
+ * string and its integer arguments, which are only formatted when drained.
+ * @param format printf format of an event record, or NULL for a message
+ * @param direction SENT_STRING or RECV_STRING for a message record
+ * @param args Event arguments, printed with %lu
+ * @param cid Message client id
+ * @param opcode Message opcode
+ * @param hostnameLen Length of the message hostname in data
+ * @param payloadLen Length of the message payload in data, after the
+ *	hostname
+ * @param data Message strings
+ */
+struct logRecord {
+	const char *format;
+	const char *direction;
+	unsigned long args[LOG_ARGS];
+	int cid;
+	int opcode;
+	int hostnameLen;
+	int payloadLen;
+	char data[LOG_DATA];
+};
+
+/*
+ * Log ring data structure; written only by its thread and read only by the
+ * drain thread
+ * @param head Records written
+ * @param tail Records drained
+ * @param dropped Records lost because the ring was full
+ * @param limited Records refused by the rate limit
+ * @param unsampled Records skipped since the last one sampled
+ * @param tokens Records the rate limit will still allow
+ * @param refilled When the rate limit was last refilled, in nanoseconds
+ * @param next Next thread's ring
+ * @param records The records
+ */
+struct logRing {
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_ulong dropped;
+	atomic_ulong limited;
+	int unsampled;
+	long tokens;
+	long refilled;
+	struct logRing *next;
+	struct logRecord records[LOG_RING];
+};
+
+//Records per second each thread may log, or 0 for no limit, and the
+// fraction 1/logSample of records kept
+int logLimit = 0;
+int logSample = 1;
+
+//Every thread's ring, the lock protecting the list, and the drain thread
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+struct logRing *logRings = NULL;
+pthread_t logThread;
+atomic_int logRunning;
+
+//The calling thread's ring
+__thread struct logRing *logRing;
+
+/*
+ * logNanos
+ * @return A coarse monotonic clock in nanoseconds, cheap enough to read for
+ *	every record
+ */
+long logNanos() {
+	struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * logReserve
+ * Find room for a record in the calling thread's ring, applying sampling
+ * and the rate limit
+ * @return The record to fill, or NULL if the record is not to be logged
+ */
+struct logRecord *logReserve() {
+	struct logRing *ring = logRing;
+	unsigned int head;
+	long now;
+
+	//Give the thread a ring on its first record
+	if ( ring == NULL ) {
+		ring = calloc(1, sizeof(*ring));
+		if ( ring == NULL ) {
+			return NULL;
+		}
+		ring->tokens = logLimit;
+		ring->refilled = logNanos();
+		pthread_mutex_lock(&logLock);
+		ring->next = logRings;
+		logRings = ring;
+		pthread_mutex_unlock(&logLock);
+		logRing = ring;
+	}
+
+	if ( logSample > 1 ) {
+		if ( ++ring->unsampled < logSample ) {
+			return NULL;
+		}
+		ring->unsampled = 0;
+	}
+
+	//Refill the rate limit once a period, up to a period's worth
+	if ( logLimit > 0 ) {
+		if ( ring->tokens == 0 ) {
+			now = logNanos();
+			if ( now - ring->refilled >= LOG_PERIOD_NS ) {
+				ring->tokens = logLimit;
+				ring->refilled = now;
+			}
+		}
+		if ( ring->tokens == 0 ) {
+			atomic_store_explicit(&ring->limited, atomic_load_explicit(
+				&ring->limited, memory_order_relaxed) + 1,
+				memory_order_relaxed);
+			return NULL;
+		}
+		ring->tokens--;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if ( head - atomic_load_explicit(&ring->tail, memory_order_acquire)
+		>= LOG_RING ) {
+		atomic_store_explicit(&ring->dropped, atomic_load_explicit(
+			&ring->dropped, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+		return NULL;
+	}
+	return &ring->records[head % LOG_RING];
+}
+
+/*
+ * logCommit
+ * Hand the record reserved by logReserve to the drain thread
+ */
+void logCommit() {
+	atomic_fetch_add_explicit(&logRing->head, 1, memory_order_release);
+}
+
+/*
+ * logEvent
+ * Log a line of debugging information
+ * @param format printf format, which must be a string constant, taking up
+ *	to four %lu arguments
+ * @param a First argument
+ * @param b Second argument
+ * @param c Third argument
+ * @param d Fourth argument
+ */
+void logEvent(const char *format, unsigned long a, unsigned long b,
+	unsigned long c, unsigned long d) {
+	struct logRecord *record = logReserve();
+
+	if ( record == NULL ) {
+		return;
+	}
+	record->format = format;
+	record->args[0] = a;
+	record->args[1] = b;
+	record->args[2] = c;
+	record->args[3] = d;
+	logCommit();
+}
+
+/*
+ * pDebug
+ * Log debugging information
+ * @param debug Boolean is debug on?
+ * @param direction SENT_STRING or RECV_STRING
+ * @param view The message to log
+ */
+void pDebug(int debug, const char *direction, const struct messageView *view) {
+	struct logRecord *record;
+
+	if ( debug != DEBUG_ON || (record = logReserve()) == NULL ) {
+		return;
+	}
+	record->format = NULL;
+	record->direction = direction;
+	record->cid = view->cid;
+	record->opcode = view->opcode;
+	record->hostnameLen = view->hostnameLen < MAX_LINE ?
+		view->hostnameLen : MAX_LINE;
+	record->payloadLen = view->payloadLen < LOG_DATA - MAX_LINE ?
+		view->payloadLen : LOG_DATA - MAX_LINE;
+	memcpy(record->data, view->hostname, record->hostnameLen);
+	memcpy(record->data + record->hostnameLen, view->payload,
+		record->payloadLen);
+	logCommit();
+}
+
+/*
+ * logPrint
+ * Format and print one record
+ * @param record The record
+ */
+void logPrint(const struct logRecord *record) {
+	const char *str1 = record->data;
+	const char *str2 = record->data + record->hostnameLen;
+	int len1 = record->hostnameLen;
+	int len2 = record->payloadLen;
+	const char *verb = "";
+
+	if ( record->format != NULL ) {
+		printf(record->format, record->args[0], record->args[1],
+			record->args[2], record->args[3]);
+		return;
+	}
+
+	if ( strcmp(record->direction, SENT_STRING) == 0 ) {
+		verb = "Sending ";
+	} else if ( strcmp(record->direction, RECV_STRING) == 0 ) {
+		verb = "Receiving ";
+	}
+
+	//A room command names the room between the command and the hostname
+	if ( record->opcode == OP_ENTER || record->opcode == OP_LEAVE ) {
+		printf("DEBUG: %s<%i %s %.*s %.*s>\n", verb, record->cid,
+			commandString(record->opcode), len2, str2, len1, str1);
+		return;
+	}
+	if ( record->opcode != OP_TEXT ) {
+		str1 = commandString(record->opcode);
+		len1 = strlen(str1);
+		str2 = record->data;
+		len2 = record->hostnameLen;
+	}
+	printf("DEBUG: %s<%i %.*s %.*s>\n", verb, record->cid, len1, str1,
+		len2, str2);
+}
+
+/*
+ * logDrain
+ * Print every record waiting in every ring, then report any records lost
+ * since the last report
+ * @param lost Records lost as of the last report, updated
+ * @param report Whether to report lost records
+ * @return The number of lines printed
+ */
+int logDrain(unsigned long *lost, int report) {
+	struct logRing *ring;
+	unsigned long dropped = 0, limited = 0;
+	unsigned int head, tail;
+	int printed = 0;
+
+	pthread_mutex_lock(&logLock);
+	ring = logRings;
+	pthread_mutex_unlock(&logLock);
+
+	//Rings are only ever pushed onto the front of the list, so the rest
+	// of the list can be walked without the lock
+	for ( ; ring != NULL; ring = ring->next ) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		for ( ; tail != head; tail++, printed++ ) {
+			logPrint(&ring->records[tail % LOG_RING]);
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		dropped += atomic_load_explicit(&ring->dropped,
+			memory_order_relaxed);
+		limited += atomic_load_explicit(&ring->limited,
+			memory_order_relaxed);
+	}
+
+	if ( report && dropped + limited != *lost ) {
+		printf("DEBUG: Log lost %lu records to full rings and %lu to "
+			"the rate limit\n", dropped, limited);
+		*lost = dropped + limited;
+		printed++;
+	}
+	if ( printed > 0 ) {
+		fflush(stdout);
+	}
+	return printed;
+}
+
+/*
+ * runLog
+ * Drain the log until it is stopped, sleeping while there is nothing to
+ * print
+ * @param arg Unused
+ * @return NULL
+ */
+void *runLog(void *arg) {
+	struct timespec idle = { 0, LOG_IDLE_NS };
+	unsigned long lost = 0;
+	long reported = logNanos();
+	int report;
+
+	//Report lost records at most once a period so that the
+	// report itself cannot flood the output
+	while ( atomic_load(&logRunning) ) {
+		report = logNanos() - reported >= LOG_PERIOD_NS;
+		if ( report ) {
+			reported = logNanos();
+		}
+		if ( logDrain(&lost, report) == 0 ) {
+			nanosleep(&idle, NULL);
+		}
+	}
+	logDrain(&lost, 1);
+	fflush(stdout);
+	return NULL;
+}
+
+/*
+ * logStart
+ * Start the drain thread
+ */
+void logStart() {
+	atomic_store(&logRunning, 1);
+	if ( pthread_create(&logThread, NULL, runLog, NULL) != 0 ) {
+		perror("Error starting log thread");
+		exit(1);
+	}
+}
+
+/*
+ * logStop
+ * Print everything logged so far and stop the drain thread
+ */
+void logStop() {
+	if ( atomic_exchange(&logRunning, 0) ) {
+		pthread_join(logThread, NULL);
+	}
+}
@@ -0,0 +1,396 @@
+/******************************************************************************/
+// chatLossy.c
+// A lossy loopback link for testing the chat client and server.  Clients
+// send to this proxy instead of the server; each datagram in either
+// direction may be dropped, duplicated, or held back and sent after the
+// next one.  Every client is given its own socket toward the server, so the
+// server sees one address per client.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+//include system, network, and io libraries
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+//include chat library
+#include "chatEvent.h"
+#include "chatResolve.h"
+
+/*
+ * Proxy configuration values
+ */
+enum {
+	MAX_PEERS = 4096,
+	DATAGRAM_SIZE = 2048,
+	HOLD_MS = 20
+};
+
+/*
+ * Held datagram data structure; a datagram waiting to be sent after the
+ * next one in the same direction
+ * @param data The datagram
+ * @param length Length of the datagram, 0 if nothing is held
+ * @param due When to send the datagram if nothing follows it
+ */
+struct heldDatagram {
+	char data[DATAGRAM_SIZE];
+	int length;
+	long due;
+};
+
+/*
+ * Peer data structure; one client and its socket toward the server
+ * @param address The client's address
+ * @param sd The socket toward the server
+ * @param up Datagram held on its way to the server
+ * @param down Datagram held on its way to the client
+ */
+struct peer {
+	struct sockaddr_in address;
+	int sd;
+	struct heldDatagram up;
+	struct heldDatagram down;
+};
+
+/*
+ * Impairment data structure
+ * @param loss Percent of datagrams dropped
+ * @param duplicate Percent of datagrams sent twice
+ * @param reorder Percent of datagrams held back
+ * @param seed State of the random number generator
+ */
+struct impairment {
+	int loss;
+	int duplicate;
+	int reorder;
+	unsigned int seed;
+};
+
+//What the proxy has done, printed when it is interrupted
+unsigned long forwarded = 0;
+unsigned long dropped = 0;
+unsigned long duplicated = 0;
+unsigned long reordered = 0;
+volatile sig_atomic_t stopping = 0;
+
+/*
+ * Function signature declarations see function definitions for further
+ * documentation
+ */
+void usage();
+void stopProxy(int signal);
+long proxyMillis();
+int makeSocket(int port);
+struct peer *findPeer(struct peer *peers, int *count,
+	const struct sockaddr_in *address, struct eventLoop *loop,
+	const struct sockaddr_in *server);
+void impair(struct impairment *how, int sd, const struct sockaddr_in *to,
+	struct heldDatagram *held, const char *data, int length);
+void flushHeld(int sd, const struct sockaddr_in *to,
+	struct heldDatagram *held, long now);
+int heldTimeout(struct peer *peers, int count, long now);
+
+/*
+ * main
+ * Read command line parameters and relay datagrams between clients and
+ * the server until interrupted
+ */
+int main( int argc, char *argv[] ) {
+	struct impairment how = { 0, 0, 0, 0 };
+	struct sockaddr_in server;
+	struct sockaddr_in from;
+	struct resolver names;
+	struct sockaddr_storage address;
+	socklen_t addressLen;
+	struct eventLoop loop;
+	struct peer *peers;
+	struct peer *peer;
+	static char data[DATAGRAM_SIZE];
+	void *ready[EVENT_BATCH];
+	socklen_t fromLen;
+	int listenSD;
+	int count = 0;
+	int length;
+	int opt;
+	int n, i;
+	long now;
+
+	how.seed = time(NULL);
+	while ( (opt = getopt(argc, argv, "d:l:o:s:")) != -1 ) {
+		switch ( opt ) {
+		case 'd':
+			how.duplicate = atoi(optarg);
+			break;
+		case 'l':
+			how.loss = atoi(optarg);
+			break;
+		case 'o':
+			how.reorder = atoi(optarg);
+			break;
+		case 's':
+			how.seed = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ( argc - optind != 3 || how.loss < 0 || how.loss > 100 ||
+		how.duplicate < 0 || how.duplicate > 100 || how.reorder < 0 ||
+		how.reorder > 100 ) {
+		usage();
+	}
+
+	//The server only listens for IPv4
+	if ( resolverInit(&names) < 0 ) {
+		perror("Could not start the resolver");
+		exit(1);
+	}
+	if ( resolverWait(&names, argv[optind+1], AF_INET, atoi(argv[optind+2]),
+		&address, &addressLen) != RESOLVE_READY ) {
+		fprintf(stderr, "Could not resolve %s\n", argv[optind+1]);
+		exit(1);
+	}
+	bcopy((char *)&address, (char *)&server, sizeof(server));
+
+	listenSD = makeSocket(atoi(argv[optind]));
+	peers = calloc(MAX_PEERS, sizeof(*peers));
+	if ( peers == NULL || eventInit(&loop) < 0 ||
+		eventAdd(&loop, listenSD, NULL) < 0 ) {
+		perror("Could not start the proxy");
+		exit(1);
+	}
+	signal(SIGINT, stopProxy);
+	signal(SIGTERM, stopProxy);
+
+	//A NULL owner is the listening socket; every other owner is the peer
+	// whose server socket is ready
+	while ( !stopping ) {
+		n = eventWait(&loop, ready, EVENT_BATCH,
+			heldTimeout(peers, count, proxyMillis()));
+		for ( i = 0; i < n; i++ ) {
+			if ( ready[i] == NULL ) {
+				fromLen = sizeof(from);
+				length = recvfrom(listenSD, data, DATAGRAM_SIZE,
+					MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
+				peer = length < 0 ? NULL : findPeer(peers, &count, &from,
+					&loop, &server);
+				if ( peer != NULL ) {
+					impair(&how, peer->sd, &server, &peer->up, data,
+						length);
+				}
+			} else {
+				peer = ready[i];
+				length = recv(peer->sd, data, DATAGRAM_SIZE,
+					MSG_DONTWAIT);
+				if ( length >= 0 ) {
+					impair(&how, listenSD, &peer->address, &peer->down,
+						data, length);
+				}
+			}
+		}
+		now = proxyMillis();
+		for ( i = 0; i < count; i++ ) {
+			flushHeld(peers[i].sd, &server, &peers[i].up, now);
+			flushHeld(listenSD, &peers[i].address, &peers[i].down, now);
+		}
+	}
+
+	printf("forwarded %lu\ndropped %lu\nduplicated %lu\nreordered %lu\n",
+		forwarded, dropped, duplicated, reordered);
+	return 0;
+}
+
+/*
+ * usage
+ * Print usage information and exit
+ */
+void usage() {
+	printf("Usage: chatLossy [-l loss] [-d duplicate] [-o reorder] "
+		"[-s seed] <port> <server> <server port>\n");
+	printf("  -l loss       percent of datagrams dropped\n");
+	printf("  -d duplicate  percent of datagrams sent twice\n");
+	printf("  -o reorder    percent of datagrams sent after the next one\n");
+	printf("  -s seed       seed for the random choices\n");
+	exit(1);
+}
+
+/*
+ * stopProxy
+ * Signal handler that ends the relay loop
+ * @param signal The signal
+ */
+void stopProxy(int signal) {
+	stopping = 1;
+}
+
+/*
+ * proxyMillis
+ * @return A monotonic clock in milliseconds
+ */
+long proxyMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * makeSocket
+ * Create a UDP socket
+ * @param port The port to bind, or 0 for any
+ * @return The socket
+ */
+int makeSocket(int port) {
+	struct sockaddr_in address;
+	int sd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if ( sd < 0 ) {
+		perror("Could not create socket");
+		exit(1);
+	}
+	bzero((char *)&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if ( bind(sd, (struct sockaddr *)&address, sizeof(address)) < 0 ) {
+		perror("Could not bind socket");
+		exit(1);
+	}
+	return sd;
+}
+
+/*
+ * findPeer
+ * Find the peer for a client address, giving a new client its own socket
+ * toward the server
+ * @param peers The peers
+ * @param count The number of peers, increased for a new client
+ * @param address The client's address
+ * @param loop The event loop to watch a new socket with
+ * @param server The server's address
+ * @return The peer, or NULL if there are already MAX_PEERS
+ */
+struct peer *findPeer(struct peer *peers, int *count,
+	const struct sockaddr_in *address, struct eventLoop *loop,
+	const struct sockaddr_in *server) {
+	struct peer *peer;
+	int i;
+
+	for ( i = 0; i < *count; i++ ) {
+		if ( peers[i].address.sin_addr.s_addr == address->sin_addr.s_addr &&
+			peers[i].address.sin_port == address->sin_port ) {
+			return &peers[i];
+		}
+	}
+	if ( *count == MAX_PEERS ) {
+		return NULL;
+	}
+	peer = &peers[(*count)++];
+	peer->address = *address;
+	peer->sd = makeSocket(0);
+	if ( connect(peer->sd, (struct sockaddr *)server, sizeof(*server)) < 0 ||
+		eventAdd(loop, peer->sd, peer) < 0 ) {
+		perror("Could not watch server socket");
+		exit(1);
+	}
+	return peer;
+}
+
+/*
+ * impair
+ * Send a datagram on, or drop it, send it twice, or hold it back as the
+ * impairment says.  A datagram already held back is sent after this one.
+ * @param how The impairment
+ * @param sd The socket to send from
+ * @param to Where to send
+ * @param held The datagram held back in this direction
+ * @param data The datagram
+ * @param length The length of the datagram
+ */
+void impair(struct impairment *how, int sd, const struct sockaddr_in *to,
+	struct heldDatagram *held, const char *data, int length) {
+	int copies = 1;
+
+	if ( (int)(rand_r(&how->seed) % 100) < how->loss ) {
+		dropped++;
+		return;
+	}
+	if ( (int)(rand_r(&how->seed) % 100) < how->duplicate ) {
+		duplicated++;
+		copies = 2;
+	}
+	if ( held->length == 0 &&
+		(int)(rand_r(&how->seed) % 100) < how->reorder ) {
+		reordered++;
+		memcpy(held->data, data, length);
+		held->length = length;
+		held->due = proxyMillis() + HOLD_MS;
+		return;
+	}
+	while ( copies-- > 0 ) {
+		sendto(sd, data, length, 0, (struct sockaddr *)to, sizeof(*to));
+		forwarded++;
+	}
+	flushHeld(sd, to, held, -1);
+}
+
+/*
+ * flushHeld
+ * Send a held datagram once it is due
+ * @param sd The socket to send from
+ * @param to Where to send
+ * @param held The datagram held back
+ * @param now The current time, or -1 to send it regardless
+ */
+void flushHeld(int sd, const struct sockaddr_in *to,
+	struct heldDatagram *held, long now) {
+	if ( held->length > 0 && (now < 0 || now >= held->due) ) {
+		sendto(sd, held->data, held->length, 0, (struct sockaddr *)to,
+			sizeof(*to));
+		forwarded++;
+		held->length = 0;
+	}
+}
+
+/*
+ * heldTimeout
+ * @param peers The peers
+ * @param count The number of peers
+ * @param now The current time
+ * @return Milliseconds until the next held datagram is due, or -1 if none
+ *	is held
+ */
+int heldTimeout(struct peer *peers, int count, long now) {
+	long next = -1;
+	long due;
+	int i;
+
+	for ( i = 0; i < count; i++ ) {
+		due = peers[i].up.length > 0 ? peers[i].up.due : -1;
+		if ( peers[i].down.length > 0 &&
+			(due < 0 || peers[i].down.due < due) ) {
+			due = peers[i].down.due;
+		}
+		if ( due >= 0 && (next < 0 || due < next) ) {
+			next = due;
+		}
+	}
+	if ( next < 0 ) {
+		return -1;
+	}
+	return next > now ? next - now : 0;
+}
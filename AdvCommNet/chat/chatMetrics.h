@@ -0,0 +1,340 @@
+/******************************************************************************/
+// chatMetrics.h
+// Server metrics.  Each worker thread keeps its own counters and latency
+// histogram, written only by that thread, so recording costs a plain
+// increment.  A query sums every worker's metrics and formats them as text.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Histogram sizing values.  Values are bucketed log-linearly: every power
+ * of two range is split into HIST_SUB buckets, so a recorded value is
+ * known to within 1/HIST_SUB of itself at any magnitude.
+ */
+enum {
+	HIST_SUB_BITS = 4,
+	HIST_SUB = 1 << HIST_SUB_BITS,
+	HIST_BUCKETS = (64 - HIST_SUB_BITS) * HIST_SUB,
+	METRICS_SAMPLE = 8,
+	METRICS_REPLY = 65000
+};
+
+/*
+ * Histogram data structure
+ * @param counts Number of values recorded in each bucket
+ * @param max Largest value recorded
+ */
+struct histogram {
+	atomic_ulong counts[HIST_BUCKETS];
+	atomic_ulong max;
+};
+
+/*
+ * Metrics data structure; one per worker thread
+ * @param joins Clients that joined
+ * @param quits Clients that quit
+ * @param messagesIn Datagrams received
+ * @param messagesOut Datagrams sent
+ * @param sendFailures Datagrams the kernel refused to send
+ * @param syscalls Receive, send and io_uring system calls made
+ * @param retransmits Reliable frames sent again for want of an
+ *	acknowledgement
+ * @param reliableLost Reliable frames given up by the server, or skipped
+ *	because a client gave them up
+ * @param queued Datagrams put on a client's queue because the socket could
+ *	not take them at once
+ * @param queueDrops Datagrams dropped because a client's queue was full
+ * @param coalesced Datagrams that replaced an older one from the same sender
+ *	on a full queue
+ * @param evictions Clients removed for going quiet or not keeping up
+ * @param batches OP_BATCH frames built
+ * @param batched Messages carried in OP_BATCH frames
+ * @param overflowDrops Datagrams the kernel dropped for want of socket
+ *	buffer space
+ * @param invalidDrops Datagrams too long for a message buffer or not well
+ *	formed
+ * @param forgedDrops Messages dropped for naming a client that is not
+ *	connected from their source
+ * @param sourceThrottled Datagrams dropped because their source was sending
+ *	faster than its rate
+ * @param joinThrottled JOINs dropped because clients were joining faster
+ *	than the join rate
+ * @param relayIn Messages taken from peered servers
+ * @param relayOut OP_RELAY frames sent to peered servers
+ * @param relayDuplicates Relayed messages dropped as already seen
+ * @param relayDrops OP_RELAY frames not sent, for want of socket buffer
+ *	space or for being too long for one datagram
+ * @param historyDrops Room text not kept in the history for being longer
+ *	than a record
+ * @param latency Nanoseconds from a datagram's arrival at the socket to the
+ *	end of its fan-out, for one message in every METRICS_SAMPLE
+ * @param unsampled Messages handled since the last latency sample
+ */
+struct metrics {
+	atomic_ulong joins;
+	atomic_ulong quits;
+	atomic_ulong messagesIn;
+	atomic_ulong messagesOut;
+	atomic_ulong sendFailures;
+	atomic_ulong syscalls;
+	atomic_ulong retransmits;
+	atomic_ulong reliableLost;
+	atomic_ulong queued;
+	atomic_ulong queueDrops;
+	atomic_ulong coalesced;
+	atomic_ulong evictions;
+	atomic_ulong batches;
+	atomic_ulong batched;
+	atomic_ulong overflowDrops;
+	atomic_ulong invalidDrops;
+	atomic_ulong forgedDrops;
+	atomic_ulong sourceThrottled;
+	atomic_ulong joinThrottled;
+	atomic_ulong relayIn;
+	atomic_ulong relayOut;
+	atomic_ulong relayDuplicates;
+	atomic_ulong relayDrops;
+	atomic_ulong historyDrops;
+	struct histogram latency;
+	int unsampled;
+};
+
+/*
+ * metricsAdd
+ * Add to a counter.  Only the owning thread writes a counter, so this needs
+ * no atomic read-modify-write; the relaxed accesses only keep readers on
+ * other threads from seeing a torn value.
+ * @param counter The counter
+ * @param n The amount to add
+ */
+void metricsAdd(atomic_ulong *counter, unsigned long n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter,
+		memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ * metricsSet
+ * Set a counter that is kept by the kernel rather than counted here
+ * @param counter The counter
+ * @param value The new value
+ */
+void metricsSet(atomic_ulong *counter, unsigned long value) {
+	atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+/*
+ * metricsGet
+ * @param counter The counter
+ * @return The counter's value
+ */
+unsigned long metricsGet(atomic_ulong *counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*
+ * metricsSample
+ * Decide whether to time the message about to be handled.  Reading the
+ * clock costs more than everything else recorded per message, so only
+ * every METRICS_SAMPLE-th message is timed.
+ * @param m The calling worker's metrics
+ * @return Whether to time the message
+ */
+int metricsSample(struct metrics *m) {
+	if ( ++m->unsampled < METRICS_SAMPLE ) {
+		return 0;
+	}
+	m->unsampled = 0;
+	return 1;
+}
+
+/*
+ * histogramIndex
+ * @param value A value
+ * @return The bucket the value falls into
+ */
+int histogramIndex(unsigned long value) {
+	int shift = 0;
+
+	//Values below 2*HIST_SUB are counted exactly; above that, drop the
+	// low bits so that HIST_SUB_BITS+1 significant bits remain
+	if ( value >= 2 * HIST_SUB ) {
+		shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+	}
+	return shift * HIST_SUB + (int)(value >> shift);
+}
+
+/*
+ * histogramHighest
+ * @param index A bucket
+ * @return The largest value counted in the bucket
+ */
+unsigned long histogramHighest(int index) {
+	int shift = index < 2 * HIST_SUB ? 0 : index / HIST_SUB - 1;
+	unsigned long sub = index - shift * HIST_SUB;
+	return ((sub + 1) << shift) - 1;
+}
+
+/*
+ * histogramRecord
+ * Record a value; called only by the histogram's owning thread
+ * @param hist The histogram
+ * @param value The value
+ */
+void histogramRecord(struct histogram *hist, unsigned long value) {
+	metricsAdd(&hist->counts[histogramIndex(value)], 1);
+	if ( value > metricsGet(&hist->max) ) {
+		metricsSet(&hist->max, value);
+	}
+}
+
+/*
+ * histogramPercentile
+ * @param counts Summed bucket counts
+ * @param total Number of values counted
+ * @param percentile The percentile, from 0 to 100
+ * @return The largest value of the bucket holding the percentile
+ */
+unsigned long histogramPercentile(const unsigned long *counts,
+	unsigned long total, double percentile) {
+	unsigned long rank = (unsigned long)(total * percentile / 100.0 + 0.5);
+	unsigned long seen = 0;
+	int i;
+
+	if ( rank < 1 ) {
+		rank = 1;
+	}
+	for ( i = 0; i < HIST_BUCKETS; i++ ) {
+		seen += counts[i];
+		if ( seen >= rank ) {
+			return histogramHighest(i);
+		}
+	}
+	return 0;
+}
+
+/*
+ * metricsFormat
+ * Sum the metrics of every worker and format them as text, one
+ * "name value" pair per line followed by one line per worker
+ * @param buffer The text buffer
+ * @param size The size of the buffer
+ * @param all Every worker's metrics
+ * @param count The number of workers
+ * @param clients The number of registered clients
+ * @return The length of the text
+ */
+int metricsFormat(char *buffer, int size, struct metrics *const *all,
+	int count, int clients) {
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	static const char *names[] = { "p50", "p90", "p99", "p999" };
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long joins = 0, quits = 0, in = 0, out = 0, failures = 0;
+	unsigned long syscalls = 0, retransmits = 0, reliableLost = 0;
+	unsigned long queued = 0, queueDrops = 0, coalesced = 0, evictions = 0;
+	unsigned long batches = 0, batched = 0;
+	unsigned long overflow = 0, invalid = 0, forged = 0, total = 0, max = 0;
+	unsigned long sourceThrottled = 0, joinThrottled = 0;
+	unsigned long relayIn = 0, relayOut = 0, relayDuplicates = 0;
+	unsigned long relayDrops = 0, historyDrops = 0;
+	unsigned long value;
+	struct metrics *m;
+	int length;
+	int i, j;
+
+	bzero((char *)counts, sizeof(counts));
+	for ( i = 0; i < count; i++ ) {
+		m = all[i];
+		joins += metricsGet(&m->joins);
+		quits += metricsGet(&m->quits);
+		in += metricsGet(&m->messagesIn);
+		out += metricsGet(&m->messagesOut);
+		failures += metricsGet(&m->sendFailures);
+		syscalls += metricsGet(&m->syscalls);
+		retransmits += metricsGet(&m->retransmits);
+		reliableLost += metricsGet(&m->reliableLost);
+		queued += metricsGet(&m->queued);
+		queueDrops += metricsGet(&m->queueDrops);
+		coalesced += metricsGet(&m->coalesced);
+		evictions += metricsGet(&m->evictions);
+		batches += metricsGet(&m->batches);
+		batched += metricsGet(&m->batched);
+		overflow += metricsGet(&m->overflowDrops);
+		invalid += metricsGet(&m->invalidDrops);
+		forged += metricsGet(&m->forgedDrops);
+		sourceThrottled += metricsGet(&m->sourceThrottled);
+		joinThrottled += metricsGet(&m->joinThrottled);
+		relayIn += metricsGet(&m->relayIn);
+		relayOut += metricsGet(&m->relayOut);
+		relayDuplicates += metricsGet(&m->relayDuplicates);
+		relayDrops += metricsGet(&m->relayDrops);
+		historyDrops += metricsGet(&m->historyDrops);
+		for ( j = 0; j < HIST_BUCKETS; j++ ) {
+			counts[j] += metricsGet(&m->latency.counts[j]);
+		}
+		if ( metricsGet(&m->latency.max) > max ) {
+			max = metricsGet(&m->latency.max);
+		}
+	}
+
+	//Take the total from the summed buckets so that the percentiles agree
+	// with the counts they were read from
+	for ( j = 0; j < HIST_BUCKETS; j++ ) {
+		total += counts[j];
+	}
+
+	length = snprintf(buffer, size, "clients %i\njoins %lu\nquits %lu\n"
+		"messages_in %lu\nmessages_out %lu\nsend_failures %lu\n"
+		"syscalls %lu\nretransmits %lu\nreliable_lost %lu\n"
+		"queued %lu\nqueue_drops %lu\nqueue_coalesced %lu\nevictions %lu\n"
+		"batches %lu\nbatched %lu\n"
+		"drops_overflow %lu\ndrops_invalid %lu\ndrops_forged %lu\n"
+		"throttled_source %lu\n"
+		"throttled_join %lu\nrelay_in %lu\nrelay_out %lu\n"
+		"relay_duplicates %lu\nrelay_drops %lu\nhistory_drops %lu\n"
+		"latency_samples %lu\n",
+		clients, joins, quits, in, out, failures, syscalls, retransmits,
+		reliableLost, queued, queueDrops, coalesced, evictions, batches,
+		batched, overflow, invalid, forged, sourceThrottled, joinThrottled,
+		relayIn, relayOut, relayDuplicates, relayDrops, historyDrops,
+		total);
+	//A bucket's largest value can be beyond anything actually recorded
+	for ( j = 0; j < 4 && length < size; j++ ) {
+		value = total == 0 ? 0 : 
+			histogramPercentile(counts, total, percentiles[j]);
+		length += snprintf(buffer + length, size - length,
+			"latency_ns_%s %lu\n", names[j], value < max ? value : max);
+	}
+	if ( length < size ) {
+		length += snprintf(buffer + length, size - length,
+			"latency_ns_max %lu\n", max);
+	}
+
+	for ( i = 0; i < count && length < size; i++ ) {
+		m = all[i];
+		length += snprintf(buffer + length, size - length,
+			"worker %i joins %lu quits %lu in %lu out %lu "
+			"drops %lu throttled %lu\n", i, metricsGet(&m->joins),
+			metricsGet(&m->quits), metricsGet(&m->messagesIn),
+			metricsGet(&m->messagesOut),
+			metricsGet(&m->overflowDrops) +
+			metricsGet(&m->invalidDrops),
+			metricsGet(&m->sourceThrottled) +
+			metricsGet(&m->joinThrottled));
+	}
+	return length < size ? length : size - 1;
+}
+
+/*
+ * metricsElapsed
+ * @param from The earlier time
+ * @param to The later time
+ * @return Nanoseconds from one time to the other, or 0 if the clock
+ *	stepped backwards between them
+ */
+unsigned long metricsElapsed(const struct timespec *from, 
+	const struct timespec *to) {
+	long nanos = (to->tv_sec - from->tv_sec) * 1000000000L + 
+		(to->tv_nsec - from->tv_nsec);
+	return nanos > 0 ? nanos : 0;
+}
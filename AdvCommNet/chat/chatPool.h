@@ -0,0 +1,275 @@
+/******************************************************************************/
+// chatPool.h
+// Fixed-size buffer pool for datagrams in flight.  Buffers are carved from
+// slabs, preferring huge pages, and handed out through per-thread caches
+// backed by a shared free list.  Each buffer carries a reference count so
+// that one received payload can be held by several senders at once.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Pool sizing values.  A buffer holds the UDP payload of one 1500 byte
+ * Ethernet frame, the most a batch of messages is allowed to grow to.
+ */
+enum {
+	POOL_BUFFER_SIZE = 1472,
+	POOL_SLAB_SIZE = 2 * 1024 * 1024,
+	POOL_CACHE_MAX = 64,
+	POOL_CACHE_REFILL = 32
+};
+
+/*
+ * Pool buffer data structure
+ * @param next Next buffer on a free list
+ * @param refs Number of holders of the buffer
+ * @param length Number of bytes of data in use
+ * @param data The datagram
+ */
+struct poolBuffer {
+	struct poolBuffer *next;
+	atomic_int refs;
+	int length;
+	char data[POOL_BUFFER_SIZE];
+};
+
+/*
+ * Pool statistics data structure
+ * @param hits Allocations served from the calling thread's cache
+ * @param misses Allocations that had to go to the shared free list
+ * @param slabs Slabs mapped
+ * @param hugeSlabs Slabs mapped on huge pages
+ */
+struct poolStats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long slabs;
+	unsigned long hugeSlabs;
+};
+
+/*
+ * Pool counters data structure; one thread's statistics, allocated and
+ * kept by the pool so that they outlive the thread.  Only the owning
+ * thread writes them; poolStatistics reads them from any thread.
+ * @param hits Allocations served from the thread's cache
+ * @param misses Allocations that had to go to the shared free list
+ * @param slabs Slabs mapped by the thread
+ * @param hugeSlabs Slabs mapped on huge pages by the thread
+ * @param next Next thread's counters
+ */
+struct poolCounters {
+	atomic_ulong hits;
+	atomic_ulong misses;
+	atomic_ulong slabs;
+	atomic_ulong hugeSlabs;
+	struct poolCounters *next;
+};
+
+/*
+ * Per-thread buffer cache data structure
+ * @param head First cached buffer
+ * @param count Number of cached buffers
+ * @param stats The thread's counters, or NULL until it first allocates
+ */
+struct poolCache {
+	struct poolBuffer *head;
+	int count;
+	struct poolCounters *stats;
+};
+
+//The shared free list, the counters of every thread that has used the
+// pool, and the lock protecting both
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+struct poolBuffer *poolFree = NULL;
+struct poolCounters *poolThreads = NULL;
+
+//The calling thread's cache
+__thread struct poolCache poolCache;
+
+/*
+ * poolCount
+ * Add one to a counter of the calling thread.  Only the owning thread
+ * writes a counter, so this needs no atomic read-modify-write.
+ * @param counter The counter
+ */
+void poolCount(atomic_ulong *counter) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter,
+		memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/*
+ * poolRegister
+ * Give the calling thread counters on the pool's list.  Called with
+ * poolLock held.
+ * @return 0 on success, -1 if the counters could not be allocated
+ */
+int poolRegister() {
+	if ( poolCache.stats == NULL ) {
+		poolCache.stats = calloc(1, sizeof(*poolCache.stats));
+		if ( poolCache.stats == NULL ) {
+			return -1;
+		}
+		poolCache.stats->next = poolThreads;
+		poolThreads = poolCache.stats;
+	}
+	return 0;
+}
+
+/*
+ * poolMapSlab
+ * Map a new slab and place its buffers on the shared free list.  Called with
+ * poolLock held.
+ * @return 0 on success, -1 if no memory could be mapped
+ */
+int poolMapSlab() {
+	struct poolBuffer *slab = MAP_FAILED;
+	int count = POOL_SLAB_SIZE / sizeof(struct poolBuffer);
+	int i;
+
+	//Explicit huge pages need to have been reserved by the administrator;
+	// fall back to asking for transparent huge pages
+#ifdef MAP_HUGETLB
+	slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if ( slab != MAP_FAILED ) {
+		poolCount(&poolCache.stats->hugeSlabs);
+	}
+#endif
+	if ( slab == MAP_FAILED ) {
+		slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if ( slab == MAP_FAILED ) {
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(slab, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+	}
+	poolCount(&poolCache.stats->slabs);
+
+	for ( i = count - 1; i >= 0; i-- ) {
+		slab[i].next = poolFree;
+		poolFree = &slab[i];
+	}
+	return 0;
+}
+
+/*
+ * poolAlloc
+ * Take a buffer from the pool, holding one reference to it
+ * @return The buffer, or NULL if the pool could not grow
+ */
+struct poolBuffer *poolAlloc() {
+	struct poolBuffer *buffer;
+	int i;
+
+	//A thread's first allocation gives it counters; a thread that has
+	// only released buffers may already have a cache
+	if ( poolCache.stats == NULL ) {
+		pthread_mutex_lock(&poolLock);
+		i = poolRegister();
+		pthread_mutex_unlock(&poolLock);
+		if ( i < 0 ) {
+			return NULL;
+		}
+	}
+
+	//Refill the thread cache from the shared free list when it runs dry
+	if ( poolCache.head == NULL ) {
+		poolCount(&poolCache.stats->misses);
+		pthread_mutex_lock(&poolLock);
+		for ( i = 0; i < POOL_CACHE_REFILL; i++ ) {
+			if ( poolFree == NULL && poolMapSlab() < 0 ) {
+				break;
+			}
+			buffer = poolFree;
+			poolFree = buffer->next;
+			buffer->next = poolCache.head;
+			poolCache.head = buffer;
+			poolCache.count++;
+		}
+		pthread_mutex_unlock(&poolLock);
+		if ( poolCache.head == NULL ) {
+			return NULL;
+		}
+	} else {
+		poolCount(&poolCache.stats->hits);
+	}
+
+	buffer = poolCache.head;
+	poolCache.head = buffer->next;
+	poolCache.count--;
+	buffer->next = NULL;
+	buffer->length = 0;
+	atomic_init(&buffer->refs, 1);
+	messageAllocs++;
+	return buffer;
+}
+
+/*
+ * poolRef
+ * Take another reference to a buffer
+ * @param buffer The buffer
+ * @return The buffer
+ */
+struct poolBuffer *poolRef(struct poolBuffer *buffer) {
+	atomic_fetch_add_explicit(&buffer->refs, 1, memory_order_relaxed);
+	return buffer;
+}
+
+/*
+ * poolRelease
+ * Drop a reference to a buffer, returning it to the calling thread's cache
+ * when the last reference is dropped
+ * @param buffer The buffer
+ */
+void poolRelease(struct poolBuffer *buffer) {
+	struct poolBuffer *spill;
+	int i;
+
+	if ( atomic_fetch_sub_explicit(&buffer->refs, 1,
+		memory_order_acq_rel) != 1 ) {
+		return;
+	}
+	buffer->next = poolCache.head;
+	poolCache.head = buffer;
+	poolCache.count++;
+
+	//Hand half of an overfull cache back to the shared free list so that
+	// buffers released on one thread can be reused on another
+	if ( poolCache.count > POOL_CACHE_MAX ) {
+		pthread_mutex_lock(&poolLock);
+		for ( i = 0; i < POOL_CACHE_MAX / 2; i++ ) {
+			spill = poolCache.head;
+			poolCache.head = spill->next;
+			spill->next = poolFree;
+			poolFree = spill;
+		}
+		poolCache.count -= POOL_CACHE_MAX / 2;
+		pthread_mutex_unlock(&poolLock);
+	}
+}
+
+/*
+ * poolStatistics
+ * Sum the pool counters of every thread that has used the pool, including
+ * threads that have since exited
+ * @param total The statistics to fill
+ */
+void poolStatistics(struct poolStats *total) {
+	struct poolCounters *stats;
+
+	bzero((char *)total, sizeof(*total));
+	pthread_mutex_lock(&poolLock);
+	for ( stats = poolThreads; stats != NULL; stats = stats->next ) {
+		total->hits += atomic_load_explicit(&stats->hits,
+			memory_order_relaxed);
+		total->misses += atomic_load_explicit(&stats->misses,
+			memory_order_relaxed);
+		total->slabs += atomic_load_explicit(&stats->slabs,
+			memory_order_relaxed);
+		total->hugeSlabs += atomic_load_explicit(&stats->hugeSlabs,
+			memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&poolLock);
+}
@@ -0,0 +1,229 @@
+/******************************************************************************/
+// chatQueue.h
+// Bounded outbound queue per client.  A datagram the kernel will not take
+// at once is kept, as a pooled copy, on the queue of the client it was for
+// and sent when the socket has room again; until then later datagrams for
+// that client queue behind it so that order is kept.  A full queue either
+// drops the new datagram or coalesces it with an older one from the same
+// sender.  Every client's datagrams leave through the same socket, so a
+// full socket backs up every queue at once; a queue says nothing about how
+// fast its own client reads.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Queue sizing values, overflow policies, and push outcomes
+ */
+enum {
+	QUEUE_DEFAULT = 64,
+	QUEUE_MAX = 4096,
+	QUEUE_DROP = 0,
+	QUEUE_COALESCE = 1,
+	QUEUE_ADDED = 0,
+	QUEUE_DROPPED = 1,
+	QUEUE_COALESCED = 2
+};
+
+/*
+ * Send queue data structure
+ * @param lock Held while the queue is used
+ * @param serial Registration serial of the client the queue belongs to, or
+ *	0 while the queue is not in use
+ * @param address Where the queued datagrams are sent
+ * @param datagrams Queued datagrams, oldest at head
+ * @param senders Client id of the sender of each queued datagram
+ * @param capacity Most datagrams the queue holds
+ * @param head Position of the oldest queued datagram
+ * @param depth Number of queued datagrams
+ * @param dropped Datagrams dropped or coalesced since the client joined
+ * @param scheduled Whether the queue is on a worker's flush list
+ * @param nextScheduled Next queue on the same flush list
+ * @param nextFree Next queue on a free list
+ */
+struct sendQueue {
+	pthread_mutex_t lock;
+	unsigned int serial;
+	struct sockaddr_in address;
+	struct poolBuffer **datagrams;
+	int *senders;
+	int capacity;
+	int head;
+	atomic_int depth;
+	unsigned long dropped;
+	int scheduled;
+	struct sendQueue *nextScheduled;
+	struct sendQueue *nextFree;
+};
+
+/*
+ * queueInit
+ * Initialize an unused queue
+ * @param queue The queue
+ * @param capacity Most datagrams the queue holds
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int queueInit(struct sendQueue *queue, int capacity) {
+	bzero((char *)queue, sizeof(*queue));
+	queue->datagrams = malloc(sizeof(*queue->datagrams) * capacity);
+	queue->senders = malloc(sizeof(*queue->senders) * capacity);
+	if ( queue->datagrams == NULL || queue->senders == NULL ) {
+		free(queue->datagrams);
+		free(queue->senders);
+		return -1;
+	}
+	queue->capacity = capacity;
+	atomic_init(&queue->depth, 0);
+	pthread_mutex_init(&queue->lock, NULL);
+	return 0;
+}
+
+/*
+ * queueClear
+ * Drop every queued datagram and take the queue out of use.  A worker may
+ * still have it on its flush list; that worker takes it off.  Called with
+ * the queue's lock held.
+ * @param queue The queue
+ */
+void queueClear(struct sendQueue *queue) {
+	int depth = atomic_load(&queue->depth);
+	int i;
+
+	for ( i = 0; i < depth; i++ ) {
+		poolRelease(queue->datagrams[(queue->head + i) % queue->capacity]);
+	}
+	atomic_store(&queue->depth, 0);
+	queue->head = 0;
+	queue->dropped = 0;
+	queue->serial = 0;
+}
+
+/*
+ * queueReset
+ * Put a queue in use for a newly registered client
+ * @param queue The queue
+ * @param serial The client's registration serial
+ * @param address The client's address
+ */
+void queueReset(struct sendQueue *queue, unsigned int serial,
+	const struct sockaddr_in *address) {
+	pthread_mutex_lock(&queue->lock);
+	queueClear(queue);
+	queue->serial = serial;
+	bcopy((char *)address, (char *)&queue->address, sizeof(queue->address));
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * queueDepth
+ * @param queue The queue
+ * @return The number of queued datagrams; read without the lock, so only a
+ *	hint unless the caller holds it
+ */
+int queueDepth(struct sendQueue *queue) {
+	return atomic_load_explicit(&queue->depth, memory_order_relaxed);
+}
+
+/*
+ * queuePush
+ * Queue a datagram for a client.  If the queue is full, QUEUE_DROP drops
+ * the new datagram, and QUEUE_COALESCE replaces the newest datagram queued
+ * from the same sender with it, or else drops the oldest.
+ * @param queue The queue
+ * @param serial The registration serial of the client the caller expects
+ * @param datagram The datagram; the queue takes its own reference
+ * @param sender Client id of the datagram's sender
+ * @param policy QUEUE_DROP or QUEUE_COALESCE
+ * @param schedule Set to whether the caller must put the queue on its flush
+ *	list
+ * @return QUEUE_ADDED, QUEUE_DROPPED, QUEUE_COALESCED, or -1 if the client
+ *	has gone
+ */
+int queuePush(struct sendQueue *queue, unsigned int serial,
+	struct poolBuffer *datagram, int sender, int policy, int *schedule) {
+	int depth;
+	int result = QUEUE_ADDED;
+	int i, at;
+
+	*schedule = 0;
+	pthread_mutex_lock(&queue->lock);
+	if ( queue->serial != serial || serial == 0 ) {
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+	depth = atomic_load(&queue->depth);
+	if ( depth == queue->capacity ) {
+		result = QUEUE_DROPPED;
+		queue->dropped++;
+	}
+	if ( result == QUEUE_DROPPED && policy == QUEUE_COALESCE ) {
+		for ( i = depth - 1; i >= 0; i-- ) {
+			at = (queue->head + i) % queue->capacity;
+			if ( queue->senders[at] == sender ) {
+				break;
+			}
+		}
+		if ( i >= 0 ) {
+			poolRelease(queue->datagrams[at]);
+			queue->datagrams[at] = poolRef(datagram);
+			result = QUEUE_COALESCED;
+		} else {
+			poolRelease(queue->datagrams[queue->head]);
+			queue->head = (queue->head + 1) % queue->capacity;
+			depth--;
+		}
+	}
+	if ( depth < queue->capacity ) {
+		at = (queue->head + depth) % queue->capacity;
+		queue->datagrams[at] = poolRef(datagram);
+		queue->senders[at] = sender;
+		atomic_store(&queue->depth, depth + 1);
+	}
+	if ( !queue->scheduled ) {
+		queue->scheduled = *schedule = 1;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return result;
+}
+
+/*
+ * queueFlush
+ * Send queued datagrams until the queue is empty or the socket is full
+ * @param queue The queue
+ * @param sd The socket to send from
+ * @param sent Incremented by the number of datagrams sent
+ * @param syscalls Incremented by the number of system calls made
+ * @return 1 if datagrams are still queued, 0 if the queue is empty or out
+ *	of use and has been taken off the flush list
+ */
+int queueFlush(struct sendQueue *queue, int sd, unsigned long *sent,
+	unsigned long *syscalls) {
+	struct poolBuffer *datagram;
+	int depth;
+	int result;
+
+	pthread_mutex_lock(&queue->lock);
+	depth = atomic_load(&queue->depth);
+	while ( depth > 0 ) {
+		datagram = queue->datagrams[queue->head];
+		result = sendto(sd, datagram->data, datagram->length, MSG_DONTWAIT,
+			(struct sockaddr *)&queue->address, sizeof(queue->address));
+		(*syscalls)++;
+		if ( result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == ENOBUFS) ) {
+			break;
+		}
+		if ( result >= 0 ) {
+			(*sent)++;
+		}
+		poolRelease(datagram);
+		queue->head = (queue->head + 1) % queue->capacity;
+		depth--;
+	}
+	atomic_store(&queue->depth, depth);
+	if ( depth == 0 ) {
+		queue->scheduled = 0;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return depth > 0;
+}
@@ -0,0 +1,295 @@
+/******************************************************************************/
+// chatRelay.h
+// Relaying between peered chat servers, so that a room spans every server
+// of a federation.  Each server is given its peers' addresses and an
+// origin id of its own, unique in the federation.  What a server's own
+// clients say, and their joins, quits and room moves, go to each peer once
+// as an OP_RELAY frame, however many clients the peer has in the room; the
+// peer fans the message out to its own clients in the room of the same
+// name.
+//
+// Every relayed message carries its origin, the origin's epoch, which
+// changes when the origin restarts, and the origin's sequence number for
+// it.  A server keeps, for each origin, the highest sequence number seen
+// and which of the RELAY_WINDOW before it have been seen, and drops a
+// message it has seen before, so messages passed on around a loop of
+// peers are delivered once.  A server passes a message on to its other
+// peers only while the message has crossed fewer links than the
+// federation's diameter; in a full mesh, a diameter of 1, nothing is passed
+// on.  Client ids are only unique within a server, so a relayed message's
+// client id is shown to clients as origin * RELAY_CID_SPAN + cid.
+//
+// An OP_RELAY frame has no client id and an empty hostname.  Its payload is
+// laid out as follows, with integers in network byte order:
+//	bytes 0-3	origin
+//	bytes 4-7	epoch
+//	bytes 8-11	sequence number
+//	byte 12		links crossed before the sender's
+//	byte 13		room name length, or RELAY_ALL for every client
+//	bytes 14-	room name, then the message as an unsequenced binary
+//			frame
+// Relayed frames are not acknowledged; one the socket will not take, or
+// that does not fit a POOL_BUFFER_SIZE datagram, is dropped and counted.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Relay sizing values.  Client ids run up to MAX_CLIENTS, so the highest
+ * origin is one short of INT_MAX / RELAY_CID_SPAN, and every id relayCid
+ * gives fits in an int.
+ */
+enum {
+	RELAY_MAX_PEERS = 16,
+	RELAY_MAX_ORIGIN = 2046,
+	RELAY_MAX_DIAMETER = 16,
+	RELAY_CID_SPAN = MAX_CLIENTS,
+	RELAY_WINDOW = 64,
+	RELAY_HEADER = 14,
+	RELAY_ALL = 0xff
+};
+
+/*
+ * Relay header data structure; an OP_RELAY frame's payload, decoded
+ * @param origin The server whose client the message came from
+ * @param epoch The origin's epoch
+ * @param seq The origin's sequence number for the message
+ * @param hops Links the message crossed before the sender's
+ * @param room The room's name, pointing into the frame
+ * @param roomLen The length of the name, or RELAY_ALL for every client
+ */
+struct relayHeader {
+	unsigned int origin;
+	unsigned int epoch;
+	unsigned int seq;
+	int hops;
+	const char *room;
+	int roomLen;
+};
+
+/*
+ * Relay origin data structure; what has been seen from one origin
+ * @param epoch The origin's epoch
+ * @param highest The highest sequence number seen
+ * @param seen Which sequence numbers have been seen, bit n for highest - n
+ */
+struct relayOrigin {
+	unsigned int epoch;
+	unsigned int highest;
+	unsigned long seen;
+};
+
+/*
+ * Relay state data structure
+ * @param origin This server's origin id, or 0 if it relays nothing
+ * @param epoch This server's epoch
+ * @param nextSeq Sequence number of the next message this server relays
+ * @param diameter Most links a message crosses
+ * @param peers The peers' addresses
+ * @param peerCount Number of peers
+ * @param lock Protects origins
+ * @param origins What has been seen from each origin, by origin id
+ */
+struct relayState {
+	unsigned int origin;
+	unsigned int epoch;
+	atomic_uint nextSeq;
+	int diameter;
+	struct sockaddr_in peers[RELAY_MAX_PEERS];
+	int peerCount;
+	pthread_mutex_t lock;
+	struct relayOrigin *origins;
+};
+
+/*
+ * relayInit
+ * Set up relaying with no peers
+ * @param relay The relay state
+ * @param origin This server's origin id, 1 to RELAY_MAX_ORIGIN
+ * @param diameter Most links a message crosses, 1 to RELAY_MAX_DIAMETER
+ * @return 0 on success, -1 if the origins could not be allocated
+ */
+int relayInit(struct relayState *relay, unsigned int origin, int diameter) {
+	bzero((char *)relay, sizeof(*relay));
+	relay->origins = calloc(RELAY_MAX_ORIGIN + 1, sizeof(*relay->origins));
+	if ( relay->origins == NULL ) {
+		return -1;
+	}
+	relay->origin = origin;
+	relay->diameter = diameter;
+
+	//A restarted server starts its sequence numbers again; a new epoch
+	// keeps its peers from taking them for messages already seen
+	relay->epoch = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+	atomic_init(&relay->nextSeq, 1);
+	pthread_mutex_init(&relay->lock, NULL);
+	return 0;
+}
+
+/*
+ * relayAddPeer
+ * Add a peer, looking up its address
+ * @param relay The relay state
+ * @param peer The peer, as host:port
+ * @return 0 on success, -1 if the peer is malformed or cannot be found, or
+ *	there are RELAY_MAX_PEERS peers already
+ */
+int relayAddPeer(struct relayState *relay, const char *peer) {
+	struct addrinfo hints;
+	struct addrinfo *found;
+	char host[NI_MAXHOST];
+	const char *colon = strrchr(peer, ':');
+
+	if ( relay->peerCount == RELAY_MAX_PEERS || colon == NULL ||
+		colon == peer || colon - peer >= NI_MAXHOST ) {
+		return -1;
+	}
+	copyString(host, sizeof(host), peer, colon - peer);
+	bzero((char *)&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ( getaddrinfo(host, colon + 1, &hints, &found) != 0 ) {
+		return -1;
+	}
+	memcpy(&relay->peers[relay->peerCount++], found->ai_addr,
+		sizeof(relay->peers[0]));
+	freeaddrinfo(found);
+	return 0;
+}
+
+/*
+ * relayFind
+ * @param relay The relay state
+ * @param address A datagram's source
+ * @return The index of the peer at the address, or -1 if it is not a peer
+ */
+int relayFind(const struct relayState *relay,
+	const struct sockaddr_in *address) {
+	int i;
+
+	for ( i = 0; i < relay->peerCount; i++ ) {
+		if ( relay->peers[i].sin_addr.s_addr == address->sin_addr.s_addr &&
+			relay->peers[i].sin_port == address->sin_port ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * relayEncode
+ * @param buffer The RELAY_HEADER bytes to fill; the room name follows
+ * @param header The header to encode
+ */
+void relayEncode(char *buffer, const struct relayHeader *header) {
+	unsigned char *b = (unsigned char *)buffer;
+
+	b[0] = header->origin >> 24;
+	b[1] = header->origin >> 16;
+	b[2] = header->origin >> 8;
+	b[3] = header->origin;
+	b[4] = header->epoch >> 24;
+	b[5] = header->epoch >> 16;
+	b[6] = header->epoch >> 8;
+	b[7] = header->epoch;
+	b[8] = header->seq >> 24;
+	b[9] = header->seq >> 16;
+	b[10] = header->seq >> 8;
+	b[11] = header->seq;
+	b[12] = header->hops;
+	b[13] = header->roomLen;
+}
+
+/*
+ * relayDecode
+ * @param frame An OP_RELAY frame
+ * @param header The header to fill; its room points into the frame
+ * @param inner The view to fill with the message relayed; its strings point
+ *	into the frame
+ * @return 0 on success, -1 if the frame is not well formed
+ */
+int relayDecode(const struct messageView *frame, struct relayHeader *header,
+	struct messageView *inner) {
+	const unsigned char *b = (const unsigned char *)frame->payload;
+	int length = frame->payloadLen - RELAY_HEADER;
+
+	if ( length < 0 ) {
+		return -1;
+	}
+	header->origin = ((unsigned int)b[0] << 24) | (b[1] << 16) |
+		(b[2] << 8) | b[3];
+	header->epoch = ((unsigned int)b[4] << 24) | (b[5] << 16) |
+		(b[6] << 8) | b[7];
+	header->seq = ((unsigned int)b[8] << 24) | (b[9] << 16) |
+		(b[10] << 8) | b[11];
+	header->hops = b[12];
+	header->roomLen = b[13];
+	header->room = frame->payload + RELAY_HEADER;
+	if ( header->origin < 1 || header->origin > RELAY_MAX_ORIGIN ) {
+		return -1;
+	}
+	if ( header->roomLen != RELAY_ALL ) {
+		if ( header->roomLen > MAX_ROOM_NAME || header->roomLen > length ) {
+			return -1;
+		}
+		length -= header->roomLen;
+	}
+
+	//The message must fill the rest of the frame, and is never itself
+	// sequenced or relayed
+	if ( decodeFrame(header->room + (header->roomLen == RELAY_ALL ? 0 :
+		header->roomLen), length, inner) != length ||
+		(inner->flags & FLAG_RELIABLE) || inner->opcode == OP_RELAY ) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * relayAccept
+ * Note a relayed message as seen
+ * @param relay The relay state
+ * @param header The message's header
+ * @return 1 if the message is new, 0 if it has been seen, is too old to
+ *	tell, or came from this server
+ */
+int relayAccept(struct relayState *relay, const struct relayHeader *header) {
+	struct relayOrigin *from = &relay->origins[header->origin];
+	int behind;
+	int accepted = 1;
+
+	if ( header->origin == relay->origin ) {
+		return 0;
+	}
+	pthread_mutex_lock(&relay->lock);
+	behind = (int)(from->highest - header->seq);
+	if ( from->seen == 0 || from->epoch != header->epoch ) {
+		from->epoch = header->epoch;
+		from->highest = header->seq;
+		from->seen = 1;
+	} else if ( behind < 0 ) {
+		from->seen = -behind >= RELAY_WINDOW ? 1 :
+			(from->seen << -behind) | 1;
+		from->highest = header->seq;
+	} else if ( behind >= RELAY_WINDOW ||
+		(from->seen & (1UL << behind)) ) {
+		accepted = 0;
+	} else {
+		from->seen |= 1UL << behind;
+	}
+	pthread_mutex_unlock(&relay->lock);
+	return accepted;
+}
+
+/*
+ * relayCid
+ * @param origin The server a client is registered with
+ * @param cid The client's id there, negated in a QUIT
+ * @return The id this server's clients know the client by
+ */
+int relayCid(unsigned int origin, int cid) {
+	if ( cid < 0 ) {
+		return -((int)origin * RELAY_CID_SPAN - cid);
+	}
+	return cid == JOIN_CID_CODE ? cid : (int)origin * RELAY_CID_SPAN + cid;
+}
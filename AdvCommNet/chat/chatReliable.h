@@ -0,0 +1,984 @@
+/******************************************************************************/
+// chatReliable.h
+// Optional reliable, ordered delivery over UDP.  Each direction between a
+// client and the server is a stream of sequenced binary frames.  The
+// receiver delivers frames in order, holding any that arrive early, and
+// acknowledges with the next sequence number it expects and a bitmap of the
+// frames it holds beyond that.  The sender keeps every frame until it is
+// acknowledged and retransmits from a timing wheel, backing off each frame
+// and pacing each link so that a lossy client costs a bounded amount of
+// traffic.  A frame still unacknowledged after RELIABLE_RETRIES
+// retransmits, or pushed out of a full window, is given up, and the
+// receiver is told not to wait for it.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Reliable delivery values; times are in milliseconds.  An acknowledgement
+ * bitmap covers the RELIABLE_SACK frames after the one expected; frames
+ * held beyond that are acknowledged once the gap before them fills.  A link
+ * retransmits in bursts of at most RELIABLE_BURST frames and on average no
+ * more than one frame every RELIABLE_PACE.
+ */
+enum {
+	RELIABLE_WINDOW = 256,
+	RELIABLE_SACK = 64,
+	RELIABLE_ACK = 12,
+	RELIABLE_STAMP = FRAME_HEADER + FRAME_SEQUENCE,
+	RELIABLE_SCRATCH = FRAME_HEADER + RELIABLE_ACK,
+	RELIABLE_ACK_EVERY = 8,
+	RELIABLE_ACK_DELAY = 5,
+	RELIABLE_RTO_INITIAL = 200,
+	RELIABLE_RTO_MIN = 40,
+	RELIABLE_RTO_MAX = 2000,
+	RELIABLE_RETRIES = 8,
+	RELIABLE_BURST = 4,
+	RELIABLE_PACE = 10,
+	WHEEL_TICK = 5,
+	WHEEL_SLOTS = 256,
+	WHEEL_CHUNK = 256
+};
+
+/*
+ * Reliable delivery outcomes, and timer kinds.  TIMER_IDLE timers are set
+ * by the server on the same wheels to notice clients that have gone quiet;
+ * they carry no link.
+ */
+enum {
+	RELIABLE_NONE = 0,
+	RELIABLE_DELIVER = 1,
+	RELIABLE_HELD = 2,
+	RELIABLE_DUPLICATE = 3,
+	RELIABLE_RESEND = 4,
+	RELIABLE_ACKNOWLEDGE = 5,
+	RELIABLE_LOST = 6,
+	TIMER_RETRANSMIT = 0,
+	TIMER_ACK = 1,
+	TIMER_IDLE = 2
+};
+
+/*
+ * Send window slot data structure
+ * @param frame The frame, or NULL once it is acknowledged or given up
+ * @param sent When the frame was last sent
+ * @param rto Retransmit timeout, doubled by each retransmit
+ * @param retries Number of times the frame has been retransmitted
+ */
+struct reliableSlot {
+	struct poolBuffer *frame;
+	long sent;
+	int rto;
+	int retries;
+};
+
+/*
+ * Reliable link data structure; both directions between one client and the
+ * server.  Every field is protected by lock.
+ * @param lock Held while the link is used
+ * @param incarnation Incremented each time the link is reset, so that
+ *	timers and member snapshots taken for an earlier client are ignored
+ * @param cid The client id acknowledgements are sent with
+ * @param address Where frames and acknowledgements are sent
+ * @param base Oldest frame sent and neither acknowledged nor given up
+ * @param next Sequence number of the next frame to send
+ * @param slots Frames sent, by sequence number
+ * @param srtt Smoothed round trip time, or -1 before the first sample
+ * @param rttvar Round trip time variation
+ * @param rto Retransmit timeout for newly sent frames
+ * @param tokens Retransmits the pacing will allow at once
+ * @param refilled When the last retransmit token was added
+ * @param expected Sequence number of the next frame to deliver
+ * @param skip Sequence number below which the sender has given up every
+ *	frame not yet received
+ * @param held Frames received ahead of expected, by sequence number
+ * @param unacked Frames received since the last acknowledgement
+ * @param ackArmed Whether an acknowledgement timer is set
+ * @param abandoned Frames given up since the receiver last acknowledged one
+ * @param nextFree Next link on a free list
+ */
+struct reliableLink {
+	pthread_mutex_t lock;
+	unsigned int incarnation;
+	int cid;
+	struct sockaddr_in address;
+	unsigned int base;
+	unsigned int next;
+	struct reliableSlot slots[RELIABLE_WINDOW];
+	int srtt;
+	int rttvar;
+	int rto;
+	int tokens;
+	long refilled;
+	unsigned int expected;
+	unsigned int skip;
+	struct poolBuffer *held[RELIABLE_WINDOW];
+	int unacked;
+	int ackArmed;
+	unsigned int abandoned;
+	struct reliableLink *nextFree;
+};
+
+/*
+ * Reliable datagram data structure; a frame or acknowledgement prepared
+ * under a link's lock, to be sent once the lock is released
+ * @param sd The socket to send from
+ * @param address Where to send
+ * @param frame The frame, with a reference held until it is sent, or NULL
+ *	for an acknowledgement
+ * @param scratch The frame's header and sequence numbers, or the whole
+ *	acknowledgement
+ * @param iov Vectors for sendmsg
+ * @param iovlen Number of vectors used, 0 if there is nothing to send
+ */
+struct reliableDatagram {
+	int sd;
+	struct sockaddr_in address;
+	struct poolBuffer *frame;
+	char scratch[RELIABLE_SCRATCH];
+	struct iovec iov[2];
+	int iovlen;
+};
+
+/*
+ * Timer data structure
+ * @param next Next timer in the same wheel slot, or on the free list
+ * @param tick The tick at which the timer expires
+ * @param link The link the timer was set for, or NULL for TIMER_IDLE
+ * @param incarnation The link's incarnation when the timer was set, or the
+ *	client's registration serial for TIMER_IDLE
+ * @param seq The frame to retransmit, or the client id for TIMER_IDLE
+ * @param sd The socket the frame was sent from
+ * @param kind TIMER_RETRANSMIT, TIMER_ACK or TIMER_IDLE
+ */
+struct reliableTimer {
+	struct reliableTimer *next;
+	long tick;
+	struct reliableLink *link;
+	unsigned int incarnation;
+	unsigned int seq;
+	int sd;
+	int kind;
+};
+
+/*
+ * Timer chunk data structure; timers are allocated WHEEL_CHUNK at a time
+ * @param next The chunk allocated before this one
+ * @param timers The timers
+ */
+struct timerChunk {
+	struct timerChunk *next;
+	struct reliableTimer timers[WHEEL_CHUNK];
+};
+
+/*
+ * Timing wheel data structure; used only by the thread that owns it.
+ * Timers hash into WHEEL_SLOTS slots by tick, so setting one costs a push
+ * and each tick only visits its own slot.  Timers are never cancelled: one
+ * whose frame has been acknowledged is simply dropped when it expires.
+ * @param slots Timers by tick
+ * @param expired Timers expired and not yet handed out
+ * @param free Unused timers
+ * @param chunks Every timer chunk allocated
+ * @param tick The next tick to expire
+ * @param count Number of timers set
+ */
+struct timerWheel {
+	struct reliableTimer *slots[WHEEL_SLOTS];
+	struct reliableTimer *expired;
+	struct reliableTimer *free;
+	struct timerChunk *chunks;
+	long tick;
+	int count;
+};
+
+/*
+ * reliableMillis
+ * @return A monotonic clock in milliseconds
+ */
+long reliableMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * reliablePut
+ * @param p Four bytes to fill
+ * @param value The value to write in network byte order
+ */
+void reliablePut(char *p, unsigned int value) {
+	unsigned char *b = (unsigned char *)p;
+	b[0] = value >> 24;
+	b[1] = value >> 16;
+	b[2] = value >> 8;
+	b[3] = value;
+}
+
+/*
+ * reliableGet
+ * @param p Four bytes in network byte order
+ * @return The value
+ */
+unsigned int reliableGet(const char *p) {
+	const unsigned char *b = (const unsigned char *)p;
+	return ((unsigned int)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+/*
+ * reliableBefore
+ * @param a A sequence number
+ * @param b A sequence number
+ * @return Whether a comes before b, allowing for wrap around
+ */
+int reliableBefore(unsigned int a, unsigned int b) {
+	return (int)(a - b) < 0;
+}
+
+/*
+ * wheelInit
+ * Initialize an empty timing wheel
+ * @param wheel The wheel
+ */
+void wheelInit(struct timerWheel *wheel) {
+	bzero((char *)wheel, sizeof(*wheel));
+	wheel->tick = reliableMillis() / WHEEL_TICK;
+}
+
+/*
+ * wheelRelease
+ * Free every timer of a wheel that is no longer used
+ * @param wheel The wheel
+ */
+void wheelRelease(struct timerWheel *wheel) {
+	struct timerChunk *chunk;
+
+	while ( (chunk = wheel->chunks) != NULL ) {
+		wheel->chunks = chunk->next;
+		free(chunk);
+	}
+	wheelInit(wheel);
+}
+
+/*
+ * wheelInsert
+ * Put a timer on the wheel
+ * @param wheel The wheel
+ * @param timer The timer
+ * @param deadline When the timer should expire
+ */
+void wheelInsert(struct timerWheel *wheel, struct reliableTimer *timer,
+	long deadline) {
+	long tick = (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+	struct reliableTimer **slot;
+
+	timer->tick = tick > wheel->tick ? tick : wheel->tick;
+	slot = &wheel->slots[timer->tick % WHEEL_SLOTS];
+	timer->next = *slot;
+	*slot = timer;
+	wheel->count++;
+}
+
+/*
+ * wheelAdd
+ * Set a timer
+ * @param wheel The wheel
+ * @param deadline When the timer should expire
+ * @param link The link the timer is for, or NULL
+ * @param incarnation The link's incarnation, or a client's serial
+ * @param seq The frame to retransmit, or a client id
+ * @param sd The socket the frame was sent from
+ * @param kind TIMER_RETRANSMIT, TIMER_ACK or TIMER_IDLE
+ */
+void wheelAdd(struct timerWheel *wheel, long deadline,
+	struct reliableLink *link, unsigned int incarnation, unsigned int seq,
+	int sd, int kind) {
+	struct reliableTimer *timer;
+	struct timerChunk *chunk;
+	int i;
+
+	if ( wheel->free == NULL ) {
+		chunk = malloc(sizeof(*chunk));
+		if ( chunk == NULL ) {
+			perror("Could not allocate timers");
+			exit(1);
+		}
+		chunk->next = wheel->chunks;
+		wheel->chunks = chunk;
+		for ( i = 0; i < WHEEL_CHUNK; i++ ) {
+			chunk->timers[i].next = wheel->free;
+			wheel->free = &chunk->timers[i];
+		}
+	}
+	timer = wheel->free;
+	wheel->free = timer->next;
+	timer->link = link;
+	timer->incarnation = incarnation;
+	timer->seq = seq;
+	timer->sd = sd;
+	timer->kind = kind;
+	wheelInsert(wheel, timer, deadline);
+}
+
+/*
+ * wheelFree
+ * Return an expired timer that is not put back on the wheel
+ * @param wheel The wheel
+ * @param timer The timer
+ */
+void wheelFree(struct timerWheel *wheel, struct reliableTimer *timer) {
+	timer->next = wheel->free;
+	wheel->free = timer;
+}
+
+/*
+ * wheelExpire
+ * Take the next expired timer off the wheel, turning the wheel up to now
+ * @param wheel The wheel
+ * @param now The current time
+ * @return The timer, which must be put back or freed, or NULL when no
+ *	more have expired
+ */
+struct reliableTimer *wheelExpire(struct timerWheel *wheel, long now) {
+	struct reliableTimer *timer, *next;
+	long tick = now / WHEEL_TICK;
+
+	while ( wheel->expired == NULL ) {
+		//An empty wheel does not need to visit the ticks it skips
+		if ( wheel->count == 0 ) {
+			if ( wheel->tick <= tick ) {
+				wheel->tick = tick + 1;
+			}
+			return NULL;
+		}
+		if ( wheel->tick > tick ) {
+			return NULL;
+		}
+
+		//Timers a whole turn or more away stay in the slot
+		timer = wheel->slots[wheel->tick % WHEEL_SLOTS];
+		wheel->slots[wheel->tick % WHEEL_SLOTS] = NULL;
+		for ( ; timer != NULL; timer = next ) {
+			next = timer->next;
+			if ( timer->tick <= wheel->tick ) {
+				timer->next = wheel->expired;
+				wheel->expired = timer;
+			} else {
+				timer->next = wheel->slots[wheel->tick % WHEEL_SLOTS];
+				wheel->slots[wheel->tick % WHEEL_SLOTS] = timer;
+			}
+		}
+		wheel->tick++;
+	}
+
+	timer = wheel->expired;
+	wheel->expired = timer->next;
+	wheel->count--;
+	return timer;
+}
+
+/*
+ * wheelTimeout
+ * @param wheel The wheel
+ * @param now The current time
+ * @return Milliseconds until the wheel next needs turning, or -1 if no
+ *	timer is set
+ */
+int wheelTimeout(struct timerWheel *wheel, long now) {
+	long wait = wheel->tick * WHEEL_TICK - now;
+
+	if ( wheel->count == 0 ) {
+		return -1;
+	}
+	return wait > 0 ? (int)wait : 0;
+}
+
+/*
+ * reliableClear
+ * Drop every frame a link holds and begin a new incarnation, so that its
+ * timers and snapshots are ignored.  Called with the link's lock held.
+ * @param link The link
+ */
+void reliableClear(struct reliableLink *link) {
+	int i;
+
+	for ( i = 0; i < RELIABLE_WINDOW; i++ ) {
+		if ( link->slots[i].frame != NULL ) {
+			poolRelease(link->slots[i].frame);
+			link->slots[i].frame = NULL;
+		}
+		if ( link->held[i] != NULL ) {
+			poolRelease(link->held[i]);
+			link->held[i] = NULL;
+		}
+	}
+	link->incarnation++;
+}
+
+/*
+ * reliableInit
+ * Initialize a link with nothing sent or received
+ * @param link The link
+ */
+void reliableInit(struct reliableLink *link) {
+	bzero((char *)link, sizeof(*link));
+	pthread_mutex_init(&link->lock, NULL);
+}
+
+/*
+ * reliableReset
+ * Start both of a link's streams over for a new client
+ * @param link The link
+ * @param cid The client id to acknowledge with
+ * @param address Where to send frames and acknowledgements
+ */
+void reliableReset(struct reliableLink *link, int cid,
+	const struct sockaddr_in *address) {
+	pthread_mutex_lock(&link->lock);
+	reliableClear(link);
+	link->cid = cid;
+	bcopy((char *)address, (char *)&link->address, sizeof(link->address));
+	link->base = 0;
+	link->next = 0;
+	link->srtt = -1;
+	link->rttvar = 0;
+	link->rto = RELIABLE_RTO_INITIAL;
+	link->tokens = RELIABLE_BURST;
+	link->refilled = reliableMillis();
+	link->expected = 0;
+	link->skip = 0;
+	link->unacked = 0;
+	link->ackArmed = 0;
+	link->abandoned = 0;
+	pthread_mutex_unlock(&link->lock);
+}
+
+/*
+ * reliableFrame
+ * Build a reliable frame of a message in a pooled buffer, leaving room for
+ * the sequence numbers
+ * @param view The message
+ * @return The frame, holding one reference, or NULL if the message is too
+ *	long or no buffer could be allocated
+ */
+struct poolBuffer *reliableFrame(const struct messageView *view) {
+	struct messageView framed = *view;
+	struct poolBuffer *frame;
+	int header = RELIABLE_STAMP;
+	int length;
+
+	//A fragment's place in its message follows the sequence numbers
+	if ( view->flags & FLAG_FRAGMENT ) {
+		header += FRAME_FRAGMENT;
+	}
+	length = header + view->hostnameLen + view->payloadLen;
+	if ( length > POOL_BUFFER_SIZE || (frame = poolAlloc()) == NULL ) {
+		return NULL;
+	}
+	framed.version = PROTOCOL_VERSION;
+	framed.flags = FLAG_RELIABLE | (view->flags & FLAG_FRAGMENT);
+	encodeHeader(frame->data, &framed);
+	bzero(frame->data + FRAME_HEADER, FRAME_SEQUENCE);
+	if ( view->flags & FLAG_FRAGMENT ) {
+		encodeFragment(frame->data + RELIABLE_STAMP, view);
+	}
+	memcpy(frame->data + header, view->hostname, view->hostnameLen);
+	memcpy(frame->data + header + view->hostnameLen, view->payload,
+		view->payloadLen);
+	frame->length = length;
+	messageCopies++;
+	return frame;
+}
+
+/*
+ * reliableStamp
+ * Lay a frame out for sending with its sequence numbers.  Called with the
+ * link's lock held.
+ * @param link The link
+ * @param frame The frame
+ * @param seq The frame's sequence number
+ * @param datagram The datagram to fill; takes a reference to the frame
+ */
+void reliableStamp(struct reliableLink *link, struct poolBuffer *frame,
+	unsigned int seq, struct reliableDatagram *datagram) {
+	memcpy(datagram->scratch, frame->data, FRAME_HEADER);
+	reliablePut(datagram->scratch + FRAME_HEADER, seq);
+	reliablePut(datagram->scratch + FRAME_HEADER + 4, link->base);
+	bcopy((char *)&link->address, (char *)&datagram->address,
+		sizeof(datagram->address));
+	datagram->frame = poolRef(frame);
+	datagram->iov[0].iov_base = datagram->scratch;
+	datagram->iov[0].iov_len = RELIABLE_STAMP;
+	datagram->iov[1].iov_base = frame->data + RELIABLE_STAMP;
+	datagram->iov[1].iov_len = frame->length - RELIABLE_STAMP;
+	datagram->iovlen = 2;
+}
+
+/*
+ * reliableAckFrame
+ * Lay out an acknowledgement of everything the link has received.  Called
+ * with the link's lock held.
+ * @param link The link
+ * @param datagram The datagram to fill
+ */
+void reliableAckFrame(struct reliableLink *link,
+	struct reliableDatagram *datagram) {
+	struct messageView ack;
+	char *payload = datagram->scratch + FRAME_HEADER;
+	unsigned long bits = 0;
+	int i;
+
+	for ( i = 0; i < RELIABLE_SACK; i++ ) {
+		if ( link->held[(link->expected + i) % RELIABLE_WINDOW] != NULL ) {
+			bits |= 1UL << i;
+		}
+	}
+	bzero((char *)&ack, sizeof(ack));
+	ack.version = PROTOCOL_VERSION;
+	ack.opcode = OP_ACK;
+	ack.cid = link->cid;
+	ack.payloadLen = RELIABLE_ACK;
+	encodeHeader(datagram->scratch, &ack);
+	reliablePut(payload, link->expected);
+	reliablePut(payload + 4, bits >> 32);
+	reliablePut(payload + 8, bits);
+	bcopy((char *)&link->address, (char *)&datagram->address,
+		sizeof(datagram->address));
+	datagram->frame = NULL;
+	datagram->iov[0].iov_base = datagram->scratch;
+	datagram->iov[0].iov_len = RELIABLE_SCRATCH;
+	datagram->iovlen = 1;
+	link->unacked = 0;
+	link->ackArmed = 0;
+}
+
+/*
+ * reliableSend
+ * Send a prepared datagram and drop its reference to its frame
+ * @param datagram The datagram
+ * @return The result of sendmsg
+ */
+int reliableSend(struct reliableDatagram *datagram) {
+	struct msghdr msg;
+	int sent;
+
+	bzero((char *)&msg, sizeof(msg));
+	msg.msg_name = &datagram->address;
+	msg.msg_namelen = sizeof(datagram->address);
+	msg.msg_iov = datagram->iov;
+	msg.msg_iovlen = datagram->iovlen;
+	sent = sendmsg(datagram->sd, &msg, 0);
+	if ( datagram->frame != NULL ) {
+		poolRelease(datagram->frame);
+		datagram->frame = NULL;
+	}
+	return sent;
+}
+
+/*
+ * reliableAdvance
+ * Move a link's send window past frames no longer outstanding.  Called with
+ * the link's lock held.
+ * @param link The link
+ */
+void reliableAdvance(struct reliableLink *link) {
+	while ( link->base != link->next &&
+		link->slots[link->base % RELIABLE_WINDOW].frame == NULL ) {
+		link->base++;
+	}
+}
+
+/*
+ * reliableQueue
+ * Send a frame on a link and keep it until it is acknowledged.  A full
+ * window gives up its oldest frame rather than hold up the sender.
+ * @param link The link
+ * @param incarnation The link's incarnation the caller expects
+ * @param frame The frame, from reliableFrame
+ * @param sd The socket to send from
+ * @param now The current time
+ * @param wheel The calling thread's timing wheel
+ * @param datagram The datagram to fill
+ * @return The number of frames given up, or -1 if the link has been reset
+ *	and nothing is to be sent
+ */
+int reliableQueue(struct reliableLink *link, unsigned int incarnation,
+	struct poolBuffer *frame, int sd, long now, struct timerWheel *wheel,
+	struct reliableDatagram *datagram) {
+	struct reliableSlot *slot;
+	unsigned int seq;
+	int lost = 0;
+	int rto;
+
+	pthread_mutex_lock(&link->lock);
+	if ( link->incarnation != incarnation ) {
+		pthread_mutex_unlock(&link->lock);
+		return -1;
+	}
+	while ( link->next - link->base >= RELIABLE_WINDOW ) {
+		slot = &link->slots[link->base % RELIABLE_WINDOW];
+		poolRelease(slot->frame);
+		slot->frame = NULL;
+		lost++;
+		link->abandoned++;
+		reliableAdvance(link);
+	}
+	seq = link->next++;
+	slot = &link->slots[seq % RELIABLE_WINDOW];
+	slot->frame = poolRef(frame);
+	slot->sent = now;
+	slot->rto = rto = link->rto;
+	slot->retries = 0;
+	reliableStamp(link, frame, seq, datagram);
+	pthread_mutex_unlock(&link->lock);
+
+	datagram->sd = sd;
+	wheelAdd(wheel, now + rto, link, incarnation, seq, sd, TIMER_RETRANSMIT);
+	return lost;
+}
+
+/*
+ * reliableMeasure
+ * Fold a round trip time into a link's retransmit timeout, as TCP does.
+ * Called with the link's lock held.
+ * @param link The link
+ * @param rtt The round trip time of a frame sent only once
+ */
+void reliableMeasure(struct reliableLink *link, int rtt) {
+	int delta = link->srtt - rtt;
+	int rto;
+
+	if ( link->srtt < 0 ) {
+		link->srtt = rtt;
+		link->rttvar = rtt / 2;
+	} else {
+		link->rttvar = (3 * link->rttvar + (delta < 0 ? -delta : delta)) / 4;
+		link->srtt = (7 * link->srtt + rtt) / 8;
+	}
+	rto = link->srtt + (4 * link->rttvar > WHEEL_TICK ?
+		4 * link->rttvar : WHEEL_TICK);
+	link->rto = rto < RELIABLE_RTO_MIN ? RELIABLE_RTO_MIN :
+		rto > RELIABLE_RTO_MAX ? RELIABLE_RTO_MAX : rto;
+}
+
+/*
+ * reliableAcked
+ * Drop an acknowledged frame.  Called with the link's lock held.
+ * @param link The link
+ * @param seq The frame's sequence number, within the send window
+ * @param now The current time
+ * @return 1 if the frame was outstanding, 0 otherwise
+ */
+int reliableAcked(struct reliableLink *link, unsigned int seq, long now) {
+	struct reliableSlot *slot = &link->slots[seq % RELIABLE_WINDOW];
+
+	if ( slot->frame == NULL ) {
+		return 0;
+	}
+	//A retransmitted frame's round trip cannot be told from its first
+	if ( slot->retries == 0 ) {
+		reliableMeasure(link, now - slot->sent);
+	}
+	poolRelease(slot->frame);
+	slot->frame = NULL;
+	return 1;
+}
+
+/*
+ * reliableAck
+ * Act on an acknowledgement received for a link
+ * @param link The link
+ * @param incarnation The link's incarnation the caller expects
+ * @param ack The OP_ACK message
+ * @param now The current time
+ * @return The number of frames newly acknowledged
+ */
+int reliableAck(struct reliableLink *link, unsigned int incarnation,
+	const struct messageView *ack, long now) {
+	unsigned int cumulative, seq;
+	unsigned long bits;
+	int acked = 0;
+	int i;
+
+	if ( ack->payloadLen != RELIABLE_ACK ) {
+		return 0;
+	}
+	cumulative = reliableGet(ack->payload);
+	bits = ((unsigned long)reliableGet(ack->payload + 4) << 32) |
+		reliableGet(ack->payload + 8);
+
+	pthread_mutex_lock(&link->lock);
+	if ( link->incarnation != incarnation ||
+		reliableBefore(link->next, cumulative) ) {
+		pthread_mutex_unlock(&link->lock);
+		return 0;
+	}
+	for ( seq = link->base; reliableBefore(seq, cumulative); seq++ ) {
+		acked += reliableAcked(link, seq, now);
+	}
+	for ( i = 0; i < RELIABLE_SACK; i++ ) {
+		seq = cumulative + i;
+		if ( (bits >> i & 1) && !reliableBefore(seq, link->base) &&
+			reliableBefore(seq, link->next) ) {
+			acked += reliableAcked(link, seq, now);
+		}
+	}
+	if ( acked > 0 ) {
+		link->abandoned = 0;
+	}
+	reliableAdvance(link);
+	pthread_mutex_unlock(&link->lock);
+	return acked;
+}
+
+/*
+ * reliableSkip
+ * Stop waiting for frames the sender has given up.  Called with the link's
+ * lock held.
+ * @param link The link
+ * @return The number of frames skipped
+ */
+unsigned long reliableSkip(struct reliableLink *link) {
+	unsigned long lost = 0;
+
+	while ( reliableBefore(link->expected, link->skip) &&
+		link->held[link->expected % RELIABLE_WINDOW] == NULL ) {
+		link->expected++;
+		lost++;
+	}
+	return lost;
+}
+
+/*
+ * reliableAccept
+ * Take a reliable frame received on a link.  The frame is to be delivered
+ * at once if it is the next one expected; a frame that arrives early is
+ * copied and held for reliableNext.  An acknowledgement is owed at once
+ * for an early or duplicate frame, a frame that fills a gap, a QUIT, or
+ * every RELIABLE_ACK_EVERY frames, and otherwise after RELIABLE_ACK_DELAY.
+ * @param link The link
+ * @param incarnation The link's incarnation the caller expects
+ * @param view The frame
+ * @param sd The socket to acknowledge from
+ * @param now The current time
+ * @param wheel The calling thread's timing wheel
+ * @param ack The acknowledgement to send at once; left with no vectors if
+ *	none is owed yet
+ * @param lost Incremented by the number of frames the sender gave up
+ * @return RELIABLE_DELIVER, RELIABLE_HELD, RELIABLE_DUPLICATE, or
+ *	RELIABLE_NONE if the frame was dropped
+ */
+int reliableAccept(struct reliableLink *link, unsigned int incarnation,
+	const struct messageView *view, int sd, long now,
+	struct timerWheel *wheel, struct reliableDatagram *ack,
+	unsigned long *lost) {
+	int result = RELIABLE_NONE;
+	int offset;
+	int immediate = 0;
+	int arm = 0;
+
+	ack->iovlen = 0;
+	ack->sd = sd;
+	pthread_mutex_lock(&link->lock);
+	if ( link->incarnation != incarnation ) {
+		pthread_mutex_unlock(&link->lock);
+		return RELIABLE_NONE;
+	}
+	if ( reliableBefore(link->skip, view->base) ) {
+		link->skip = view->base;
+	}
+	*lost += reliableSkip(link);
+
+	offset = (int)(view->seq - link->expected);
+	if ( offset < 0 || (offset < RELIABLE_WINDOW &&
+		link->held[view->seq % RELIABLE_WINDOW] != NULL) ) {
+		result = RELIABLE_DUPLICATE;
+		immediate = 1;
+	} else if ( offset == 0 ) {
+		link->expected++;
+		result = RELIABLE_DELIVER;
+		immediate = link->held[link->expected % RELIABLE_WINDOW] != NULL;
+	} else if ( offset < RELIABLE_WINDOW ) {
+		link->held[view->seq % RELIABLE_WINDOW] = reliableFrame(view);
+		if ( link->held[view->seq % RELIABLE_WINDOW] != NULL ) {
+			result = RELIABLE_HELD;
+			immediate = 1;
+		}
+	}
+
+	if ( result != RELIABLE_NONE ) {
+		if ( ++link->unacked >= RELIABLE_ACK_EVERY ||
+			view->opcode == OP_QUIT ) {
+			immediate = 1;
+		}
+		if ( immediate ) {
+			reliableAckFrame(link, ack);
+		} else if ( !link->ackArmed ) {
+			link->ackArmed = arm = 1;
+		}
+	}
+	pthread_mutex_unlock(&link->lock);
+
+	if ( arm ) {
+		wheelAdd(wheel, now + RELIABLE_ACK_DELAY, link, incarnation, 0, sd,
+			TIMER_ACK);
+	}
+	return result;
+}
+
+/*
+ * reliableNext
+ * Take the next held frame that is now in order
+ * @param link The link
+ * @param incarnation The link's incarnation the caller expects
+ * @param lost Incremented by the number of frames the sender gave up
+ * @return The frame, holding one reference, or NULL if there is none
+ */
+struct poolBuffer *reliableNext(struct reliableLink *link,
+	unsigned int incarnation, unsigned long *lost) {
+	struct poolBuffer *frame = NULL;
+
+	pthread_mutex_lock(&link->lock);
+	if ( link->incarnation == incarnation ) {
+		*lost += reliableSkip(link);
+		frame = link->held[link->expected % RELIABLE_WINDOW];
+		if ( frame != NULL ) {
+			link->held[link->expected % RELIABLE_WINDOW] = NULL;
+			link->expected++;
+		}
+	}
+	pthread_mutex_unlock(&link->lock);
+	return frame;
+}
+
+/*
+ * reliableRefill
+ * Add the retransmit tokens earned since the last was added.  Called with
+ * the link's lock held.
+ * @param link The link
+ * @param now The current time
+ */
+void reliableRefill(struct reliableLink *link, long now) {
+	long earned = (now - link->refilled) / RELIABLE_PACE;
+
+	if ( earned > 0 ) {
+		link->tokens = link->tokens + earned > RELIABLE_BURST ?
+			RELIABLE_BURST : link->tokens + earned;
+		link->refilled += earned * RELIABLE_PACE;
+	}
+}
+
+/*
+ * reliableExpire
+ * Act on an expired timer.  A retransmit timer whose frame is still
+ * outstanding gives the frame up, retransmits it and backs off, or waits
+ * for the link's pacing to allow a retransmit; an acknowledgement timer
+ * prepares the acknowledgement still owed.
+ * @param wheel The wheel the timer expired from
+ * @param timer The timer; it is put back on the wheel while its frame is
+ *	outstanding and freed otherwise
+ * @param now The current time
+ * @param datagram The datagram to fill for RELIABLE_RESEND or
+ *	RELIABLE_ACKNOWLEDGE
+ * @return RELIABLE_RESEND, RELIABLE_ACKNOWLEDGE, RELIABLE_LOST, or
+ *	RELIABLE_NONE if there is nothing to do
+ */
+int reliableExpire(struct timerWheel *wheel, struct reliableTimer *timer,
+	long now, struct reliableDatagram *datagram) {
+	struct reliableLink *link = timer->link;
+	struct reliableSlot *slot;
+	int result = RELIABLE_NONE;
+	int outstanding;
+	long deadline = -1;
+
+	pthread_mutex_lock(&link->lock);
+	slot = &link->slots[timer->seq % RELIABLE_WINDOW];
+	outstanding = link->incarnation == timer->incarnation &&
+		timer->kind == TIMER_RETRANSMIT &&
+		!reliableBefore(timer->seq, link->base) &&
+		reliableBefore(timer->seq, link->next) && slot->frame != NULL;
+	if ( link->incarnation == timer->incarnation &&
+		timer->kind == TIMER_ACK && link->ackArmed ) {
+		reliableAckFrame(link, datagram);
+		datagram->sd = timer->sd;
+		result = RELIABLE_ACKNOWLEDGE;
+	} else if ( !outstanding ) {
+		//The frame was acknowledged or the link reset; drop the timer
+	} else if ( slot->retries >= RELIABLE_RETRIES ) {
+		poolRelease(slot->frame);
+		slot->frame = NULL;
+		link->abandoned++;
+		reliableAdvance(link);
+		result = RELIABLE_LOST;
+	} else {
+		//Wait for a token rather than retransmit in a burst
+		if ( link->tokens == RELIABLE_BURST ) {
+			link->refilled = now;
+		}
+		reliableRefill(link, now);
+		if ( link->tokens == 0 ) {
+			deadline = link->refilled + RELIABLE_PACE;
+		} else {
+			link->tokens--;
+			slot->retries++;
+			slot->rto = 2 * slot->rto > RELIABLE_RTO_MAX ?
+				RELIABLE_RTO_MAX : 2 * slot->rto;
+			slot->sent = now;
+			reliableStamp(link, slot->frame, timer->seq, datagram);
+			datagram->sd = timer->sd;
+			deadline = now + slot->rto;
+			result = RELIABLE_RESEND;
+		}
+	}
+	pthread_mutex_unlock(&link->lock);
+
+	if ( deadline >= 0 ) {
+		wheelInsert(wheel, timer, deadline);
+	} else {
+		wheelFree(wheel, timer);
+	}
+	return result;
+}
+
+/*
+ * reliableRoom
+ * @param link The link
+ * @return Whether a frame can be sent without giving up an older one
+ */
+int reliableRoom(struct reliableLink *link) {
+	int room;
+
+	pthread_mutex_lock(&link->lock);
+	room = link->next - link->base < RELIABLE_WINDOW;
+	pthread_mutex_unlock(&link->lock);
+	return room;
+}
+
+/*
+ * reliableOutstanding
+ * @param link The link
+ * @return The number of frames sent and neither acknowledged nor given up
+ */
+int reliableOutstanding(struct reliableLink *link) {
+	int outstanding;
+
+	pthread_mutex_lock(&link->lock);
+	outstanding = link->next - link->base;
+	pthread_mutex_unlock(&link->lock);
+	return outstanding;
+}
+
+/*
+ * reliableAbandoned
+ * @param link The link
+ * @return The number of frames given up since the receiver last
+ *	acknowledged one
+ */
+unsigned int reliableAbandoned(struct reliableLink *link) {
+	unsigned int abandoned;
+
+	pthread_mutex_lock(&link->lock);
+	abandoned = link->abandoned;
+	pthread_mutex_unlock(&link->lock);
+	return abandoned;
+}
@@ -0,0 +1,401 @@
+/******************************************************************************/
+// chatResolve.h
+// Cached, asynchronous name resolution for the chat client and load
+// generator.  Names are resolved with getaddrinfo, for IPv4, IPv6 or
+// either, by a background thread, so that a caller never blocks on a
+// lookup: it is told the lookup is pending and is woken through a pipe it
+// watches when the answer arrives.  Answers are kept for RESOLVE_TTL_SEC,
+// failures for RESOLVE_NEGATIVE_SEC, and an expired answer is still given
+// out while it is looked up again.  Numeric addresses are answered at
+// once.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Resolver sizing and result values
+ */
+enum {
+	RESOLVE_ENTRIES = 64,
+	RESOLVE_ADDRESSES = 8,
+	RESOLVE_NAME = 256,
+	RESOLVE_TTL_SEC = 60,
+	RESOLVE_NEGATIVE_SEC = 5,
+	RESOLVE_READY = 0,
+	RESOLVE_PENDING = 1,
+	RESOLVE_FAILED = -1
+};
+
+/*
+ * Cache entry states
+ */
+enum {
+	ENTRY_EMPTY,
+	ENTRY_QUEUED,
+	ENTRY_RESOLVING,
+	ENTRY_READY,
+	ENTRY_FAILED
+};
+
+/*
+ * Resolver cache entry data structure
+ * @param name The name looked up
+ * @param family AF_INET, AF_INET6 or AF_UNSPEC
+ * @param state ENTRY_EMPTY through ENTRY_FAILED
+ * @param refresh Whether an answer is being looked up again while the old
+ *	one is still given out
+ * @param error The getaddrinfo error of a failed lookup
+ * @param expires When the answer expires, in milliseconds
+ * @param used When the entry was last asked for, for replacement
+ * @param count Number of addresses
+ * @param addresses The addresses, in the order getaddrinfo gave them
+ * @param lengths The length of each address
+ */
+struct resolveEntry {
+	char name[RESOLVE_NAME];
+	int family;
+	int state;
+	int refresh;
+	int error;
+	long expires;
+	long used;
+	int count;
+	struct sockaddr_storage addresses[RESOLVE_ADDRESSES];
+	socklen_t lengths[RESOLVE_ADDRESSES];
+};
+
+/*
+ * Resolver data structure
+ * @param lock Held while the cache is used
+ * @param work Signalled when a lookup is queued
+ * @param entries The cache
+ * @param notify Pipe written by the lookup thread each time a lookup
+ *	finishes; callers watch notify[0]
+ * @param started Whether the lookup thread is running
+ * @param thread The lookup thread
+ */
+struct resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct resolveEntry entries[RESOLVE_ENTRIES];
+	int notify[2];
+	int started;
+	pthread_t thread;
+};
+
+void *resolverThread(void *arg);
+
+/*
+ * resolverMillis
+ * @return A monotonic clock in milliseconds
+ */
+long resolverMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * resolverInit
+ * Initialize an empty resolver; the lookup thread starts with the first
+ * lookup that needs it
+ * @param resolver The resolver
+ * @return 0 on success, -1 if the notification pipe could not be made
+ */
+int resolverInit(struct resolver *resolver) {
+	bzero((char *)resolver, sizeof(*resolver));
+	pthread_mutex_init(&resolver->lock, NULL);
+	pthread_cond_init(&resolver->work, NULL);
+	if ( pipe(resolver->notify) < 0 ) {
+		return -1;
+	}
+	fcntl(resolver->notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(resolver->notify[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * resolverAnswer
+ * Copy an entry's first address of a family, with a port, to the caller.
+ * Called with the resolver lock held.
+ * @param entry A ready entry
+ * @param family The family wanted, or AF_UNSPEC for the first address
+ * @param port The port, in host order
+ * @param address Set to the address
+ * @param length Set to the length of the address
+ * @return RESOLVE_READY, or RESOLVE_FAILED if no address is of the family
+ */
+int resolverAnswer(const struct resolveEntry *entry, int family, int port,
+	struct sockaddr_storage *address, socklen_t *length) {
+	int i;
+
+	for ( i = 0; i < entry->count; i++ ) {
+		if ( family != AF_UNSPEC &&
+			entry->addresses[i].ss_family != family ) {
+			continue;
+		}
+		memcpy(address, &entry->addresses[i], entry->lengths[i]);
+		*length = entry->lengths[i];
+		if ( address->ss_family == AF_INET ) {
+			((struct sockaddr_in *)address)->sin_port = htons(port);
+		} else {
+			((struct sockaddr_in6 *)address)->sin6_port = htons(port);
+		}
+		return RESOLVE_READY;
+	}
+	return RESOLVE_FAILED;
+}
+
+/*
+ * resolverStore
+ * Fill an entry from a getaddrinfo answer.  Called with the resolver lock
+ * held.
+ * @param entry The entry
+ * @param error The getaddrinfo result
+ * @param found The addresses found, if error is 0
+ * @param now The current time in milliseconds
+ */
+void resolverStore(struct resolveEntry *entry, int error,
+	const struct addrinfo *found, long now) {
+	const struct addrinfo *ai;
+
+	entry->refresh = 0;
+	entry->error = error;
+	if ( error != 0 ) {
+		//A failed refresh keeps the answer it was refreshing
+		if ( entry->state == ENTRY_READY ) {
+			entry->expires = now + RESOLVE_NEGATIVE_SEC * 1000L;
+			return;
+		}
+		entry->state = ENTRY_FAILED;
+		entry->expires = now + RESOLVE_NEGATIVE_SEC * 1000L;
+		return;
+	}
+	entry->count = 0;
+	for ( ai = found; ai != NULL && entry->count < RESOLVE_ADDRESSES;
+		ai = ai->ai_next ) {
+		if ( ai->ai_addrlen > sizeof(entry->addresses[0]) ) {
+			continue;
+		}
+		memcpy(&entry->addresses[entry->count], ai->ai_addr,
+			ai->ai_addrlen);
+		entry->lengths[entry->count++] = ai->ai_addrlen;
+	}
+	entry->state = entry->count > 0 ? ENTRY_READY : ENTRY_FAILED;
+	entry->expires = now + (entry->count > 0 ? RESOLVE_TTL_SEC :
+		RESOLVE_NEGATIVE_SEC) * 1000L;
+}
+
+/*
+ * resolverEntry
+ * Find the cache entry for a name and family, taking the least recently
+ * used entry not being looked up for a name not cached.  Called with the
+ * resolver lock held.
+ * @param resolver The resolver
+ * @param name The name
+ * @param family The family
+ * @return The entry, or NULL if every entry is being looked up
+ */
+struct resolveEntry *resolverEntry(struct resolver *resolver,
+	const char *name, int family) {
+	struct resolveEntry *entry;
+	struct resolveEntry *oldest = NULL;
+	int i;
+
+	for ( i = 0; i < RESOLVE_ENTRIES; i++ ) {
+		entry = &resolver->entries[i];
+		if ( entry->state != ENTRY_EMPTY && entry->family == family &&
+			strcmp(entry->name, name) == 0 ) {
+			return entry;
+		}
+		if ( entry->state != ENTRY_QUEUED &&
+			entry->state != ENTRY_RESOLVING && !entry->refresh &&
+			(oldest == NULL || entry->used < oldest->used) ) {
+			oldest = entry;
+		}
+	}
+	if ( oldest != NULL ) {
+		bzero((char *)oldest, sizeof(*oldest));
+		strcpy(oldest->name, name);
+		oldest->family = family;
+	}
+	return oldest;
+}
+
+/*
+ * resolverLookup
+ * Look a name up without blocking.  A numeric address is answered at
+ * once; any other name is answered from the cache, or queued for the
+ * lookup thread, which writes to notify[1] when it is done.
+ * @param resolver The resolver
+ * @param name The host name or numeric address
+ * @param family AF_INET, AF_INET6 or AF_UNSPEC
+ * @param port The port to give the address, in host order
+ * @param address Set to the address when the lookup is ready
+ * @param length Set to the length of the address when the lookup is ready
+ * @return RESOLVE_READY, RESOLVE_PENDING, or RESOLVE_FAILED if the name
+ *	has no address of the family or could not be queued
+ */
+int resolverLookup(struct resolver *resolver, const char *name, int family,
+	int port, struct sockaddr_storage *address, socklen_t *length) {
+	struct resolveEntry *entry;
+	struct resolveEntry numeric;
+	struct addrinfo hints;
+	struct addrinfo *found;
+	long now = resolverMillis();
+	int result = RESOLVE_PENDING;
+
+	if ( strlen(name) >= RESOLVE_NAME ) {
+		return RESOLVE_FAILED;
+	}
+
+	//Numeric addresses need no lookup and are not cached
+	bzero((char *)&hints, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if ( getaddrinfo(name, NULL, &hints, &found) == 0 ) {
+		bzero((char *)&numeric, sizeof(numeric));
+		resolverStore(&numeric, 0, found, now);
+		freeaddrinfo(found);
+		return resolverAnswer(&numeric, family, port, address, length);
+	}
+
+	pthread_mutex_lock(&resolver->lock);
+	entry = resolverEntry(resolver, name, family);
+	if ( entry == NULL ) {
+		pthread_mutex_unlock(&resolver->lock);
+		return RESOLVE_FAILED;
+	}
+	entry->used = now;
+
+	//An expired answer is given out while it is looked up again
+	if ( entry->state == ENTRY_READY ) {
+		result = resolverAnswer(entry, family, port, address, length);
+		if ( now >= entry->expires && !entry->refresh ) {
+			entry->refresh = 1;
+		}
+	} else if ( entry->state == ENTRY_FAILED ) {
+		result = RESOLVE_FAILED;
+		if ( now >= entry->expires ) {
+			entry->state = ENTRY_QUEUED;
+			result = RESOLVE_PENDING;
+		}
+	} else if ( entry->state == ENTRY_EMPTY ) {
+		entry->state = ENTRY_QUEUED;
+	}
+	if ( (entry->state == ENTRY_QUEUED || entry->refresh) &&
+		!resolver->started ) {
+		if ( pthread_create(&resolver->thread, NULL, resolverThread,
+			resolver) != 0 ) {
+			entry->state = ENTRY_FAILED;
+			entry->refresh = 0;
+			pthread_mutex_unlock(&resolver->lock);
+			return RESOLVE_FAILED;
+		}
+		pthread_detach(resolver->thread);
+		resolver->started = 1;
+	}
+	pthread_cond_signal(&resolver->work);
+	pthread_mutex_unlock(&resolver->lock);
+	return result;
+}
+
+/*
+ * resolverDrain
+ * Empty the notification pipe once its reader has woken
+ * @param resolver The resolver
+ */
+void resolverDrain(struct resolver *resolver) {
+	char discard[64];
+	while ( read(resolver->notify[0], discard, sizeof(discard)) > 0 ) {
+	}
+}
+
+/*
+ * resolverWait
+ * Look a name up, waiting for the lookup thread if need be; for callers
+ * with nothing else to do until the name is known
+ * @param resolver The resolver
+ * @param name The host name or numeric address
+ * @param family AF_INET, AF_INET6 or AF_UNSPEC
+ * @param port The port to give the address, in host order
+ * @param address Set to the address
+ * @param length Set to the length of the address
+ * @return RESOLVE_READY or RESOLVE_FAILED
+ */
+int resolverWait(struct resolver *resolver, const char *name, int family,
+	int port, struct sockaddr_storage *address, socklen_t *length) {
+	struct pollfd ready;
+	int result;
+
+	ready.fd = resolver->notify[0];
+	ready.events = POLLIN;
+	while ( (result = resolverLookup(resolver, name, family, port, address,
+		length)) == RESOLVE_PENDING ) {
+		poll(&ready, 1, -1);
+		resolverDrain(resolver);
+	}
+	return result;
+}
+
+/*
+ * resolverThread
+ * Look up queued names, and answers due to be refreshed, one at a time
+ * for as long as the process runs
+ * @param arg The resolver
+ * @return Never returns
+ */
+void *resolverThread(void *arg) {
+	struct resolver *resolver = arg;
+	struct resolveEntry *entry;
+	struct addrinfo hints;
+	struct addrinfo *found;
+	char name[RESOLVE_NAME];
+	int error;
+	int i;
+
+	pthread_mutex_lock(&resolver->lock);
+	while ( 1 ) {
+		entry = NULL;
+		for ( i = 0; i < RESOLVE_ENTRIES && entry == NULL; i++ ) {
+			if ( resolver->entries[i].state == ENTRY_QUEUED ||
+				(resolver->entries[i].refresh &&
+				resolver->entries[i].state == ENTRY_READY) ) {
+				entry = &resolver->entries[i];
+			}
+		}
+		if ( entry == NULL ) {
+			pthread_cond_wait(&resolver->work, &resolver->lock);
+			continue;
+		}
+
+		//The lookup is made without the lock; the entry cannot be
+		// replaced while it is resolving or refreshing
+		if ( entry->state == ENTRY_QUEUED ) {
+			entry->state = ENTRY_RESOLVING;
+		}
+		entry->refresh = 1;
+		strcpy(name, entry->name);
+		bzero((char *)&hints, sizeof(hints));
+		hints.ai_family = entry->family;
+		hints.ai_socktype = SOCK_DGRAM;
+		pthread_mutex_unlock(&resolver->lock);
+
+		found = NULL;
+		error = getaddrinfo(name, NULL, &hints, &found);
+
+		pthread_mutex_lock(&resolver->lock);
+		if ( entry->state == ENTRY_RESOLVING ) {
+			entry->state = ENTRY_EMPTY;
+		}
+		resolverStore(entry, error, found, resolverMillis());
+		if ( found != NULL ) {
+			freeaddrinfo(found);
+		}
+		if ( write(resolver->notify[1], "", 1) < 0 ) {
+			//A full pipe already wakes its reader
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,312 @@
+/******************************************************************************/
+// chatRoom.h
+// Chat rooms for the chat server.  Every registered client is in exactly
+// one room, the lobby until it enters another, and the text it sends goes
+// only to the clients in the same room.  Each room keeps a dense member
+// array, indexed by the room's name, so that a message costs its own room's
+// size rather than the whole table's.
+//
+// Rooms change under the client table's lock and are read like the table:
+// through immutable member snapshots, republished whenever the table's
+// version has moved on and reclaimed in the table's epochs.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Room sizing values.  ROOM_ALL is not a room; it asks for every
+ * registered client.
+ */
+enum {
+	ROOM_LOBBY = 0,
+	ROOM_ALL = -1,
+	MAX_ROOMS = 1 << 16,
+	MAX_ROOM_NAME = 32,
+	ROOM_BUCKETS = 1024,
+	INITIAL_ROOM_MEMBERS = 4
+};
+
+/*
+ * Room data structure
+ * @param name The room's name; empty for the lobby
+ * @param nameLen The length of the name
+ * @param members Dense array of the connection ids of the room's clients
+ * @param count Number of clients in the room
+ * @param capacity Size of the member array
+ * @param snapshot The most recently published member snapshot
+ * @param next Next room in the same name hash bucket while open; next room
+ *	on the free list while closed
+ */
+struct chatRoom {
+	char name[MAX_ROOM_NAME+1];
+	int nameLen;
+	int *members;
+	int count;
+	int capacity;
+	struct memberSnapshot *_Atomic snapshot;
+	int next;
+};
+
+/*
+ * Room index data structure
+ * @param rooms Rooms by number; a room is never freed once opened, so a
+ *	reader may keep a room number without the lock
+ * @param opened Number of rooms ever opened
+ * @param freeHead First closed room, or -1 if none
+ * @param buckets Name hash bucket heads, -1 when empty
+ * @param roomOf The room each connection id is in, readable without the
+ *	lock
+ */
+struct roomIndex {
+	struct chatRoom **rooms;
+	int opened;
+	int freeHead;
+	int buckets[ROOM_BUCKETS];
+	atomic_int *roomOf;
+};
+
+/*
+ * roomHash
+ * @param name A room name
+ * @param nameLen The length of the name
+ * @return The bucket for the name
+ */
+int roomHash(const char *name, int nameLen) {
+	unsigned int h = 2166136261u;
+	int i;
+
+	for ( i = 0; i < nameLen; i++ ) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return (int)(h & (ROOM_BUCKETS - 1));
+}
+
+/*
+ * roomIndexInit
+ * Initialize a room index holding only the lobby
+ * @param index The room index
+ */
+void roomIndexInit(struct roomIndex *index) {
+	struct chatRoom *lobby;
+	int i;
+
+	index->rooms = calloc(MAX_ROOMS, sizeof(*index->rooms));
+	index->roomOf = calloc(MAX_CLIENTS + 1, sizeof(*index->roomOf));
+	lobby = calloc(1, sizeof(*lobby));
+	if ( index->rooms == NULL || index->roomOf == NULL || lobby == NULL ) {
+		perror("Could not allocate room index");
+		exit(1);
+	}
+	for ( i = 0; i < ROOM_BUCKETS; i++ ) {
+		index->buckets[i] = -1;
+	}
+	atomic_init(&lobby->snapshot, calloc(1, sizeof(struct memberSnapshot)));
+	if ( atomic_load(&lobby->snapshot) == NULL ) {
+		perror("Could not allocate room index");
+		exit(1);
+	}
+	lobby->next = -1;
+	index->rooms[ROOM_LOBBY] = lobby;
+	index->opened = 1;
+	index->freeHead = -1;
+}
+
+/*
+ * roomFind
+ * Find an open room by name.  Called with the table lock held.
+ * @param index The room index
+ * @param name The room's name
+ * @param nameLen The length of the name
+ * @return The room number, or -1 if no such room is open
+ */
+int roomFind(struct roomIndex *index, const char *name, int nameLen) {
+	int room = index->buckets[roomHash(name, nameLen)];
+
+	while ( room >= 0 ) {
+		if ( index->rooms[room]->nameLen == nameLen &&
+			memcmp(index->rooms[room]->name, name, nameLen) == 0 ) {
+			return room;
+		}
+		room = index->rooms[room]->next;
+	}
+	return -1;
+}
+
+/*
+ * roomOpen
+ * Find a room by name, opening it if it is not open.  Called with the table
+ * lock held.
+ * @param index The room index
+ * @param name The room's name
+ * @param nameLen The length of the name
+ * @return The room number, or -1 if the name is empty or too long or
+ *	MAX_ROOMS rooms are open
+ */
+int roomOpen(struct roomIndex *index, const char *name, int nameLen) {
+	struct chatRoom *entry;
+	int room, b;
+
+	if ( nameLen < 1 || nameLen > MAX_ROOM_NAME ) {
+		return -1;
+	}
+	room = roomFind(index, name, nameLen);
+	if ( room >= 0 ) {
+		return room;
+	}
+
+	//Reuse a closed room, keeping its member array and snapshot, or
+	// open a new one
+	if ( index->freeHead >= 0 ) {
+		room = index->freeHead;
+		entry = index->rooms[room];
+		index->freeHead = entry->next;
+	} else {
+		if ( index->opened == MAX_ROOMS ||
+			(entry = calloc(1, sizeof(*entry))) == NULL ) {
+			return -1;
+		}
+		atomic_init(&entry->snapshot,
+			calloc(1, sizeof(struct memberSnapshot)));
+		if ( atomic_load(&entry->snapshot) == NULL ) {
+			free(entry);
+			return -1;
+		}
+		room = index->opened++;
+		index->rooms[room] = entry;
+	}
+	memcpy(entry->name, name, nameLen);
+	entry->name[nameLen] = '\0';
+	entry->nameLen = nameLen;
+	b = roomHash(name, nameLen);
+	entry->next = index->buckets[b];
+	index->buckets[b] = room;
+	return room;
+}
+
+/*
+ * roomDrop
+ * Take a client out of the room it is in, closing the room if that leaves
+ * it empty.  Called with the table lock held.
+ * @param index The room index
+ * @param table The client table
+ * @param cid The client's connection id
+ */
+void roomDrop(struct roomIndex *index, struct clientTable *table, int cid) {
+	struct clientEntry *entry = &table->entries[cid];
+	int room = atomic_load(&index->roomOf[cid]);
+	struct chatRoom *from = index->rooms[room];
+	int *link;
+	int last;
+
+	if ( entry->roomMember < 0 ) {
+		return;
+	}
+
+	//Move the last member into the vacated member position
+	last = from->members[--from->count];
+	from->members[entry->roomMember] = last;
+	table->entries[last].roomMember = entry->roomMember;
+	entry->roomMember = -1;
+	atomic_fetch_add(&table->version, 1);
+
+	//A closed room keeps its number; a message racing with the close may
+	// still reach whoever opens it next
+	if ( from->count == 0 && room != ROOM_LOBBY ) {
+		link = &index->buckets[roomHash(from->name, from->nameLen)];
+		while ( *link != room ) {
+			link = &index->rooms[*link]->next;
+		}
+		*link = from->next;
+		from->nameLen = 0;
+		from->next = index->freeHead;
+		index->freeHead = room;
+	}
+}
+
+/*
+ * roomMove
+ * Move a connected client into a room, out of the room it was in.  Called
+ * with the table lock held.
+ * @param index The room index
+ * @param table The client table
+ * @param cid The client's connection id
+ * @param room The room number
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int roomMove(struct roomIndex *index, struct clientTable *table, int cid,
+	int room) {
+	struct clientEntry *entry = &table->entries[cid];
+	struct chatRoom *to = index->rooms[room];
+	int *members;
+	int capacity;
+
+	if ( entry->roomMember >= 0 &&
+		atomic_load(&index->roomOf[cid]) == room ) {
+		return 0;
+	}
+	if ( to->count == to->capacity ) {
+		capacity = to->capacity == 0 ?
+			INITIAL_ROOM_MEMBERS : 2 * to->capacity;
+		members = realloc(to->members, sizeof(int) * capacity);
+		if ( members == NULL ) {
+			return -1;
+		}
+		to->members = members;
+		to->capacity = capacity;
+	}
+	roomDrop(index, table, cid);
+
+	entry->roomMember = to->count;
+	to->members[to->count++] = cid;
+	atomic_store(&index->roomOf[cid], room);
+	atomic_fetch_add(&table->version, 1);
+	return 0;
+}
+
+/*
+ * roomOf
+ * @param index The room index
+ * @param cid A connection id
+ * @return The room the client is in, or the lobby for an id out of range;
+ *	read without the lock, so only as current as the caller's message
+ */
+int roomOf(struct roomIndex *index, int cid) {
+	if ( cid <= JOIN_CID_CODE || cid > MAX_CLIENTS ) {
+		return ROOM_LOBBY;
+	}
+	return atomic_load_explicit(&index->roomOf[cid], memory_order_relaxed);
+}
+
+/*
+ * roomReadLock
+ * Enter a snapshot read section for one room, publishing a fresh snapshot
+ * of the room first as clientTableReadLock does for the whole table
+ * @param index The room index
+ * @param table The client table
+ * @param room The room number
+ * @param reader The calling thread's reader slot
+ * @return The room's member snapshot, valid until clientTableReadUnlock
+ */
+struct memberSnapshot *roomReadLock(struct roomIndex *index,
+	struct clientTable *table, int room, int reader) {
+	struct chatRoom *entry = index->rooms[room];
+	struct memberSnapshot *snap = clientTablePin(table, reader,
+		&entry->snapshot);
+
+	//Pinned before it is looked at, as in clientTableReadLock
+	if ( snap->version != atomic_load(&table->version) &&
+		pthread_mutex_trylock(&table->lock) == 0 ) {
+		snap = atomic_load(&entry->snapshot);
+		if ( snap->version != atomic_load(&table->version) ) {
+			snap = clientTableSnapshot(table, entry->members,
+				entry->count);
+			if ( snap != NULL ) {
+				clientTableRetire(table,
+					atomic_exchange(&entry->snapshot, snap));
+			}
+		}
+		pthread_mutex_unlock(&table->lock);
+		snap = atomic_load(&entry->snapshot);
+	}
+	return snap;
+}
@@ -0,0 +1,281 @@
+/******************************************************************************/
+// chatRoster.h
+// Membership roster for the chat server: a file, mapped into memory, with
+// a slot for each connection id holding the registered client's address,
+// hostname, protocol and room.  A slot is rewritten whenever its client
+// joins, quits or changes rooms, so the file is always current, and a
+// restarted server reads it back to take up its clients where it left off.
+//
+// Each slot carries a write version, odd while the slot is being written,
+// and a checksum of its contents.  A slot that was half written when the
+// server stopped fails one or the other and is rejected on reading, as is
+// a file whose header does not match this layout.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Roster file values
+ */
+enum {
+	ROSTER_MAGIC = 0x43485231,
+	ROSTER_LAYOUT = 1,
+	ROSTER_INITIAL = 1024
+};
+
+/*
+ * Roster file header data structure, at the start of the file
+ * @param magic ROSTER_MAGIC
+ * @param layout ROSTER_LAYOUT
+ * @param slotSize The size of a slot
+ * @param slots Number of slots following the header
+ */
+struct rosterHeader {
+	unsigned int magic;
+	unsigned int layout;
+	unsigned int slotSize;
+	unsigned int slots;
+};
+
+/*
+ * Roster slot data structure; slot cid holds connection id cid
+ * @param version Incremented before and after each write, so odd while
+ *	the slot is being written
+ * @param checksum Checksum of the rest of the slot
+ * @param serial The client's registration serial, or 0 if the slot is
+ *	unused
+ * @param addr The client's IPv4 address, in network order
+ * @param port The client's port, in network order
+ * @param protocol The client's wire protocol
+ * @param batched Whether the client unpacks OP_BATCH frames
+ * @param hostnameLen The length of the hostname
+ * @param roomLen The length of the name of the client's room
+ * @param hostname The client's hostname
+ * @param room The name of the client's room; empty for the lobby
+ */
+struct rosterSlot {
+	unsigned int version;
+	unsigned int checksum;
+	unsigned int serial;
+	unsigned int addr;
+	unsigned short port;
+	unsigned char protocol;
+	unsigned char batched;
+	unsigned char hostnameLen;
+	unsigned char roomLen;
+	char hostname[MAX_LINE];
+	char room[MAX_ROOM_NAME];
+};
+
+/*
+ * Roster data structure
+ * @param fd The roster file, or -1 if there is none
+ * @param map The file's mapping
+ * @param slots Number of slots the file holds
+ */
+struct roster {
+	int fd;
+	char *map;
+	unsigned int slots;
+};
+
+/*
+ * rosterChecksum
+ * @param slot A roster slot
+ * @return The checksum of everything in the slot after its checksum
+ */
+unsigned int rosterChecksum(const struct rosterSlot *slot) {
+	const unsigned char *p = (const unsigned char *)&slot->serial;
+	const unsigned char *end = (const unsigned char *)(slot + 1);
+	unsigned int h = 2166136261u;
+
+	while ( p < end ) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * rosterSize
+ * @param slots A number of slots
+ * @return The size of a roster file holding that many slots
+ */
+unsigned long rosterSize(unsigned int slots) {
+	return sizeof(struct rosterHeader) +
+		(unsigned long)slots * sizeof(struct rosterSlot);
+}
+
+/*
+ * rosterSlotAt
+ * @param roster The roster
+ * @param cid A connection id less than the roster's slots
+ * @return The connection id's slot
+ */
+struct rosterSlot *rosterSlotAt(struct roster *roster, int cid) {
+	return (struct rosterSlot *)(roster->map + rosterSize(cid));
+}
+
+/*
+ * rosterInit
+ * Open and map a roster file, starting it afresh if it is new or was not
+ * written in this layout
+ * @param roster The roster
+ * @param path The roster file
+ * @return 1 if the file held a roster to read back, 0 if it was started
+ *	afresh
+ */
+int rosterInit(struct roster *roster, const char *path) {
+	struct rosterHeader *header;
+	struct stat st;
+	int valid;
+
+	roster->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if ( roster->fd < 0 || fstat(roster->fd, &st) < 0 ) {
+		perror("Could not open roster file");
+		exit(1);
+	}
+
+	//The header is checked through a read, since a short file cannot be
+	// mapped for its full declared size
+	roster->slots = 0;
+	valid = st.st_size >= (off_t)sizeof(*header);
+	if ( valid ) {
+		roster->map = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED,
+			roster->fd, 0);
+		if ( roster->map == MAP_FAILED ) {
+			perror("Could not map roster file");
+			exit(1);
+		}
+		header = (struct rosterHeader *)roster->map;
+		valid = header->magic == ROSTER_MAGIC &&
+			header->layout == ROSTER_LAYOUT &&
+			header->slotSize == sizeof(struct rosterSlot) &&
+			header->slots > 0 && header->slots <= MAX_CLIENTS + 1 &&
+			(unsigned long)st.st_size >= rosterSize(header->slots);
+		if ( valid ) {
+			roster->slots = header->slots;
+		}
+		munmap(roster->map, sizeof(*header));
+	}
+	if ( !valid ) {
+		if ( st.st_size > 0 ) {
+			fprintf(stderr, "Rejected roster file %s\n", path);
+		}
+		roster->slots = ROSTER_INITIAL;
+		if ( ftruncate(roster->fd, 0) < 0 ||
+			ftruncate(roster->fd, rosterSize(roster->slots)) < 0 ) {
+			perror("Could not size roster file");
+			exit(1);
+		}
+	}
+
+	roster->map = mmap(NULL, rosterSize(roster->slots),
+		PROT_READ | PROT_WRITE, MAP_SHARED, roster->fd, 0);
+	if ( roster->map == MAP_FAILED ) {
+		perror("Could not map roster file");
+		exit(1);
+	}
+
+	//The header of a new file is written last, so that a file cut short
+	// while it was being started is rejected again
+	if ( !valid ) {
+		header = (struct rosterHeader *)roster->map;
+		header->layout = ROSTER_LAYOUT;
+		header->slotSize = sizeof(struct rosterSlot);
+		header->slots = roster->slots;
+		atomic_thread_fence(memory_order_release);
+		header->magic = ROSTER_MAGIC;
+	}
+	return valid;
+}
+
+/*
+ * rosterGrow
+ * Grow the roster file and its mapping to hold a connection id
+ * @param roster The roster
+ * @param cid The connection id
+ * @return 0 on success, -1 if the file could not be grown
+ */
+int rosterGrow(struct roster *roster, int cid) {
+	unsigned int slots = roster->slots;
+	char *map;
+
+	while ( slots <= (unsigned int)cid ) {
+		slots *= 2;
+	}
+	if ( ftruncate(roster->fd, rosterSize(slots)) < 0 ||
+		(map = mremap(roster->map, rosterSize(roster->slots),
+		rosterSize(slots), MREMAP_MAYMOVE)) == MAP_FAILED ) {
+		return -1;
+	}
+	roster->map = map;
+	roster->slots = slots;
+	((struct rosterHeader *)roster->map)->slots = slots;
+	return 0;
+}
+
+/*
+ * rosterWrite
+ * Rewrite a connection id's slot.  Called with the client table lock held.
+ * @param roster The roster
+ * @param cid The connection id
+ * @param entry The client's entry, or NULL to mark the slot unused
+ * @param room The name of the client's room
+ * @param roomLen The length of the room's name
+ */
+void rosterWrite(struct roster *roster, int cid,
+	const struct clientEntry *entry, const char *room, int roomLen) {
+	struct rosterSlot *slot;
+	unsigned int version;
+
+	if ( roster->fd < 0 ||
+		((unsigned int)cid >= roster->slots && (entry == NULL ||
+		rosterGrow(roster, cid) < 0)) ) {
+		return;
+	}
+	slot = rosterSlotAt(roster, cid);
+
+	//The version is odd until the slot is whole again
+	version = slot->version | 1;
+	slot->version = version;
+	atomic_thread_fence(memory_order_release);
+	bzero((char *)&slot->serial, sizeof(*slot) -
+		offsetof(struct rosterSlot, serial));
+	if ( entry != NULL ) {
+		slot->serial = entry->serial;
+		slot->addr = entry->info.address.sin_addr.s_addr;
+		slot->port = entry->info.address.sin_port;
+		slot->protocol = entry->info.protocol;
+		slot->batched = entry->info.batched;
+		slot->hostnameLen = entry->info.hostnameLen;
+		memcpy(slot->hostname, entry->info.hostname, slot->hostnameLen);
+		slot->roomLen = roomLen;
+		memcpy(slot->room, room, roomLen);
+	}
+	slot->checksum = rosterChecksum(slot);
+	atomic_thread_fence(memory_order_release);
+	slot->version = version + 1;
+}
+
+/*
+ * rosterRead
+ * Read back a connection id's slot
+ * @param roster The roster
+ * @param cid The connection id
+ * @param copy Set to the slot's contents
+ * @return 1 if the slot holds a client, 0 if it is unused, or -1 if it was
+ *	half written or does not hold a well-formed client
+ */
+int rosterRead(struct roster *roster, int cid, struct rosterSlot *copy) {
+	*copy = *rosterSlotAt(roster, cid);
+	if ( copy->version == 0 || (copy->serial == 0 &&
+		(copy->version & 1) == 0 && copy->checksum == rosterChecksum(copy)) ) {
+		return 0;
+	}
+	if ( (copy->version & 1) != 0 || copy->checksum != rosterChecksum(copy) ||
+		copy->hostnameLen == 0 || copy->hostnameLen >= MAX_LINE ||
+		copy->roomLen > MAX_ROOM_NAME ) {
+		return -1;
+	}
+	return 1;
+}
@@ -5,25 +5,377 @@
 // @date 2015-11-11
 /******************************************************************************/
 
+//sendmmsg and recvmmsg are GNU extensions
+#define _GNU_SOURCE
+
 //include system, network, and io libraries
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
 //include chat library
 #include "chatUtil.h"
+#include "chatPool.h"
+#include "chatReliable.h"
+#include "chatQueue.h"
+#include "chatTable.h"
+#include "chatRoom.h"
+#include "chatHistory.h"
+#include "chatRoster.h"
+#include "chatMetrics.h"
+#include "chatLimit.h"
+#include "chatRelay.h"
+#include "chatLog.h"
+
+//define a global table of registered clients, the rooms they are in, what
+// has been said in them, the file they are saved in, and the peered servers
+// they are relayed to
+struct clientTable clientRegister;
+struct roomIndex chatRooms;
+struct historyStore chatHistory;
+struct roster chatRoster = { -1, NULL, 0 };
+struct relayState chatRelay;
+
+//Batched sends and receives are used where the platform provides sendmmsg
+// and recvmmsg; define NO_MMSG to force one system call per datagram.
+#if defined(__linux__) && !defined(NO_MMSG)
+#define HAVE_MMSG 1
+#endif
+
+//The io_uring engine is built where the kernel headers describe it; define
+// NO_URING to leave it out.
+#if defined(__linux__) && !defined(NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include "chatUring.h"
+#endif
+#endif
+
+/*
+ * Server configuration values
+ */
+enum {
+	SEND_BATCH = 64,
+	DEFAULT_RECV_BATCH = 32,
+	MAX_RECV_BATCH = 1024,
+	MAX_THREADS = 64,
+	TOUCH_CACHE = 1024,
+	TOUCH_INTERVAL = 1000,
+	EVICT_BATCH = 64,
+	BATCH_SLOTS = 16,
+	MAX_BATCH_WINDOW = 1000000,
+	SEND_ALL = 0,
+	SEND_UNBATCHED = 1,
+	SEND_BATCHED = 2,
+	CATCHUP_MAX = 64,
+	CATCHUP_PACE = 4,
+	HISTORY_FRAME = HISTORY_RECORD
+};
+
+/*
+ * Server options data structure
+ * @param recvBatch Maximum datagrams read per receive system call
+ * @param threads Number of worker threads, each with its own socket
+ * @param metricsPort Local UDP port answering metrics queries, or 0 to keep
+ *	no latency metrics
+ * @param uring Whether workers use the io_uring engine
+ * @param reliable Whether clients may ask for reliable delivery
+ * @param queueDepth Most datagrams queued for one client, and most reliable
+ *	frames a client may let the server give up before it is evicted
+ * @param queuePolicy QUEUE_DROP or QUEUE_COALESCE
+ * @param idleTimeout Seconds a client may stay silent before it is
+ *	evicted, or 0 to never evict silent clients
+ * @param batchWindow Microseconds a room's text may wait to share one
+ *	OP_BATCH frame, or 0 to send every message on its own
+ * @param historyDepth Messages of history kept per room, or 0 to keep none
+ * @param historyFile File the history is appended to, or NULL
+ * @param rosterFile File the registered clients are saved in, or NULL
+ * @param sourceRate Datagrams per second each source address may send, or
+ *	0 to not limit sources
+ * @param joinRate JOINs per second the server admits, or 0 to admit every
+ *	JOIN
+ * @param origin This server's origin id among its peers, or 0 if not given
+ * @param diameter Most links between peers a relayed message crosses
+ * @param peerCount Number of peers
+ * @param peers Each peer, as host:port
+ */
+struct serverOptions {
+	int recvBatch;
+	int threads;
+	int metricsPort;
+	int uring;
+	int reliable;
+	int queueDepth;
+	int queuePolicy;
+	int idleTimeout;
+	int batchWindow;
+	int historyDepth;
+	const char *historyFile;
+	const char *rosterFile;
+	int sourceRate;
+	int joinRate;
+	int origin;
+	int diameter;
+	int peerCount;
+	const char *peers[RELAY_MAX_PEERS];
+};
+
+/*
+ * Receive batch data structure
+ * @param size Maximum datagrams per receive
+ * @param buffers Pooled message buffers, one per datagram; each buffer's
+ *	length is the length of the datagram received into it
+ * @param addresses Source address of each datagram
+ * @param parsed Parsed message of each datagram, pointing into its buffer
+ * @param protocols Wire protocol each datagram was sent in
+ * @param valid Whether each datagram arrived whole and well formed
+ * @param arrivals When each datagram reached the socket
+ * @param msgs recvmmsg headers
+ * @param iovs recvmmsg buffer vectors
+ * @param controls Ancillary data carrying the socket drop counter and
+ *	arrival time
+ */
+struct receiveBatch {
+	int size;
+	struct poolBuffer **buffers;
+	struct sockaddr_in *addresses;
+	struct messageView *parsed;
+	int *protocols;
+	int *valid;
+	struct timespec *arrivals;
+#ifdef HAVE_MMSG
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	char (*controls)[CMSG_SPACE(sizeof(unsigned int)) +
+		CMSG_SPACE(sizeof(struct timespec))];
+#endif
+};
+
+/*
+ * Wire formats data structure; one message laid out for sendmsg in each
+ * wire protocol
+ * @param iov Vectors for each protocol
+ * @param iovlen Number of vectors used by each protocol
+ * @param scratch Text client id or frame header for each protocol
+ * @param sending SEND_ALL, or SEND_UNBATCHED or SEND_BATCHED to send only
+ *	to the clients that do not, or do, unpack OP_BATCH frames
+ */
+struct wireFormats {
+	struct iovec iov[PROTOCOL_VERSION+1][GATHER_IOV];
+	int iovlen[PROTOCOL_VERSION+1];
+	char scratch[PROTOCOL_VERSION+1][GATHER_SCRATCH];
+	int sending;
+};
+
+/*
+ * Room batch data structure; text for one room waiting to go out as one
+ * OP_BATCH frame to the room's clients that unpack them
+ * @param room The room, or -1 while the batch is not in use
+ * @param count Number of messages in the batch
+ * @param due When the batch must be sent, in microseconds
+ * @param length Bytes of the frame filled, its header included
+ * @param data The OP_BATCH frame
+ */
+struct roomBatch {
+	int room;
+	int count;
+	long due;
+	int length;
+	char data[POOL_BUFFER_SIZE];
+};
+
+/*
+ * Catch-up data structure; a room's history on its way to a client
+ * @param cid The client
+ * @param serial The client's registration serial
+ * @param room The room
+ * @param next Sequence number of the next message to send
+ * @param end Sequence number to stop before, the room's next when the
+ *	client asked
+ */
+struct catchUp {
+	int cid;
+	unsigned int serial;
+	int room;
+	unsigned int next;
+	unsigned int end;
+};
+
+#ifdef HAVE_URING
+/*
+ * io_uring engine sizing values.  Received datagrams are handled a batch at
+ * a time; each batch's sends are queued in one generation and its receive
+ * buffers go back to the kernel when the last of those sends completes.
+ * Sends of several generations can be in flight at once.
+ */
+enum {
+	URING_ENTRIES = 4096,
+	URING_BUFFERS = 1024,
+	URING_BUFFER_SIZE = 2048,
+	URING_GENERATIONS = 4,
+	URING_CHUNK = 64 * 1024,
+	URING_RECV = 0,
+	URING_TIMER = URING_GENERATIONS + 1
+};
+
+/*
+ * io_uring send data structure; one queued datagram
+ * @param msg The sendmsg header
+ * @param address The recipient, copied from the member snapshot
+ */
+struct uringSend {
+	struct msghdr msg;
+	struct sockaddr_in address;
+};
+
+/*
+ * io_uring arena chunk data structure
+ * @param next Next chunk of the generation
+ * @param used Bytes of data handed out
+ * @param data Memory for sends and wire formats, aligned as uringAlloc
+ *	rounds sizes
+ */
+struct uringChunk {
+	struct uringChunk *next;
+	int used;
+	char data[URING_CHUNK] __attribute__((aligned(16)));
+};
+
+/*
+ * io_uring generation data structure
+ * @param inflight Sends submitted and not yet completed
+ * @param closed Whether the generation's batch has been handled
+ * @param buffers Receive buffers holding the batch
+ * @param bufferCount Number of receive buffers
+ * @param arrivals Arrival times of the batch's sampled messages
+ * @param arrivalCount Number of arrival times
+ * @param chunks Arena memory for the generation's sends
+ * @param chunk Arena chunk being handed out
+ */
+struct uringGeneration {
+	int inflight;
+	int closed;
+	int buffers[URING_BUFFERS];
+	int bufferCount;
+	struct timespec arrivals[URING_BUFFERS];
+	int arrivalCount;
+	struct uringChunk *chunks;
+	struct uringChunk *chunk;
+};
+
+/*
+ * io_uring engine data structure
+ * @param ring The worker's ring
+ * @param recvMsg Header telling multishot receives how much name and
+ *	control space to leave in each buffer
+ * @param armed Whether a multishot receive is outstanding
+ * @param held Receive buffers not yet given back to the kernel
+ * @param pending Receive completions not yet handled
+ * @param pendingCount Number of receive completions not yet handled
+ * @param generations The generations
+ * @param current The generation taking new sends
+ * @param tick Timeout that wakes the worker to turn its timing wheel
+ * @param ticking Whether the timeout is outstanding
+ */
+struct uringEngine {
+	struct uring ring;
+	struct msghdr recvMsg;
+	int armed;
+	int held;
+	struct io_uring_cqe pending[URING_BUFFERS];
+	int pendingCount;
+	struct uringGeneration generations[URING_GENERATIONS];
+	int current;
+	struct __kernel_timespec tick;
+	int ticking;
+};
+#endif
+
+/*
+ * Worker data structure
+ * @param id The worker number, also its client table reader slot
+ * @param sd The worker's server socket
+ * @param debug Whether debugging output should be printed
+ * @param thread The worker's thread
+ * @param batch The worker's receive buffers
+ * @param metrics The worker's counters and latency histogram
+ * @param limiter The worker's share of the source and JOIN rate limits
+ * @param wheel Reliable delivery and idle timers set by the worker
+ * @param scheduled Client queues the worker flushes, linked through
+ *	nextScheduled
+ * @param touchedCid Client id last noticed in each touch cache slot
+ * @param touchedAt When each touch cache slot's client was last noticed
+ * @param touchedFrom The address each touch cache slot's client was
+ *	noticed at
+ * @param evictCids Clients waiting to be evicted
+ * @param evictSerials Registration serial of each client to evict
+ * @param evictCount Number of clients waiting to be evicted
+ * @param batches Room text waiting to be sent in OP_BATCH frames
+ * @param batchCount Number of batches in use
+ * @param catchUps Histories being sent to clients
+ * @param catchUpCount Number of histories being sent
+ * @param catchUpDue When the histories next send, in milliseconds
+ * @param uring The worker's io_uring engine, or NULL for blocking I/O
+ */
+struct worker {
+	int id;
+	int sd;
+	int debug;
+	pthread_t thread;
+	struct receiveBatch batch;
+	struct metrics metrics;
+	struct rateLimiter limiter;
+	struct timerWheel wheel;
+	struct sendQueue *scheduled;
+	int touchedCid[TOUCH_CACHE];
+	long touchedAt[TOUCH_CACHE];
+	struct sockaddr_in touchedFrom[TOUCH_CACHE];
+	int evictCids[EVICT_BATCH];
+	unsigned int evictSerials[EVICT_BATCH];
+	int evictCount;
+	struct roomBatch batches[BATCH_SLOTS];
+	int batchCount;
+	struct catchUp catchUps[CATCHUP_MAX];
+	int catchUpCount;
+	long catchUpDue;
+#ifdef HAVE_URING
+	struct uringEngine *uring;
+#endif
+};
+
+//Options given on the command line
+struct serverOptions serverOptions = { DEFAULT_RECV_BATCH, 1, 0, 0, 0,
+	QUEUE_DEFAULT, QUEUE_DROP, 0, 0, 0, NULL, NULL, 0, 0, 0, 1, 0 };
+
+//The server's workers, and the worker running on the current thread
+struct worker *workers;
+__thread struct worker *self;
 
-//define a global list of registered clients
-struct clientInformation clientRegister[MAX_CLIENTS+1];
+//Reliable links and queues of clients that have quit, kept for reuse
+// because member snapshots may still point at them; protected by the client
+// table lock
+struct reliableLink *freeLinks = NULL;
+struct sendQueue *freeQueues = NULL;
 
 /*
  * Function signature declarations see function definitions for further 
@@ -31,15 +383,96 @@ struct clientInformation clientRegister[MAX_CLIENTS+1];
  */
 void usage();
 void startServer(int port, int debug);
-int readClientMessage(int debug, int clientSD);
+int makeServerSocket(int port, int shared);
+void *runWorker(void *arg);
+void startMetrics(int port);
+void *runMetrics(void *arg);
+int receiveClientMessages(int sd, struct receiveBatch *batch, int debug);
+void initReceiveBatch(struct receiveBatch *batch, int size);
+void readControl(struct msghdr *hdr, struct timespec *arrival);
+void resetReceiveSlot(struct receiveBatch *batch, int i);
+int parseDatagram(const char *buffer, int length, struct messageView *view);
+int admitJoin(const struct messageView *rmsg);
+void processClientMessage(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *rmsg, int protocol, int debug);
+void dispatchClientMessage(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *rmsg, int protocol, int debug);
+void receiveReliable(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *rmsg, int protocol, int debug);
+struct reliableLink *findLink(int cid, const struct sockaddr_in *address,
+	unsigned int *incarnation);
+struct reliableLink *takeLink();
+void retireLink(struct reliableLink *link);
+struct sendQueue *takeQueue();
+void retireQueue(struct sendQueue *queue);
+void serviceWorker();
+int workerTicks();
+long workerWake();
+void serviceTimers();
+void idleExpired(struct reliableTimer *timer, long now);
+int touchClient(int cid, const struct sockaddr_in *address);
+int scheduleEviction(int cid, unsigned int serial);
+void evictPending();
+void flushQueues();
+long batchMicros();
+int batchMessage(const struct wireFormats *formats, int room);
+void flushBatch(struct roomBatch *batch);
+void flushBatches(int all);
+void replayHistory(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *request, int debug);
+void serviceCatchUps();
+int queueDatagram(const struct wireFormats *formats, 
+	struct poolBuffer **copies, const struct memberRef *member,
+	int sender);
+int formatQueues(char *buffer, int size);
+unsigned long droppedPackets();
 void addClient(int clientSD, struct sockaddr_in client_addr, 
-	char *domain, int debug);
-void removeClient(int sd, int cid, char *domain, int debug);
+	const struct messageView *join, int protocol, int debug);
+void removeClient(int sd, const struct messageView *quit, 
+	unsigned int serial, int debug);
+void moveClient(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *request, int debug);
+void *sendStorage(void *local, int size);
 void initialize();
-void sendJoinAck(int sd, int connectionID, int debug);
-void sendBcastMessage(int sd, struct message theMessage, int debug);
-void sendMessage(int sd, int connectionID, struct message theMessage, 
+void restoreClients();
+void watchClients(struct worker *watcher);
+void saveClient(int cid);
+void sendJoinAck(int sd, int connectionID, const struct messageView *join,
 	int debug);
+void sendBcastMessage(int sd, const struct messageView *theMessage, 
+	int room, int debug);
+void sendMessage(int sd, int connectionID, 
+	const struct messageView *theMessage, int debug);
+void relayMessage(int sd, const struct messageView *theMessage, int room,
+	const char *name);
+void receiveRelay(int sd, struct sockaddr_in peerAddr,
+	const struct messageView *frame, int debug);
+int relaySend(int sd, const char *frame, int length, int except);
+int sendClient(int sd, int connectionID, unsigned int serial,
+	const struct messageView *theMessage);
+void gatherFormats(struct wireFormats *formats, 
+	const struct messageView *theMessage);
+int sendBuffer(int sd, const struct wireFormats *formats,
+	const struct memberRef *members, int count, int sender);
+int sendsTo(const struct wireFormats *formats, const struct memberRef *member);
+int sendReliable(int sd, const struct messageView *theMessage,
+	const struct memberRef *members, int count);
+int sendDatagrams(struct reliableDatagram *datagrams, int count);
+#ifdef HAVE_URING
+void runUringWorker();
+void uringEnter(struct uringEngine *engine, unsigned wait);
+void uringArm(struct uringEngine *engine);
+void uringTick(struct uringEngine *engine);
+void uringReap(struct uringEngine *engine);
+void uringProcess(struct uringEngine *engine);
+void uringReceive(struct uringEngine *engine, struct uringGeneration *gen,
+	const struct io_uring_cqe *cqe, const struct timespec *now);
+void uringRetire(struct uringEngine *engine, struct uringGeneration *gen);
+void *uringAlloc(struct uringGeneration *gen, int size);
+int uringSendBuffer(struct uringEngine *engine, int sd,
+	const struct wireFormats *formats, const struct memberRef *members, 
+	int count);
+#endif
 
 /*
  * main
@@ -47,24 +480,147 @@ void sendMessage(int sd, int connectionID, struct message theMessage,
  * routine.
  */
 int main( int argc, char *argv[] ) {
-	char* server;
 	int port = 0;
 	int debug = 0;
+	int opt;
+
+	//validate & set options
+	while ( (opt = getopt(argc, argv,
+		"b:cD:F:H:i:J:L:M:m:O:P:q:R:rS:t:uw:")) != -1 ) {
+		switch ( opt ) {
+		case 't':
+			serverOptions.threads = atoi(optarg);
+			if ( serverOptions.threads < 1 ||
+				serverOptions.threads > MAX_THREADS ) {
+				usage();
+			}
+			break;
+		case 'b':
+			serverOptions.recvBatch = atoi(optarg);
+			if ( serverOptions.recvBatch < 1 ||
+				serverOptions.recvBatch > MAX_RECV_BATCH ) {
+				usage();
+			}
+			break;
+		case 'L':
+			logLimit = atoi(optarg);
+			if ( logLimit < 0 ) {
+				usage();
+			}
+			break;
+		case 'S':
+			logSample = atoi(optarg);
+			if ( logSample < 1 ) {
+				usage();
+			}
+			break;
+		case 'u':
+			serverOptions.uring = 1;
+			break;
+		case 'r':
+			serverOptions.reliable = 1;
+			break;
+		case 'q':
+			serverOptions.queueDepth = atoi(optarg);
+			if ( serverOptions.queueDepth < 1 ||
+				serverOptions.queueDepth > QUEUE_MAX ) {
+				usage();
+			}
+			break;
+		case 'c':
+			serverOptions.queuePolicy = QUEUE_COALESCE;
+			break;
+		case 'i':
+			serverOptions.idleTimeout = atoi(optarg);
+			if ( serverOptions.idleTimeout < 1 ) {
+				usage();
+			}
+			break;
+		case 'H':
+			serverOptions.historyDepth = atoi(optarg);
+			if ( serverOptions.historyDepth < 1 ||
+				serverOptions.historyDepth > HISTORY_MAX ) {
+				usage();
+			}
+			break;
+		case 'F':
+			serverOptions.historyFile = optarg;
+			break;
+		case 'M':
+			serverOptions.rosterFile = optarg;
+			break;
+		case 'R':
+			serverOptions.sourceRate = atoi(optarg);
+			if ( serverOptions.sourceRate < 1 ||
+				serverOptions.sourceRate > LIMIT_MAX_RATE ) {
+				usage();
+			}
+			break;
+		case 'J':
+			serverOptions.joinRate = atoi(optarg);
+			if ( serverOptions.joinRate < 1 ||
+				serverOptions.joinRate > LIMIT_MAX_RATE ) {
+				usage();
+			}
+			break;
+		case 'w':
+			serverOptions.batchWindow = atoi(optarg);
+			if ( serverOptions.batchWindow < 1 ||
+				serverOptions.batchWindow > MAX_BATCH_WINDOW ) {
+				usage();
+			}
+			break;
+		case 'O':
+			serverOptions.origin = atoi(optarg);
+			if ( serverOptions.origin < 1 ||
+				serverOptions.origin > RELAY_MAX_ORIGIN ) {
+				usage();
+			}
+			break;
+		case 'P':
+			if ( serverOptions.peerCount == RELAY_MAX_PEERS ) {
+				usage();
+			}
+			serverOptions.peers[serverOptions.peerCount++] = optarg;
+			break;
+		case 'D':
+			serverOptions.diameter = atoi(optarg);
+			if ( serverOptions.diameter < 1 ||
+				serverOptions.diameter > RELAY_MAX_DIAMETER ) {
+				usage();
+			}
+			break;
+		case 'm':
+			serverOptions.metricsPort = atoi(optarg);
+			if ( serverOptions.metricsPort < 1 ||
+				serverOptions.metricsPort > 65535 ) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
 	
-	if ( argc != 3 ) {
+	//History is only kept in a file if it is kept at all, and a server
+	// with peers must be told its origin id
+	if ( argc - optind != 2 || (serverOptions.historyFile != NULL &&
+		serverOptions.historyDepth == 0) || (serverOptions.peerCount > 0 &&
+		serverOptions.origin == 0) ) {
 		usage();
 	}
 
 	//validate & set debug
-	debug = atoi(argv[2]);
+	debug = atoi(argv[optind+1]);
 	if ( debug == DEBUG_ON ) {
 		printf("Debug is on.\n");
+		logStart();
 	} else if ( debug == DEBUG_OFF) {
 	} else {
 		usage();
 	}
 
-	port = atoi(argv[1]);
+	port = atoi(argv[optind]);
 	if ( port < 0 || port > 65535 ) {
 		usage();
 	}
@@ -77,13 +633,145 @@ int main( int argc, char *argv[] ) {
 
 /*
  * initialize
- * Set all clients into an unregistered state
+ * Set all clients into an unregistered state, or into the state saved in
+ * the roster file, and look up the peers
  */
 void initialize() {
 	int i;
-	for ( i = 0; i < MAX_CLIENTS; i++ ) {
-		clientRegister[i].connected = 0;
+
+	clientTableInit(&clientRegister, INITIAL_CLIENTS, serverOptions.threads);
+	roomIndexInit(&chatRooms);
+	if ( relayInit(&chatRelay, serverOptions.origin,
+		serverOptions.diameter) < 0 ) {
+		perror("Could not allocate relay state");
+		exit(1);
+	}
+	for ( i = 0; i < serverOptions.peerCount; i++ ) {
+		if ( relayAddPeer(&chatRelay, serverOptions.peers[i]) < 0 ) {
+			fprintf(stderr, "Could not find peer %s\n",
+				serverOptions.peers[i]);
+			exit(1);
+		}
+	}
+	if ( serverOptions.historyDepth > 0 ) {
+		historyInit(&chatHistory, serverOptions.historyDepth,
+			serverOptions.historyFile);
+		historyOpen(&chatHistory, ROOM_LOBBY, "", 0);
+	}
+	if ( serverOptions.rosterFile != NULL &&
+		rosterInit(&chatRoster, serverOptions.rosterFile) ) {
+		restoreClients();
+	}
+}
+
+/*
+ * restoreClients
+ * Register the clients saved in the roster file, in the rooms they were
+ * in, and clear the slots that cannot be restored
+ */
+void restoreClients() {
+	struct sockaddr_in address;
+	struct rosterSlot slot;
+	struct sendQueue *queue;
+	struct clientEntry *entry;
+	long now = reliableMillis();
+	int restored = 0;
+	int rejected = 0;
+	int room;
+	int cid;
+	int found;
+
+	bzero((char *)&address, sizeof(address));
+	address.sin_family = AF_INET;
+	for ( cid = JOIN_CID_CODE + 1; cid < chatRoster.slots; cid++ ) {
+		if ( (found = rosterRead(&chatRoster, cid, &slot)) == 0 ) {
+			continue;
+		}
+		address.sin_addr.s_addr = slot.addr;
+		address.sin_port = slot.port;
+		queue = found > 0 ? takeQueue() : NULL;
+		if ( found < 0 || clientTableRestore(&clientRegister, cid,
+			slot.serial, &address, slot.hostname, slot.hostnameLen,
+			slot.protocol, queue) < 0 ) {
+			if ( queue != NULL ) {
+				queue->nextFree = freeQueues;
+				freeQueues = queue;
+			}
+			rosterWrite(&chatRoster, cid, NULL, NULL, 0);
+			rejected++;
+			continue;
+		}
+		entry = clientTableLookup(&clientRegister, cid);
+		entry->info.batched = slot.batched;
+		entry->lastSeen = now;
+		if ( queue != NULL ) {
+			queueReset(queue, entry->serial, &address);
+		}
+
+		//A room that cannot be opened again leaves its client in the
+		// lobby
+		room = slot.roomLen > 0 ? roomOpen(&chatRooms, slot.room,
+			slot.roomLen) : ROOM_LOBBY;
+		if ( room < 0 || roomMove(&chatRooms, &clientRegister, cid,
+			room) < 0 ) {
+			room = ROOM_LOBBY;
+			roomMove(&chatRooms, &clientRegister, cid, room);
+		}
+		if ( room != ROOM_LOBBY && serverOptions.historyDepth > 0 ) {
+			historyOpen(&chatHistory, room, slot.room, slot.roomLen);
+		} else if ( room == ROOM_LOBBY && slot.roomLen > 0 ) {
+			saveClient(cid);
+		}
+		restored++;
+	}
+	clientTableFreeList(&clientRegister);
+	printf("Restored %i clients from %s", restored, serverOptions.rosterFile);
+	if ( rejected > 0 ) {
+		printf(", rejected %i", rejected);
+	}
+	printf("\n");
+}
+
+/*
+ * watchClients
+ * Set an idle timer for every registered client, for clients restored
+ * before any worker was running
+ * @param watcher The worker whose timer wheel takes the timers
+ */
+void watchClients(struct worker *watcher) {
+	struct clientEntry *entry;
+	int i;
+
+	for ( i = 0; i < clientRegister.memberCount; i++ ) {
+		entry = &clientRegister.entries[clientRegister.members[i]];
+		wheelAdd(&watcher->wheel, 
+			entry->lastSeen + serverOptions.idleTimeout * 1000L, NULL,
+			entry->serial, clientRegister.members[i], watcher->sd,
+			TIMER_IDLE);
+	}
+}
+
+/*
+ * saveClient
+ * Bring a client's roster slot up to date with its entry, or mark the slot
+ * unused if the client is gone.  Clients with reliable delivery are not
+ * saved, since their sequence state does not survive a restart.  Called
+ * with the client table lock held.
+ * @param cid The client's connection id
+ */
+void saveClient(int cid) {
+	struct clientEntry *entry = clientTableLookup(&clientRegister, cid);
+	struct chatRoom *room;
+
+	if ( chatRoster.fd < 0 ) {
+		return;
 	}
+	if ( entry == NULL || entry->info.link != NULL ) {
+		rosterWrite(&chatRoster, cid, NULL, NULL, 0);
+		return;
+	}
+	room = chatRooms.rooms[roomOf(&chatRooms, cid)];
+	rosterWrite(&chatRoster, cid, entry, room->name, room->nameLen);
 }
 
 /*
@@ -91,23 +779,118 @@ void initialize() {
  * Print usage information and exit
  */
 void usage() {
-	printf("Usage: chatServer <port> <debug>\n");
+	printf("Usage: chatServer [-b batch] [-c] [-D diameter] [-F file] "
+		"[-H depth] [-i seconds]\n       [-J rate] [-L limit] [-M file] "
+		"[-m port] [-O origin] [-P host:port]...\n       [-q depth] "
+		"[-R rate] [-r] [-S sample] [-t threads] [-u] [-w usec]\n"
+		"       <port> <debug>\n");
+	printf("  -b batch  datagrams read per receive call (1-%i, default %i)\n",
+		MAX_RECV_BATCH, DEFAULT_RECV_BATCH);
+	printf("  -c  coalesce a full client queue by sender instead of "
+		"dropping\n");
+	printf("  -D diameter  most links between peers a message crosses "
+		"(1-%i, default 1,\n               a full mesh)\n",
+		RELAY_MAX_DIAMETER);
+	printf("  -F file  append the history to this file and read it back "
+		"after a restart\n");
+	printf("  -H depth  messages of history kept per room (1-%i)\n",
+		HISTORY_MAX);
+	printf("  -i seconds  evict clients silent this long (binary clients "
+		"ping\n              every %i seconds)\n", KEEPALIVE_SEC);
+	printf("  -J rate  JOINs admitted per second, shared among the threads "
+		"(1-%i)\n", LIMIT_MAX_RATE);
+	printf("  -L limit  debug records per second per thread (default "
+		"unlimited)\n");
+	printf("  -M file  save registered clients in this file and take them "
+		"back\n           after a restart\n");
+	printf("  -m port  answer metrics queries on this localhost UDP port\n");
+	printf("  -O origin  this server's id among its peers (1-%i), needed "
+		"with -P\n", RELAY_MAX_ORIGIN);
+	printf("  -P host:port  relay rooms with the server there; repeat for "
+		"up to %i peers\n", RELAY_MAX_PEERS);
+	printf("  -q depth  datagrams queued per client (1-%i, default %i)\n",
+		QUEUE_MAX, QUEUE_DEFAULT);
+	printf("  -R rate  datagrams per second each client address may send "
+		"(1-%i)\n", LIMIT_MAX_RATE);
+	printf("  -r  offer reliable, ordered delivery to clients that ask\n");
+	printf("  -S sample  log one debug record in every sample "
+		"(default 1)\n");
+	printf("  -t threads  worker threads sharing the port (1-%i, default 1)\n",
+		MAX_THREADS);
+	printf("  -u  use io_uring for socket I/O\n");
+	printf("  -w usec  batch a room's text for up to usec microseconds "
+		"(1-%i)\n            or %i bytes, for clients that unpack "
+		"batches\n", MAX_BATCH_WINDOW, POOL_BUFFER_SIZE);
 	exit(1);
 }
 
 /*
  * startServer
- * Start the server loop, listenting for and processing data on the port
+ * Start the server workers, each listenting for and processing data on the
+ * port with its own socket
  * @param port The port to which to listen 
  * @param debug Whether debug messages will be printed.
  */
 void startServer(int port, int debug) {
-	struct sockaddr_in serv_addr, cli_addr;
+	int i, j;
+
+	workers = calloc(serverOptions.threads, sizeof(struct worker));
+	if ( workers == NULL ) {
+		perror("Could not allocate workers");
+		exit(1);
+	}
+
+	//Bind every worker socket before any worker starts so that the
+	// kernel spreads clients over all of them from the first datagram
+	for ( i = 0; i < serverOptions.threads; i++ ) {
+		workers[i].id = i;
+		workers[i].debug = debug;
+		workers[i].sd = makeServerSocket(port, serverOptions.threads > 1);
+		initReceiveBatch(&workers[i].batch, serverOptions.recvBatch);
+		wheelInit(&workers[i].wheel);
+		if ( limiterInit(&workers[i].limiter, serverOptions.sourceRate,
+			(serverOptions.joinRate + serverOptions.threads - 1) /
+			serverOptions.threads, reliableMillis()) < 0 ) {
+			perror("Could not allocate rate limiter");
+			exit(1);
+		}
+		for ( j = 0; j < BATCH_SLOTS; j++ ) {
+			workers[i].batches[j].room = -1;
+		}
+	}
+	printf("Waiting for data on UDP port %i\n", port);
+
+	//Clients restored from the roster are watched by the first worker
+	if ( serverOptions.idleTimeout > 0 ) {
+		watchClients(&workers[0]);
+	}
+
+	if ( serverOptions.metricsPort > 0 ) {
+		startMetrics(serverOptions.metricsPort);
+	}
+
+	for ( i = 1; i < serverOptions.threads; i++ ) {
+		if ( pthread_create(&workers[i].thread, NULL, runWorker,
+			&workers[i]) != 0 ) {
+			perror("Error starting worker");
+			exit(1);
+		}
+	}
+	runWorker(&workers[0]);
+}
+
+/*
+ * makeServerSocket
+ * Create and bind a server socket
+ * @param port The port to which to listen
+ * @param shared Whether other sockets will be bound to the same port
+ * @return The server socket
+ */
+int makeServerSocket(int port, int shared) {
+	struct sockaddr_in serv_addr;
+	struct timeval tick = { 0, WHEEL_TICK * 1000 };
 	int sd;
-	int clilen;
-	int childSD;
-	int i;
-	fd_set active_fd_set, read_fd_set;
+	int on = 1;
 
 	//initialize the server socket
 	sd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -116,6 +899,39 @@ void startServer(int port, int debug) {
 		exit(1);
 	}
 
+	//Ask for the count of datagrams the kernel drops on this socket
+#ifdef SO_RXQ_OVFL
+	setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+
+	//Ask for the time each datagram reached the socket
+#ifdef SO_TIMESTAMPNS
+	if ( serverOptions.metricsPort > 0 ) {
+		setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	}
+#endif
+
+	//Wake the worker every timer tick to retransmit and notice idle
+	// clients while it is idle
+	if ( serverOptions.reliable || serverOptions.idleTimeout > 0 ) {
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+	}
+
+	//Let each worker bind its own socket to the port; the kernel
+	// balances incoming datagrams across them by source address
+	if ( shared ) {
+#ifdef SO_REUSEPORT
+		if ( setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, 
+			sizeof(on)) < 0 ) {
+			perror("Error sharing socket port");
+			exit(1);
+		}
+#else
+		fprintf(stderr, "Worker threads need SO_REUSEPORT\n");
+		exit(1);
+#endif
+	}
+
 	//Set up the server listening address and port
 	bzero((char *) &serv_addr, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
@@ -127,158 +943,2486 @@ void startServer(int port, int debug) {
 		< 0 ) {
 		perror("Error binding to socket");
 		exit(1);
-	} else {
-		printf("Waiting for data on UDP port %i\n", port);
 	}
+	return sd;
+}
+
+/*
+ * runWorker
+ * Receive and process client data as it becomes available on a worker's
+ * socket
+ * @param arg The worker
+ * @return Never returns
+ */
+void *runWorker(void *arg) {
+	struct timeval wait;
+	long waking;
+	long wake;
 
-	//Recieve client data as it becomes available on the server socket
+	self = arg;
+	waking = workerWake();
+#ifdef HAVE_URING
+	//Only returns if io_uring cannot be set up
+	if ( serverOptions.uring ) {
+		runUringWorker();
+	}
+#endif
 	while ( 1 ) {
-		receiveClientMessage(sd, debug);
+		receiveClientMessages(self->sd, &self->batch, self->debug);
+		serviceWorker();
+
+		//Client queues waiting for the socket to drain, and batches
+		// waiting out their window, need the worker to wake even if
+		// nothing arrives
+		wake = workerWake();
+		if ( waking != wake ) {
+			waking = wake;
+			wait.tv_sec = wake / 1000000;
+			wait.tv_usec = wake % 1000000;
+			setsockopt(self->sd, SOL_SOCKET, SO_RCVTIMEO, &wait,
+				sizeof(wait));
+		}
 	}
+	return NULL;
 }
 
 /*
- * receiveClientMessage
- * Receive a message from the client on the server socket
- * @param sd The server socket
- * @param debug Whether debugging output should be printed
+ * startMetrics
+ * Start the thread answering metrics queries
+ * @param port The localhost port on which to answer
  */
-int receiveClientMessage(int sd, int debug) {
-	struct sockaddr_in clientAddr;
-	socklen_t clientLen = sizeof(clientAddr);
-	int receivedLen = 0;
-	struct message rmsg;
-	char buffer[3*MAX_LINE];
-	bzero((char *) &buffer, sizeof(buffer));
-
-	//Receive a message as a raw string buffer and parse that message into
-	// a message data structure.
-	receivedLen = recvfrom(sd, buffer, 3*MAX_LINE, 0, 
-		(struct sockaddr *)&clientAddr, &clientLen);
-	
-	rmsg = parseMessage(buffer);
-	pDebug(debug, RECV_STRING, rmsg);	
+void startMetrics(int port) {
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int *sd;
 
-	//Process messages containing the join command; add the client
-	if ( rmsg.cid == 0 && strcmp(rmsg.str1,JOIN_STRING) == 0 ) {
-		addClient(sd, clientAddr, rmsg.str2, debug);
-	//Process messages containing the quit command; remove the client
-	} else if (rmsg.cid < 0 && strcmp(rmsg.str1,QUIT_STRING) == 0 ) {
-		removeClient(sd, rmsg.cid, rmsg.str2, debug);
-	//Re-broadcast all other messages
-	} else {
-		sendBcastMessage(sd, rmsg, debug);
+	sd = malloc(sizeof(*sd));
+	if ( sd == NULL ) {
+		perror("Could not allocate metrics socket");
+		exit(1);
+	}
+	*sd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ( *sd < 0 ) {
+		perror("Error opening metrics socket");
+		exit(1);
+	}
+
+	//Only answer queries from this host
+	bzero((char *) &addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if ( bind(*sd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+		perror("Error binding to metrics socket");
+		exit(1);
 	}
+
+	if ( pthread_create(&thread, NULL, runMetrics, sd) != 0 ) {
+		perror("Error starting metrics thread");
+		exit(1);
+	}
+	printf("Answering metrics queries on localhost UDP port %i\n", port);
 }
 
 /*
- * addClient
- * Add a new client to the registered client list
- * @param sd The server socket
- * @param client_addr The client address sockaddr_in structure
- * @param domain The client domain
- * @param debug Whether to output debugging informaiton
+ * runMetrics
+ * Answer every datagram received on the metrics socket with the current
+ * metrics as text
+ * @param arg The metrics socket
+ * @return Never returns
  */
-void addClient(int sd, struct sockaddr_in client_addr, char *domain, int debug) {
+void *runMetrics(void *arg) {
+	struct metrics *all[MAX_THREADS];
+	struct sockaddr_in addr;
+	socklen_t addrLen;
+	char query[MAX_LINE];
+	char *reply;
+	int sd = *(int *)arg;
+	int clients;
+	int length;
 	int i;
-	int allocated = -1;
-
-	//Find the first available client registration number and assign
-	// this client's information to that number.  Remember that number.
-	for ( i = 1; i < MAX_CLIENTS+1; i++ ) {
-		if ( clientRegister[i].connected == 0 ) {
-			clientRegister[i].connected = 1;
-			bcopy((char *)&client_addr, 
-				(char *)&clientRegister[i].address, 
-				sizeof(client_addr));
-			strcpy(clientRegister[i].hostname, domain);
-			allocated = i;
-			break;
+
+	reply = malloc(METRICS_REPLY);
+	if ( reply == NULL ) {
+		perror("Could not allocate metrics reply");
+		exit(1);
+	}
+	for ( i = 0; i < serverOptions.threads; i++ ) {
+		all[i] = &workers[i].metrics;
+	}
+
+	while ( 1 ) {
+		addrLen = sizeof(addr);
+		if ( recvfrom(sd, query, sizeof(query), 0,
+			(struct sockaddr *)&addr, &addrLen) < 0 ) {
+			continue;
 		}
+		pthread_mutex_lock(&clientRegister.lock);
+		clients = clientRegister.memberCount;
+		pthread_mutex_unlock(&clientRegister.lock);
+		length = metricsFormat(reply, METRICS_REPLY, all, 
+			serverOptions.threads, clients);
+		length += formatQueues(reply + length, METRICS_REPLY - length);
+		sendto(sd, reply, length, 0, (struct sockaddr *)&addr, addrLen);
 	}
+	return NULL;
+}
 
-	//Send a join-ack including the newly registered client's number.
-	if ( allocated >= 0 ) {
-		sendJoinAck(sd, allocated, debug);
-	} else {
-		printf("Server can only support %i connections.\n", i);
+/*
+ * formatQueues
+ * Format one line per registered client giving the datagrams waiting for
+ * it, on its queue or unacknowledged on its reliable link, the datagrams
+ * its queue has dropped, and how long it has been silent
+ * @param buffer The text buffer
+ * @param size The size of the buffer
+ * @return The length of the text; clients that do not fit are left out
+ */
+int formatQueues(char *buffer, int size) {
+	struct clientEntry *entry;
+	unsigned long dropped;
+	long now = reliableMillis();
+	int length = 0;
+	int depth;
+	int i;
+
+	pthread_mutex_lock(&clientRegister.lock);
+	for ( i = 0; i < clientRegister.memberCount && length < size; i++ ) {
+		entry = clientTableLookup(&clientRegister, clientRegister.members[i]);
+		if ( entry == NULL ) {
+			continue;
+		}
+		depth = 0;
+		dropped = 0;
+		if ( entry->info.queue != NULL ) {
+			pthread_mutex_lock(&entry->info.queue->lock);
+			depth = queueDepth(entry->info.queue);
+			dropped = entry->info.queue->dropped;
+			pthread_mutex_unlock(&entry->info.queue->lock);
+		}
+		if ( entry->info.link != NULL ) {
+			depth += reliableOutstanding(entry->info.link);
+		}
+		length += snprintf(buffer + length, size - length,
+			"client %i queue %i dropped %lu idle_ms %ld\n", 
+			clientRegister.members[i], depth, dropped, 
+			now - entry->lastSeen);
 	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	return length < size ? length : size - 1;
 }
 
 /*
- * removeClient
- * Remove a client from the registered client list
- * @param sd The server socket
- * @param cid The client to remove
- * @param domain The client domain
- * @param debug Whether to output debugging informaiton
+ * initReceiveBatch
+ * Allocate the buffers for a receive batch
+ * @param batch The receive batch
+ * @param size Maximum datagrams per receive
  */
-void removeClient(int sd, int cid, char *domain, int debug) {
-	struct message rmsg;
+void initReceiveBatch(struct receiveBatch *batch, int size) {
+	int i;
 
-	//construct a QUIT-ACK message
-	rmsg.cid = -1 * cid;
-	strcpy(rmsg.str1, QUIT_STRING);
-	strcpy(rmsg.str2, domain);
-	
-	//broadcast the quit-ack message
-	sendBcastMessage(sd, rmsg, debug);
+	batch->size = size;
+	batch->buffers = malloc(sizeof(*batch->buffers) * size);
+	batch->addresses = malloc(sizeof(*batch->addresses) * size);
+	batch->parsed = malloc(sizeof(*batch->parsed) * size);
+	batch->protocols = malloc(sizeof(*batch->protocols) * size);
+	batch->valid = malloc(sizeof(*batch->valid) * size);
+	batch->arrivals = malloc(sizeof(*batch->arrivals) * size);
+#ifdef HAVE_MMSG
+	batch->msgs = malloc(sizeof(*batch->msgs) * size);
+	batch->iovs = malloc(sizeof(*batch->iovs) * size);
+	batch->controls = malloc(sizeof(*batch->controls) * size);
+	if ( batch->msgs == NULL || batch->iovs == NULL ||
+		batch->controls == NULL ) {
+		perror("Could not allocate receive batch");
+		exit(1);
+	}
+#endif
+	if ( batch->buffers == NULL || batch->addresses == NULL ||
+		batch->parsed == NULL || batch->protocols == NULL || 
+		batch->valid == NULL || batch->arrivals == NULL ) {
+		perror("Could not allocate receive batch");
+		exit(1);
+	}
+	for ( i = 0; i < size; i++ ) {
+		batch->buffers[i] = poolAlloc();
+		if ( batch->buffers[i] == NULL ) {
+			perror("Could not allocate receive batch");
+			exit(1);
+		}
+	}
+#ifdef HAVE_MMSG
+	bzero((char *)batch->msgs, sizeof(*batch->msgs) * size);
+	for ( i = 0; i < size; i++ ) {
+		resetReceiveSlot(batch, i);
+	}
+#endif
+}
 
-	//remove the client from the register
-	clientRegister[-1 * cid].connected = 0;
+#ifdef HAVE_MMSG
+/*
+ * resetReceiveSlot
+ * Point a receive slot's header back at its buffer, address and control
+ * space, undoing what the last recvmmsg wrote into it
+ * @param batch The receive batch
+ * @param i The slot
+ */
+void resetReceiveSlot(struct receiveBatch *batch, int i) {
+	struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+	batch->iovs[i].iov_base = batch->buffers[i]->data;
+	batch->iovs[i].iov_len = POOL_BUFFER_SIZE;
+	hdr->msg_name = &batch->addresses[i];
+	hdr->msg_namelen = sizeof(batch->addresses[i]);
+	hdr->msg_iov = &batch->iovs[i];
+	hdr->msg_iovlen = 1;
+	hdr->msg_control = batch->controls[i];
+	hdr->msg_controllen = sizeof(batch->controls[i]);
+	hdr->msg_flags = 0;
 }
+#endif
 
 /*
- * sendJoinAck
- * Send a join acknowledgement over broadcast
- * @param sd The server socket
- * @param connectionID the client id to ack
- * @debug debug Whether to output debugging information
- */	
-void sendJoinAck(int sd, int connectionID, int debug) {
-	struct message joinack;
-	joinack.cid = connectionID;
-	strcpy(joinack.str1, JOIN_STRING);
-	strcpy(joinack.str2, clientRegister[connectionID].hostname);
-	sendBcastMessage(sd, joinack, debug);
+ * readControl
+ * Read the ancillary data received with a datagram
+ * @param hdr The datagram's message header
+ * @param arrival When the datagram reached the socket, set if the kernel
+ *	reported it
+ */
+void readControl(struct msghdr *hdr, struct timespec *arrival) {
+	struct cmsghdr *cmsg;
+
+	for ( cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(hdr, cmsg) ) {
+#ifdef SO_RXQ_OVFL
+		if ( cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SO_RXQ_OVFL ) {
+			metricsSet(&self->metrics.overflowDrops,
+				*(unsigned int *)CMSG_DATA(cmsg));
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		if ( cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_TIMESTAMPNS ) {
+			memcpy(arrival, CMSG_DATA(cmsg), sizeof(*arrival));
+		}
+#endif
+	}
 }
 
 /*
- * sendBcastMessage
- * Send a message to all registered clients
+ * droppedPackets
+ * @return The number of datagrams dropped since the server started
+ */
+unsigned long droppedPackets() {
+	unsigned long dropped = 0;
+	int i;
+	for ( i = 0; i < serverOptions.threads; i++ ) {
+		dropped += metricsGet(&workers[i].metrics.overflowDrops) + 
+			metricsGet(&workers[i].metrics.invalidDrops);
+	}
+	return dropped;
+}
+
+/*
+ * receiveClientMessages
+ * Receive a batch of messages from clients on the server socket, parse the
+ * whole batch, then process each message in arrival order
  * @param sd The server socket
- * @param theMessage The message to send 
- * @debug debug Whether to output debugging information
- */	
-void sendBcastMessage(int sd, struct message theMessage, int debug) {
+ * @param batch The receive batch buffers
+ * @param debug Whether debugging output should be printed
+ * @return The number of datagrams received
+ */
+int receiveClientMessages(int sd, struct receiveBatch *batch, int debug) {
+	struct poolStats stats;
+	struct timespec now;
+	int timed = serverOptions.metricsPort > 0;
+	long millis = 0;
+	int received = 0;
+	int receivedLen;
 	int i;
-	for ( i = 1; i < MAX_CLIENTS+1; i++ ) {
-		if ( clientRegister[i].connected == 1 ) {
-			sendMessage(sd, i, theMessage, debug);
+#ifdef HAVE_MMSG
+	struct msghdr *hdr;
+
+	//Block for the first datagram, then take whatever else is already
+	// queued up to the batch size
+	received = recvmmsg(sd, batch->msgs, batch->size, MSG_WAITFORONE, NULL);
+	metricsAdd(&self->metrics.syscalls, 1);
+	if ( received < 0 ) {
+		return 0;
+	}
+	if ( timed ) {
+		clock_gettime(CLOCK_REALTIME, &now);
+	}
+
+	for ( i = 0; i < received; i++ ) {
+		hdr = &batch->msgs[i].msg_hdr;
+		if ( timed ) {
+			batch->arrivals[i] = now;
+		}
+		receivedLen = batch->msgs[i].msg_len;
+		batch->buffers[i]->length = receivedLen;
+		batch->valid[i] = (hdr->msg_flags & MSG_TRUNC) == 0;
+		readControl(hdr, &batch->arrivals[i]);
+	}
+#else
+	socklen_t clientLen = sizeof(batch->addresses[0]);
+
+	receivedLen = recvfrom(sd, batch->buffers[0]->data, POOL_BUFFER_SIZE, 0,
+		(struct sockaddr *)&batch->addresses[0], &clientLen);
+	metricsAdd(&self->metrics.syscalls, 1);
+	if ( receivedLen < 0 ) {
+		return 0;
+	}
+	batch->buffers[0]->length = receivedLen;
+	batch->valid[0] = 1;
+	received = 1;
+	if ( timed ) {
+		clock_gettime(CLOCK_REALTIME, &batch->arrivals[0]);
+	}
+#endif
+	metricsAdd(&self->metrics.messagesIn, received);
+	if ( serverOptions.sourceRate > 0 ) {
+		millis = reliableMillis();
+	}
+
+	//Parse the whole batch into message data structures before acting
+	// on any of them.  A source over its rate is dropped unparsed, unless
+	// it is a peer relaying for all of its clients.
+	for ( i = 0; i < received; i++ ) {
+		if ( batch->valid[i] && !limitSource(&self->limiter, 
+			&batch->addresses[i], millis) &&
+			relayFind(&chatRelay, &batch->addresses[i]) < 0 ) {
+			batch->valid[i] = 0;
+			metricsAdd(&self->metrics.sourceThrottled, 1);
+			continue;
+		}
+		if ( batch->valid[i] ) {
+			batch->protocols[i] = parseDatagram(
+				batch->buffers[i]->data, batch->buffers[i]->length,
+				&batch->parsed[i]);
+			batch->valid[i] = batch->protocols[i] >= 0;
+		}
+		if ( !batch->valid[i] ) {
+			metricsAdd(&self->metrics.invalidDrops, 1);
+		}
+	}
+
+	if ( debug == DEBUG_ON ) {
+		poolStatistics(&stats);
+		logEvent("DEBUG: Received %lu datagrams in 1 syscall, "
+			"%lu dropped, pool %lu hits %lu misses\n", received, 
+			droppedPackets(), stats.hits, stats.misses);
+	}
+
+	for ( i = 0; i < received; i++ ) {
+		if ( batch->valid[i] ) {
+			processClientMessage(sd, batch->addresses[i],
+				&batch->parsed[i], batch->protocols[i], debug);
+			if ( timed && metricsSample(&self->metrics) ) {
+				clock_gettime(CLOCK_REALTIME, &now);
+				histogramRecord(&self->metrics.latency,
+					metricsElapsed(&batch->arrivals[i], &now));
+			}
+		}
+
+		//Keep the buffer for the next receive unless something is
+		// still holding the message it carries
+		if ( atomic_load(&batch->buffers[i]->refs) > 1 ) {
+			poolRelease(batch->buffers[i]);
+			batch->buffers[i] = poolAlloc();
+			if ( batch->buffers[i] == NULL ) {
+				perror("Could not allocate receive buffer");
+				exit(1);
+			}
 		}
+#ifdef HAVE_MMSG
+		resetReceiveSlot(batch, i);
+#endif
 	}
+	return received;
 }
 
 /*
- * sendMessage
- * Send a message to a registered clients
- * @param sd The server socket
- * @param connectionID the client id to which to send 
- * @param theMessage The message to send 
- * @debug debug Whether to output debugging information
- */	
-void sendMessage(int sd, int connectionID, struct message theMessage, int debug) {
-	char buffer[3*MAX_LINE];
-	bzero((char *) &buffer, sizeof(buffer));
-	
-	//Translate the message from a message data structure into a raw 
-	// buffer string
-	sprintf(buffer, "%i %s %s", theMessage.cid, theMessage.str1,
-		theMessage.str2);
+ * parseDatagram
+ * Parse a datagram in either wire protocol, in place
+ * @param buffer The datagram, which need not be NUL terminated
+ * @param length The length of the datagram
+ * @param view The message view to fill; its strings point into buffer
+ * @return The wire protocol the datagram was sent in, or -1 if it is not
+ *	well formed
+ */
+int parseDatagram(const char *buffer, int length, struct messageView *view) {
+	const char *nul;
+	int textLen = length;
 
-	if ( sendto(sd, buffer, strlen(buffer), 0, 
-		(struct sockaddr *)&clientRegister[connectionID].address,
-		sizeof(clientRegister[connectionID].address)) < 0 ) {
+	//A text JOIN may carry a binary JOIN frame after a NUL, offering the
+	// binary protocol
+	if ( (unsigned char)buffer[0] != FRAME_MAGIC ) {
+		nul = memchr(buffer, '\0', length);
+		if ( nul != NULL ) {
+			textLen = nul - buffer;
+			if ( decodeFrame(nul + 1, length - textLen - 1, 
+				view) >= 0 && view->opcode == OP_JOIN ) {
+				buffer = nul + 1;
+				length -= textLen + 1;
+			}
+		}
 	}
-	pDebug(debug, SENT_STRING, theMessage);
+
+	if ( (unsigned char)buffer[0] != FRAME_MAGIC ) {
+		return parseMessage(buffer, textLen, view) < 0 ? 
+			-1 : PROTOCOL_TEXT;
+	} else if ( decodeFrame(buffer, length, view) < 0 ) {
+		return -1;
+	}
+	return view->version < PROTOCOL_VERSION ? 
+		view->version : PROTOCOL_VERSION;
+}
+
+/*
+ * admitJoin
+ * Take a token for a message if it is a JOIN, so that clients joining in
+ * a burst are let in at the join rate while members carry on
+ * @param rmsg The parsed message
+ * @return 1 if the message may be handled, 0 if it is a JOIN to be dropped
+ */
+int admitJoin(const struct messageView *rmsg) {
+	if ( rmsg->cid != JOIN_CID_CODE || rmsg->opcode != OP_JOIN ||
+		serverOptions.joinRate == 0 ||
+		limitJoin(&self->limiter, reliableMillis()) ) {
+		return 1;
+	}
+	metricsAdd(&self->metrics.joinThrottled, 1);
+	return 0;
+}
+
+/*
+ * processClientMessage
+ * Act on one message received from a client: take an acknowledgement or a
+ * reliable frame for the client's link, and act on anything else at once.
+ * A message relayed by a peer is handed to receiveRelay.
+ * @param sd The server socket
+ * @param clientAddr The address the message came from
+ * @param rmsg The parsed message
+ * @param protocol The wire protocol the message was sent in
+ * @param debug Whether debugging output should be printed
+ */
+void processClientMessage(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *rmsg, int protocol, int debug) {
+	struct reliableLink *link;
+	unsigned int incarnation;
+	int cid = rmsg->cid < 0 ? -rmsg->cid : rmsg->cid;
+	int owned;
+
+	if ( rmsg->opcode == OP_RELAY ) {
+		receiveRelay(sd, clientAddr, rmsg, debug);
+		return;
+	}
+
+	//Anything a client sends shows it is still there
+	owned = cid > JOIN_CID_CODE && touchClient(cid, &clientAddr);
+	if ( rmsg->opcode == OP_PING || !admitJoin(rmsg) ) {
+		return;
+	}
+	if ( rmsg->opcode == OP_ACK ) {
+		link = findLink(rmsg->cid, &clientAddr, &incarnation);
+		if ( link != NULL ) {
+			reliableAck(link, incarnation, rmsg, reliableMillis());
+		}
+		return;
+	}
+	pDebug(debug, RECV_STRING, rmsg);	
+
+	//Only a client may quit, speak or move as itself.  A reliable frame's
+	// sender is checked against its link instead.
+	if ( !owned && !(rmsg->flags & FLAG_RELIABLE) &&
+		!(rmsg->cid == JOIN_CID_CODE && rmsg->opcode == OP_JOIN) ) {
+		metricsAdd(&self->metrics.forgedDrops, 1);
+		return;
+	}
+	if ( rmsg->flags & FLAG_RELIABLE ) {
+		receiveReliable(sd, clientAddr, rmsg, protocol, debug);
+	} else {
+		dispatchClientMessage(sd, clientAddr, rmsg, protocol, debug);
+	}
+}
+
+/*
+ * dispatchClientMessage
+ * Act on one message from a client, in the order the client sent it
+ * @param sd The server socket
+ * @param clientAddr The address the message came from
+ * @param rmsg The parsed message
+ * @param protocol The wire protocol the message was sent in
+ * @param debug Whether debugging output should be printed
+ */
+void dispatchClientMessage(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *rmsg, int protocol, int debug) {
+	unsigned long allocs = messageAllocs;
+	unsigned long copies = messageCopies;
+	int room;
+
+	//Process messages containing the join command; add the client
+	if ( rmsg->cid == 0 && rmsg->opcode == OP_JOIN ) {
+		addClient(sd, clientAddr, rmsg, protocol, debug);
+	//Process messages containing the quit command; remove the client
+	} else if ( rmsg->cid < 0 && rmsg->opcode == OP_QUIT ) {
+		removeClient(sd, rmsg, 0, debug);
+	//Process room commands; move the client between rooms
+	} else if ( rmsg->opcode == OP_ENTER || rmsg->opcode == OP_LEAVE ) {
+		moveClient(sd, clientAddr, rmsg, debug);
+	//Process history requests; start sending the room's history
+	} else if ( rmsg->opcode == OP_HISTORY ) {
+		replayHistory(sd, clientAddr, rmsg, debug);
+	//Re-broadcast all other messages to the sender's room, and relay text
+	// to the room on the peered servers
+	} else {
+		room = roomOf(&chatRooms, rmsg->cid);
+		sendBcastMessage(sd, rmsg, room, debug);
+		if ( rmsg->opcode == OP_TEXT ) {
+			relayMessage(sd, rmsg, room, NULL);
+		}
+	}
+
+	if ( debug == DEBUG_ON ) {
+		logEvent("DEBUG: Handled with %lu allocations and %lu copies\n",
+			messageAllocs - allocs, messageCopies - copies, 0, 0);
+	}
+}
+
+/*
+ * receiveReliable
+ * Take a reliable frame from a client, acknowledge it, and act on every
+ * message it puts in order
+ * @param sd The server socket
+ * @param clientAddr The address the frame came from
+ * @param rmsg The parsed frame
+ * @param protocol The wire protocol the frame was sent in
+ * @param debug Whether debugging output should be printed
+ */
+void receiveReliable(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *rmsg, int protocol, int debug) {
+	struct reliableDatagram ack;
+	struct reliableLink *link;
+	struct messageView ordered;
+	struct poolBuffer *held;
+	unsigned int incarnation;
+	unsigned long lost = 0;
+	int result;
+
+	link = findLink(rmsg->opcode == OP_QUIT ? -rmsg->cid : rmsg->cid,
+		&clientAddr, &incarnation);
+	if ( link == NULL ) {
+		metricsAdd(&self->metrics.invalidDrops, 1);
+		return;
+	}
+	result = reliableAccept(link, incarnation, rmsg, sd, reliableMillis(),
+		&self->wheel, &ack, &lost);
+
+	//Acknowledge before acting, since a QUIT resets the link
+	if ( ack.iovlen > 0 ) {
+		if ( reliableSend(&ack) < 0 ) {
+			metricsAdd(&self->metrics.sendFailures, 1);
+		} else {
+			metricsAdd(&self->metrics.messagesOut, 1);
+		}
+		metricsAdd(&self->metrics.syscalls, 1);
+	}
+
+	//Messages are passed on unsequenced, to be sequenced afresh for each
+	// recipient
+	if ( result == RELIABLE_DELIVER ) {
+		ordered = *rmsg;
+		ordered.flags &= FLAG_FRAGMENT;
+		dispatchClientMessage(sd, clientAddr, &ordered, protocol, debug);
+	}
+	while ( (held = reliableNext(link, incarnation, &lost)) != NULL ) {
+		if ( decodeFrame(held->data, held->length, &ordered) >= 0 ) {
+			ordered.flags &= FLAG_FRAGMENT;
+			dispatchClientMessage(sd, clientAddr, &ordered, protocol,
+				debug);
+		}
+		poolRelease(held);
+	}
+	metricsAdd(&self->metrics.reliableLost, lost);
+}
+
+/*
+ * findLink
+ * Find the reliable link of a connected client
+ * @param cid The client's connection id
+ * @param address The address a message claiming to be from the client came
+ *	from
+ * @param incarnation Set to the link's incarnation
+ * @return The link, or NULL if the client is not connected from that
+ *	address or does not take reliable delivery
+ */
+struct reliableLink *findLink(int cid, const struct sockaddr_in *address,
+	unsigned int *incarnation) {
+	struct clientEntry *entry;
+	struct reliableLink *link = NULL;
+
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, cid);
+	if ( entry != NULL && entry->info.link != NULL &&
+		entry->info.address.sin_addr.s_addr == address->sin_addr.s_addr &&
+		entry->info.address.sin_port == address->sin_port ) {
+		link = entry->info.link;
+		*incarnation = link->incarnation;
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	return link;
+}
+
+/*
+ * takeLink
+ * Take a reliable link for a joining client.  Called with the client table
+ * lock held.
+ * @return The link, or NULL if none could be allocated
+ */
+struct reliableLink *takeLink() {
+	struct reliableLink *link = freeLinks;
+
+	if ( link != NULL ) {
+		freeLinks = link->nextFree;
+		return link;
+	}
+	link = malloc(sizeof(*link));
+	if ( link != NULL ) {
+		reliableInit(link);
+	}
+	return link;
+}
+
+/*
+ * retireLink
+ * Drop everything a quitting client's link holds and keep the link for
+ * reuse.  Called with the client table lock held.
+ * @param link The link
+ */
+void retireLink(struct reliableLink *link) {
+	pthread_mutex_lock(&link->lock);
+	reliableClear(link);
+	pthread_mutex_unlock(&link->lock);
+	link->nextFree = freeLinks;
+	freeLinks = link;
+}
+
+/*
+ * takeQueue
+ * Take an outbound queue for a joining client.  Called with the client
+ * table lock held.
+ * @return The queue, or NULL if none could be allocated
+ */
+struct sendQueue *takeQueue() {
+	struct sendQueue *queue = freeQueues;
+
+	if ( queue != NULL ) {
+		freeQueues = queue->nextFree;
+		return queue;
+	}
+	queue = malloc(sizeof(*queue));
+	if ( queue != NULL && queueInit(queue, serverOptions.queueDepth) < 0 ) {
+		free(queue);
+		queue = NULL;
+	}
+	return queue;
+}
+
+/*
+ * retireQueue
+ * Drop everything a quitting client's queue holds and keep the queue for
+ * reuse.  Called with the client table lock held.
+ * @param queue The queue
+ */
+void retireQueue(struct sendQueue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	queueClear(queue);
+	pthread_mutex_unlock(&queue->lock);
+	queue->nextFree = freeQueues;
+	freeQueues = queue;
+}
+
+/*
+ * serviceWorker
+ * Do the work a worker owes between receives: expire timers, send what its
+ * client queues hold, and evict the clients it has found dead
+ */
+void serviceWorker() {
+	serviceTimers();
+	flushBatches(0);
+	serviceCatchUps();
+	flushQueues();
+	evictPending();
+}
+
+/*
+ * workerTicks
+ * @return Whether the worker must wake every timer tick while idle: to
+ *	turn its timing wheel, to flush client queues waiting on the socket, or
+ *	to send more of a history
+ */
+int workerTicks() {
+	return serverOptions.reliable || serverOptions.idleTimeout > 0 ||
+		self->scheduled != NULL || self->catchUpCount > 0;
+}
+
+/*
+ * workerWake
+ * @return Microseconds a worker may wait for a datagram before it has work
+ *	of its own to do, or 0 to wait as long as it takes
+ */
+long workerWake() {
+	if ( self->batchCount > 0 ) {
+		return serverOptions.batchWindow;
+	}
+	return workerTicks() ? WHEEL_TICK * 1000L : 0;
+}
+
+/*
+ * serviceTimers
+ * Retransmit, give up, acknowledge, and notice idle clients as the
+ * worker's expired timers say
+ */
+void serviceTimers() {
+	struct reliableDatagram datagram;
+	struct reliableTimer *timer;
+	long now = reliableMillis();
+	int result;
+
+	while ( (timer = wheelExpire(&self->wheel, now)) != NULL ) {
+		if ( timer->kind == TIMER_IDLE ) {
+			idleExpired(timer, now);
+			continue;
+		}
+		result = reliableExpire(&self->wheel, timer, now, &datagram);
+		if ( result == RELIABLE_LOST ) {
+			metricsAdd(&self->metrics.reliableLost, 1);
+			if ( self->debug == DEBUG_ON ) {
+				logEvent("DEBUG: Gave up a reliable frame after %lu "
+					"retransmits\n", RELIABLE_RETRIES, 0, 0, 0);
+			}
+		} else if ( result != RELIABLE_NONE ) {
+			if ( result == RELIABLE_RESEND ) {
+				metricsAdd(&self->metrics.retransmits, 1);
+			}
+			sendDatagrams(&datagram, 1);
+		}
+	}
+}
+
+/*
+ * idleExpired
+ * Evict a client whose idle timer has expired if nothing has been heard
+ * from it since the timer was set, or set the timer again from when it
+ * was last heard from
+ * @param timer The expired TIMER_IDLE timer
+ * @param now The current time
+ */
+void idleExpired(struct reliableTimer *timer, long now) {
+	struct clientEntry *entry;
+	long deadline = -1;
+
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, timer->seq);
+	if ( entry != NULL && entry->serial == timer->incarnation ) {
+		deadline = entry->lastSeen + serverOptions.idleTimeout * 1000L;
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+
+	//The client quit, or is already waiting to be evicted
+	if ( deadline < 0 ) {
+		wheelFree(&self->wheel, timer);
+	} else if ( deadline > now ) {
+		wheelInsert(&self->wheel, timer, deadline);
+	} else if ( scheduleEviction(timer->seq, timer->incarnation) < 0 ) {
+		wheelInsert(&self->wheel, timer, now + WHEEL_TICK);
+	} else {
+		wheelFree(&self->wheel, timer);
+	}
+}
+
+/*
+ * touchClient
+ * Note that a client was heard from, if the datagram came from the
+ * client's address.  Each worker notes a client at most once every
+ * TOUCH_INTERVAL, so a busy client costs the table lock about once a second
+ * rather than once a message; until then the client is taken to be still
+ * connected from the address it was noted at.
+ * @param cid The client's connection id
+ * @param address The address the datagram came from
+ * @return Whether the client is connected from the address
+ */
+int touchClient(int cid, const struct sockaddr_in *address) {
+	struct clientEntry *entry;
+	int slot = cid % TOUCH_CACHE;
+	long now = reliableMillis();
+	int owned;
+
+	if ( self->touchedCid[slot] == cid &&
+		now - self->touchedAt[slot] < TOUCH_INTERVAL &&
+		self->touchedFrom[slot].sin_addr.s_addr == address->sin_addr.s_addr &&
+		self->touchedFrom[slot].sin_port == address->sin_port ) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, cid);
+	owned = entry != NULL &&
+		entry->info.address.sin_addr.s_addr == address->sin_addr.s_addr &&
+		entry->info.address.sin_port == address->sin_port;
+	if ( owned ) {
+		entry->lastSeen = now;
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+
+	//Only the client's own address is cached, so a forged id costs the
+	// lock every time rather than passing for the client
+	if ( owned ) {
+		self->touchedCid[slot] = cid;
+		self->touchedAt[slot] = now;
+		self->touchedFrom[slot] = *address;
+	}
+	return owned;
+}
+
+/*
+ * scheduleEviction
+ * Mark a client to be evicted once the worker is done with what it is
+ * sending, since eviction broadcasts the client's QUIT
+ * @param cid The client's connection id
+ * @param serial The registration serial of the client to evict
+ * @return 0 on success, -1 if the worker already has EVICT_BATCH clients
+ *	waiting
+ */
+int scheduleEviction(int cid, unsigned int serial) {
+	int i;
+
+	for ( i = 0; i < self->evictCount; i++ ) {
+		if ( self->evictCids[i] == cid && self->evictSerials[i] == serial ) {
+			return 0;
+		}
+	}
+	if ( self->evictCount == EVICT_BATCH ) {
+		return -1;
+	}
+	self->evictCids[self->evictCount] = cid;
+	self->evictSerials[self->evictCount++] = serial;
+	return 0;
+}
+
+/*
+ * evictPending
+ * Remove the clients the worker has marked for eviction, telling everyone
+ * as though each had sent its QUIT
+ */
+void evictPending() {
+	static const char reason[] = "";
+	struct messageView quit;
+	struct clientEntry *entry;
+	char *hostname;
+	char local[MAX_LINE];
+	int found;
+	int i;
+#ifdef HAVE_URING
+	struct uringGeneration *gen;
+#endif
+
+	for ( i = 0; i < self->evictCount; i++ ) {
+		hostname = local;
+#ifdef HAVE_URING
+		//io_uring sends read the QUIT after this returns, so its
+		// hostname goes in the current generation's arena; a generation
+		// already submitted must finish first
+		if ( self->uring != NULL ) {
+			gen = &self->uring->generations[self->uring->current];
+			hostname = gen->closed ? NULL : uringAlloc(gen, MAX_LINE);
+			if ( hostname == NULL ) {
+				break;
+			}
+		}
+#endif
+		bzero((char *)&quit, sizeof(quit));
+		pthread_mutex_lock(&clientRegister.lock);
+		entry = clientTableLookup(&clientRegister, self->evictCids[i]);
+		found = entry != NULL && entry->serial == self->evictSerials[i];
+		if ( found ) {
+			quit.hostnameLen = entry->info.hostnameLen;
+			memcpy(hostname, entry->info.hostname, quit.hostnameLen);
+		}
+		pthread_mutex_unlock(&clientRegister.lock);
+
+		//A client may have joined with an empty hostname; only one that
+		// has quit or been replaced is skipped
+		if ( !found ) {
+			continue;
+		}
+
+		quit.version = PROTOCOL_VERSION;
+		quit.opcode = OP_QUIT;
+		quit.cid = -self->evictCids[i];
+		quit.hostname = hostname;
+		quit.payload = reason;
+		if ( self->debug == DEBUG_ON ) {
+			logEvent("DEBUG: Evicting client %lu\n", self->evictCids[i],
+				0, 0, 0);
+		}
+		removeClient(self->sd, &quit, self->evictSerials[i], self->debug);
+		metricsAdd(&self->metrics.evictions, 1);
+	}
+
+	//Clients left over wait for the next call
+	memmove(self->evictCids, self->evictCids + i, 
+		(self->evictCount - i) * sizeof(*self->evictCids));
+	memmove(self->evictSerials, self->evictSerials + i,
+		(self->evictCount - i) * sizeof(*self->evictSerials));
+	self->evictCount -= i;
+}
+
+/*
+ * flushQueues
+ * Send what the worker's scheduled client queues hold, until they are
+ * empty or the socket is full again
+ */
+void flushQueues() {
+	struct sendQueue *queue;
+	struct sendQueue *next;
+	unsigned long sent = 0;
+	unsigned long syscalls = 0;
+
+	//A queue leaves the list once it is empty; read its successor first,
+	// since another worker may schedule it on its own list from then on
+	while ( (queue = self->scheduled) != NULL ) {
+		next = queue->nextScheduled;
+		if ( queueFlush(queue, self->sd, &sent, &syscalls) ) {
+			break;
+		}
+		self->scheduled = next;
+	}
+	metricsAdd(&self->metrics.messagesOut, sent);
+	metricsAdd(&self->metrics.syscalls, syscalls);
+}
+
+/*
+ * batchMicros
+ * @return The time in microseconds, from a clock that never steps
+ */
+long batchMicros() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/*
+ * batchMessage
+ * Add a message's frame to the batch of the room it is for, sending the
+ * batch first if the frame does not fit in it.  A room without a batch
+ * takes a free one, or the one due soonest once it has been sent.
+ * @param formats The message laid out in each wire protocol
+ * @param room The room
+ * @return 0 if the message was batched, -1 if its frame is too long for
+ *	any batch
+ */
+int batchMessage(const struct wireFormats *formats, int room) {
+	const struct iovec *iov = formats->iov[PROTOCOL_VERSION];
+	struct roomBatch *batch = NULL;
+	struct roomBatch *spare = NULL;
+	int length = 0;
+	int i;
+
+	for ( i = 0; i < formats->iovlen[PROTOCOL_VERSION]; i++ ) {
+		length += iov[i].iov_len;
+	}
+	if ( FRAME_HEADER + length > POOL_BUFFER_SIZE ) {
+		return -1;
+	}
+
+	for ( i = 0; i < BATCH_SLOTS && batch == NULL; i++ ) {
+		if ( self->batches[i].room == room ) {
+			batch = &self->batches[i];
+		} else if ( spare == NULL || (spare->room >= 0 && 
+			(self->batches[i].room < 0 ||
+			self->batches[i].due < spare->due)) ) {
+			spare = &self->batches[i];
+		}
+	}
+	if ( batch != NULL && batch->length + length > POOL_BUFFER_SIZE ) {
+		flushBatch(batch);
+	}
+	if ( batch == NULL ) {
+		if ( spare->room >= 0 ) {
+			flushBatch(spare);
+		}
+		batch = spare;
+	}
+	if ( batch->room < 0 ) {
+		batch->room = room;
+		batch->count = 0;
+		batch->due = batchMicros() + serverOptions.batchWindow;
+		batch->length = FRAME_HEADER;
+		self->batchCount++;
+	}
+
+	for ( i = 0; i < formats->iovlen[PROTOCOL_VERSION]; i++ ) {
+		memcpy(batch->data + batch->length, iov[i].iov_base,
+			iov[i].iov_len);
+		batch->length += iov[i].iov_len;
+	}
+	batch->count++;
+	return 0;
+}
+
+/*
+ * flushBatch
+ * Send a batch as one OP_BATCH frame to every client in its room that
+ * unpacks them, and take it out of use
+ * @param batch The batch
+ */
+void flushBatch(struct roomBatch *batch) {
+	struct messageView frame;
+	struct wireFormats formats;
+	struct memberSnapshot *snap;
+	char *data;
+
+	bzero((char *)&frame, sizeof(frame));
+	frame.version = PROTOCOL_VERSION;
+	frame.opcode = OP_BATCH;
+	frame.cid = JOIN_CID_CODE;
+	frame.payloadLen = batch->length - FRAME_HEADER;
+	encodeHeader(batch->data, &frame);
+
+	//io_uring sends read the frame after this returns
+	data = sendStorage(batch->data, batch->length);
+	if ( data != batch->data ) {
+		memcpy(data, batch->data, batch->length);
+	}
+	formats.iov[PROTOCOL_VERSION][0].iov_base = data;
+	formats.iov[PROTOCOL_VERSION][0].iov_len = batch->length;
+	formats.iovlen[PROTOCOL_VERSION] = 1;
+	formats.iovlen[PROTOCOL_TEXT] = 0;
+	formats.sending = SEND_BATCHED;
+
+	snap = roomReadLock(&chatRooms, &clientRegister, batch->room, self->id);
+	sendBuffer(self->sd, &formats, snap->members, snap->count,
+		JOIN_CID_CODE);
+	clientTableReadUnlock(&clientRegister, self->id);
+
+	metricsAdd(&self->metrics.batches, 1);
+	metricsAdd(&self->metrics.batched, batch->count);
+	batch->room = -1;
+	self->batchCount--;
+}
+
+/*
+ * flushBatches
+ * Send the worker's batches
+ * @param all Whether to send every batch, or only those that are due
+ */
+void flushBatches(int all) {
+	long now;
+	int i;
+
+	if ( self->batchCount == 0 ) {
+		return;
+	}
+#ifdef HAVE_URING
+	//Batches wait for a generation that can still take sends
+	if ( self->uring != NULL &&
+		self->uring->generations[self->uring->current].closed ) {
+		return;
+	}
+#endif
+	now = all ? 0 : batchMicros();
+	for ( i = 0; i < BATCH_SLOTS; i++ ) {
+		if ( self->batches[i].room >= 0 &&
+			(all || self->batches[i].due <= now) ) {
+			flushBatch(&self->batches[i]);
+		}
+	}
+}
+
+/*
+ * addClient
+ * Add a new client to the registered client list
+ * @param sd The server socket
+ * @param client_addr The client address sockaddr_in structure
+ * @param join The client's JOIN message
+ * @param protocol The wire protocol the client joined with
+ * @param debug Whether to output debugging informaiton
+ */
+void addClient(int sd, struct sockaddr_in client_addr, 
+	const struct messageView *join, int protocol, int debug) {
+	struct reliableLink *link = NULL;
+	struct sendQueue *queue;
+	struct clientEntry *entry;
+	long now = reliableMillis();
+	int allocated;
+
+	//A client that repeats its JOIN before seeing the join-ack keeps the
+	// number it was already given.  Otherwise take the first available
+	// client registration number.
+	pthread_mutex_lock(&clientRegister.lock);
+	allocated = clientTableFind(&clientRegister, &client_addr);
+	if ( allocated == JOIN_CID_CODE ) {
+		//A binary client may ask for reliable delivery; its join-ack is
+		// the first frame of its stream
+		if ( serverOptions.reliable && protocol >= PROTOCOL_VERSION &&
+			(join->flags & FLAG_OFFER_RELIABLE) ) {
+			link = takeLink();
+		}
+		queue = takeQueue();
+		allocated = clientTableAdd(&clientRegister, &client_addr, 
+			join->hostname, join->hostnameLen, protocol, link, queue);
+		if ( allocated > JOIN_CID_CODE ) {
+			clientTableLookup(&clientRegister, allocated)->info.batched =
+				protocol >= PROTOCOL_VERSION &&
+				(join->flags & FLAG_OFFER_BATCH) != 0;
+		}
+		//A new client waits in the lobby
+		if ( allocated > JOIN_CID_CODE && roomMove(&chatRooms, 
+			&clientRegister, allocated, ROOM_LOBBY) < 0 ) {
+			clientTableRemove(&clientRegister, allocated);
+			allocated = -1;
+		}
+		if ( allocated > JOIN_CID_CODE ) {
+			metricsAdd(&self->metrics.joins, 1);
+			entry = clientTableLookup(&clientRegister, allocated);
+			entry->lastSeen = now;
+			if ( link != NULL ) {
+				reliableReset(link, allocated, &client_addr);
+			}
+			if ( queue != NULL ) {
+				queueReset(queue, entry->serial, &client_addr);
+			}
+			//The joining worker watches the client for silence
+			if ( serverOptions.idleTimeout > 0 ) {
+				wheelAdd(&self->wheel, 
+					now + serverOptions.idleTimeout * 1000L, NULL,
+					entry->serial, allocated, sd, TIMER_IDLE);
+			}
+			saveClient(allocated);
+		} else {
+			if ( link != NULL ) {
+				link->nextFree = freeLinks;
+				freeLinks = link;
+			}
+			if ( queue != NULL ) {
+				queue->nextFree = freeQueues;
+				freeQueues = queue;
+			}
+		}
+	} else {
+		clientTableSetProtocol(&clientRegister, allocated, protocol);
+		clientTableLookup(&clientRegister, allocated)->lastSeen = now;
+		saveClient(allocated);
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+
+	//Send a join-ack including the newly registered client's number.
+	if ( allocated > JOIN_CID_CODE ) {
+		sendJoinAck(sd, allocated, join, debug);
+	} else {
+		printf("Server can only support %i connections.\n", MAX_CLIENTS);
+	}
+}
+
+/*
+ * removeClient
+ * Remove a client from the registered client list
+ * @param sd The server socket
+ * @param quit The client's QUIT message, carrying the negated client id
+ * @param serial The registration serial of the client to remove, or 0 for
+ *	whichever client holds the id
+ * @param debug Whether to output debugging informaiton
+ */
+void removeClient(int sd, const struct messageView *quit, 
+	unsigned int serial, int debug) {
+	struct messageView quitack = *quit;
+	struct clientEntry *entry;
+	int cid = -1 * quit->cid;
+
+	//ignore quits from clients that are not registered
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, cid);
+	if ( entry != NULL && serial != 0 && entry->serial != serial ) {
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	if ( entry == NULL ) {
+		return;
+	}
+
+	//construct a QUIT-ACK message from the quit message's strings
+	quitack.cid = cid;
+	
+	//broadcast the quit-ack message, here and on the peered servers
+	sendBcastMessage(sd, &quitack, ROOM_ALL, debug);
+	relayMessage(sd, &quitack, ROOM_ALL, NULL);
+
+	//remove the client from the register
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, cid);
+	if ( entry != NULL && (serial == 0 || entry->serial == serial) ) {
+		if ( entry->info.link != NULL ) {
+			retireLink(entry->info.link);
+		}
+		if ( entry->info.queue != NULL ) {
+			retireQueue(entry->info.queue);
+		}
+		roomDrop(&chatRooms, &clientRegister, cid);
+		clientTableRemove(&clientRegister, cid);
+		saveClient(cid);
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	metricsAdd(&self->metrics.quits, 1);
+}
+
+/*
+ * moveClient
+ * Move a client into the room it asked to enter, or back to the lobby, and
+ * tell the room it left and the room it entered.  The lobby is not told.
+ * @param sd The server socket
+ * @param clientAddr The address the request came from
+ * @param request The client's ENTER or LEAVE message
+ * @param debug Whether to output debugging informaiton
+ */
+void moveClient(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *request, int debug) {
+	struct messageView notice;
+	struct clientEntry *entry;
+	char local[MAX_LINE + 2 * (MAX_ROOM_NAME + 1)];
+	char *hostname = sendStorage(local, sizeof(local));
+	char *left = hostname + MAX_LINE;
+	char *entered = left + MAX_ROOM_NAME + 1;
+	int from = -1;
+	int to = ROOM_LOBBY;
+
+	//Only the client itself may move it
+	bzero((char *)&notice, sizeof(notice));
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, request->cid);
+	if ( entry != NULL &&
+		entry->info.address.sin_addr.s_addr == clientAddr.sin_addr.s_addr &&
+		entry->info.address.sin_port == clientAddr.sin_port ) {
+		from = roomOf(&chatRooms, request->cid);
+		strcpy(left, chatRooms.rooms[from]->name);
+		if ( request->opcode == OP_ENTER ) {
+			to = roomOpen(&chatRooms, request->payload, 
+				request->payloadLen);
+		}
+		if ( to >= 0 && to != from && roomMove(&chatRooms, 
+			&clientRegister, request->cid, to) < 0 ) {
+			to = -1;
+		}
+		if ( to >= 0 ) {
+			strcpy(entered, chatRooms.rooms[to]->name);
+		}
+		if ( to >= 0 && serverOptions.historyDepth > 0 ) {
+			historyOpen(&chatHistory, to, entered, strlen(entered));
+		}
+		if ( to >= 0 && to != from ) {
+			saveClient(request->cid);
+		}
+		notice.hostnameLen = entry->info.hostnameLen;
+		memcpy(hostname, entry->info.hostname, notice.hostnameLen);
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	if ( from < 0 || to < 0 || to == from ) {
+		return;
+	}
+
+	//The client hears that it left from the room it is no longer in, and
+	// that it entered from the room it is now in
+	notice.version = PROTOCOL_VERSION;
+	notice.cid = request->cid;
+	notice.hostname = hostname;
+	if ( from != ROOM_LOBBY ) {
+		notice.opcode = OP_LEAVE;
+		notice.payload = left;
+		notice.payloadLen = strlen(left);
+		sendBcastMessage(sd, &notice, from, debug);
+		relayMessage(sd, &notice, from, left);
+		sendMessage(sd, request->cid, &notice, debug);
+	}
+	if ( to != ROOM_LOBBY ) {
+		notice.opcode = OP_ENTER;
+		notice.payload = entered;
+		notice.payloadLen = strlen(entered);
+		sendBcastMessage(sd, &notice, to, debug);
+		relayMessage(sd, &notice, to, entered);
+	}
+}
+
+/*
+ * sendStorage
+ * Find memory for strings that a message about to be sent points at
+ * @param local Memory on the caller's stack
+ * @param size The number of bytes needed
+ * @return local, or with io_uring memory in the current generation, since
+ *	io_uring sends read the strings after the caller returns
+ */
+void *sendStorage(void *local, int size) {
+#ifdef HAVE_URING
+	if ( self->uring != NULL ) {
+		return uringAlloc(&self->uring->generations[self->uring->current],
+			size);
+	}
+#endif
+	return local;
+}
+
+/*
+ * sendJoinAck
+ * Send a join acknowledgement over broadcast, here and on the peered
+ * servers
+ * @param sd The server socket
+ * @param connectionID the client id to ack
+ * @param join The client's JOIN message
+ * @debug debug Whether to output debugging information
+ */	
+void sendJoinAck(int sd, int connectionID, const struct messageView *join,
+	int debug) {
+	struct messageView joinack = *join;
+	joinack.cid = connectionID;
+	joinack.flags = 0;
+	sendBcastMessage(sd, &joinack, ROOM_ALL, debug);
+	relayMessage(sd, &joinack, ROOM_ALL, NULL);
+}
+
+/*
+ * sendBcastMessage
+ * Send a message to the registered clients in a room
+ * @param sd The server socket
+ * @param theMessage The message to send 
+ * @param room The room, or ROOM_ALL for every registered client
+ * @debug debug Whether to output debugging information
+ */	
+void sendBcastMessage(int sd, const struct messageView *theMessage, 
+	int room, int debug) {
+	struct wireFormats formats;
+	struct memberSnapshot *snap;
+	int count;
+	int syscalls;
+
+	//Lay the message out once per wire protocol, pointing at the buffer
+	// it arrived in, and send it to every client in the current member
+	// snapshot of the room
+	gatherFormats(&formats, theMessage);
+
+	//Text said in a room is kept in the room's history, unless it was too
+	// long for one datagram; a hand-built datagram too long for a record is
+	// counted
+	if ( serverOptions.historyDepth > 0 && theMessage->opcode == OP_TEXT &&
+		!(theMessage->flags & FLAG_FRAGMENT) && room != ROOM_ALL &&
+		historyRecord(&chatHistory, room, formats.iov[PROTOCOL_VERSION],
+		formats.iovlen[PROTOCOL_VERSION]) < 0 ) {
+		metricsAdd(&self->metrics.historyDrops, 1);
+	}
+
+	//Text for a room waits in the room's batch for the clients that
+	// unpack batches.  Anything else first sends what the worker has
+	// batched, so that no client sees messages out of order.
+	if ( serverOptions.batchWindow > 0 ) {
+		if ( theMessage->opcode == OP_TEXT && room != ROOM_ALL &&
+			!(theMessage->flags & FLAG_FRAGMENT) &&
+			batchMessage(&formats, room) == 0 ) {
+			formats.sending = SEND_UNBATCHED;
+		} else {
+			flushBatches(1);
+		}
+	}
+	snap = room == ROOM_ALL ? clientTableReadLock(&clientRegister, self->id) :
+		roomReadLock(&chatRooms, &clientRegister, room, self->id);
+	count = snap->count;
+	syscalls = sendBuffer(sd, &formats, snap->members, count,
+		theMessage->cid < 0 ? -theMessage->cid : theMessage->cid);
+	if ( serverOptions.reliable ) {
+		syscalls += sendReliable(sd, theMessage, snap->members, count);
+	}
+	clientTableReadUnlock(&clientRegister, self->id);
+
+	pDebug(debug, SENT_STRING, theMessage);
+	if ( debug == DEBUG_ON ) {
+		logEvent("DEBUG: Broadcast to %lu clients in %lu syscalls\n",
+			count, syscalls, 0, 0);
+	}
+}
+
+/*
+ * sendMessage
+ * Send a message to a registered clients
+ * @param sd The server socket
+ * @param connectionID the client id to which to send 
+ * @param theMessage The message to send 
+ * @debug debug Whether to output debugging information
+ */	
+void sendMessage(int sd, int connectionID, 
+	const struct messageView *theMessage, int debug) {
+	if ( sendClient(sd, connectionID, 0, theMessage) == 0 ) {
+		pDebug(debug, SENT_STRING, theMessage);
+	}
+}
+
+/*
+ * relayMessage
+ * Send a message from this server's clients to every peer, once each
+ * @param sd The server socket
+ * @param theMessage The message to relay
+ * @param room The room it was sent to, or ROOM_ALL for every client
+ * @param name The room's name, or NULL to look it up
+ */
+void relayMessage(int sd, const struct messageView *theMessage, int room,
+	const char *name) {
+	struct messageView inner = *theMessage;
+	struct messageView outer;
+	struct relayHeader header;
+	struct iovec iov[GATHER_IOV];
+	char scratch[GATHER_SCRATCH];
+	char frame[POOL_BUFFER_SIZE];
+	char *roomName = frame + FRAME_HEADER + RELAY_HEADER;
+	int length;
+	int count;
+	int i;
+
+	if ( chatRelay.peerCount == 0 ) {
+		return;
+	}
+
+	//Peers find the room by name; a room closed since the message was
+	// sent has no name and is not relayed
+	header.roomLen = 0;
+	if ( room == ROOM_ALL ) {
+		header.roomLen = RELAY_ALL;
+	} else if ( room != ROOM_LOBBY && name != NULL ) {
+		header.roomLen = strlen(name);
+		memcpy(roomName, name, header.roomLen);
+	} else if ( room != ROOM_LOBBY ) {
+		pthread_mutex_lock(&clientRegister.lock);
+		header.roomLen = chatRooms.rooms[room]->nameLen;
+		memcpy(roomName, chatRooms.rooms[room]->name, header.roomLen);
+		pthread_mutex_unlock(&clientRegister.lock);
+		if ( header.roomLen == 0 ) {
+			return;
+		}
+	}
+	length = FRAME_HEADER + RELAY_HEADER +
+		(header.roomLen == RELAY_ALL ? 0 : header.roomLen);
+
+	//The message goes in as a binary frame, whatever protocol its sender
+	// spoke, and is copied once for all of the peers
+	inner.version = PROTOCOL_VERSION;
+	inner.flags &= FLAG_FRAGMENT;
+	count = gatherMessage(&inner, PROTOCOL_VERSION, scratch, iov);
+	for ( i = 0; i < count; i++ ) {
+		if ( length + (int)iov[i].iov_len > POOL_BUFFER_SIZE ) {
+			metricsAdd(&self->metrics.relayDrops, chatRelay.peerCount);
+			return;
+		}
+		memcpy(frame + length, iov[i].iov_base, iov[i].iov_len);
+		length += iov[i].iov_len;
+	}
+	messageCopies++;
+
+	bzero((char *)&outer, sizeof(outer));
+	outer.version = PROTOCOL_VERSION;
+	outer.opcode = OP_RELAY;
+	outer.cid = JOIN_CID_CODE;
+	outer.payloadLen = length - FRAME_HEADER;
+	encodeHeader(frame, &outer);
+	header.origin = chatRelay.origin;
+	header.epoch = chatRelay.epoch;
+	header.seq = atomic_fetch_add(&chatRelay.nextSeq, 1);
+	header.hops = 0;
+	relayEncode(frame + FRAME_HEADER, &header);
+	relaySend(sd, frame, length, -1);
+}
+
+/*
+ * receiveRelay
+ * Take a message relayed by a peer: deliver it to this server's clients in
+ * the room of the same name, if one is open, and pass it on to the other
+ * peers while it has crossed fewer links than the diameter
+ * @param sd The server socket
+ * @param peerAddr The address the frame came from
+ * @param frame The OP_RELAY frame
+ * @param debug Whether debugging output should be printed
+ */
+void receiveRelay(int sd, struct sockaddr_in peerAddr,
+	const struct messageView *frame, int debug) {
+	struct relayHeader header;
+	struct messageView inner;
+	struct messageView outer = *frame;
+	char forward[POOL_BUFFER_SIZE];
+	int peer = relayFind(&chatRelay, &peerAddr);
+	int room = ROOM_LOBBY;
+	int sent = 0;
+
+	//Only peers relay; anything else claiming to is dropped like any
+	// other malformed datagram
+	if ( peer < 0 || relayDecode(frame, &header, &inner) < 0 ) {
+		metricsAdd(&self->metrics.invalidDrops, 1);
+		return;
+	}
+	if ( !relayAccept(&chatRelay, &header) ) {
+		metricsAdd(&self->metrics.relayDuplicates, 1);
+		return;
+	}
+	metricsAdd(&self->metrics.relayIn, 1);
+
+	if ( header.roomLen == RELAY_ALL ) {
+		room = ROOM_ALL;
+	} else if ( header.roomLen > 0 ) {
+		pthread_mutex_lock(&clientRegister.lock);
+		room = roomFind(&chatRooms, header.room, header.roomLen);
+		pthread_mutex_unlock(&clientRegister.lock);
+	}
+	//A room none of this server's clients are in is not open here
+	if ( header.roomLen == RELAY_ALL || room >= 0 ) {
+		inner.cid = relayCid(header.origin, inner.cid);
+		sendBcastMessage(sd, &inner, room, debug);
+	}
+
+	//The frame goes on as it came, one link further
+	if ( header.hops + 1 < chatRelay.diameter ) {
+		outer.hostnameLen = 0;
+		encodeHeader(forward, &outer);
+		memcpy(forward + FRAME_HEADER, frame->payload, frame->payloadLen);
+		header.hops++;
+		relayEncode(forward + FRAME_HEADER, &header);
+		messageCopies++;
+		sent = relaySend(sd, forward, FRAME_HEADER + frame->payloadLen,
+			peer);
+	}
+	if ( debug == DEBUG_ON ) {
+		logEvent("DEBUG: Relayed message %lu from origin %lu, passed on "
+			"in %lu syscalls\n", header.seq, header.origin, sent, 0);
+	}
+}
+
+/*
+ * relaySend
+ * Send an OP_RELAY frame to every peer but one, in one system call where
+ * sendmmsg is available.  A peer whose datagram the socket will not take
+ * misses the message; relayed frames are not retransmitted.
+ * @param sd The server socket
+ * @param frame The frame
+ * @param length The length of the frame
+ * @param except The peer not to send to, or -1 to send to every peer
+ * @return The number of send system calls made
+ */
+int relaySend(int sd, const char *frame, int length, int except) {
+	struct iovec iov = { (void *)frame, length };
+	int syscalls = 0;
+	int count = 0;
+	int sent = 0;
+	int i;
+#ifdef HAVE_MMSG
+	struct mmsghdr msgs[RELAY_MAX_PEERS];
+	struct msghdr *hdr;
+
+	for ( i = 0; i < chatRelay.peerCount; i++ ) {
+		if ( i == except ) {
+			continue;
+		}
+		hdr = &msgs[count++].msg_hdr;
+		bzero((char *)hdr, sizeof(*hdr));
+		hdr->msg_name = &chatRelay.peers[i];
+		hdr->msg_namelen = sizeof(chatRelay.peers[i]);
+		hdr->msg_iov = &iov;
+		hdr->msg_iovlen = 1;
+	}
+	if ( count > 0 ) {
+		sent = sendmmsg(sd, msgs, count, MSG_DONTWAIT);
+		syscalls = 1;
+		if ( sent < 0 ) {
+			sent = 0;
+		}
+	}
+#else
+	struct msghdr msg;
+
+	bzero((char *)&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	for ( i = 0; i < chatRelay.peerCount; i++ ) {
+		if ( i == except ) {
+			continue;
+		}
+		msg.msg_name = &chatRelay.peers[i];
+		msg.msg_namelen = sizeof(chatRelay.peers[i]);
+		count++;
+		syscalls++;
+		if ( sendmsg(sd, &msg, MSG_DONTWAIT) >= 0 ) {
+			sent++;
+		}
+	}
+#endif
+	metricsAdd(&self->metrics.syscalls, syscalls);
+	metricsAdd(&self->metrics.messagesOut, sent);
+	metricsAdd(&self->metrics.relayOut, sent);
+	if ( sent < count ) {
+		metricsAdd(&self->metrics.relayDrops, count - sent);
+	}
+	return syscalls;
+}
+
+/*
+ * sendClient
+ * Send a message to one registered client, reliably if it takes reliable
+ * delivery
+ * @param sd The server socket
+ * @param connectionID the client id to which to send
+ * @param serial The registration serial of the client expected, or 0 for
+ *	whichever client holds the id
+ * @param theMessage The message to send
+ * @return 0 on success, -1 if the client is not registered
+ */
+int sendClient(int sd, int connectionID, unsigned int serial,
+	const struct messageView *theMessage) {
+	struct wireFormats formats;
+	struct memberRef member;
+	struct clientEntry *entry;
+
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, connectionID);
+	if ( entry != NULL && serial != 0 && entry->serial != serial ) {
+		entry = NULL;
+	}
+	if ( entry != NULL ) {
+		clientTableMember(&clientRegister, connectionID, &member);
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	if ( entry == NULL ) {
+		return -1;
+	}
+
+	gatherFormats(&formats, theMessage);
+	sendBuffer(sd, &formats, &member, 1, JOIN_CID_CODE);
+	sendReliable(sd, theMessage, &member, 1);
+	return 0;
+}
+
+/*
+ * gatherFormats
+ * Lay a message out for sending in every wire protocol
+ * @param formats The wire formats to fill
+ * @param theMessage The message
+ */
+void gatherFormats(struct wireFormats *formats, 
+	const struct messageView *theMessage) {
+	int protocol;
+	for ( protocol = PROTOCOL_TEXT; protocol <= PROTOCOL_VERSION; 
+		protocol++ ) {
+		formats->iovlen[protocol] = gatherMessage(theMessage, protocol,
+			formats->scratch[protocol], formats->iov[protocol]);
+	}
+	formats->sending = SEND_ALL;
+}
+
+/*
+ * sendBuffer
+ * Send one message to a list of registered clients, batching up to
+ * SEND_BATCH datagrams per system call where sendmmsg is available.
+ * Clients taking reliable delivery are left to sendReliable, and clients
+ * formats->sending leaves out are skipped.  Sends never
+ * wait for the socket: a client's datagram goes on its queue if the socket
+ * is full, or if the client already has datagrams queued.
+ * @param sd The server socket
+ * @param formats The message laid out in each wire protocol
+ * @param members The clients to which to send
+ * @param count The number of clients
+ * @param sender Client id of the message's sender, for coalescing
+ * @return The number of send system calls made
+ */
+int sendBuffer(int sd, const struct wireFormats *formats,
+	const struct memberRef *members, int count, int sender) {
+	struct poolBuffer *copies[PROTOCOL_VERSION+1] = { NULL };
+	int syscalls = 0;
+	int full = 0;
+	int i;
+#ifdef HAVE_URING
+	//io_uring queues sends in the kernel instead
+	if ( self->uring != NULL ) {
+		return uringSendBuffer(self->uring, sd, formats, members, count);
+	}
+#endif
+#ifdef HAVE_MMSG
+	struct mmsghdr msgs[SEND_BATCH];
+	struct msghdr *hdr;
+	int who[SEND_BATCH];
+	int batch, sent, n, protocol;
+
+	for ( i = 0; i < count; ) {
+		for ( batch = 0; batch < SEND_BATCH && i < count; i++ ) {
+			if ( !sendsTo(formats, &members[i]) ) {
+				continue;
+			}
+			if ( full || (members[i].queue != NULL &&
+				queueDepth(members[i].queue) > 0) ) {
+				queueDatagram(formats, copies, &members[i], sender);
+				continue;
+			}
+			protocol = members[i].protocol;
+			who[batch] = i;
+			hdr = &msgs[batch++].msg_hdr;
+			hdr->msg_name = (void *)&members[i].address;
+			hdr->msg_namelen = sizeof(struct sockaddr_in);
+			hdr->msg_iov = (struct iovec *)formats->iov[protocol];
+			hdr->msg_iovlen = formats->iovlen[protocol];
+			hdr->msg_control = NULL;
+			hdr->msg_controllen = 0;
+			hdr->msg_flags = 0;
+		}
+
+		//sendmmsg stops at the first datagram that fails; skip that
+		// recipient and carry on with the rest of the batch, or queue
+		// the rest if the socket is full
+		n = 0;
+		while ( n < batch ) {
+			sent = sendmmsg(sd, &msgs[n], batch - n, MSG_DONTWAIT);
+			syscalls++;
+			metricsAdd(&self->metrics.syscalls, 1);
+			if ( sent > 0 ) {
+				metricsAdd(&self->metrics.messagesOut, sent);
+				n += sent;
+			} else if ( errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == ENOBUFS ) {
+				full = 1;
+				for ( ; n < batch; n++ ) {
+					queueDatagram(formats, copies, &members[who[n]],
+						sender);
+				}
+			} else {
+				metricsAdd(&self->metrics.sendFailures, 1);
+				n++;
+			}
+		}
+	}
+#else
+	struct msghdr msg;
+	int protocol;
+
+	for ( i = 0; i < count; i++ ) {
+		if ( !sendsTo(formats, &members[i]) ) {
+			continue;
+		}
+		if ( full || (members[i].queue != NULL &&
+			queueDepth(members[i].queue) > 0) ) {
+			queueDatagram(formats, copies, &members[i], sender);
+			continue;
+		}
+		protocol = members[i].protocol;
+		msg.msg_name = (void *)&members[i].address;
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		msg.msg_iov = (struct iovec *)formats->iov[protocol];
+		msg.msg_iovlen = formats->iovlen[protocol];
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		msg.msg_flags = 0;
+		if ( sendmsg(sd, &msg, MSG_DONTWAIT) >= 0 ) {
+			metricsAdd(&self->metrics.messagesOut, 1);
+		} else if ( errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == ENOBUFS ) {
+			full = 1;
+			queueDatagram(formats, copies, &members[i], sender);
+		} else {
+			metricsAdd(&self->metrics.sendFailures, 1);
+		}
+		syscalls++;
+		metricsAdd(&self->metrics.syscalls, 1);
+	}
+#endif
+	for ( i = PROTOCOL_TEXT; i <= PROTOCOL_VERSION; i++ ) {
+		if ( copies[i] != NULL ) {
+			poolRelease(copies[i]);
+		}
+	}
+	return syscalls;
+}
+
+/*
+ * replayHistory
+ * Start sending a client the history of the room it is in, as much at a
+ * time as CATCHUP_PACE frames a timer tick
+ * @param sd The server socket
+ * @param clientAddr The address the request came from
+ * @param request The client's OP_HISTORY message
+ * @param debug Whether to output debugging informaiton
+ */
+void replayHistory(int sd, struct sockaddr_in clientAddr,
+	const struct messageView *request, int debug) {
+	struct clientEntry *entry;
+	struct catchUp *item;
+	char number[GATHER_SCRATCH];
+	unsigned int serial = 0;
+	int count = 0;
+
+	if ( serverOptions.historyDepth == 0 ||
+		self->catchUpCount == CATCHUP_MAX ) {
+		return;
+	}
+
+	//Only the client itself may ask
+	pthread_mutex_lock(&clientRegister.lock);
+	entry = clientTableLookup(&clientRegister, request->cid);
+	if ( entry != NULL &&
+		entry->info.address.sin_addr.s_addr == clientAddr.sin_addr.s_addr &&
+		entry->info.address.sin_port == clientAddr.sin_port ) {
+		serial = entry->serial;
+	}
+	pthread_mutex_unlock(&clientRegister.lock);
+	copyString(number, sizeof(number), request->payload,
+		request->payloadLen);
+	if ( !(request->flags & FLAG_SINCE) ) {
+		count = atoi(number);
+	}
+	if ( serial == 0 || (count < 1 && !(request->flags & FLAG_SINCE)) ) {
+		return;
+	}
+
+	item = &self->catchUps[self->catchUpCount];
+	item->cid = request->cid;
+	item->serial = serial;
+	item->room = roomOf(&chatRooms, request->cid);
+	item->next = historyStart(&chatHistory, item->room, count,
+		strtoul(number, NULL, 10), &item->end);
+	if ( item->next == item->end ) {
+		return;
+	}
+	self->catchUpCount++;
+	if ( debug == DEBUG_ON ) {
+		logEvent("DEBUG: Sending client %lu history %lu to %lu\n",
+			item->cid, item->next, item->end - 1, 0);
+	}
+}
+
+/*
+ * serviceCatchUps
+ * Send every history in progress its next CATCHUP_PACE frames, once a
+ * timer tick, so that a client catching up does not get the whole history
+ * in one burst.  A history stops early if its client leaves the room.
+ */
+void serviceCatchUps() {
+	struct messageView frame;
+	struct catchUp *item;
+	char local[HISTORY_FRAME];
+	char *records;
+	unsigned int first;
+	long now;
+	int length;
+	int done;
+	int i, n;
+
+	if ( self->catchUpCount == 0 ||
+		(now = reliableMillis()) < self->catchUpDue ) {
+		return;
+	}
+#ifdef HAVE_URING
+	if ( self->uring != NULL &&
+		self->uring->generations[self->uring->current].closed ) {
+		return;
+	}
+#endif
+	self->catchUpDue = now + WHEEL_TICK;
+
+	bzero((char *)&frame, sizeof(frame));
+	frame.version = PROTOCOL_VERSION;
+	frame.opcode = OP_HISTORY;
+	frame.hostname = "";
+	for ( i = 0; i < self->catchUpCount; ) {
+		item = &self->catchUps[i];
+		done = roomOf(&chatRooms, item->cid) != item->room;
+		for ( n = 0; n < CATCHUP_PACE && !done; n++ ) {
+			//io_uring sends read the records after this returns
+			records = sendStorage(local, HISTORY_FRAME);
+			length = historyCopy(&chatHistory, item->room, &item->next,
+				item->end, records, HISTORY_FRAME, &first);
+			frame.cid = (int)first;
+			frame.payload = records;
+			frame.payloadLen = length;
+			done = length == 0 || sendClient(self->sd, item->cid,
+				item->serial, &frame) < 0 || item->next == item->end;
+		}
+		if ( done ) {
+			*item = self->catchUps[--self->catchUpCount];
+		} else {
+			i++;
+		}
+	}
+}
+
+/*
+ * sendsTo
+ * @param formats The message laid out in each wire protocol
+ * @param member A client
+ * @return Whether sendBuffer sends the message to the client, rather than
+ *	leaving it to sendReliable or to the client's room batch
+ */
+int sendsTo(const struct wireFormats *formats, const struct memberRef *member) {
+	int batched = member->batched && member->protocol >= PROTOCOL_VERSION;
+
+	if ( member->link != NULL || formats->iovlen[member->protocol] == 0 ) {
+		return 0;
+	}
+	if ( formats->sending == SEND_UNBATCHED ) {
+		return !batched;
+	}
+	return formats->sending == SEND_ALL || batched;
+}
+
+/*
+ * queueDatagram
+ * Put a message on a client's queue, copying it out of the buffer it
+ * arrived in the first time it is queued in each wire protocol
+ * @param formats The message laid out in each wire protocol
+ * @param copies The message's pooled copy in each wire protocol, or NULL
+ *	where none has been made yet
+ * @param member The client
+ * @param sender Client id of the message's sender
+ * @return QUEUE_ADDED, QUEUE_DROPPED, QUEUE_COALESCED, or -1 if the message
+ *	could not be queued
+ */
+int queueDatagram(const struct wireFormats *formats, 
+	struct poolBuffer **copies, const struct memberRef *member,
+	int sender) {
+	int protocol = member->protocol;
+	struct poolBuffer *copy = copies[protocol];
+	int schedule;
+	int result;
+	int i;
+
+	if ( member->queue == NULL ) {
+		metricsAdd(&self->metrics.sendFailures, 1);
+		return -1;
+	}
+	if ( copy == NULL && (copy = poolAlloc()) != NULL ) {
+		for ( i = 0; i < formats->iovlen[protocol]; i++ ) {
+			if ( copy->length + formats->iov[protocol][i].iov_len >
+				POOL_BUFFER_SIZE ) {
+				break;
+			}
+			memcpy(copy->data + copy->length, 
+				formats->iov[protocol][i].iov_base,
+				formats->iov[protocol][i].iov_len);
+			copy->length += formats->iov[protocol][i].iov_len;
+		}
+		if ( i < formats->iovlen[protocol] ) {
+			poolRelease(copy);
+			copy = NULL;
+		} else {
+			messageCopies++;
+		}
+		copies[protocol] = copy;
+	}
+	if ( copy == NULL ) {
+		metricsAdd(&self->metrics.queueDrops, 1);
+		return -1;
+	}
+
+	result = queuePush(member->queue, member->serial, copy, sender,
+		serverOptions.queuePolicy, &schedule);
+	if ( schedule ) {
+		member->queue->nextScheduled = self->scheduled;
+		self->scheduled = member->queue;
+	}
+	if ( result == QUEUE_ADDED ) {
+		metricsAdd(&self->metrics.queued, 1);
+	} else if ( result == QUEUE_DROPPED ) {
+		metricsAdd(&self->metrics.queueDrops, 1);
+	} else if ( result == QUEUE_COALESCED ) {
+		metricsAdd(&self->metrics.coalesced, 1);
+	}
+	return result;
+}
+
+/*
+ * sendReliable
+ * Send one message, sequenced, to the clients in a list that take reliable
+ * delivery, keeping it on each client's link until it is acknowledged
+ * @param sd The server socket
+ * @param theMessage The message to send
+ * @param members The clients to which to send
+ * @param count The number of clients
+ * @return The number of send system calls made
+ */
+int sendReliable(int sd, const struct messageView *theMessage,
+	const struct memberRef *members, int count) {
+	struct reliableDatagram datagrams[SEND_BATCH];
+	struct poolBuffer *frame = NULL;
+	unsigned long lost = 0;
+	long now = 0;
+	int syscalls = 0;
+	int n = 0;
+	int given;
+	int i;
+
+	//Every recipient's datagram shares one copy of the frame, which
+	// stays on the links after the message's own buffer is reused
+	for ( i = 0; i < count; i++ ) {
+		if ( members[i].link == NULL ) {
+			continue;
+		}
+		if ( frame == NULL ) {
+			frame = reliableFrame(theMessage);
+			if ( frame == NULL ) {
+				metricsAdd(&self->metrics.sendFailures, 1);
+				return 0;
+			}
+			now = reliableMillis();
+		}
+		given = reliableQueue(members[i].link, members[i].incarnation,
+			frame, sd, now, &self->wheel, &datagrams[n]);
+		if ( given < 0 ) {
+			continue;
+		}
+		lost += given;
+
+		//A client that lets the server give up queueDepth frames
+		// without acknowledging any is not keeping up
+		if ( given > 0 && reliableAbandoned(members[i].link) >=
+			(unsigned int)serverOptions.queueDepth ) {
+			scheduleEviction(members[i].cid, members[i].serial);
+		}
+		if ( ++n == SEND_BATCH ) {
+			syscalls += sendDatagrams(datagrams, n);
+			n = 0;
+		}
+	}
+	if ( n > 0 ) {
+		syscalls += sendDatagrams(datagrams, n);
+	}
+	if ( frame != NULL ) {
+		poolRelease(frame);
+	}
+	metricsAdd(&self->metrics.reliableLost, lost);
+	return syscalls;
+}
+
+/*
+ * sendDatagrams
+ * Send prepared reliable datagrams, batched where sendmmsg is available,
+ * and drop their references to their frames
+ * @param datagrams The datagrams, at most SEND_BATCH, all from one socket
+ * @param count The number of datagrams
+ * @return The number of send system calls made
+ */
+int sendDatagrams(struct reliableDatagram *datagrams, int count) {
+	int syscalls = 0;
+	int i;
+#ifdef HAVE_MMSG
+	struct mmsghdr msgs[SEND_BATCH];
+	struct msghdr *hdr;
+	int sent;
+
+	for ( i = 0; i < count; i++ ) {
+		hdr = &msgs[i].msg_hdr;
+		hdr->msg_name = &datagrams[i].address;
+		hdr->msg_namelen = sizeof(datagrams[i].address);
+		hdr->msg_iov = datagrams[i].iov;
+		hdr->msg_iovlen = datagrams[i].iovlen;
+		hdr->msg_control = NULL;
+		hdr->msg_controllen = 0;
+		hdr->msg_flags = 0;
+	}
+	//A frame the socket will not take stays on its link and is sent
+	// again when its timer expires, like a lost one
+	i = 0;
+	while ( i < count ) {
+		sent = sendmmsg(datagrams[0].sd, &msgs[i], count - i, 
+			MSG_DONTWAIT);
+		syscalls++;
+		metricsAdd(&self->metrics.syscalls, 1);
+		if ( sent > 0 ) {
+			metricsAdd(&self->metrics.messagesOut, sent);
+			i += sent;
+		} else {
+			metricsAdd(&self->metrics.sendFailures, 1);
+			i++;
+		}
+	}
+	for ( i = 0; i < count; i++ ) {
+		if ( datagrams[i].frame != NULL ) {
+			poolRelease(datagrams[i].frame);
+		}
+	}
+#else
+	for ( i = 0; i < count; i++ ) {
+		if ( reliableSend(&datagrams[i]) < 0 ) {
+			metricsAdd(&self->metrics.sendFailures, 1);
+		} else {
+			metricsAdd(&self->metrics.messagesOut, 1);
+		}
+		syscalls++;
+		metricsAdd(&self->metrics.syscalls, 1);
+	}
+#endif
+	return syscalls;
+}
+
+#ifdef HAVE_URING
+/*
+ * runUringWorker
+ * Receive and process client data on the worker's socket through io_uring.
+ * One multishot receive stays armed, filling buffers provided to the
+ * kernel, and each batch of received datagrams is handled while the sends
+ * of earlier batches are still in flight.
+ * @return Only if io_uring cannot be set up
+ */
+void runUringWorker() {
+	struct uringEngine *engine = calloc(1, sizeof(*engine));
+
+	if ( engine == NULL || uringInit(&engine->ring, URING_ENTRIES,
+		URING_BUFFERS, URING_BUFFER_SIZE) < 0 ) {
+		fprintf(stderr, "io_uring is not available; using blocking "
+			"I/O\n");
+		free(engine);
+		return;
+	}
+	engine->recvMsg.msg_namelen = sizeof(struct sockaddr_in);
+	engine->recvMsg.msg_controllen = CMSG_SPACE(sizeof(unsigned int)) +
+		CMSG_SPACE(sizeof(struct timespec));
+	self->uring = engine;
+
+	while ( 1 ) {
+		uringProcess(engine);
+		if ( !engine->armed && engine->held < URING_BUFFERS ) {
+			uringArm(engine);
+		}
+		if ( !engine->ticking && workerWake() > 0 ) {
+			uringTick(engine);
+		}
+		uringEnter(engine, 1);
+		uringReap(engine);
+		serviceWorker();
+	}
+}
+
+/*
+ * uringEnter
+ * Submit queued requests and wait for completions
+ * @param engine The engine
+ * @param wait Completions to wait for
+ */
+void uringEnter(struct uringEngine *engine, unsigned wait) {
+	uringSubmit(&engine->ring, wait);
+	metricsAdd(&self->metrics.syscalls, 1);
+}
+
+/*
+ * uringArm
+ * Queue a multishot receive on the worker's socket
+ * @param engine The engine
+ */
+void uringArm(struct uringEngine *engine) {
+	struct io_uring_sqe *sqe = uringGetSqe(&engine->ring);
+
+	if ( sqe == NULL ) {
+		return;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = self->sd;
+	sqe->addr = (unsigned long)&engine->recvMsg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_RECV;
+	engine->armed = 1;
+}
+
+/*
+ * uringTick
+ * Queue a timeout that wakes the worker after a timer tick, or when its
+ * batches are due.  A batch started while a tick is outstanding may wait
+ * for that tick.
+ * @param engine The engine
+ */
+void uringTick(struct uringEngine *engine) {
+	struct io_uring_sqe *sqe = uringGetSqe(&engine->ring);
+
+	if ( sqe == NULL ) {
+		return;
+	}
+	engine->tick.tv_sec = workerWake() / 1000000;
+	engine->tick.tv_nsec = workerWake() % 1000000 * 1000L;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&engine->tick;
+	sqe->len = 1;
+	sqe->user_data = URING_TIMER;
+	engine->ticking = 1;
+}
+
+/*
+ * uringReap
+ * Consume every completion: set received datagrams aside to be handled,
+ * and count finished sends against their generation
+ * @param engine The engine
+ */
+void uringReap(struct uringEngine *engine) {
+	struct io_uring_cqe *cqe;
+	struct uringGeneration *gen;
+
+	while ( (cqe = uringPeek(&engine->ring)) != NULL ) {
+		if ( cqe->user_data == URING_RECV ) {
+			//The receive stops when it runs out of buffers
+			if ( !(cqe->flags & IORING_CQE_F_MORE) ) {
+				engine->armed = 0;
+			}
+			if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+				engine->pending[engine->pendingCount++] = *cqe;
+				engine->held++;
+			}
+		} else if ( cqe->user_data == URING_TIMER ) {
+			engine->ticking = 0;
+		} else {
+			gen = &engine->generations[cqe->user_data - 1];
+			if ( cqe->res < 0 ) {
+				metricsAdd(&self->metrics.sendFailures, 1);
+			} else {
+				metricsAdd(&self->metrics.messagesOut, 1);
+			}
+			if ( --gen->inflight == 0 && gen->closed ) {
+				uringRetire(engine, gen);
+			}
+		}
+		uringAdvance(&engine->ring);
+	}
+}
+
+/*
+ * uringProcess
+ * Handle every received datagram set aside, queueing their sends in the
+ * current generation, unless that generation is still in flight
+ * @param engine The engine
+ */
+void uringProcess(struct uringEngine *engine) {
+	struct uringGeneration *gen = &engine->generations[engine->current];
+	struct timespec now;
+	int i;
+
+	if ( engine->pendingCount == 0 || gen->closed ) {
+		return;
+	}
+	if ( serverOptions.metricsPort > 0 ) {
+		clock_gettime(CLOCK_REALTIME, &now);
+	}
+	metricsAdd(&self->metrics.messagesIn, engine->pendingCount);
+	if ( self->debug == DEBUG_ON ) {
+		logEvent("DEBUG: Received %lu datagrams through io_uring, "
+			"%lu dropped\n", engine->pendingCount, droppedPackets(),
+			0, 0);
+	}
+
+	for ( i = 0; i < engine->pendingCount; i++ ) {
+		uringReceive(engine, gen, &engine->pending[i], &now);
+	}
+	engine->pendingCount = 0;
+
+	gen->closed = 1;
+	engine->current = (engine->current + 1) % URING_GENERATIONS;
+	if ( gen->inflight == 0 ) {
+		uringRetire(engine, gen);
+	}
+}
+
+/*
+ * uringReceive
+ * Handle one received datagram in the buffer the kernel placed it in
+ * @param engine The engine
+ * @param gen The generation taking the datagram's sends
+ * @param cqe The receive completion
+ * @param now When the batch was reaped, for datagrams without a kernel
+ *	timestamp
+ */
+void uringReceive(struct uringEngine *engine, struct uringGeneration *gen,
+	const struct io_uring_cqe *cqe, const struct timespec *now) {
+	int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	struct io_uring_recvmsg_out *out = 
+		(struct io_uring_recvmsg_out *)uringBuffer(&engine->ring, id);
+	struct sockaddr_in addr;
+	struct messageView view;
+	struct msghdr control;
+	struct timespec arrival;
+	char *payload;
+	int protocol = -1;
+
+	gen->buffers[gen->bufferCount++] = id;
+
+	//The buffer holds the header, then the source address, ancillary
+	// data and payload, each in the space recvMsg reserved for it
+	bzero((char *)&addr, sizeof(addr));
+	memcpy(&addr, out + 1, out->namelen < sizeof(addr) ? 
+		out->namelen : sizeof(addr));
+	bzero((char *)&control, sizeof(control));
+	control.msg_control = (char *)(out + 1) + engine->recvMsg.msg_namelen;
+	control.msg_controllen = out->controllen;
+	if ( serverOptions.metricsPort > 0 ) {
+		arrival = *now;
+	}
+	readControl(&control, &arrival);
+	payload = (char *)control.msg_control + engine->recvMsg.msg_controllen;
+
+	//A source over its rate is dropped unparsed, unless it is a peer
+	if ( cqe->res >= 0 && serverOptions.sourceRate > 0 &&
+		!limitSource(&self->limiter, &addr, reliableMillis()) &&
+		relayFind(&chatRelay, &addr) < 0 ) {
+		metricsAdd(&self->metrics.sourceThrottled, 1);
+		return;
+	}
+	if ( cqe->res >= 0 && !(out->flags & MSG_TRUNC) && 
+		out->payloadlen <= POOL_BUFFER_SIZE ) {
+		protocol = parseDatagram(payload, out->payloadlen, &view);
+	}
+	if ( protocol < 0 ) {
+		metricsAdd(&self->metrics.invalidDrops, 1);
+		return;
+	}
+
+	processClientMessage(self->sd, addr, &view, protocol, self->debug);
+	if ( serverOptions.metricsPort > 0 && metricsSample(&self->metrics) ) {
+		gen->arrivals[gen->arrivalCount++] = arrival;
+	}
+}
+
+/*
+ * uringRetire
+ * Finish a generation whose sends have all completed: record its
+ * latencies, give its receive buffers back to the kernel, and reuse its
+ * arena
+ * @param engine The engine
+ * @param gen The generation
+ */
+void uringRetire(struct uringEngine *engine, struct uringGeneration *gen) {
+	struct uringChunk *chunk;
+	struct timespec now;
+	int i;
+
+	if ( gen->arrivalCount > 0 ) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		for ( i = 0; i < gen->arrivalCount; i++ ) {
+			histogramRecord(&self->metrics.latency,
+				metricsElapsed(&gen->arrivals[i], &now));
+		}
+	}
+
+	for ( i = 0; i < gen->bufferCount; i++ ) {
+		uringProvide(&engine->ring, gen->buffers[i]);
+	}
+	uringProvideCommit(&engine->ring);
+	engine->held -= gen->bufferCount;
+
+	for ( chunk = gen->chunks; chunk != NULL; chunk = chunk->next ) {
+		chunk->used = 0;
+	}
+	gen->chunk = gen->chunks;
+	gen->bufferCount = 0;
+	gen->arrivalCount = 0;
+	gen->closed = 0;
+}
+
+/*
+ * uringAlloc
+ * Hand out memory that lives until the generation is retired
+ * @param gen The generation
+ * @param size The number of bytes
+ * @return The memory
+ */
+void *uringAlloc(struct uringGeneration *gen, int size) {
+	struct uringChunk *chunk = gen->chunk;
+	void *memory;
+
+	size = (size + 15) & ~15;
+	if ( chunk != NULL && chunk->used + size > URING_CHUNK ) {
+		chunk = chunk->next;
+		if ( chunk != NULL ) {
+			gen->chunk = chunk;
+		}
+	}
+	if ( chunk == NULL ) {
+		chunk = malloc(sizeof(*chunk));
+		if ( chunk == NULL ) {
+			perror("Could not allocate io_uring arena");
+			exit(1);
+		}
+		chunk->used = 0;
+		chunk->next = NULL;
+		if ( gen->chunk == NULL ) {
+			gen->chunks = chunk;
+		} else {
+			gen->chunk->next = chunk;
+		}
+		gen->chunk = chunk;
+	}
+	memory = chunk->data + chunk->used;
+	chunk->used += size;
+	return memory;
+}
+
+/*
+ * uringSendBuffer
+ * Queue one message to a list of registered clients in the current
+ * generation.  The message's wire formats and recipients are copied into
+ * the generation's arena, since the sends outlive the caller's copies.
+ * @param engine The engine
+ * @param sd The server socket
+ * @param formats The message laid out in each wire protocol
+ * @param members The clients to which to send
+ * @param count The number of clients
+ * @return The number of system calls made to make room for the sends
+ */
+int uringSendBuffer(struct uringEngine *engine, int sd,
+	const struct wireFormats *formats, const struct memberRef *members, 
+	int count) {
+	struct uringGeneration *gen = &engine->generations[engine->current];
+	struct wireFormats *copy = uringAlloc(gen, sizeof(*copy));
+	struct io_uring_sqe *sqe;
+	struct uringSend *send;
+	const char *base;
+	int syscalls = 0;
+	int protocol;
+	int i;
+
+	//Point the copy's vectors at its own client id and header scratch
+	memcpy(copy, formats, sizeof(*copy));
+	for ( protocol = PROTOCOL_TEXT; protocol <= PROTOCOL_VERSION; 
+		protocol++ ) {
+		for ( i = 0; i < copy->iovlen[protocol]; i++ ) {
+			base = copy->iov[protocol][i].iov_base;
+			if ( base >= (const char *)formats->scratch && base < 
+				(const char *)formats->scratch + 
+				sizeof(formats->scratch) ) {
+				copy->iov[protocol][i].iov_base = (char *)copy->scratch +
+					(base - (const char *)formats->scratch);
+			}
+		}
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		if ( !sendsTo(formats, &members[i]) ) {
+			continue;
+		}
+		protocol = members[i].protocol;
+		send = uringAlloc(gen, sizeof(*send));
+		bcopy((char *)&members[i].address, (char *)&send->address,
+			sizeof(send->address));
+		bzero((char *)&send->msg, sizeof(send->msg));
+		send->msg.msg_name = &send->address;
+		send->msg.msg_namelen = sizeof(send->address);
+		send->msg.msg_iov = copy->iov[protocol];
+		send->msg.msg_iovlen = copy->iovlen[protocol];
+
+		while ( (sqe = uringGetSqe(&engine->ring)) == NULL ) {
+			uringEnter(engine, 0);
+			syscalls++;
+		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sd;
+		sqe->addr = (unsigned long)&send->msg;
+		sqe->len = 1;
+		sqe->user_data = engine->current + 1;
+		gen->inflight++;
+	}
+	return syscalls;
 }
+#endif
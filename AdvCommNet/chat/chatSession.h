@@ -0,0 +1,1084 @@
+/******************************************************************************/
+// chatSession.h
+// Chat client sessions, driven without blocking from one thread.  A
+// chatClient holds any number of sessions, each a client of the server
+// with its own socket, since the server tells clients apart by address.
+// Every socket is watched by one event loop, which the caller may add
+// descriptors of its own to; chatClientPoll waits on it, keeps the
+// sessions joined, pinged and retransmitting, handles what they receive,
+// and hands back only the caller's descriptors that are ready.
+//
+// What the sessions receive is passed to the client's handlers: each
+// session's own join-ack, other clients' text, quits, joins and room
+// changes, and history.  Handlers are called from chatClientPoll and from
+// any call that sends on a reliable session, since such a session takes
+// what has arrived, without waiting, before it sends.
+//
+// No call that sends blocks.  A reliable session whose send window is full
+// keeps what it is asked to send, in order, on its backlog, and
+// chatClientPoll sends it as the server's acknowledgements open the window;
+// the client's backlog counts what every session is holding, so the caller
+// can stop taking input until it is sent.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Client session values
+ */
+enum {
+	JOIN_TIMEOUT_SEC = 1,
+	QUIT_LINGER_MS = 3000,
+	MAX_SESSIONS = 16384,
+	SESSION_SUFFIX = 6,
+	RECEIVE_BUDGET = 64,
+	CHAT_SENT = 0,
+	CHAT_QUEUED = 1
+};
+
+struct chatClient;
+
+/*
+ * Chat session data structure
+ * @param info The session's client information; connected is its client
+ *	id once joined, JOIN_CID_CODE until then
+ * @param sd The session's socket
+ * @param deliver Whether the session's text, quits, notices and history
+ *	are passed to the handlers; its join-ack always is
+ * @param joinDue When to send the next join command, in milliseconds
+ * @param backlog Reliable frames waiting for room in the send window,
+ *	oldest first, linked through their next fields
+ * @param backlogTail The newest frame on the backlog
+ * @param user Left to the caller
+ * @param client The client the session belongs to
+ */
+struct chatSession {
+	struct clientInformation info;
+	int sd;
+	int deliver;
+	long joinDue;
+	struct poolBuffer *backlog;
+	struct poolBuffer *backlogTail;
+	void *user;
+	struct chatClient *client;
+};
+
+/*
+ * Chat handlers data structure; a NULL handler is skipped.  Views and
+ * their strings are only valid during the call.
+ * @param joined Called once, when a session is assigned its client id
+ * @param text Called with another client's text, once every fragment of a
+ *	long message is in
+ * @param quit Called when a client quits
+ * @param notice Called when another client joins, or a client enters or
+ *	leaves a room; the view's opcode says which
+ * @param history Called with each message the server's history holds,
+ *	and its sequence number in the room
+ */
+struct chatHandlers {
+	void (*joined)(struct chatSession *session);
+	void (*text)(struct chatSession *session, const struct messageView *view);
+	void (*quit)(struct chatSession *session, const struct messageView *view);
+	void (*notice)(struct chatSession *session,
+		const struct messageView *view);
+	void (*history)(struct chatSession *session, unsigned int seq,
+		const struct messageView *view);
+};
+
+/*
+ * Chat options data structure
+ * @param offerBinary Whether to offer the binary protocol when joining
+ * @param offerReliable Whether to ask for reliable delivery when joining
+ * @param historyCount Messages of history to ask for on joining and on
+ *	entering a room, or 0
+ * @param historySince Ask on joining for the lobby's messages after this
+ *	number instead, or -1
+ * @param reassemblySlots Most long messages put back together at once, or
+ *	0 for REASSEMBLY_SLOTS
+ * @param debug Whether debugging output should be printed
+ */
+struct chatOptions {
+	int offerBinary;
+	int offerReliable;
+	int historyCount;
+	long historySince;
+	int reassemblySlots;
+	int debug;
+};
+
+/*
+ * Chat client data structure
+ * @param sessions The sessions
+ * @param count Number of sessions
+ * @param joining Number of sessions not yet joined
+ * @param aimed Whether the sessions know the server's address
+ * @param handlers What to do with what the sessions receive
+ * @param options How the sessions join
+ * @param loop Watches every session's socket, and the caller's descriptors
+ * @param wheel Reliable delivery timers of every session
+ * @param pingDue When the joined sessions next ping, in milliseconds, or 0
+ * @param messageIds Number of the last message sent in fragments
+ * @param reassembly Long messages being put back together
+ * @param backlog Reliable frames on every session's backlog
+ * @param retransmits Reliable frames sent again
+ * @param lost Reliable frames given up, by either end
+ */
+struct chatClient {
+	struct chatSession *sessions;
+	int count;
+	int joining;
+	int aimed;
+	struct chatHandlers handlers;
+	struct chatOptions options;
+	struct eventLoop loop;
+	struct timerWheel wheel;
+	long pingDue;
+	unsigned int messageIds;
+	struct reassembler reassembly;
+	int backlog;
+	unsigned long retransmits;
+	unsigned long lost;
+};
+
+/*
+ * Function signature declarations see function definitions for further
+ * documentation
+ */
+int chatReceiveSession(struct chatSession *session);
+int chatHandleMessage(struct chatSession *session, const char *buffer,
+	int length);
+void chatDeliver(struct chatSession *session, const struct messageView *view);
+int chatSend(struct chatSession *session, const struct messageView *message);
+void chatSendBacklogs(struct chatClient *client);
+
+/*
+ * chatMillis
+ * @return A monotonic clock in milliseconds
+ */
+long chatMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * chatSocket
+ * Create a socket to use for sending data to the server
+ * @return The socket, or -1 on failure
+ */
+int chatSocket() {
+	int sd;
+	struct sockaddr_in client_addr;
+
+	sd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ( sd < 0 ) {
+		return -1;
+	}
+
+	bzero((char *) &client_addr, sizeof(client_addr));
+	client_addr.sin_family = AF_INET;
+	client_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	client_addr.sin_port = htons(0);
+
+	if ( bind(sd, (struct sockaddr *) &client_addr, sizeof(client_addr))
+		< 0 ) {
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+/*
+ * chatClientInit
+ * Set up a client's sessions, each with its own socket, watched by the
+ * client's event loop.  Session 0 is named hostname and session i
+ * hostname.i; every session delivers.  The sessions join once the client
+ * is aimed.
+ * @param client The client
+ * @param count Number of sessions, 1 to MAX_SESSIONS
+ * @param hostname The sessions' hostname; only its first
+ *	MAX_LINE - 1 - SESSION_SUFFIX characters are used
+ * @param handlers What to do with what the sessions receive
+ * @param options How the sessions join
+ * @return 0 on success, -1 on failure, with errno set
+ */
+int chatClientInit(struct chatClient *client, int count, const char *hostname,
+	const struct chatHandlers *handlers, const struct chatOptions *options) {
+	struct chatSession *session;
+	int i;
+
+	if ( count < 1 || count > MAX_SESSIONS ) {
+		errno = EINVAL;
+		return -1;
+	}
+	bzero((char *)client, sizeof(*client));
+	client->handlers = *handlers;
+	client->options = *options;
+	client->count = count;
+	client->joining = count;
+	if ( eventInit(&client->loop) < 0 ) {
+		return -1;
+	}
+	client->sessions = calloc(count, sizeof(*client->sessions));
+	if ( client->sessions == NULL ||
+		reassemblerInit(&client->reassembly, options->reassemblySlots > 0 ?
+		options->reassemblySlots : REASSEMBLY_SLOTS) < 0 ) {
+		return -1;
+	}
+	wheelInit(&client->wheel);
+
+	for ( i = 0; i < count; i++ ) {
+		session = &client->sessions[i];
+		session->client = client;
+		session->deliver = 1;
+		session->info.connected = JOIN_CID_CODE;
+		session->info.protocol = PROTOCOL_TEXT;
+		//Every session's ".<number>" suffix, up to SESSION_SUFFIX long,
+		// fits after the name, so no two sessions share a hostname
+		if ( i == 0 ) {
+			snprintf(session->info.hostname, MAX_LINE, "%.*s",
+				MAX_LINE - 1 - SESSION_SUFFIX, hostname);
+		} else {
+			snprintf(session->info.hostname, MAX_LINE, "%.*s.%i",
+				MAX_LINE - 1 - SESSION_SUFFIX, hostname, i);
+		}
+		session->info.hostnameLen = strlen(session->info.hostname);
+		session->sd = chatSocket();
+		if ( session->sd < 0 ) {
+			return -1;
+		}
+		if ( options->offerReliable ) {
+			session->info.link = malloc(sizeof(struct reliableLink));
+			if ( session->info.link == NULL ) {
+				return -1;
+			}
+			reliableInit(session->info.link);
+		}
+		if ( eventAdd(&client->loop, session->sd, session) < 0 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * chatClientAim
+ * Give every session the server's address, so that it can start joining
+ * @param client The client
+ * @param server_addr The server's address
+ */
+void chatClientAim(struct chatClient *client,
+	const struct sockaddr_in *server_addr) {
+	struct chatSession *session;
+	int i;
+
+	for ( i = 0; i < client->count; i++ ) {
+		session = &client->sessions[i];
+		bcopy((char *)server_addr, (char *)&session->info.address,
+			sizeof(*server_addr));
+		session->joinDue = 0;
+		if ( session->info.link != NULL ) {
+			reliableReset(session->info.link, JOIN_CID_CODE, server_addr);
+		}
+	}
+	client->aimed = 1;
+}
+
+/*
+ * chatClientWatch
+ * Watch one of the caller's descriptors for input along with the sessions
+ * @param client The client
+ * @param fd The descriptor
+ * @param owner What chatClientPoll reports when the descriptor is
+ *	readable; not a session
+ * @return 0 on success, -1 on failure
+ */
+int chatClientWatch(struct chatClient *client, int fd, void *owner) {
+	return eventAdd(&client->loop, fd, owner);
+}
+
+/*
+ * chatClientUnwatch
+ * Stop watching one of the caller's descriptors
+ * @param client The client
+ * @param fd The descriptor
+ */
+void chatClientUnwatch(struct chatClient *client, int fd) {
+	eventRemove(&client->loop, fd);
+}
+
+/*
+ * chatCommand
+ * Prepare and send a message with no text of its own
+ * @param session The session
+ * @param opcode The message's opcode
+ * @param flags The message's flags
+ * @param cid The client id to send
+ * @param payload The room or number the message carries
+ * @param payloadLen The length of the payload
+ * @return As chatSend
+ */
+int chatCommand(struct chatSession *session, int opcode, int flags, int cid,
+	const char *payload, int payloadLen) {
+	struct messageView command;
+	command.version = session->info.protocol;
+	command.opcode = opcode;
+	command.flags = flags;
+	command.cid = cid;
+	command.hostname = session->info.hostname;
+	command.hostnameLen = session->info.hostnameLen;
+	command.payload = payload;
+	command.payloadLen = payloadLen;
+
+	return chatSend(session, &command);
+}
+
+/*
+ * chatJoin
+ * Prepare and send a JOIN command.  The binary protocol is offered by
+ * following the text JOIN with a NUL and a binary JOIN frame.
+ * @param session The session
+ */
+void chatJoin(struct chatSession *session) {
+	struct clientInformation *myinfo = &session->info;
+	struct messageView joinMessage;
+	char scratch[2][GATHER_SCRATCH];
+	struct iovec iov[2*GATHER_IOV+1];
+	struct msghdr msg;
+	int n;
+
+	joinMessage.version = PROTOCOL_TEXT;
+	joinMessage.opcode = OP_JOIN;
+	joinMessage.flags = FLAG_OFFER_BATCH |
+		(myinfo->link != NULL ? FLAG_OFFER_RELIABLE : 0);
+	joinMessage.cid = JOIN_CID_CODE;
+	joinMessage.hostname = myinfo->hostname;
+	joinMessage.hostnameLen = myinfo->hostnameLen;
+	joinMessage.payload = "";
+	joinMessage.payloadLen = 0;
+
+	n = gatherMessage(&joinMessage, PROTOCOL_TEXT, scratch[0], iov);
+	if ( session->client->options.offerBinary ) {
+		iov[n].iov_base = "";
+		iov[n++].iov_len = 1;
+		n += gatherMessage(&joinMessage, PROTOCOL_VERSION, scratch[1],
+			iov + n);
+	}
+
+	bzero((char *)&msg, sizeof(msg));
+	msg.msg_name = &myinfo->address;
+	msg.msg_namelen = sizeof(myinfo->address);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	sendmsg(session->sd, &msg, 0);
+
+	pDebug(session->client->options.debug, SENT_STRING, &joinMessage);
+}
+
+/*
+ * chatAskHistory
+ * Ask for history of the room a session is in.  A server that only speaks
+ * text keeps no history, and is not asked.
+ * @param session The session
+ * @param since Whether value is the number of the last message the session
+ *	has, rather than the number of messages wanted
+ * @param value The number
+ */
+void chatAskHistory(struct chatSession *session, int since,
+	unsigned long value) {
+	char number[GATHER_SCRATCH];
+
+	if ( session->info.protocol < PROTOCOL_VERSION ) {
+		return;
+	}
+	chatCommand(session, OP_HISTORY, since ? FLAG_SINCE : 0,
+		session->info.connected, number,
+		snprintf(number, sizeof(number), "%lu", value));
+}
+
+/*
+ * chatSendJoins
+ * Send a join command from every session that is due to send one
+ * @param client The client
+ * @param now The current time in milliseconds
+ * @return Milliseconds until the next session is due to send a join
+ */
+int chatSendJoins(struct chatClient *client, long now) {
+	struct chatSession *session;
+	long next = -1;
+	int i;
+
+	for ( i = 0; i < client->count; i++ ) {
+		session = &client->sessions[i];
+		if ( session->info.connected != JOIN_CID_CODE ) {
+			continue;
+		}
+		if ( session->joinDue <= now ) {
+			chatJoin(session);
+			session->joinDue = now + JOIN_TIMEOUT_SEC * 1000;
+		}
+		if ( next < 0 || session->joinDue < next ) {
+			next = session->joinDue;
+		}
+	}
+	return next < 0 ? -1 : next - now;
+}
+
+/*
+ * chatSendPings
+ * Ping the server from every session that speaks the binary protocol, once
+ * every KEEPALIVE_SEC, so that a server evicting idle clients keeps quiet
+ * ones.  Text sessions cannot ping and must talk to stay registered.
+ * @param client The client
+ * @param now The current time in milliseconds
+ * @return Milliseconds until the sessions are due to ping again
+ */
+int chatSendPings(struct chatClient *client, long now) {
+	struct chatSession *session;
+	int i;
+
+	if ( client->pingDue == 0 ) {
+		client->pingDue = now + KEEPALIVE_SEC * 1000L;
+	}
+	if ( now >= client->pingDue ) {
+		for ( i = 0; i < client->count; i++ ) {
+			session = &client->sessions[i];
+			if ( session->info.connected != JOIN_CID_CODE &&
+				session->info.protocol >= PROTOCOL_VERSION ) {
+				chatCommand(session, OP_PING, 0, session->info.connected,
+					"", 0);
+			}
+		}
+		client->pingDue = now + KEEPALIVE_SEC * 1000L;
+	}
+	return client->pingDue - now;
+}
+
+/*
+ * chatServiceTimers
+ * Retransmit, give up, and acknowledge as the expired timers say
+ * @param client The client
+ * @param now The current time in milliseconds
+ * @return Milliseconds until the timers next need servicing, or -1 if none
+ *	is set
+ */
+int chatServiceTimers(struct chatClient *client, long now) {
+	struct reliableDatagram datagram;
+	struct reliableTimer *timer;
+	int result;
+
+	while ( (timer = wheelExpire(&client->wheel, now)) != NULL ) {
+		result = reliableExpire(&client->wheel, timer, now, &datagram);
+		if ( result == RELIABLE_LOST ) {
+			client->lost++;
+		} else if ( result != RELIABLE_NONE ) {
+			if ( result == RELIABLE_RESEND ) {
+				client->retransmits++;
+			}
+			reliableSend(&datagram);
+		}
+	}
+	return wheelTimeout(&client->wheel, now);
+}
+
+/*
+ * chatIsSession
+ * @param client The client
+ * @param owner An owner the event loop reported
+ * @return Whether the owner is one of the client's sessions
+ */
+int chatIsSession(struct chatClient *client, void *owner) {
+	return (char *)owner >= (char *)client->sessions &&
+		(char *)owner < (char *)(client->sessions + client->count);
+}
+
+/*
+ * chatClientPoll
+ * Send the joins, pings and retransmits that are due, wait for input,
+ * handle what the sessions receive, and send what the sessions' backlogs
+ * now have room for.  Waits no longer than the next of
+ * those is due, so the caller should call again whatever it returns.
+ * @param client The client
+ * @param ready The owners of the caller's readable descriptors, filled;
+ *	descriptors beyond max stay readable for the next call
+ * @param max The most owners to return
+ * @param timeout Milliseconds to wait, or -1 to wait for input
+ * @return The number of owners returned
+ */
+int chatClientPoll(struct chatClient *client, void **ready, int max,
+	int timeout) {
+	void *owners[EVENT_BATCH];
+	long now = chatMillis();
+	int wait;
+	int count = 0;
+	int n, i;
+
+	//The sessions wait for the server's address before joining, and ping
+	// once they have all joined
+	if ( client->aimed ) {
+		wait = client->joining > 0 ? chatSendJoins(client, now) :
+			chatSendPings(client, now);
+		if ( timeout < 0 || wait < timeout ) {
+			timeout = wait;
+		}
+	}
+	if ( client->options.offerReliable ) {
+		wait = chatServiceTimers(client, now);
+		if ( wait >= 0 && (timeout < 0 || wait < timeout) ) {
+			timeout = wait;
+		}
+	}
+
+	n = eventWait(&client->loop, owners, EVENT_BATCH, timeout);
+	for ( i = 0; i < n; i++ ) {
+		if ( chatIsSession(client, owners[i]) ) {
+			chatReceiveSession(owners[i]);
+		} else if ( count < max ) {
+			ready[count++] = owners[i];
+		}
+	}
+
+	//What arrived may have opened send windows
+	chatSendBacklogs(client);
+	return count;
+}
+
+/*
+ * chatReceive
+ * Receive a message from the server on a session's socket and handle it
+ * @param session The session
+ * @return 0 if a message was handled, -1 if none was waiting
+ */
+int chatReceive(struct chatSession *session) {
+	socklen_t serverLen = sizeof(session->info.address);
+	int receivedLen = 0;
+	struct poolBuffer *buffer = poolAlloc();
+
+	if ( buffer == NULL ) {
+		return 0;
+	}
+	//Receive a message into a pooled buffer and handle it in place; the
+	// received length bounds every later read of the buffer
+	receivedLen = recvfrom(session->sd, buffer->data, POOL_BUFFER_SIZE,
+		MSG_DONTWAIT, (struct sockaddr *)&session->info.address,
+		&serverLen);
+	if ( receivedLen > 0 ) {
+		buffer->length = receivedLen;
+		chatHandleMessage(session, buffer->data, buffer->length);
+	}
+	poolRelease(buffer);
+	return receivedLen < 0 ? -1 : 0;
+}
+
+/*
+ * chatReceiveSession
+ * Receive and handle the messages waiting on a session's socket, leaving
+ * the rest for the next wait rather than starve other sessions
+ * @param session The session
+ * @return The number of messages handled
+ */
+int chatReceiveSession(struct chatSession *session) {
+	int i;
+
+	for ( i = 0; i < RECEIVE_BUDGET; i++ ) {
+		if ( chatReceive(session) < 0 ) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * chatHandleBatch
+ * Act on every frame an OP_BATCH frame carries, in order, as though each
+ * had arrived alone.  A batch never holds another batch, so a bad one
+ * cannot recurse.
+ * @param session The session
+ * @param batch The OP_BATCH frame
+ */
+void chatHandleBatch(struct chatSession *session,
+	const struct messageView *batch) {
+	const char *record = batch->payload;
+	int left = batch->payloadLen;
+	struct messageView view;
+	int length;
+
+	while ( left > 0 && (length = decodeFrame(record, left, &view)) > 0 ) {
+		if ( view.opcode != OP_BATCH ) {
+			chatHandleMessage(session, record, length);
+		}
+		record += length;
+		left -= length;
+	}
+}
+
+/*
+ * chatReceiveReliable
+ * Take a reliable frame from the server, acknowledge it, and act on every
+ * message it puts in order
+ * @param session The session
+ * @param view The frame
+ */
+void chatReceiveReliable(struct chatSession *session,
+	const struct messageView *view) {
+	struct chatClient *client = session->client;
+	struct reliableLink *link = session->info.link;
+	struct reliableDatagram ack;
+	struct messageView ordered;
+	struct poolBuffer *held;
+	int result;
+
+	//The join-ack is the first frame of the stream, and carries the id
+	// every acknowledgement is sent with
+	if ( view->opcode == OP_JOIN && link->cid == JOIN_CID_CODE &&
+		view->hostnameLen == session->info.hostnameLen &&
+		memcmp(view->hostname, session->info.hostname,
+		view->hostnameLen) == 0 ) {
+		pthread_mutex_lock(&link->lock);
+		link->cid = view->cid;
+		pthread_mutex_unlock(&link->lock);
+	}
+
+	result = reliableAccept(link, link->incarnation, view, session->sd,
+		chatMillis(), &client->wheel, &ack, &client->lost);
+	if ( ack.iovlen > 0 ) {
+		reliableSend(&ack);
+	}
+
+	if ( result == RELIABLE_DELIVER ) {
+		chatDeliver(session, view);
+	}
+	while ( session->info.link != NULL && (held = reliableNext(link,
+		link->incarnation, &client->lost)) != NULL ) {
+		if ( decodeFrame(held->data, held->length, &ordered) >= 0 ) {
+			chatDeliver(session, &ordered);
+		}
+		poolRelease(held);
+	}
+}
+
+/*
+ * chatHandleMessage
+ * View a message from the server in place, as a binary frame or as text,
+ * and act on it.  Acknowledgements and reliable frames are passed to the
+ * session's reliable link.
+ * @param session The session
+ * @param buffer The raw message buffer
+ * @param length The length of the message buffer
+ * @return 0 if the message was handled, -1 if it is malformed
+ */
+int chatHandleMessage(struct chatSession *session, const char *buffer,
+	int length) {
+	struct reliableLink *link = session->info.link;
+	struct messageView view;
+	int valid;
+
+	if ( (unsigned char)buffer[0] == FRAME_MAGIC ) {
+		valid = decodeFrame(buffer, length, &view);
+	} else {
+		valid = parseMessage(buffer, length, &view);
+	}
+	if ( valid < 0 ) {
+		return -1;
+	}
+	if ( view.opcode == OP_BATCH ) {
+		chatHandleBatch(session, &view);
+		return 0;
+	}
+	if ( view.opcode == OP_ACK ) {
+		if ( link != NULL ) {
+			reliableAck(link, link->incarnation, &view, chatMillis());
+		}
+		return 0;
+	}
+	pDebug(session->client->options.debug, RECV_STRING, &view);
+
+	if ( (view.flags & FLAG_RELIABLE) && link != NULL ) {
+		chatReceiveReliable(session, &view);
+	} else {
+		chatDeliver(session, &view);
+	}
+	return 0;
+}
+
+/*
+ * chatJoined
+ * Take a session's join-ack: note its client id and the server's protocol,
+ * and ask for history
+ * @param session The session
+ * @param view The join-ack
+ */
+void chatJoined(struct chatSession *session, const struct messageView *view) {
+	struct chatClient *client = session->client;
+	struct reliableLink *link = session->info.link;
+
+	session->info.protocol = view->version;
+
+	//A server that does not take reliable delivery answers without it;
+	// drop the link and send plainly
+	if ( link != NULL && !(view->flags & FLAG_RELIABLE) ) {
+		pthread_mutex_lock(&link->lock);
+		reliableClear(link);
+		pthread_mutex_unlock(&link->lock);
+		free(link);
+		session->info.link = NULL;
+	}
+
+	//Join-acks to joins sent again are not news
+	if ( session->info.connected != JOIN_CID_CODE || view->cid <= 0 ) {
+		return;
+	}
+	session->info.connected = view->cid;
+	client->joining--;
+	if ( client->options.historySince >= 0 ) {
+		chatAskHistory(session, 1, client->options.historySince);
+	} else if ( client->options.historyCount > 0 ) {
+		chatAskHistory(session, 0, client->options.historyCount);
+	}
+	if ( client->handlers.joined != NULL ) {
+		client->handlers.joined(session);
+	}
+}
+
+/*
+ * chatDeliverHistory
+ * Pass on the messages an OP_HISTORY frame carries, each with its sequence
+ * number in the room
+ * @param session The session
+ * @param view The OP_HISTORY frame
+ */
+void chatDeliverHistory(struct chatSession *session,
+	const struct messageView *view) {
+	const char *record = view->payload;
+	int left = view->payloadLen;
+	unsigned int seq = (unsigned int)view->cid;
+	struct messageView said;
+	int length;
+
+	while ( left > 0 && (length = decodeFrame(record, left, &said)) > 0 ) {
+		session->client->handlers.history(session, seq++, &said);
+		record += length;
+		left -= length;
+	}
+}
+
+/*
+ * chatDeliver
+ * Act on a message from the server, in the order the server sent it
+ * @param session The session
+ * @param view The message
+ */
+void chatDeliver(struct chatSession *session, const struct messageView *view) {
+	struct chatHandlers *handlers = &session->client->handlers;
+	struct messageView whole;
+
+	//A join-ack naming this session's hostname is its own
+	if ( view->opcode == OP_JOIN &&
+		view->hostnameLen == session->info.hostnameLen &&
+		memcmp(view->hostname, session->info.hostname,
+		view->hostnameLen) == 0 ) {
+		chatJoined(session, view);
+		return;
+	}
+	if ( !session->deliver ) {
+		return;
+	}
+
+	if ( view->opcode == OP_QUIT ) {
+		if ( handlers->quit != NULL ) {
+			handlers->quit(session, view);
+		}
+	} else if ( view->opcode == OP_JOIN || view->opcode == OP_ENTER ||
+		view->opcode == OP_LEAVE ) {
+		if ( handlers->notice != NULL ) {
+			handlers->notice(session, view);
+		}
+	} else if ( view->opcode == OP_HISTORY ) {
+		if ( handlers->history != NULL ) {
+			chatDeliverHistory(session, view);
+		}
+	//Pass on text which this session didn't send, once every fragment of
+	// a long one is in
+	} else if ( view->opcode == OP_TEXT && handlers->text != NULL ) {
+		if ( view->flags & FLAG_FRAGMENT ) {
+			if ( reassemble(&session->client->reassembly,
+				session - session->client->sessions, view, chatMillis(),
+				&whole) != REASSEMBLY_COMPLETE ) {
+				return;
+			}
+			view = &whole;
+		}
+		if ( view->cid != session->info.connected ) {
+			handlers->text(session, view);
+		}
+	}
+}
+
+/*
+ * chatSend
+ * Send a message, on the session's reliable link if it has one.  A reliable
+ * message that would give up an older one, or that would overtake the
+ * session's backlog, goes on the end of the backlog instead.
+ * @param session The session
+ * @param message The message to send
+ * @return CHAT_SENT, CHAT_QUEUED if it went on the backlog, or -1 if no
+ *	buffer could be allocated for a reliable frame
+ */
+int chatSend(struct chatSession *session, const struct messageView *message) {
+	struct chatClient *client = session->client;
+	struct clientInformation *myinfo = &session->info;
+	char scratch[GATHER_SCRATCH];
+	struct iovec iov[GATHER_IOV];
+	struct msghdr msg;
+	struct reliableDatagram datagram;
+	struct poolBuffer *frame;
+	int lost;
+
+	//Pings, like acknowledgements, are not sequenced
+	if ( myinfo->link != NULL && message->opcode != OP_PING ) {
+		frame = reliableFrame(message);
+		if ( frame == NULL ) {
+			return -1;
+		}
+		pDebug(client->options.debug, SENT_STRING, message);
+		if ( session->backlog != NULL || !reliableRoom(myinfo->link) ) {
+			frame->next = NULL;
+			if ( session->backlog == NULL ) {
+				session->backlog = frame;
+			} else {
+				session->backlogTail->next = frame;
+			}
+			session->backlogTail = frame;
+			client->backlog++;
+			return CHAT_QUEUED;
+		}
+		lost = reliableQueue(myinfo->link, myinfo->link->incarnation, frame,
+			session->sd, chatMillis(), &client->wheel, &datagram);
+		poolRelease(frame);
+		if ( lost >= 0 ) {
+			client->lost += lost;
+			reliableSend(&datagram);
+		}
+		return CHAT_SENT;
+	}
+
+	//Send straight from the message's strings in the server's protocol
+	msg.msg_name = &myinfo->address;
+	msg.msg_namelen = sizeof(myinfo->address);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = gatherMessage(message, myinfo->protocol, scratch, iov);
+	msg.msg_control = NULL;
+	msg.msg_controllen = 0;
+	msg.msg_flags = 0;
+	sendmsg(session->sd, &msg, 0);
+
+	pDebug(client->options.debug, SENT_STRING, message);
+	return CHAT_SENT;
+}
+
+/*
+ * chatSendBacklog
+ * Send the oldest frames of a session's backlog while its send window has
+ * room for them
+ * @param session The session
+ */
+void chatSendBacklog(struct chatSession *session) {
+	struct chatClient *client = session->client;
+	struct reliableLink *link = session->info.link;
+	struct reliableDatagram datagram;
+	struct poolBuffer *frame;
+	int lost;
+
+	while ( session->backlog != NULL && reliableRoom(link) ) {
+		frame = session->backlog;
+		session->backlog = frame->next;
+		client->backlog--;
+		lost = reliableQueue(link, link->incarnation, frame, session->sd,
+			chatMillis(), &client->wheel, &datagram);
+		poolRelease(frame);
+		if ( lost >= 0 ) {
+			client->lost += lost;
+			reliableSend(&datagram);
+		}
+	}
+}
+
+/*
+ * chatTakeArrived
+ * Take what has arrived on a reliable session, without waiting, so that a
+ * burst of sends does not outrun the acknowledgements and frames coming
+ * back.  Does nothing for other sessions.
+ * @param session The session
+ */
+void chatTakeArrived(struct chatSession *session) {
+	if ( session->info.link != NULL ) {
+		chatReceiveSession(session);
+		chatSendBacklog(session);
+	}
+}
+
+/*
+ * chatSendBacklogs
+ * Send what every session's backlog has room for
+ * @param client The client
+ */
+void chatSendBacklogs(struct chatClient *client) {
+	int i;
+
+	for ( i = 0; i < client->count && client->backlog > 0; i++ ) {
+		chatSendBacklog(&client->sessions[i]);
+	}
+}
+
+/*
+ * chatSay
+ * Send text from a session, in fragments if it is too long for one
+ * datagram.  A server speaking only text is sent what fits one datagram.
+ * @param session The session
+ * @param text The text, not ending in a newline
+ * @param length The length of the text, at most MAX_MESSAGE
+ * @return CHAT_SENT, CHAT_QUEUED if any of it went on the session's
+ *	backlog, or -1 if a reliable frame could not be allocated
+ */
+int chatSay(struct chatSession *session, const char *text, int length) {
+	struct messageView message;
+	int offset = 0;
+	int result = CHAT_SENT;
+	int sent;
+
+	message.opcode = OP_TEXT;
+	message.hostname = session->info.hostname;
+	message.hostnameLen = session->info.hostnameLen;
+	if ( length > FRAGMENT_DATA && session->info.protocol != PROTOCOL_TEXT ) {
+		message.flags = FLAG_FRAGMENT;
+		message.messageId = ++session->client->messageIds;
+		message.messageLen = length;
+	} else {
+		message.flags = 0;
+		if ( length > FRAGMENT_DATA ) {
+			length = FRAGMENT_DATA;
+		}
+	}
+
+	do {
+		chatTakeArrived(session);
+		message.version = session->info.protocol;
+		message.cid = session->info.connected;
+		message.payload = text + offset;
+		message.payloadLen = length - offset < FRAGMENT_DATA ?
+			length - offset : FRAGMENT_DATA;
+		message.offset = offset;
+		sent = chatSend(session, &message);
+		if ( sent != CHAT_SENT ) {
+			result = sent;
+		}
+		offset += message.payloadLen;
+	} while ( offset < length && result >= 0 );
+	return result;
+}
+
+/*
+ * chatMove
+ * Move a session between rooms, and ask for the history of the room it
+ * moves to if the client asks for history
+ * @param session The session
+ * @param opcode OP_ENTER or OP_LEAVE
+ * @param room The room
+ * @param roomLen The length of the room
+ * @return As chatSend for the room command
+ */
+int chatMove(struct chatSession *session, int opcode, const char *room,
+	int roomLen) {
+	int result;
+
+	chatTakeArrived(session);
+	result = chatCommand(session, opcode, 0, session->info.connected, room,
+		roomLen);
+	if ( result >= 0 && session->client->options.historyCount > 0 ) {
+		chatAskHistory(session, 0, session->client->options.historyCount);
+	}
+	return result;
+}
+
+/*
+ * chatQuit
+ * Send a QUIT command from a session that has joined
+ * @param session The session
+ */
+void chatQuit(struct chatSession *session) {
+	if ( session->info.connected != JOIN_CID_CODE ) {
+		chatCommand(session, OP_QUIT, 0, -1 * session->info.connected,
+			"", 0);
+	}
+}
+
+/*
+ * chatLinger
+ * Keep receiving, retransmitting and sending backlogs until every reliable
+ * session's sends are acknowledged, or a time passes.  The caller's
+ * descriptors are not reported, so unwatch any that may become readable
+ * first.
+ * @param client The client
+ * @param linger Most milliseconds to wait
+ */
+void chatLinger(struct chatClient *client, int linger) {
+	void *owners[EVENT_BATCH];
+	long deadline = chatMillis() + linger;
+	int outstanding = 1;
+	int wait;
+	int n, i;
+
+	while ( outstanding && chatMillis() < deadline ) {
+		wait = chatServiceTimers(client, chatMillis());
+		n = eventWait(&client->loop, owners, EVENT_BATCH, wait);
+		for ( i = 0; i < n; i++ ) {
+			if ( chatIsSession(client, owners[i]) ) {
+				chatReceiveSession(owners[i]);
+			}
+		}
+		chatSendBacklogs(client);
+		outstanding = client->backlog > 0;
+		for ( i = 0; i < client->count && !outstanding; i++ ) {
+			outstanding = client->sessions[i].info.link != NULL &&
+				reliableOutstanding(client->sessions[i].info.link) > 0;
+		}
+	}
+}
+
+/*
+ * chatClientClose
+ * Close every session's socket and free what the client holds, whether or
+ * not chatClientInit succeeded.  Does not quit the sessions.
+ * @param client The client
+ */
+void chatClientClose(struct chatClient *client) {
+	struct chatSession *session;
+	struct poolBuffer *frame;
+	int i;
+
+	for ( i = 0; client->sessions != NULL && i < client->count; i++ ) {
+		session = &client->sessions[i];
+		if ( session->client == NULL ) {
+			break;
+		}
+		if ( session->sd >= 0 ) {
+			close(session->sd);
+		}
+		while ( session->backlog != NULL ) {
+			frame = session->backlog;
+			session->backlog = frame->next;
+			poolRelease(frame);
+		}
+		if ( session->info.link != NULL ) {
+			reliableClear(session->info.link);
+			pthread_mutex_destroy(&session->info.link->lock);
+			free(session->info.link);
+		}
+	}
+	free(client->sessions);
+	client->sessions = NULL;
+	client->count = 0;
+	reassemblerFree(&client->reassembly);
+	wheelRelease(&client->wheel);
+	eventClose(&client->loop);
+}
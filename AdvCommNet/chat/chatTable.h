@@ -0,0 +1,664 @@
+/******************************************************************************/
+// chatTable.h
+// Registered client table for the chat server.  Clients are indexed by
+// connection id, hashed by source address, and kept in a dense member array
+// so that broadcasts only visit connected clients.
+//
+// Joins and quits change the table under its lock.  Broadcasts never take
+// the lock: they read an immutable snapshot of the member array, which is
+// republished after the table changes and freed once no reader can still
+// hold it (epoch based reclamation, in the style of RCU).
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * Table sizing values
+ */
+enum {
+	INITIAL_CLIENTS = 16,
+	MAX_CLIENTS = 1 << 20
+};
+
+/*
+ * Client table entry
+ * @param info The registered client's information
+ * @param next Next entry in the same address hash bucket while connected;
+ *	next entry on the free list while unused
+ * @param member Position of the client in the dense member array
+ * @param serial Registration serial, unique to this registration of the
+ *	connection id
+ * @param lastSeen When a datagram from the client was last noticed, in
+ *	milliseconds
+ * @param roomMember Position of the client in its room's member array, or
+ *	-1 while it is in no room
+ */
+struct clientEntry {
+	struct clientInformation info;
+	int next;
+	int member;
+	unsigned int serial;
+	long lastSeen;
+	int roomMember;
+};
+
+/*
+ * Snapshot member data structure
+ * @param cid The client's connection id
+ * @param address The client's address
+ * @param protocol The client's wire protocol
+ * @param link The client's reliable delivery state, or NULL
+ * @param incarnation The link's incarnation when the snapshot was taken
+ * @param queue The client's outbound queue, or NULL
+ * @param serial The client's registration serial
+ * @param batched Whether the client unpacks OP_BATCH frames
+ */
+struct memberRef {
+	int cid;
+	struct sockaddr_in address;
+	int protocol;
+	struct reliableLink *link;
+	unsigned int incarnation;
+	struct sendQueue *queue;
+	unsigned int serial;
+	int batched;
+};
+
+/*
+ * Member snapshot data structure
+ * @param version The table version the snapshot was taken from
+ * @param retireEpoch The epoch at which the snapshot was replaced
+ * @param retired Next snapshot waiting to be freed
+ * @param count Number of members
+ * @param members The connected clients
+ */
+struct memberSnapshot {
+	unsigned long version;
+	unsigned long retireEpoch;
+	struct memberSnapshot *retired;
+	int count;
+	struct memberRef members[];
+};
+
+/*
+ * Client table data structure
+ * @param entries Entries indexed by connection id; entry 0 is reserved for
+ *	JOIN_CID_CODE and is never allocated
+ * @param capacity Number of entries, including the reserved entry
+ * @param freeHead First unused entry, or -1 when the table is full
+ * @param members Dense array of connected connection ids
+ * @param memberCount Number of connected clients
+ * @param buckets Address hash bucket heads, -1 when empty
+ * @param bucketMask Number of buckets less one; a power of two less one
+ * @param lock Held while the table is changed
+ * @param version Incremented each time the membership changes
+ * @param serials Last registration serial handed out
+ * @param snapshot The most recently published member snapshot
+ * @param retired Replaced snapshots not yet freed
+ * @param epoch The current reclamation epoch, starting at 1
+ * @param readers Number of reader slots
+ * @param readerEpochs Epoch each reader entered at, 0 when not reading
+ */
+struct clientTable {
+	struct clientEntry *entries;
+	int capacity;
+	int freeHead;
+	int *members;
+	int memberCount;
+	int *buckets;
+	int bucketMask;
+	pthread_mutex_t lock;
+	atomic_ulong version;
+	unsigned int serials;
+	struct memberSnapshot *_Atomic snapshot;
+	struct memberSnapshot *retired;
+	atomic_ulong epoch;
+	int readers;
+	atomic_ulong *readerEpochs;
+};
+
+/*
+ * clientTableHash
+ * @param table The client table
+ * @param address The address to hash
+ * @return The bucket for the address
+ */
+int clientTableHash(struct clientTable *table,
+	const struct sockaddr_in *address) {
+	unsigned int h;
+	h = (unsigned int)address->sin_addr.s_addr * 2654435761u;
+	h ^= (unsigned int)address->sin_port * 40503u;
+	h ^= h >> 15;
+	return (int)(h & (unsigned int)table->bucketMask);
+}
+
+/*
+ * clientTableRehash
+ * Rebuild the address hash for a table of the current capacity
+ * @param table The client table
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int clientTableRehash(struct clientTable *table) {
+	int *buckets;
+	int count = 1;
+	int i, b;
+
+	while ( count < table->capacity ) {
+		count <<= 1;
+	}
+	buckets = malloc(sizeof(int) * count);
+	if ( buckets == NULL ) {
+		return -1;
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->bucketMask = count - 1;
+	for ( i = 0; i < count; i++ ) {
+		table->buckets[i] = -1;
+	}
+
+	//Re-link every connected client into its new bucket
+	for ( i = 0; i < table->memberCount; i++ ) {
+		int cid = table->members[i];
+		b = clientTableHash(table, &table->entries[cid].info.address);
+		table->entries[cid].next = table->buckets[b];
+		table->buckets[b] = cid;
+	}
+	return 0;
+}
+
+/*
+ * clientTableGrow
+ * Grow the table to a new capacity, placing the new entries on the free list
+ * lowest connection id first.
+ * @param table The client table
+ * @param capacity The new capacity
+ * @return 0 on success, -1 if the table is at MAX_CLIENTS or memory could not
+ *	be allocated
+ */
+int clientTableGrow(struct clientTable *table, int capacity) {
+	struct clientEntry *entries;
+	int *members;
+	int i;
+
+	if ( capacity > MAX_CLIENTS + 1 ) {
+		capacity = MAX_CLIENTS + 1;
+	}
+	if ( capacity <= table->capacity ) {
+		return -1;
+	}
+
+	entries = realloc(table->entries, sizeof(struct clientEntry) * capacity);
+	if ( entries == NULL ) {
+		return -1;
+	}
+	table->entries = entries;
+	members = realloc(table->members, sizeof(int) * capacity);
+	if ( members == NULL ) {
+		return -1;
+	}
+	table->members = members;
+
+	for ( i = capacity - 1; i >= table->capacity; i-- ) {
+		table->entries[i].info.connected = 0;
+		table->entries[i].info.link = NULL;
+		table->entries[i].info.queue = NULL;
+		table->entries[i].member = -1;
+		table->entries[i].roomMember = -1;
+		if ( i > JOIN_CID_CODE ) {
+			table->entries[i].next = table->freeHead;
+			table->freeHead = i;
+		}
+	}
+	table->capacity = capacity;
+
+	return clientTableRehash(table);
+}
+
+/*
+ * clientTableInit
+ * Initialize an empty client table
+ * @param table The client table
+ * @param capacity The initial number of client slots
+ * @param readers The number of threads that will read snapshots
+ */
+void clientTableInit(struct clientTable *table, int capacity, int readers) {
+	struct memberSnapshot *empty;
+	int i;
+
+	table->entries = NULL;
+	table->capacity = 0;
+	table->freeHead = -1;
+	table->members = NULL;
+	table->memberCount = 0;
+	table->buckets = NULL;
+	table->bucketMask = 0;
+	table->serials = 0;
+
+	if ( clientTableGrow(table, capacity + 1) < 0 ) {
+		perror("Could not allocate client table");
+		exit(1);
+	}
+
+	empty = calloc(1, sizeof(struct memberSnapshot));
+	table->readerEpochs = malloc(sizeof(atomic_ulong) * readers);
+	if ( empty == NULL || table->readerEpochs == NULL ) {
+		perror("Could not allocate client table");
+		exit(1);
+	}
+	pthread_mutex_init(&table->lock, NULL);
+	atomic_init(&table->version, 0);
+	atomic_init(&table->snapshot, empty);
+	table->retired = NULL;
+	atomic_init(&table->epoch, 1);
+	table->readers = readers;
+	for ( i = 0; i < readers; i++ ) {
+		atomic_init(&table->readerEpochs[i], 0);
+	}
+}
+
+/*
+ * clientTableLookup
+ * Find a connected client by connection id
+ * @param table The client table
+ * @param cid The connection id
+ * @return The client's entry, or NULL if cid is not connected
+ */
+struct clientEntry *clientTableLookup(struct clientTable *table, int cid) {
+	if ( cid <= JOIN_CID_CODE || cid >= table->capacity ) {
+		return NULL;
+	}
+	if ( table->entries[cid].info.connected == 0 ) {
+		return NULL;
+	}
+	return &table->entries[cid];
+}
+
+/*
+ * clientTableFind
+ * Find a connected client by source address
+ * @param table The client table
+ * @param address The client's address
+ * @return The client's connection id, or JOIN_CID_CODE if none is connected
+ *	from that address
+ */
+int clientTableFind(struct clientTable *table,
+	const struct sockaddr_in *address) {
+	int cid = table->buckets[clientTableHash(table, address)];
+	struct sockaddr_in *a;
+
+	while ( cid >= 0 ) {
+		a = &table->entries[cid].info.address;
+		if ( a->sin_addr.s_addr == address->sin_addr.s_addr &&
+			a->sin_port == address->sin_port ) {
+			return cid;
+		}
+		cid = table->entries[cid].next;
+	}
+	return JOIN_CID_CODE;
+}
+
+/*
+ * clientTableLink
+ * Fill in an unused entry for a client and link it into its hash bucket
+ * and onto the end of the member array
+ * @param table The client table
+ * @param cid The entry's connection id, already off the free list
+ * @param address The client's address
+ * @param hostname The client's hostname
+ * @param hostnameLen The length of the hostname
+ * @param protocol The client's wire protocol
+ * @param link The client's reliable delivery state, or NULL
+ * @param queue The client's outbound queue, or NULL
+ */
+void clientTableLink(struct clientTable *table, int cid,
+	const struct sockaddr_in *address, const char *hostname,
+	int hostnameLen, int protocol, struct reliableLink *link,
+	struct sendQueue *queue) {
+	struct clientEntry *entry = &table->entries[cid];
+	int b;
+
+	entry->info.connected = 1;
+	bcopy((char *)address, (char *)&entry->info.address,
+		sizeof(entry->info.address));
+	copyString(entry->info.hostname, MAX_LINE, hostname, hostnameLen);
+	entry->info.hostnameLen = strlen(entry->info.hostname);
+	entry->info.protocol = protocol;
+	entry->info.link = link;
+	entry->info.queue = queue;
+	entry->info.batched = 0;
+
+	b = clientTableHash(table, address);
+	entry->next = table->buckets[b];
+	table->buckets[b] = cid;
+
+	entry->member = table->memberCount;
+	table->members[table->memberCount++] = cid;
+	atomic_fetch_add(&table->version, 1);
+}
+
+/*
+ * clientTableAdd
+ * Register a client in the first free slot
+ * @param table The client table
+ * @param address The client's address
+ * @param hostname The client's hostname
+ * @param hostnameLen The length of the hostname
+ * @param protocol The client's wire protocol
+ * @param link The client's reliable delivery state, or NULL
+ * @param queue The client's outbound queue, or NULL
+ * @return The new connection id, or -1 if the table is full
+ */
+int clientTableAdd(struct clientTable *table,
+	const struct sockaddr_in *address, const char *hostname, 
+	int hostnameLen, int protocol, struct reliableLink *link,
+	struct sendQueue *queue) {
+	int cid;
+
+	if ( table->freeHead < 0 &&
+		clientTableGrow(table, table->capacity * 2) < 0 ) {
+		return -1;
+	}
+
+	//Pop the free list
+	cid = table->freeHead;
+	table->freeHead = table->entries[cid].next;
+	clientTableLink(table, cid, address, hostname, hostnameLen, protocol,
+		link, queue);
+
+	//Serial 0 is never handed out, so that it can mean no client
+	if ( ++table->serials == 0 ) {
+		table->serials = 1;
+	}
+	table->entries[cid].serial = table->serials;
+
+	return cid;
+}
+
+/*
+ * clientTableRestore
+ * Register a client under the connection id and serial it had before the
+ * server restarted.  The free list is left as it was; clientTableFreeList
+ * rebuilds it once every client has been restored.
+ * @param table The client table
+ * @param cid The client's connection id
+ * @param serial The client's registration serial
+ * @param address The client's address
+ * @param hostname The client's hostname
+ * @param hostnameLen The length of the hostname
+ * @param protocol The client's wire protocol
+ * @param queue The client's outbound queue, or NULL
+ * @return 0 on success, -1 if the id or address is taken or memory could
+ *	not be allocated
+ */
+int clientTableRestore(struct clientTable *table, int cid,
+	unsigned int serial, const struct sockaddr_in *address,
+	const char *hostname, int hostnameLen, int protocol,
+	struct sendQueue *queue) {
+	int capacity = table->capacity;
+
+	if ( cid <= JOIN_CID_CODE || cid > MAX_CLIENTS ) {
+		return -1;
+	}
+	while ( capacity <= cid ) {
+		capacity *= 2;
+	}
+	if ( capacity > table->capacity &&
+		clientTableGrow(table, capacity) < 0 ) {
+		return -1;
+	}
+	if ( table->entries[cid].info.connected ||
+		clientTableFind(table, address) != JOIN_CID_CODE ) {
+		return -1;
+	}
+	clientTableLink(table, cid, address, hostname, hostnameLen, protocol,
+		NULL, queue);
+	table->entries[cid].serial = serial;
+	if ( (int)(serial - table->serials) > 0 ) {
+		table->serials = serial;
+	}
+	return 0;
+}
+
+/*
+ * clientTableFreeList
+ * Rebuild the free list from the unused entries, lowest connection id
+ * first
+ * @param table The client table
+ */
+void clientTableFreeList(struct clientTable *table) {
+	int i;
+
+	table->freeHead = -1;
+	for ( i = table->capacity - 1; i > JOIN_CID_CODE; i-- ) {
+		if ( !table->entries[i].info.connected ) {
+			table->entries[i].next = table->freeHead;
+			table->freeHead = i;
+		}
+	}
+}
+
+/*
+ * clientTableSetProtocol
+ * Change the wire protocol of a connected client
+ * @param table The client table
+ * @param cid The connection id
+ * @param protocol The client's wire protocol
+ */
+void clientTableSetProtocol(struct clientTable *table, int cid, int protocol) {
+	struct clientEntry *entry = clientTableLookup(table, cid);
+
+	if ( entry != NULL && entry->info.protocol != protocol ) {
+		entry->info.protocol = protocol;
+		atomic_fetch_add(&table->version, 1);
+	}
+}
+
+/*
+ * clientTableRemove
+ * Unregister a connected client and return its slot to the free list
+ * @param table The client table
+ * @param cid The connection id to remove
+ * @return 0 on success, -1 if cid is not connected
+ */
+int clientTableRemove(struct clientTable *table, int cid) {
+	struct clientEntry *entry = clientTableLookup(table, cid);
+	int *link;
+	int last;
+
+	if ( entry == NULL ) {
+		return -1;
+	}
+
+	//Unlink from the hash bucket
+	link = &table->buckets[clientTableHash(table, &entry->info.address)];
+	while ( *link != cid ) {
+		link = &table->entries[*link].next;
+	}
+	*link = entry->next;
+
+	//Move the last member into the vacated member position
+	last = table->members[--table->memberCount];
+	table->members[entry->member] = last;
+	table->entries[last].member = entry->member;
+
+	entry->info.connected = 0;
+	entry->info.link = NULL;
+	entry->info.queue = NULL;
+	entry->member = -1;
+	entry->next = table->freeHead;
+	table->freeHead = cid;
+	atomic_fetch_add(&table->version, 1);
+
+	return 0;
+}
+
+/*
+ * clientTableReclaim
+ * Free retired snapshots that no reader can still be using.  Called with the
+ * table lock held.
+ * @param table The client table
+ */
+void clientTableReclaim(struct clientTable *table) {
+	struct memberSnapshot **link = &table->retired;
+	struct memberSnapshot *snap;
+	unsigned long oldest = 0;
+	unsigned long e;
+	int i;
+
+	//Find the oldest epoch any reader is still inside
+	for ( i = 0; i < table->readers; i++ ) {
+		e = atomic_load(&table->readerEpochs[i]);
+		if ( e != 0 && (oldest == 0 || e < oldest) ) {
+			oldest = e;
+		}
+	}
+
+	//A reader that entered at or after a snapshot's retire epoch can only
+	// have seen its replacement
+	while ( (snap = *link) != NULL ) {
+		if ( oldest == 0 || oldest >= snap->retireEpoch ) {
+			*link = snap->retired;
+			free(snap);
+		} else {
+			link = &snap->retired;
+		}
+	}
+}
+
+/*
+ * clientTableMember
+ * Fill in what a sender needs to know of a connected client.  Called with
+ * the table lock held.
+ * @param table The client table
+ * @param cid The client's connection id
+ * @param member The member to fill
+ */
+void clientTableMember(struct clientTable *table, int cid,
+	struct memberRef *member) {
+	struct clientEntry *entry = &table->entries[cid];
+
+	member->cid = cid;
+	member->protocol = entry->info.protocol;
+	member->link = entry->info.link;
+	member->incarnation = member->link == NULL ? 0 : member->link->incarnation;
+	member->queue = entry->info.queue;
+	member->serial = entry->serial;
+	member->batched = entry->info.batched;
+	bcopy((char *)&entry->info.address, (char *)&member->address,
+		sizeof(struct sockaddr_in));
+}
+
+/*
+ * clientTableSnapshot
+ * Take a snapshot of some of the table's connected clients.  Called with
+ * the table lock held.
+ * @param table The client table
+ * @param cids The connection ids of the clients
+ * @param count The number of clients
+ * @return The snapshot, stamped with the table's version, or NULL if
+ *	memory could not be allocated
+ */
+struct memberSnapshot *clientTableSnapshot(struct clientTable *table,
+	const int *cids, int count) {
+	struct memberSnapshot *snap;
+	int i;
+
+	snap = malloc(sizeof(struct memberSnapshot) +
+		sizeof(struct memberRef) * count);
+	if ( snap == NULL ) {
+		return NULL;
+	}
+	snap->version = atomic_load(&table->version);
+	snap->retired = NULL;
+	snap->count = count;
+	for ( i = 0; i < count; i++ ) {
+		clientTableMember(table, cids[i], &snap->members[i]);
+	}
+	return snap;
+}
+
+/*
+ * clientTableRetire
+ * Retire a replaced snapshot, to be freed once no reader can still be
+ * using it.  Called with the table lock held.
+ * @param table The client table
+ * @param old The replaced snapshot
+ */
+void clientTableRetire(struct clientTable *table, struct memberSnapshot *old) {
+	old->retireEpoch = atomic_fetch_add(&table->epoch, 1) + 1;
+	old->retired = table->retired;
+	table->retired = old;
+	clientTableReclaim(table);
+}
+
+/*
+ * clientTablePublish
+ * Replace the published snapshot with one taken from the current table.
+ * Called with the table lock held.
+ * @param table The client table
+ */
+void clientTablePublish(struct clientTable *table) {
+	struct memberSnapshot *snap;
+
+	snap = clientTableSnapshot(table, table->members, table->memberCount);
+	if ( snap != NULL ) {
+		clientTableRetire(table, atomic_exchange(&table->snapshot, snap));
+	}
+}
+
+/*
+ * clientTablePin
+ * Enter a snapshot read section and load a published snapshot.  The
+ * reader's epoch is published before the snapshot is loaded: a snapshot
+ * still published when the reader loads it is retired at a later epoch, so
+ * clientTableReclaim keeps it until the reader leaves.
+ * @param table The client table
+ * @param reader The calling thread's reader slot
+ * @param published Where the snapshot is published
+ * @return The snapshot, valid until clientTableReadUnlock
+ */
+struct memberSnapshot *clientTablePin(struct clientTable *table, int reader,
+	struct memberSnapshot *_Atomic *published) {
+	atomic_store(&table->readerEpochs[reader], atomic_load(&table->epoch));
+	return atomic_load(published);
+}
+
+/*
+ * clientTableReadLock
+ * Enter a snapshot read section.  If the table has changed since the last
+ * snapshot was published and no other thread holds the table lock, publish a
+ * fresh snapshot first; otherwise carry on with the current one rather than
+ * wait.
+ * @param table The client table
+ * @param reader The calling thread's reader slot
+ * @return The member snapshot, valid until clientTableReadUnlock
+ */
+struct memberSnapshot *clientTableReadLock(struct clientTable *table,
+	int reader) {
+	struct memberSnapshot *snap = clientTablePin(table, reader,
+		&table->snapshot);
+
+	//The snapshot is pinned before it is looked at, and whatever replaces
+	// it is published after the reader's epoch, so it is pinned too
+	if ( snap->version != atomic_load(&table->version) &&
+		pthread_mutex_trylock(&table->lock) == 0 ) {
+		snap = atomic_load(&table->snapshot);
+		if ( snap->version != atomic_load(&table->version) ) {
+			clientTablePublish(table);
+		}
+		pthread_mutex_unlock(&table->lock);
+		snap = atomic_load(&table->snapshot);
+	}
+	return snap;
+}
+
+/*
+ * clientTableReadUnlock
+ * Leave a snapshot read section
+ * @param table The client table
+ * @param reader The calling thread's reader slot
+ */
+void clientTableReadUnlock(struct clientTable *table, int reader) {
+	atomic_store(&table->readerEpochs[reader], 0);
+}
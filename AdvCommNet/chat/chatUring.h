@@ -0,0 +1,240 @@
+/******************************************************************************/
+// chatUring.h
+// A minimal io_uring ring, driven with the raw system calls: a submission
+// and completion queue shared with the kernel, and a ring of provided
+// buffers the kernel receives datagrams into.  Only one thread may use a
+// ring.
+// @author J. Joel vanBrandwijk
+// @date 2015-11-11
+/******************************************************************************/
+
+/*
+ * io_uring values; the provided buffer group id
+ */
+enum {
+	URING_BUFFER_GROUP = 0
+};
+
+/*
+ * io_uring data structure
+ * @param fd The ring
+ * @param sqHead Kernel's submission queue head
+ * @param sqTail Submission queue tail shared with the kernel
+ * @param sqMask Submission queue index mask
+ * @param sqArray Submission queue index array
+ * @param sqes Submission queue entries
+ * @param sqLocal Submission queue tail including entries not yet published
+ * @param cqHead Completion queue head shared with the kernel
+ * @param cqTail Kernel's completion queue tail
+ * @param cqMask Completion queue index mask
+ * @param cqes Completion queue entries
+ * @param buffers The provided buffer ring
+ * @param bufferMask Provided buffer ring index mask
+ * @param bufferTail Provided buffer ring tail including buffers not yet
+ *	published
+ * @param bufferBase Memory of the provided buffers
+ * @param bufferSize Size of each provided buffer
+ */
+struct uring {
+	int fd;
+	atomic_uint *sqHead;
+	atomic_uint *sqTail;
+	unsigned sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned sqLocal;
+	atomic_uint *cqHead;
+	atomic_uint *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buffers;
+	unsigned bufferMask;
+	unsigned short bufferTail;
+	char *bufferBase;
+	int bufferSize;
+};
+
+/*
+ * uringBuffer
+ * @param ring The ring
+ * @param id A provided buffer id
+ * @return The buffer's memory
+ */
+char *uringBuffer(struct uring *ring, int id) {
+	return ring->bufferBase + (size_t)id * ring->bufferSize;
+}
+
+/*
+ * uringProvide
+ * Queue a buffer to be given back to the kernel by uringProvideCommit
+ * @param ring The ring
+ * @param id The buffer id
+ */
+void uringProvide(struct uring *ring, int id) {
+	struct io_uring_buf *buf;
+
+	buf = &ring->buffers->bufs[ring->bufferTail & ring->bufferMask];
+	buf->addr = (unsigned long)uringBuffer(ring, id);
+	buf->len = ring->bufferSize;
+	buf->bid = id;
+	ring->bufferTail++;
+}
+
+/*
+ * uringProvideCommit
+ * Give the kernel every buffer queued by uringProvide
+ * @param ring The ring
+ */
+void uringProvideCommit(struct uring *ring) {
+	atomic_store_explicit((_Atomic unsigned short *)&ring->buffers->tail,
+		ring->bufferTail, memory_order_release);
+}
+
+/*
+ * uringInit
+ * Set up a ring and register its provided buffers
+ * @param ring The ring
+ * @param entries Submission queue entries, a power of two
+ * @param count Provided buffers, a power of two
+ * @param size Size of each provided buffer
+ * @return 0 on success, -1 if io_uring is not available
+ */
+int uringInit(struct uring *ring, unsigned entries, int count, int size) {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sqSize, cqSize;
+	char *sq, *cq;
+	int i;
+
+	bzero((char *)&params, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if ( ring->fd < 0 ) {
+		return -1;
+	}
+
+	//Map the queues; kernels with IORING_FEAT_SINGLE_MMAP share one
+	// mapping for both
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqSize = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+	}
+	sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if ( sq == MAP_FAILED ) {
+		return -1;
+	}
+	cq = sq;
+	if ( !(params.features & IORING_FEAT_SINGLE_MMAP) ) {
+		cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if ( cq == MAP_FAILED ) {
+			return -1;
+		}
+	}
+	ring->sqes = mmap(NULL, 
+		params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQES);
+	if ( ring->sqes == MAP_FAILED ) {
+		return -1;
+	}
+	ring->sqHead = (atomic_uint *)(sq + params.sq_off.head);
+	ring->sqTail = (atomic_uint *)(sq + params.sq_off.tail);
+	ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring->sqLocal = atomic_load(ring->sqTail);
+	ring->cqHead = (atomic_uint *)(cq + params.cq_off.head);
+	ring->cqTail = (atomic_uint *)(cq + params.cq_off.tail);
+	ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	//Give the kernel a ring of buffers to receive into
+	ring->buffers = mmap(NULL, count * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufferBase = mmap(NULL, (size_t)count * size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( ring->buffers == MAP_FAILED || ring->bufferBase == MAP_FAILED ) {
+		return -1;
+	}
+	ring->bufferMask = count - 1;
+	ring->bufferTail = 0;
+	ring->bufferSize = size;
+	bzero((char *)&reg, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->buffers;
+	reg.ring_entries = count;
+	reg.bgid = URING_BUFFER_GROUP;
+	if ( syscall(__NR_io_uring_register, ring->fd,
+		IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+		return -1;
+	}
+	for ( i = 0; i < count; i++ ) {
+		uringProvide(ring, i);
+	}
+	uringProvideCommit(ring);
+	return 0;
+}
+
+/*
+ * uringGetSqe
+ * Take the next submission queue entry, cleared
+ * @param ring The ring
+ * @return The entry, or NULL if the submission queue is full
+ */
+struct io_uring_sqe *uringGetSqe(struct uring *ring) {
+	struct io_uring_sqe *sqe;
+	unsigned index = ring->sqLocal & ring->sqMask;
+
+	if ( ring->sqLocal - atomic_load_explicit(ring->sqHead, 
+		memory_order_acquire) > ring->sqMask ) {
+		return NULL;
+	}
+	sqe = &ring->sqes[index];
+	ring->sqArray[index] = index;
+	ring->sqLocal++;
+	bzero((char *)sqe, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * uringSubmit
+ * Submit every queued entry and optionally wait for completions
+ * @param ring The ring
+ * @param wait Completions to wait for
+ * @return The number of entries submitted, or -1 on error
+ */
+int uringSubmit(struct uring *ring, unsigned wait) {
+	unsigned tail = atomic_load_explicit(ring->sqTail, 
+		memory_order_relaxed);
+
+	atomic_store_explicit(ring->sqTail, ring->sqLocal, 
+		memory_order_release);
+	return syscall(__NR_io_uring_enter, ring->fd, ring->sqLocal - tail,
+		wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * uringPeek
+ * @param ring The ring
+ * @return The oldest completion not yet consumed, or NULL if there is none
+ */
+struct io_uring_cqe *uringPeek(struct uring *ring) {
+	unsigned head = atomic_load_explicit(ring->cqHead, 
+		memory_order_relaxed);
+
+	if ( head == atomic_load_explicit(ring->cqTail, 
+		memory_order_acquire) ) {
+		return NULL;
+	}
+	return &ring->cqes[head & ring->cqMask];
+}
+
+/*
+ * uringAdvance
+ * Consume the completion returned by uringPeek
+ * @param ring The ring
+ */
+void uringAdvance(struct uring *ring) {
+	atomic_fetch_add_explicit(ring->cqHead, 1, memory_order_release);
+}
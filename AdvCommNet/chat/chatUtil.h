@@ -15,23 +15,134 @@ enum {
  * @param connected Server: 0 or 1 connection state; Client: connection id
  * @param address Server: client address; client: server address
  * @param hostname: pid.hostname of the client
+ * @param hostnameLen The length of the hostname
+ * @param protocol Wire protocol in use: PROTOCOL_TEXT or a binary frame version
+ * @param link Reliable delivery state, or NULL if messages are not sequenced
+ * @param queue Server: outbound queue for datagrams the socket could not
+ *	take at once; client: unused
+ * @param batched Server: whether the client unpacks OP_BATCH frames;
+ *	client: unused
  */
 struct clientInformation {
 	int connected;
 	struct sockaddr_in address;
 	char hostname[MAX_LINE];
+	int hostnameLen;
+	int protocol;
+	struct reliableLink *link;
+	struct sendQueue *queue;
+	int batched;
 };
 
 /*
- * Message data structure
- * @param cid the client id
- * @param str1 command or hostname
- * @param str2 message or hostname
+ * Message view data structure; the strings point into the buffer the
+ * message was received in or built from and are not NUL terminated
+ * @param version The frame version, or PROTOCOL_TEXT for a text message
+ * @param opcode OP_JOIN, OP_QUIT, OP_TEXT, OP_ENTER or OP_LEAVE
+ * @param flags Frame flags
+ * @param cid The client id
+ * @param hostname The sender's hostname
+ * @param hostnameLen The length of the hostname
+ * @param payload The message text, or the room of an OP_ENTER or OP_LEAVE
+ * @param payloadLen The length of the message text
+ * @param seq Sequence number of a FLAG_RELIABLE frame
+ * @param base Oldest sequence number the sender of a FLAG_RELIABLE frame
+ *	will still retransmit
+ * @param messageId Sender's number for the message a FLAG_FRAGMENT frame
+ *	is part of
+ * @param offset Where in its message a FLAG_FRAGMENT frame's payload goes
+ * @param messageLen The length of the whole message a FLAG_FRAGMENT frame
+ *	is part of
  */
-struct message {
+struct messageView {
+	int version;
+	int opcode;
+	int flags;
 	int cid;
-	char str1[MAX_LINE];
-	char str2[MAX_LINE];
+	const char *hostname;
+	int hostnameLen;
+	const char *payload;
+	int payloadLen;
+	unsigned int seq;
+	unsigned int base;
+	unsigned int messageId;
+	int offset;
+	int messageLen;
+};
+
+/*
+ * Wire protocol values.  A binary frame is laid out as follows, with
+ * integers in network byte order:
+ *	byte 0		FRAME_MAGIC
+ *	byte 1		frame version
+ *	byte 2		opcode
+ *	byte 3		flags
+ *	bytes 4-7	cid
+ *	bytes 8-9	hostname length
+ *	bytes 10-11	payload length
+ *	bytes 12-	hostname, then payload
+ * A frame flagged FLAG_RELIABLE carries FRAME_SEQUENCE more bytes between
+ * the header and the hostname: its sequence number, then the oldest
+ * sequence number its sender will still retransmit.  gatherMessage does
+ * not write them; reliable frames are built by chatReliable.h.  An OP_TEXT
+ * frame flagged FLAG_FRAGMENT carries FRAME_FRAGMENT more bytes after
+ * those: the sender's number for the message, the offset of the payload
+ * in it, and the message's length.  A message longer than FRAGMENT_DATA,
+ * up to MAX_MESSAGE, is sent as fragments of FRAGMENT_DATA bytes, all but
+ * the last, so that every fragment fits one POOL_BUFFER_SIZE datagram;
+ * the server passes them on as they come and the receiver puts them back
+ * together.  Text clients are sent only the first fragment.  An OP_ACK
+ * frame acknowledges reliable frames and is not itself sequenced.  An
+ * OP_PING frame, sent every KEEPALIVE_SEC seconds by an otherwise quiet
+ * client, only tells the server the client is still there; it is not
+ * sequenced and not forwarded.  OP_ENTER moves a client into the room
+ * named by its payload, opening the room if need be, and OP_LEAVE moves it
+ * back to the lobby; the server tells the room entered or left, naming it
+ * in the payload.  In text, a room command is a client id, ENTER or LEAVE,
+ * the room, and the hostname.  An OP_BATCH frame, sent only by the server,
+ * carries whole unsequenced frames back to back as its payload, each to be
+ * handled as though it had arrived alone; its cid is JOIN_CID_CODE and its
+ * hostname is empty.  A client asks for the history of the room it is in
+ * with an OP_HISTORY frame whose payload is, in decimal, the number of
+ * most recent messages it wants or, flagged FLAG_SINCE, the sequence
+ * number of the last message it has.  The server answers with OP_HISTORY
+ * frames laid out as OP_BATCH frames, except that the cid is the sequence
+ * number of the first message carried.  An OP_RELAY frame, sent only
+ * between peered servers, carries a message said on one server to the
+ * others; its payload is laid out in chatRelay.h.
+ * Text clients never send FRAME_MAGIC as the first byte.  A client offers
+ * the binary protocol by following its text JOIN with a NUL and a binary
+ * JOIN frame; servers that only speak text stop reading at the NUL.  A
+ * client asks for reliable delivery by flagging that frame
+ * FLAG_OFFER_RELIABLE, and says it can unpack OP_BATCH frames by flagging it
+ * FLAG_OFFER_BATCH.
+ */
+enum {
+	FRAME_MAGIC = 0xC7,
+	FRAME_HEADER = 12,
+	PROTOCOL_TEXT = 0,
+	PROTOCOL_VERSION = 1,
+	OP_JOIN = 1,
+	OP_QUIT = 2,
+	OP_TEXT = 3,
+	OP_ACK = 4,
+	OP_PING = 5,
+	OP_ENTER = 6,
+	OP_LEAVE = 7,
+	OP_BATCH = 8,
+	OP_HISTORY = 9,
+	OP_RELAY = 10,
+	FLAG_RELIABLE = 0x01,
+	FLAG_OFFER_RELIABLE = 0x02,
+	FLAG_OFFER_BATCH = 0x04,
+	FLAG_SINCE = 0x08,
+	FLAG_FRAGMENT = 0x10,
+	FRAME_SEQUENCE = 8,
+	FRAME_FRAGMENT = 8,
+	FRAGMENT_DATA = 1280,
+	MAX_MESSAGE = 0xffff,
+	GATHER_IOV = 6,
+	GATHER_SCRATCH = FRAME_HEADER + FRAME_FRAGMENT
 };
 
 /*
@@ -39,16 +150,20 @@ struct message {
  */
 enum {
 	JOIN_CID_CODE = 0,
+	KEEPALIVE_SEC = 15,
 	DEBUG_ON = 1,
-	DEBUG_OFF = 0,
-	MAX_CLIENTS = 10
+	DEBUG_OFF = 0
 };
 
 /*
- * Strings for joining or quitting
+ * Strings for joining or quitting, entering or leaving a room, and pinging
  */
 static const char JOIN_STRING[] = "JOIN";
 static const char QUIT_STRING[] = "QUIT";
+static const char ENTER_STRING[] = "ENTER";
+static const char LEAVE_STRING[] = "LEAVE";
+static const char PING_STRING[] = "PING";
+static const char HISTORY_STRING[] = "HISTORY";
 
 /*
  * Strings for debugging direction
@@ -56,46 +171,371 @@ static const char QUIT_STRING[] = "QUIT";
 static const char SENT_STRING[] = "SENT";
 static const char RECV_STRING[] = "RECV";
 
+/*
+ * Message accounting for the current thread: buffers allocated to carry
+ * messages, and message strings copied from one buffer to another
+ */
+__thread unsigned long messageAllocs = 0;
+__thread unsigned long messageCopies = 0;
+
+/*
+ * commandString
+ * @param opcode A message opcode other than OP_TEXT
+ * @return The word naming the command in text
+ */
+const char *commandString(int opcode) {
+	switch ( opcode ) {
+	case OP_JOIN:
+		return JOIN_STRING;
+	case OP_ENTER:
+		return ENTER_STRING;
+	case OP_LEAVE:
+		return LEAVE_STRING;
+	case OP_PING:
+		return PING_STRING;
+	case OP_HISTORY:
+		return HISTORY_STRING;
+	default:
+		return QUIT_STRING;
+	}
+}
+
+/*
+ * textSpace
+ * @param c A character
+ * @return Whether the character is white space, as isspace would say in
+ *	the C locale, without the locale table lookup
+ */
+int textSpace(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * textLineEnd
+ * Find the end of a line with the C library's memchr, which compares a
+ * vector register's width of bytes at a time
+ * @param p The start of the line
+ * @param end The end of the buffer
+ * @return The first newline or NUL, or end if there is neither
+ */
+const char *textLineEnd(const char *p, const char *end) {
+	const char *found = memchr(p, '\n', end - p);
+
+	if ( found != NULL ) {
+		end = found;
+	}
+	found = memchr(p, '\0', end - p);
+	return found != NULL ? found : end;
+}
+
 /*
  * parseMessage
  * @param buffer The message buffer to parse
- * @return message data structure
- * This fuction parses a message buffer string into component parts.
+ * @param length The length of the message buffer
+ * @param view The view to fill; its strings point into buffer
+ * @return 0 on success, -1 if the buffer is not a text message
+ * This fuction parses a text message buffer into component parts in place,
+ * in one pass.  A message is a client id, a command or hostname, and the
+ * rest of the line; a room command has the room before the rest of the
+ * line.  A client id that does not fit in an int, or a hostname too long
+ * for the client table to hold, makes the message malformed.
  */
-struct message parseMessage(char *buffer) {
-	struct message rmsg;
-	int rcid;
-	char rstr1[MAX_LINE];
-	char rstr2[MAX_LINE];
+int parseMessage(const char *buffer, int length, struct messageView *view) {
+	const char *p = buffer;
+	const char *end = buffer + length;
+	const char *word;
+	unsigned int value = 0;
+	int negative = 0;
+	unsigned int base = 10;
+	unsigned int digit;
+	int digits = 0;
 
-	sscanf(buffer, "%i %s %80[^\n]", &rcid, rstr1, rstr2);
+	//Read the client id as %i would: optional sign, then decimal, 0x
+	// hexadecimal or 0 octal digits
+	while ( p < end && textSpace(*p) ) {
+		p++;
+	}
+	if ( p < end && (*p == '-' || *p == '+') ) {
+		negative = *p++ == '-';
+	}
+	if ( p < end && *p == '0' ) {
+		base = 8;
+		digits++;
+		p++;
+		if ( p + 1 < end && (*p == 'x' || *p == 'X') &&
+			isxdigit((unsigned char)p[1]) ) {
+			base = 16;
+			p++;
+		}
+	}
+	for ( ; p < end; p++, digits++ ) {
+		digit = (unsigned char)*p - '0';
+		if ( digit > 9 && base == 16 ) {
+			digit = ((unsigned char)*p | 0x20) - 'a' + 10;
+			if ( digit < 10 ) {
+				break;
+			}
+		}
+		if ( digit >= base ) {
+			break;
+		}
+		if ( value > (0x7fffffffu - digit) / base ) {
+			return -1;
+		}
+		value = value * base + digit;
+	}
+	if ( digits == 0 ) {
+		return -1;
+	}
+	view->cid = negative ? -(int)value : (int)value;
 
-	rmsg.cid = rcid;
-	strcpy(rmsg.str1, rstr1);
-	strcpy(rmsg.str2, rstr2);
+	//The second word is a command or the sender's hostname
+	while ( p < end && textSpace(*p) ) {
+		p++;
+	}
+	word = p;
+	while ( p < end && *p != '\0' && !textSpace(*p) ) {
+		p++;
+	}
+	if ( p == word ) {
+		return -1;
+	}
+	view->hostname = word;
+	view->hostnameLen = p - word;
 
-	return rmsg;
+	//The rest of the line is the message text, or the hostname of a
+	// JOIN or QUIT
+	while ( p < end && textSpace(*p) ) {
+		p++;
+	}
+	view->payload = p;
+	view->payloadLen = textLineEnd(p, end) - p;
+
+	view->version = PROTOCOL_TEXT;
+	view->flags = 0;
+	view->opcode = OP_TEXT;
+	if ( view->hostnameLen == 4 &&
+		(memcmp(word, JOIN_STRING, 4) == 0 ||
+		memcmp(word, QUIT_STRING, 4) == 0) ) {
+		view->opcode = word[0] == 'J' ? OP_JOIN : OP_QUIT;
+		view->hostname = view->payload;
+		view->hostnameLen = view->payloadLen;
+		view->payload = "";
+		view->payloadLen = 0;
+	} else if ( view->hostnameLen == 5 &&
+		(memcmp(word, ENTER_STRING, 5) == 0 ||
+		memcmp(word, LEAVE_STRING, 5) == 0) ) {
+		//Split the room from the hostname after it
+		view->opcode = word[0] == 'E' ? OP_ENTER : OP_LEAVE;
+		end = view->payload + view->payloadLen;
+		p = view->payload;
+		while ( p < end && !textSpace(*p) ) {
+			p++;
+		}
+		view->payloadLen = p - view->payload;
+		while ( p < end && textSpace(*p) ) {
+			p++;
+		}
+		view->hostname = p;
+		view->hostnameLen = end - p;
+	}
+	return view->hostnameLen < MAX_LINE ? 0 : -1;
+}
+
+/*
+ * decodeFrame
+ * @param buffer The raw buffer holding a binary frame
+ * @param length The number of bytes in the buffer
+ * @param view The view to fill; its strings point into buffer
+ * @return The length of the frame, or -1 if the buffer does not hold a
+ *	complete, well formed frame, or its hostname is too long for the
+ *	client table to hold
+ * This function decodes a binary frame in place, without copying.
+ */
+int decodeFrame(const char *buffer, int length, struct messageView *view) {
+	const unsigned char *b = (const unsigned char *)buffer;
+	int header = FRAME_HEADER;
+	int total;
+
+	if ( length < FRAME_HEADER || b[0] != FRAME_MAGIC || b[1] == 0 ) {
+		return -1;
+	}
+	view->version = b[1];
+	view->opcode = b[2];
+	view->flags = b[3];
+	view->cid = (int)(((unsigned int)b[4] << 24) | (b[5] << 16) |
+		(b[6] << 8) | b[7]);
+	view->hostnameLen = (b[8] << 8) | b[9];
+	view->payloadLen = (b[10] << 8) | b[11];
+	if ( view->hostnameLen >= MAX_LINE ) {
+		return -1;
+	}
+	view->seq = 0;
+	view->base = 0;
+	if ( view->flags & FLAG_RELIABLE ) {
+		if ( length < FRAME_HEADER + FRAME_SEQUENCE ) {
+			return -1;
+		}
+		view->seq = ((unsigned int)b[12] << 24) | (b[13] << 16) |
+			(b[14] << 8) | b[15];
+		view->base = ((unsigned int)b[16] << 24) | (b[17] << 16) |
+			(b[18] << 8) | b[19];
+		header += FRAME_SEQUENCE;
+	}
+
+	//A fragment must lie within the message it is part of
+	if ( view->flags & FLAG_FRAGMENT ) {
+		if ( length < header + FRAME_FRAGMENT ) {
+			return -1;
+		}
+		b += header;
+		view->messageId = ((unsigned int)b[0] << 24) | (b[1] << 16) |
+			(b[2] << 8) | b[3];
+		view->offset = (b[4] << 8) | b[5];
+		view->messageLen = (b[6] << 8) | b[7];
+		if ( view->offset + view->payloadLen > view->messageLen ) {
+			return -1;
+		}
+		header += FRAME_FRAGMENT;
+	}
+	total = header + view->hostnameLen + view->payloadLen;
+	if ( total > length ) {
+		return -1;
+	}
+	view->hostname = buffer + header;
+	view->payload = view->hostname + view->hostnameLen;
+	return total;
+}
+
+/*
+ * encodeHeader
+ * @param header The FRAME_HEADER bytes to fill
+ * @param view The message whose header to encode
+ * @return 0 on success, -1 if a string is too long for a frame
+ * This function encodes the header of a binary frame.
+ */
+int encodeHeader(char *header, const struct messageView *view) {
+	unsigned char *b = (unsigned char *)header;
+	unsigned int cid = (unsigned int)view->cid;
+
+	if ( view->hostnameLen > 0xffff || view->payloadLen > 0xffff ) {
+		return -1;
+	}
+	b[0] = FRAME_MAGIC;
+	b[1] = view->version;
+	b[2] = view->opcode;
+	b[3] = view->flags;
+	b[4] = cid >> 24;
+	b[5] = cid >> 16;
+	b[6] = cid >> 8;
+	b[7] = cid;
+	b[8] = view->hostnameLen >> 8;
+	b[9] = view->hostnameLen;
+	b[10] = view->payloadLen >> 8;
+	b[11] = view->payloadLen;
+	return 0;
+}
+
+/*
+ * encodeFragment
+ * @param fragment The FRAME_FRAGMENT bytes to fill
+ * @param view The FLAG_FRAGMENT message whose place in its message to encode
+ */
+void encodeFragment(char *fragment, const struct messageView *view) {
+	unsigned char *b = (unsigned char *)fragment;
+
+	b[0] = view->messageId >> 24;
+	b[1] = view->messageId >> 16;
+	b[2] = view->messageId >> 8;
+	b[3] = view->messageId;
+	b[4] = view->offset >> 8;
+	b[5] = view->offset;
+	b[6] = view->messageLen >> 8;
+	b[7] = view->messageLen;
 }
 
 /*
- * pDebug
- * Print debugging information
- * @param debug Boolean is debug on?
- * @param direction Formatting parameter
- * @param rmsg The message to print
- */
-void pDebug(int debug, const char *direction, struct message rmsg) {
-	sscanf(rmsg.str2, "%80[^\n]", &rmsg.str2);
-	if ( debug == DEBUG_ON ) {
-		if ( strcmp(direction, SENT_STRING) == 0 ) {
-			printf("DEBUG: Sending <%i %s %s>\n",
-				rmsg.cid, rmsg.str1, rmsg.str2);
-		} else if ( strcmp(direction, RECV_STRING) == 0 ) {
-			printf("DEBUG: Receiving <%i %s %s>\n",
-				rmsg.cid, rmsg.str1, rmsg.str2);
+ * gatherMessage
+ * @param view The message to send
+ * @param protocol The wire protocol to send it in
+ * @param scratch At least GATHER_SCRATCH bytes for the text client id or the
+ *	frame header
+ * @param iov At least GATHER_IOV vectors to fill
+ * @return The number of vectors filled, 0 if the message is not sent in the
+ *	protocol
+ * This function lays a message out for sendmsg in the given protocol.  Only
+ * the client id or frame header is written; the vectors point at the
+ * message's own strings.
+ */
+int gatherMessage(const struct messageView *view, int protocol, char *scratch,
+	struct iovec *iov) {
+	int n = 0;
+
+	//Text has no fragments; a text client sees the start of the message
+	if ( protocol == PROTOCOL_TEXT && (view->flags & FLAG_FRAGMENT) &&
+		view->offset > 0 ) {
+		return 0;
+	}
+	if ( protocol == PROTOCOL_TEXT ) {
+		//cid, then command and hostname or hostname and text
+		iov[n].iov_base = scratch;
+		iov[n++].iov_len = snprintf(scratch, GATHER_SCRATCH, "%i ",
+			view->cid);
+		if ( view->opcode == OP_TEXT ) {
+			iov[n].iov_base = (void *)view->hostname;
+			iov[n++].iov_len = view->hostnameLen;
 		} else {
-			printf("DEBUG: <%i %s %s>\n", 
-				rmsg.cid, rmsg.str1, rmsg.str2);
+			iov[n].iov_base = (void *)commandString(view->opcode);
+			iov[n].iov_len = strlen(iov[n].iov_base);
+			n++;
 		}
+		iov[n].iov_base = " ";
+		iov[n++].iov_len = 1;
+		if ( view->opcode == OP_ENTER || view->opcode == OP_LEAVE ) {
+			iov[n].iov_base = (void *)view->payload;
+			iov[n++].iov_len = view->payloadLen;
+			iov[n].iov_base = " ";
+			iov[n++].iov_len = 1;
+		}
+		if ( view->opcode == OP_TEXT ) {
+			iov[n].iov_base = (void *)view->payload;
+			iov[n++].iov_len = view->payloadLen;
+		} else {
+			iov[n].iov_base = (void *)view->hostname;
+			iov[n++].iov_len = view->hostnameLen;
+		}
+	} else {
+		struct messageView framed = *view;
+		framed.version = protocol;
+		encodeHeader(scratch, &framed);
+		iov[n].iov_base = scratch;
+		iov[n++].iov_len = FRAME_HEADER;
+		if ( view->flags & FLAG_FRAGMENT ) {
+			encodeFragment(scratch + FRAME_HEADER, view);
+			iov[n - 1].iov_len += FRAME_FRAGMENT;
+		}
+		iov[n].iov_base = (void *)view->hostname;
+		iov[n++].iov_len = view->hostnameLen;
+		iov[n].iov_base = (void *)view->payload;
+		iov[n++].iov_len = view->payloadLen;
+	}
+	return n;
+}
+
+/*
+ * copyString
+ * @param dest The string to fill
+ * @param size The size of dest
+ * @param src The view string
+ * @param length The length of the view string
+ * This function copies a view string into a NUL terminated string,
+ * truncating it to size-1 bytes.
+ */
+void copyString(char *dest, int size, const char *src, int length) {
+	if ( length > size - 1 ) {
+		length = size - 1;
 	}
+	memcpy(dest, src, length);
+	dest[length] = '\0';
+	messageCopies++;
 }